@@ -68,12 +68,16 @@ typedef bool _Bool;
 # endif
 
 /*
- * Define a MIN() macro.
+ * Define MIN() and MAX() macros.
  */
 # ifdef MIN
 #  undef MIN
 # endif
 # define MIN(x, y) ((x) < (y) ? (x) : (y))
+# ifdef MAX
+#  undef MAX
+# endif
+# define MAX(x, y) ((x) > (y) ? (x) : (y))
 
 /*
  * For building without systemd(1) support.
@@ -0,0 +1,82 @@
+# Copyright (c) 2014 Holger Weiss <holger@weiss.in-berlin.de>
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# NSCA_LIB_ZLIB
+# -------------
+# Check the availability of zlib.  If the library is found, we define
+# HAVE_ZLIB_H to 1.  We then also set the output variables ZLIBCPPFLAGS,
+# ZLIBLDFLAGS, and ZLIBLIBS to appropriate values.
+AC_DEFUN([NSCA_LIB_ZLIB],
+[
+  nsca_save_CPPFLAGS=$CPPFLAGS
+  nsca_save_LDFLAGS=$LDFLAGS
+  nsca_zlib_dir=unknown
+  AC_ARG_WITH([zlib],
+    [AS_HELP_STRING([--with-zlib=PATH],
+      [use the zlib library in PATH])],
+    [nsca_with_zlib=$with_zlib],
+    [nsca_with_zlib=maybe])
+  AC_MSG_CHECKING([whether zlib is desired])
+  AS_CASE([$nsca_with_zlib],
+    [no],
+      [AC_MSG_RESULT([no])],
+    [yes|maybe],
+      [AC_MSG_RESULT([$nsca_with_zlib])
+       AC_MSG_CHECKING([for the location of zlib])
+       for _nsca_zlib_dir in "$ac_pwd/lib/zlib" /usr /usr/local /usr/pkg
+       do dnl Solaris 10 doesn't have "test -e".
+         AS_IF([test -r "$_nsca_zlib_dir/include/zlib.h"],
+           [nsca_zlib_dir=$_nsca_zlib_dir
+            break])
+       done
+       AS_IF([test "x$nsca_zlib_dir" != xunknown],
+         [AC_MSG_RESULT([$nsca_zlib_dir])
+          AS_IF([test "x$nsca_with_zlib" = xmaybe],
+            [nsca_with_zlib=yes])],
+         [AC_MSG_RESULT([not found])
+          AS_IF([test "x$nsca_with_zlib" = xmaybe],
+            [nsca_with_zlib=no])])],
+    [AC_MSG_RESULT([yes])
+     nsca_zlib_dir=$nsca_with_zlib
+     nsca_with_zlib=yes])
+  AS_IF([test "x$nsca_with_zlib" = xyes],
+    [AS_IF([test "x$nsca_zlib_dir" != xunknown &&
+      test "x$nsca_zlib_dir" != x/usr],
+      [ZLIBCPPFLAGS="-I$nsca_zlib_dir/include"
+       ZLIBLDFLAGS="-L$nsca_zlib_dir/lib"
+       CPPFLAGS="$ZLIBCPPFLAGS $CPPFLAGS"
+       LDFLAGS="$ZLIBLDFLAGS $LDFLAGS"])
+     AC_CHECK_HEADERS([zlib.h], [],
+       [AC_MSG_ERROR([zlib header file not found])])
+     AC_CHECK_LIB([z], [deflate],
+       [ZLIBLIBS='-lz'],
+       [AC_MSG_FAILURE([cannot link with zlib])])])
+  AC_SUBST([ZLIBCPPFLAGS])
+  AC_SUBST([ZLIBLDFLAGS])
+  AC_SUBST([ZLIBLIBS])
+  CPPFLAGS=$nsca_save_CPPFLAGS
+  LDFLAGS=$nsca_save_LDFLAGS
+])# NSCA_LIB_ZLIB
+
+dnl vim:set joinspaces textwidth=80:
@@ -26,6 +26,7 @@ struct nscang_object {
    char *svc_description;
    int port;
    int timeout;
+   int keepalive;
 };
 typedef struct nscang_object nscang_object_t;
 
@@ -45,8 +46,9 @@ static char *strdupnull(const char *s) {
 static int init_object(
       nscang_object_t *o,
       char *host, int port, char *identity, char *psk, char *ciphers,
-      char *node_name, char * svc_description, int timeout) {
+      char *node_name, char * svc_description, int timeout, int keepalive) {
    o->timeout = timeout;
+   o->keepalive = keepalive;
    o->port = port;
    DUP_OR_RETURN(host);
    DUP_OR_RETURN(identity);
@@ -90,7 +92,7 @@ BOOT:
 	SSL_load_error_strings();
 
 Net::NSCAng::Client
-_new(class, host, port, identity, psk, ciphers, node_name, svc_description, timeout)
+_new(class, host, port, identity, psk, ciphers, node_name, svc_description, timeout, keepalive)
    char * class
    char * host
    int port
@@ -100,6 +102,7 @@ _new(class, host, port, identity, psk, ciphers, node_name, svc_description, time
    SV * node_name
    SV * svc_description
    int timeout
+   int keepalive
 
    CODE:
       // Alloc new object
@@ -111,7 +114,7 @@ _new(class, host, port, identity, psk, ciphers, node_name, svc_description, time
       if(init_object(RETVAL,
                host, port,  identity, psk,
                SV_OR_NULL(ciphers), SV_OR_NULL(node_name),
-               SV_OR_NULL(svc_description), timeout)
+               SV_OR_NULL(svc_description), timeout, keepalive)
         ) {
          free_object(RETVAL);
          croak("no memory for object");
@@ -165,27 +168,50 @@ _result(self, is_host_result, node_name, svc_description, return_code, plugin_ou
    if(!cnode_name)
       croak("node_name missing");
 
+   // The client library reconnects and resubmits if the session broke down
 	if(nscang_client_send_push(client,
       cnode_name, csvc_description, return_code, plugin_output, self->timeout))
       XSRETURN_UNDEF;
 
-   if(client->_errno == NSCANG_ERROR_TIMEOUT) {
-	   nscang_client_disconnect(client);
-
-      if(nscang_client_send_push(client,
-               cnode_name, csvc_description, return_code, plugin_output, self->timeout))
-         XSRETURN_UNDEF;
+   // Retrieve the error description
+   nscang_client_errstr(client, errstr, sizeof(errstr));
+   // Keep the session if the server merely rejected the result, otherwise
+   // remember to reinitialize the client next time through
+   if(client->_errno != NSCANG_ERROR_FAIL) {
+      self->client_initialized = 0;
+      nscang_client_free(&(self->client));
    }
 
+   RETVAL = newSVpv(errstr, 0);
+   OUTPUT:
+      RETVAL
+
+void
+connect(self)
+   Net::NSCAng::Client self
+
+   CODE:
+   char errstr[1024];
+   nscang_client_t *client = &self->client;
+
+   if(!self->client_initialized)
+      init_client(self);
+
+   if(nscang_client_send_moin(client, self->timeout))
+      XSRETURN_EMPTY;
+
+   // The session may have been closed by the server, so try once more
+   nscang_client_disconnect(client);
+   if(nscang_client_send_moin(client, self->timeout))
+      XSRETURN_EMPTY;
+
    // Retrieve the error description
    nscang_client_errstr(client, errstr, sizeof(errstr));
    // Remember to reinitialize the client text time through
    self->client_initialized = 0;
    nscang_client_free(&(self->client));
 
-   RETVAL = newSVpv(errstr, 0);
-   OUTPUT:
-      RETVAL
+   croak("connect: %s", errstr);
 
 SV *
 command(self, command)
@@ -209,13 +235,82 @@ command(self, command)
 	if(nscang_client_send_command(client, ccommand, self->timeout))
       XSRETURN_UNDEF;
 
-   if(client->_errno == NSCANG_ERROR_TIMEOUT)
-	   nscang_client_disconnect(client);
-
    // Retrieve the error description
    nscang_client_errstr(client, errstr, sizeof(errstr));
-   // Remember to reinitialize the client text time through
-   self->client_initialized = 0;
-   nscang_client_free(&(self->client));
+   // Keep the session if the server merely rejected the command
+   if(client->_errno != NSCANG_ERROR_FAIL) {
+      self->client_initialized = 0;
+      nscang_client_free(&(self->client));
+   }
 
    croak(errstr);
+
+SV *
+_send_batch(self, commands)
+   Net::NSCAng::Client self
+   AV * commands
+
+   CODE:
+   nscang_client_t *client = &self->client;
+   const char **ccommands;
+   char **errors;
+   AV *result;
+   SSize_t i, n;
+
+   if(!self->client_initialized)
+      init_client(self);
+
+   n = av_len(commands) + 1;
+   Newx(ccommands, n ? n : 1, const char *);
+   Newx(errors, n ? n : 1, char *);
+   for(i = 0; i < n; i++) {
+      SV **elem = av_fetch(commands, i, 0);
+
+      if(!elem || !SvOK(*elem)) {
+         Safefree(ccommands);
+         Safefree(errors);
+         croak("command %ld missing", (long)i);
+      }
+      ccommands[i] = SvPV_nolen(*elem);
+   }
+
+   nscang_client_send_batch(client, ccommands, n, errors, self->timeout);
+
+   // One entry per command: undef if it was accepted, the error otherwise
+   result = newAV();
+   av_extend(result, n);
+   for(i = 0; i < n; i++) {
+      if(errors[i]) {
+         av_push(result, newSVpv(errors[i], 0));
+         free(errors[i]);
+      } else {
+         av_push(result, newSV(0));
+      }
+   }
+   Safefree(ccommands);
+   Safefree(errors);
+
+   RETVAL = newRV_noinc((SV *)result);
+   OUTPUT:
+      RETVAL
+
+SV *
+keepalive(self)
+   Net::NSCAng::Client self
+
+   CODE:
+   char errstr[1024];
+   nscang_client_t *client = &self->client;
+
+   // Nothing to keep alive yet, or the session was used recently enough
+   if(!self->client_initialized
+         || nscang_client_idle_time(client) < self->keepalive)
+      XSRETURN_UNDEF;
+
+   if(nscang_client_noop(client, self->timeout))
+      XSRETURN_UNDEF;
+
+   // The session is gone; the next submission will reconnect
+   RETVAL = newSVpv(nscang_client_errstr(client, errstr, sizeof(errstr)), 0);
+   OUTPUT:
+      RETVAL
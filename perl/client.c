@@ -27,22 +27,311 @@
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "client.h"
-#include "uthash.h"
 
-static nscang_client_t *nscang_client_instances;
+/*
+ * All clients using the same cipher list share a single SSL_CTX, which is
+ * created on first use and kept for the lifetime of the process.  The PSK
+ * callback finds the credentials of a client via SSL_get_ex_data(), so no
+ * global lookup table is involved once the client is set up.
+ */
+typedef struct nscang_ctx_s {
+	char *ciphers;
+	SSL_CTX *ssl_ctx;
+	struct nscang_ctx_s *next;
+} nscang_ctx_t;
+
+static nscang_ctx_t *nscang_ctx_cache;
+static pthread_mutex_t nscang_ctx_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t nscang_ex_index_once = PTHREAD_ONCE_INIT;
+static int nscang_ex_index = -1;
+
+static void
+wait_for_socket(nscang_client_t *c, int for_write)
+{
+	fd_set fdset;
+	struct timeval tv;
+	int fd = BIO_get_fd(c->bio, NULL);
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 100000;
+
+	if (fd < 0) {
+		select(0, NULL, NULL, NULL, &tv);
+		return;
+	}
 
-unsigned int
+	FD_ZERO(&fdset);
+	FD_SET(fd, &fdset);
+	if (for_write)
+		select(fd + 1, NULL, &fdset, NULL, &tv);
+	else
+		select(fd + 1, &fdset, NULL, NULL, &tv);
+}
+
+/*
+ * Drop the connection without sending anything, as the server has closed it
+ * already.
+ */
+static void
+reset_session(nscang_client_t *c)
+{
+	SSL_set_shutdown(c->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+	SSL_set_session(c->ssl, NULL); /* Don't try to resume it. */
+	SSL_clear(c->ssl);
+	BIO_reset(c->bio);
+
+	c->rbuf_len = 0;
+	c->state = NSCANG_STATE_NEW;
+}
+
+/*
+ * Check whether an established session is still usable.  When the server
+ * times out an idle session, it sends a BAIL and closes the connection, so if
+ * there's anything to read before we sent a request, the session is gone.
+ */
+static int
+check_session(nscang_client_t *c)
+{
+	fd_set fdset;
+	struct timeval tv;
+	int fd, rc;
+
+	if (c->rbuf_len == 0 && SSL_pending(c->ssl) == 0) {
+		if ((fd = BIO_get_fd(c->bio, NULL)) < 0)
+			return 1;
+
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		FD_ZERO(&fdset);
+		FD_SET(fd, &fdset);
+		if (select(fd + 1, &fdset, NULL, NULL, &tv) <= 0)
+			return 1;
+
+		/* This might just be a TLS record without application data. */
+		rc = SSL_read(c->ssl, c->rbuf, sizeof(c->rbuf));
+		if (rc <= 0 && BIO_should_retry(c->bio))
+			return 1;
+	}
+
+	reset_session(c);
+	return 0;
+}
+
+static int
+is_connection_error(nscang_client_t *c)
+{
+	switch (c->_errno) {
+	case NSCANG_ERROR_TIMEOUT:
+	case NSCANG_ERROR_TOO_LONG_RESPONSE:
+	case NSCANG_ERROR_PROTOCOL_MISMATCH:
+	case NSCANG_ERROR_UNKNOWN_RESPONSE:
+	case NSCANG_ERROR_BAIL:
+	case NSCANG_ERROR_SSL:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Check whether a string's prefix matches /\[\d{1,9}\]/
+ * Returns 1 for match, 0 for no match, -1 for incomplete/bad match
+ */
+static int
+has_timestamp_prefix(const char *s)
+{
+   char *end;
+
+   if(*s++ != '[') return 0;
+   if((*s < '0') || (*s > '9')) return -1; // counter strtol's skip-whitespace and sign permissiveness
+   errno = 0;
+   (void)strtol(s, &end, 10); // discard result
+   if(errno) return -1;
+   if(*end == ']') return 1;
+   return -1;
+}
+
+/*
+ * Copy the command into the buffer, prefixed with a time stamp unless it has
+ * one already, and terminated with a newline.  Returns the length of the
+ * result, or 0 if the command has a malformed time stamp.
+ */
+static int
+format_command(nscang_client_t *c, char *buf, int size, const char *command,
+               unsigned int now)
+{
+	int len;
+
+	switch (has_timestamp_prefix(command)) {
+	case 0:
+		len = snprintf(buf, size - 1, "[%u] %s", now, command);
+		break;
+	case 1:
+		len = snprintf(buf, size - 1, "%s", command);
+		break;
+	default:
+		c->_errno = NSCANG_ERROR_FAIL;
+		snprintf(c->errstr, sizeof(c->errstr),
+		    "invalid time stamp format in command `%s'", command);
+		return 0;
+	}
+
+	if (len < 0)
+		len = 0;
+	else if (len > size - 2) /* The command was truncated. */
+		len = size - 2;
+
+	if (len == 0 || buf[len - 1] != '\n')
+		buf[len++] = '\n';
+	return len;
+}
+
+static int
+push(nscang_client_t *c, char *command, int len, int timeout)
+{
+	char cmd[32 + NSCANG_MAX_COMMAND_SIZE];
+	int cmd_len, rc;
+
+	cmd_len = snprintf(cmd, 32, "PUSH %d\n", len);
+
+	if (c->version > 1) {
+		/* The payload may follow the PUSH line right away. */
+		memcpy(cmd + cmd_len, command, len);
+		if (!nscang_client_write(c, cmd, cmd_len + len, timeout))
+			return 0;
+	} else {
+		if (!nscang_client_write(c, cmd, cmd_len, timeout))
+			return 0;
+
+		rc = nscang_client_response(c, timeout);
+
+		if (!rc)
+			return 0;
+
+		if (rc != NSCANG_RESP_OKAY) {
+			c->_errno = NSCANG_ERROR_PROTOCOL_MISMATCH;
+			return 0;
+		}
+
+		if (!nscang_client_write(c, command, len, timeout))
+			return 0;
+	}
+
+	rc = nscang_client_response(c, timeout);
+
+	if (!rc)
+		return 0;
+
+	if (rc != NSCANG_RESP_OKAY) {
+		c->_errno = NSCANG_ERROR_PROTOCOL_MISMATCH;
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Submit the commands starting at index `first' (skipping those that have an
+ * error set already), and return the index of the first command that wasn't
+ * acknowledged by the server.  With protocol version 2, commands are sent in
+ * windows of NSCANG_PIPELINE_WINDOW commands, and the responses to one window
+ * are read while the next one is in flight.
+ */
+static int
+pipeline(nscang_client_t *c, const char **commands, int n_commands, int first,
+         char **errors, unsigned int now, int timeout)
+{
+	char command_buf[NSCANG_MAX_COMMAND_SIZE];
+	char errstr[1024];
+	char *buf;
+	size_t buf_len;
+	int n_sent = first, n_acked = first, in_flight = 0;
+	int len, n, target, rc;
+
+	if (c->version < 2) {
+		for (; n_acked < n_commands; n_acked++) {
+			if (errors[n_acked] != NULL)
+				continue;
+			len = format_command(c, command_buf,
+			    sizeof(command_buf), commands[n_acked], now);
+			if (push(c, command_buf, len, timeout))
+				continue;
+			if (c->_errno != NSCANG_ERROR_FAIL)
+				break;
+			errors[n_acked] = strdup(nscang_client_errstr(c, errstr,
+			    sizeof(errstr)));
+		}
+		return n_acked;
+	}
+
+	buf = malloc(NSCANG_PIPELINE_WINDOW * (32 + sizeof(command_buf)));
+	if (buf == NULL) {
+		c->_errno = NSCANG_ERROR_MALLOC;
+		return n_acked;
+	}
+
+	while (1) {
+		for (buf_len = 0, n = 0; n_sent < n_commands
+		    && n < NSCANG_PIPELINE_WINDOW; n_sent++) {
+			if (errors[n_sent] != NULL)
+				continue;
+			len = format_command(c, command_buf,
+			    sizeof(command_buf), commands[n_sent], now);
+			buf_len += snprintf(buf + buf_len, 32, "PUSH %d\n",
+			    len);
+			memcpy(buf + buf_len, command_buf, len);
+			buf_len += len;
+			n++;
+		}
+		if (n > 0 && !nscang_client_write(c, buf, buf_len, timeout))
+			break;
+		in_flight += n;
+
+		/*
+		 * Collect the responses to the previous window while the
+		 * current one is in flight, or all of them once we're done.
+		 */
+		target = n_sent < n_commands ? NSCANG_PIPELINE_WINDOW : 0;
+
+		for (; n_acked < n_sent; n_acked++) {
+			if (errors[n_acked] != NULL)
+				continue;
+			if (in_flight <= target)
+				break;
+			rc = nscang_client_response(c, timeout);
+			if (rc == 0 && c->_errno == NSCANG_ERROR_FAIL)
+				errors[n_acked] = strdup(nscang_client_errstr(c,
+				    errstr, sizeof(errstr)));
+			else if (rc != NSCANG_RESP_OKAY) {
+				if (rc != 0)
+					c->_errno =
+					    NSCANG_ERROR_PROTOCOL_MISMATCH;
+				goto out;
+			}
+			in_flight--;
+		}
+		if (n_acked == n_commands)
+			break;
+	}
+
+out:
+	free(buf);
+	return n_acked;
+}
+
+static unsigned int
 set_psk(SSL *ssl, const char *hint, char *identity,
         unsigned int max_identity_length, unsigned char *psk,
         unsigned int max_psk_length)
 {
-	nscang_client_t *c = NULL;
+	nscang_client_t *c = SSL_get_ex_data(ssl, nscang_ex_index);
 
-   HASH_FIND_PTR(nscang_client_instances, &ssl, c);
 	if (c != NULL) {
 		strncpy(identity, c->identity, max_identity_length);
 		identity[max_identity_length - 1] = 0x00;
@@ -57,29 +346,78 @@ set_psk(SSL *ssl, const char *hint, char *identity,
 	return 0;
 }
 
-int
-nscang_client_init(nscang_client_t *c, char *host, int port, char *ciphers,
-                   char *identity, char *psk)
+static void
+init_ex_index(void)
 {
-	char port_str[6];
+	nscang_ex_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+}
 
-	snprintf(port_str, sizeof(port_str), "%d", port);
-	memset(c, 0x00, sizeof(nscang_client_t));
+static int
+get_ssl_ctx(nscang_client_t *c, char *ciphers)
+{
+	nscang_ctx_t *entry;
+	const char *key = ciphers != NULL ? ciphers : "";
 
-	c->ssl_ctx = SSL_CTX_new(SSLv23_client_method());
-	if (c->ssl_ctx == NULL) {
-		c->_errno = NSCANG_ERROR_SSL_CTX_CREATE;
+	pthread_mutex_lock(&nscang_ctx_cache_lock);
+
+	for (entry = nscang_ctx_cache; entry != NULL; entry = entry->next)
+		if (strcmp(entry->ciphers, key) == 0) {
+			c->ssl_ctx = entry->ssl_ctx;
+			pthread_mutex_unlock(&nscang_ctx_cache_lock);
+			return 1;
+		}
+
+	if ((entry = malloc(sizeof(nscang_ctx_t))) == NULL
+	    || (entry->ciphers = strdup(key)) == NULL) {
+		free(entry);
+		pthread_mutex_unlock(&nscang_ctx_cache_lock);
+		c->_errno = NSCANG_ERROR_MALLOC;
 		return 0;
 	}
 
+	ERR_clear_error();
+	entry->ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+	if (entry->ssl_ctx == NULL) {
+		c->_errno = NSCANG_ERROR_SSL_CTX_CREATE;
+		goto fail;
+	}
+
 	if (ciphers != NULL) {
-		if (SSL_CTX_set_cipher_list(c->ssl_ctx, ciphers) != 1) {
+		if (SSL_CTX_set_cipher_list(entry->ssl_ctx, ciphers) != 1) {
+			SSL_CTX_free(entry->ssl_ctx);
 			c->_errno = NSCANG_ERROR_SSL_CIPHERS;
-			return 0;
+			goto fail;
 		}
 	}
 
-	SSL_CTX_set_options(c->ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+	SSL_CTX_set_options(entry->ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+	SSL_CTX_set_psk_client_callback(entry->ssl_ctx, set_psk);
+
+	entry->next = nscang_ctx_cache;
+	nscang_ctx_cache = entry;
+	pthread_mutex_unlock(&nscang_ctx_cache_lock);
+
+	c->ssl_ctx = entry->ssl_ctx;
+	return 1;
+
+fail:
+	pthread_mutex_unlock(&nscang_ctx_cache_lock);
+	free(entry->ciphers);
+	free(entry);
+	return 0;
+}
+
+int
+nscang_client_init(nscang_client_t *c, char *host, int port, char *ciphers,
+                   char *identity, char *psk)
+{
+	char port_str[6];
+
+	snprintf(port_str, sizeof(port_str), "%d", port);
+	memset(c, 0x00, sizeof(nscang_client_t));
+
+	if (!get_ssl_ctx(c, ciphers))
+		return 0;
 
 	c->bio = BIO_new(BIO_s_connect());
 	if (c->bio == NULL) {
@@ -99,7 +437,6 @@ nscang_client_init(nscang_client_t *c, char *host, int port, char *ciphers,
 
 	SSL_set_bio(c->ssl, c->bio, c->bio);
 	SSL_set_connect_state(c->ssl);
-	SSL_set_psk_client_callback(c->ssl, set_psk);
 
 	c->identity = malloc(strlen(identity) + 1);
 	c->psk = malloc(strlen(psk) + 1);
@@ -112,7 +449,12 @@ nscang_client_init(nscang_client_t *c, char *host, int port, char *ciphers,
 	strcpy(c->identity, identity);
 	strcpy(c->psk, psk);
 
-	HASH_ADD_PTR(nscang_client_instances, ssl, c);
+	pthread_once(&nscang_ex_index_once, init_ex_index);
+	if (nscang_ex_index < 0
+	    || !SSL_set_ex_data(c->ssl, nscang_ex_index, c)) {
+		c->_errno = NSCANG_ERROR_SSL_CREATE;
+		return 0;
+	}
 
 	c->state = NSCANG_STATE_NEW;
 
@@ -125,18 +467,12 @@ nscang_client_free(nscang_client_t *c)
 	if (c->state != NSCANG_STATE_NONE)
 		nscang_client_disconnect(c);
 
-	if (c->ssl != NULL) {
-      HASH_DEL(nscang_client_instances, c);
-	}
 	if (c->ssl != NULL) {
 		SSL_free(c->ssl);
 		c->ssl = NULL;
 		c->bio = NULL;
 	}
-	if (c->ssl_ctx != NULL) {
-		SSL_CTX_free(c->ssl_ctx);
-		c->ssl_ctx = NULL;
-	}
+	c->ssl_ctx = NULL; /* Shared, see get_ssl_ctx(). */
 	if (c->identity != NULL) {
 		free(c->identity);
 		c->identity = NULL;
@@ -152,19 +488,15 @@ nscang_client_free(nscang_client_t *c)
 int
 nscang_client_write(nscang_client_t *c, void *buf, int len, int timeout)
 {
-	int rc;
 	time_t endtime;
-	fd_set fdset;
-	struct timeval tv;
-
-	tv.tv_sec = 0;
-	tv.tv_usec = 100000;
 
 	endtime = time(NULL) + timeout;
 
 	while (1) {
-		if ((rc = SSL_write(c->ssl, buf, len)) > 0)
+		if (SSL_write(c->ssl, buf, len) > 0) {
+			c->last_activity = time(NULL);
 			return 1;
+		}
 
 		if (!BIO_should_retry(c->bio)) {
 			c->_errno = NSCANG_ERROR_SSL;
@@ -176,48 +508,36 @@ nscang_client_write(nscang_client_t *c, void *buf, int len, int timeout)
 			return 0;
 		}
 
-		FD_ZERO(&fdset);
-		FD_SET(BIO_get_fd(c->bio, NULL), &fdset);
-		select(1, NULL, &fdset, NULL, &tv);
+		wait_for_socket(c, 1);
 	}
 }
 
 int
 nscang_client_response(nscang_client_t *c, int timeout)
 {
-	int rc;
+	int rc, len, version;
 	time_t endtime;
-	fd_set fdset;
-	char buf[1024];
-	int was_read = 0;
-	char *ptr = buf;
-	struct timeval tv;
-
-	tv.tv_sec = 0;
-	tv.tv_usec = 100000;
+	char buf[sizeof(c->rbuf)];
+	char *eol;
 
 	endtime = time(NULL) + timeout;
 
-	while (1) {
-		rc = SSL_read(c->ssl, ptr, 1024 - was_read);
-
-		if (rc > 0) {
-			was_read = was_read + rc;
-			ptr = buf + was_read;
+	/*
+	 * With pipelining, a single SSL_read() may return multiple response
+	 * lines, so we keep any data following the first line in c->rbuf.
+	 */
+	while ((eol = memchr(c->rbuf, '\n', c->rbuf_len)) == NULL) {
+		if (c->rbuf_len == sizeof(c->rbuf)) {
+			c->_errno = NSCANG_ERROR_TOO_LONG_RESPONSE;
+			return 0;
+		}
 
-			if (buf[was_read - 1] == '\n') {
-				if (buf[was_read - 2] == '\r')
-					buf[was_read - 2] = 0x00;
-				else
-					buf[was_read - 1] = 0x00;
+		rc = SSL_read(c->ssl, c->rbuf + c->rbuf_len,
+		    sizeof(c->rbuf) - c->rbuf_len);
 
-				break;
-			}
-
-			if (was_read == 1024) {
-				c->_errno = NSCANG_ERROR_TOO_LONG_RESPONSE;
-				return 0;
-			}
+		if (rc > 0) {
+			c->rbuf_len += rc;
+			continue;
 		} else if (!BIO_should_retry(c->bio)) {
 			c->_errno = NSCANG_ERROR_SSL;
 			return 0;
@@ -228,13 +548,24 @@ nscang_client_response(nscang_client_t *c, int timeout)
 			return 0;
 		}
 
-		FD_ZERO(&fdset);
-		FD_SET(BIO_get_fd(c->bio, NULL), &fdset);
-		select(1, &fdset, NULL, NULL, &tv);
+		wait_for_socket(c, 0);
 	}
 
+	len = eol - c->rbuf + 1;
+	memcpy(buf, c->rbuf, len);
+	c->rbuf_len -= len;
+	memmove(c->rbuf, c->rbuf + len, c->rbuf_len);
+	c->last_activity = time(NULL);
+
+	if (len >= 2 && buf[len - 2] == '\r')
+		buf[len - 2] = 0x00;
+	else
+		buf[len - 1] = 0x00;
+
 	if (strncmp(buf, "MOIN", 4) == 0) {
-		if (strcmp(buf, "MOIN 1") == 0) {
+		version = atoi(buf + 4);
+		if (version >= 1 && version <= NSCANG_PROTOCOL_VERSION) {
+			c->version = version;
 			return NSCANG_RESP_MOIN;
 		} else {
 			c->_errno = NSCANG_ERROR_BAD_PROTO_VERSION;
@@ -250,7 +581,8 @@ nscang_client_response(nscang_client_t *c, int timeout)
 		c->errstr[sizeof(c->errstr) - 1] = 0x00;
 		return 0;
 	} else if (strncmp(buf, "BAIL", 4) == 0) {
-		nscang_client_disconnect(c);
+		/* The server is closing the connection, so don't say goodbye. */
+		reset_session(c);
 		c->_errno = NSCANG_ERROR_BAIL;
 		strncpy(c->errstr, buf + 5, sizeof(c->errstr) - 1);
 		c->errstr[sizeof(c->errstr) - 1] = 0x00;
@@ -270,25 +602,18 @@ nscang_client_response(nscang_client_t *c, int timeout)
 void
 nscang_client_disconnect(nscang_client_t *c)
 {
-	fd_set fdset;
-	struct timeval tv;
-
-	tv.tv_sec = 0;
-	tv.tv_usec = 100000;
-
 	if (c->state == NSCANG_STATE_MOIN)
 		nscang_client_send_quit(c);
 
 	if ((SSL_shutdown(c->ssl) == -1) && BIO_should_retry(c->bio)) {
-		FD_ZERO(&fdset);
-		FD_SET(BIO_get_fd(c->bio, NULL), &fdset);
-		select(1, NULL, &fdset, NULL, &tv);
+		wait_for_socket(c, 1);
 		SSL_shutdown(c->ssl);
 	}
 
 	SSL_clear(c->ssl);
 	BIO_reset(c->bio);
 
+	c->rbuf_len = 0;
 	c->state = NSCANG_STATE_NEW;
 }
 
@@ -298,7 +623,7 @@ nscang_client_send_moin(nscang_client_t *c, int timeout)
 	char cmd[64];
 	int len, rc;
 
-	if (c->state == NSCANG_STATE_MOIN)
+	if (c->state == NSCANG_STATE_MOIN && check_session(c))
 		return 1;
 
 	if (c->state != NSCANG_STATE_NEW) {
@@ -307,8 +632,8 @@ nscang_client_send_moin(nscang_client_t *c, int timeout)
 	}
 
 	srandom(time(NULL));
-	len = snprintf(cmd, sizeof(cmd), "MOIN 1 %08ld%08ld\r\n", random(),
-	    random());
+	len = snprintf(cmd, sizeof(cmd), "MOIN %d %08ld%08ld\r\n",
+	    NSCANG_PROTOCOL_VERSION, random(), random());
 
 	if (!nscang_client_write(c, cmd, len, timeout))
 		return 0;
@@ -327,104 +652,141 @@ nscang_client_send_moin(nscang_client_t *c, int timeout)
 	return 1;
 }
 
-/* Check whether a string's prefix matches /\[\d{1,9}\]/
- * Returns 1 for match, 0 for no match, -1 for incomplete/bad match
- */
-static int
-has_timestamp_prefix(const char *s)
+int
+nscang_client_send_command(nscang_client_t *c, const char *command, int timeout)
 {
-   char *end;
+	char command_buf[NSCANG_MAX_COMMAND_SIZE];
+	int len, reused;
 
-   if(*s++ != '[') return 0;
-   if((*s < '0') || (*s > '9')) return -1; // counter strtol's skip-whitespace and sign permissiveness
-   (void)strtol(s, &end, 10); // discard result
-   if(errno) return -1;
-   if(*end == ']') return 1;
-   return -1;
+	if (!(len = format_command(c, command_buf, sizeof(command_buf), command,
+	    (unsigned int)time(NULL))))
+		return 0;
+
+	/*
+	 * If a session that was established earlier breaks down while the
+	 * command is in flight, reconnect and submit the command once more.
+	 */
+	reused = c->state == NSCANG_STATE_MOIN && check_session(c);
+
+	if (nscang_client_send_moin(c, timeout)
+	    && push(c, command_buf, len, timeout))
+		return 1;
+
+	if (!reused || !is_connection_error(c))
+		return 0;
+
+	nscang_client_disconnect(c);
+
+	return nscang_client_send_moin(c, timeout)
+	    && push(c, command_buf, len, timeout);
 }
 
 int
-nscang_client_send_command(nscang_client_t *c, const char *command, int timeout)
+nscang_client_send_push(nscang_client_t *c, char *host, char *service,
+                        int status, char *message, int timeout)
 {
-   const int command_len = strlen(command);
-	char command_buf[1024];
-	char cmd[32];
-	int rc, len;
-
-   switch( has_timestamp_prefix(command) ) {
-      case 0 :
-         // There was no timestamp. Add one.
-         snprintf(command_buf, sizeof(command_buf)-1, "[%u] %s", (unsigned int)time(NULL), command);
-         break;
-      case 1 :
-         // Timestamp found, just copy everything
-         strncpy(command_buf, command, sizeof(command_buf)-1);
-         command_buf[sizeof(command_buf)-1] = '\0';
-         break;
-      default :
-         // Malformed timestamp
-         c->_errno = NSCANG_ERROR_FAIL;
-         snprintf(c->errstr, sizeof(c->errstr), "invalid time stamp format in command `%s'", command);
-         return 0;
-   }
-
-   /* make sure command_buf is newline-terminated */
-   len = strlen(command_buf);
-   if(command_buf[len-1] != '\n') {
-      command_buf[len] = '\n';
-      len++;
-      command_buf[len] = '\0';
-   }
-
-	if (!nscang_client_send_moin(c, timeout))
-      return 0;
-
-   snprintf(cmd, sizeof(cmd), "PUSH %d\r\n", len);
-	if (!nscang_client_write(c, cmd, strlen(cmd), timeout))
-      return 0;
+	char command[NSCANG_MAX_COMMAND_SIZE];
 
-	rc = nscang_client_response(c, timeout);
+	if (service == NULL)
+		snprintf(command, sizeof(command) - 1,
+		    "PROCESS_HOST_CHECK_RESULT;%s;%d;%s",
+		    host, status, message);
+	else
+		snprintf(command, sizeof(command) - 1,
+		    "PROCESS_SERVICE_CHECK_RESULT;%s;%s;%d;%s",
+		    host, service, status, message);
 
-	if (!rc)
-      return 0;
+	return nscang_client_send_command(c, command, timeout);
+}
 
-	if (rc != NSCANG_RESP_OKAY) {
-		c->_errno = NSCANG_ERROR_PROTOCOL_MISMATCH;
-      return 0;
+/*
+ * Submit the given commands, and return the number of commands that failed.
+ * The error message for each failed command is stored in the corresponding
+ * element of `errors' (which must be released with free(3)), the other
+ * elements are set to NULL.  With protocol version 2, the commands are
+ * pipelined.  If the session breaks down, we reconnect and resubmit the
+ * commands that weren't acknowledged, as long as the previous attempt got
+ * some of them through (or used a session established earlier).
+ */
+int
+nscang_client_send_batch(nscang_client_t *c, const char **commands,
+                         int n_commands, char **errors, int timeout)
+{
+	char command_buf[NSCANG_MAX_COMMAND_SIZE];
+	char errstr[1024];
+	unsigned int now = (unsigned int)time(NULL);
+	int i, first, n_acked, reused, n_failed = 0;
+
+	for (i = 0; i < n_commands; i++)
+		if (format_command(c, command_buf, sizeof(command_buf),
+		    commands[i], now))
+			errors[i] = NULL;
+		else
+			errors[i] = strdup(nscang_client_errstr(c, errstr,
+			    sizeof(errstr)));
+
+	reused = c->state == NSCANG_STATE_MOIN && check_session(c);
+	n_acked = first = 0;
+
+	while ((first = n_acked) < n_commands) {
+		if (nscang_client_send_moin(c, timeout))
+			n_acked = pipeline(c, commands, n_commands, first,
+			    errors, now, timeout);
+
+		if (n_acked == n_commands)
+			break;
+		if (!is_connection_error(c) || !(reused || n_acked > first))
+			break;
+		if (c->state == NSCANG_STATE_MOIN)
+			nscang_client_disconnect(c);
+		reused = 0;
 	}
 
-	if (!nscang_client_write(c, command_buf, len, timeout))
-      return 0;
+	nscang_client_errstr(c, errstr, sizeof(errstr));
+	for (i = n_acked; i < n_commands; i++)
+		if (errors[i] == NULL)
+			errors[i] = strdup(errstr);
+	for (i = 0; i < n_commands; i++)
+		if (errors[i] != NULL)
+			n_failed++;
 
-	rc = nscang_client_response(c, timeout);
+	return n_failed;
+}
 
-	if (!rc)
-      return 0;
+/*
+ * Send a NOOP to keep an established session from timing out on the server
+ * side.  If the server has closed the session in the meantime, it's reset
+ * quietly, and the next command will reconnect.
+ */
+int
+nscang_client_noop(nscang_client_t *c, int timeout)
+{
+	int rc;
 
-	if (rc != NSCANG_RESP_OKAY) {
+	if (c->state != NSCANG_STATE_MOIN || !check_session(c))
+		return 1;
+
+	if (!nscang_client_write(c, "NOOP\n", 5, timeout))
+		goto fail;
+
+	if ((rc = nscang_client_response(c, timeout)) == NSCANG_RESP_OKAY)
+		return 1;
+	if (rc != 0)
 		c->_errno = NSCANG_ERROR_PROTOCOL_MISMATCH;
-      return 0;
-	}
 
-   return 1;
+fail:
+	if (c->state == NSCANG_STATE_MOIN)
+		nscang_client_disconnect(c);
+	return 0;
 }
 
 int
-nscang_client_send_push(nscang_client_t *c, char *host, char *service,
-                        int status, char *message, int timeout)
+nscang_client_idle_time(nscang_client_t *c)
 {
-	char command[1024];
-
-	if (service == NULL)
-      snprintf(command, sizeof(command) - 1,
-            "PROCESS_HOST_CHECK_RESULT;%s;%d;%s",
-            host, status, message);
-	else
-      snprintf(command, sizeof(command) - 1,
-            "PROCESS_SERVICE_CHECK_RESULT;%s;%s;%d;%s",
-            host, service, status, message);
+	if (c->state != NSCANG_STATE_MOIN)
+		return 0;
 
-   return nscang_client_send_command(c, command, timeout);
+	return (int)(time(NULL) - c->last_activity);
 }
 
 int
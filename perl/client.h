@@ -31,8 +31,7 @@
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
-
-#include "uthash.h"
+#include <time.h>
 
 typedef enum { NSCANG_STATE_NONE=0, NSCANG_STATE_NEW, NSCANG_STATE_MOIN } nscang_state_t;
 typedef enum { NSCANG_RESP_MOIN=1, NSCANG_RESP_OKAY } nscang_response_t;
@@ -53,29 +52,42 @@ typedef enum {
 	NSCANG_ERROR_SSL
 } nscang_error_t;
 
+#define NSCANG_PROTOCOL_VERSION 2
+#define NSCANG_MAX_COMMAND_SIZE 1024
+#define NSCANG_PIPELINE_WINDOW  256
+
 typedef struct {
 	SSL_CTX *ssl_ctx;
 	BIO *bio;
 	SSL *ssl;
 	nscang_state_t state;
+	int version;
+	time_t last_activity;
+
+	char rbuf[1024];
+	int rbuf_len;
 
 	char *identity;
 	char *psk;
 
 	nscang_error_t _errno;
 	char errstr[1024];
-
-	UT_hash_handle hh;
 } nscang_client_t;
 
 int nscang_client_init(nscang_client_t *c, char *host, int port,
                        char *ciphers, char *identity, char *psk);
 void nscang_client_free(nscang_client_t *c);
+int nscang_client_write(nscang_client_t *c, void *buf, int len, int timeout);
+int nscang_client_response(nscang_client_t *c, int timeout);
 void nscang_client_disconnect(nscang_client_t *c);
 int nscang_client_send_moin(nscang_client_t *c, int timeout);
 int nscang_client_send_command(nscang_client_t *c, const char *command, int timeout);
 int nscang_client_send_push(nscang_client_t *c, char *host, char *service,
                             int status, char *message, int timeout);
+int nscang_client_send_batch(nscang_client_t *c, const char **commands,
+                             int n_commands, char **errors, int timeout);
+int nscang_client_noop(nscang_client_t *c, int timeout);
+int nscang_client_idle_time(nscang_client_t *c);
 int nscang_client_send_quit(nscang_client_t *c);
 char *nscang_client_errstr(nscang_client_t *c, char *buf, int buf_size);
 
@@ -99,8 +99,18 @@ monitoring system. Same rationale as C<node_name> above.
 =item C<timeout>: The timeout in seconds to wait for server responses and
 connection setup. Default is 10.
 
+=item C<keepalive>: The number of seconds a session may be idle before
+L</keepalive()> sends a C<NOOP> to keep it open. This should be well below the
+C<timeout> configured on the server. Default is 30.
+
 =back
 
+The session with the server is established on first use and kept open across
+calls. If the server has closed it in the meantime (e.g., because it was idle
+for too long), the client notices and reconnects transparently; if the session
+breaks down while a result is being submitted, the result is submitted once
+more on a new connection.
+
 The constructor dies with an error message if anything should go wrong, so use
 C<eval>, L<Try::Tiny> or the like.
 
@@ -111,7 +121,7 @@ sub new {
     my %args = @_%2 ? %{$_[0]} : @_;
     $class->_new($host, $args{port} // 5668, $identity, $psk,
         @args{qw/ ciphers node_name svc_description /},
-        $args{timeout} // 10,
+        $args{timeout} // 10, $args{keepalive} // 30,
     );
 }
 
@@ -160,6 +170,18 @@ sub host_result {
     $err and croak("host_result: $err");
 }
 
+=head2 connect
+
+  connect();
+
+Establish the session with the server unless that was done already. The
+result methods do this on demand, so calling it is optional; it's useful for
+making sure a session is ready before it's needed, which is what
+L<Net::NSCAng::Client::Pool> does. Errors are signaled by dying with an error
+message.
+
+=cut
+
 =head2 command
 
   command($cmd);
@@ -175,23 +197,66 @@ brackets to be accepted by the server; if you leave this off, the method will
 add it for you. Refer to the Nagios/Icinga documentiation for available
 commands and the format to follow for each command.
 
+=head2 send_batch
+
+  $errors = send_batch(\@commands);
+  $errors = send_batch([
+    "PROCESS_HOST_CHECK_RESULT;myserver;0;OK",
+    "PROCESS_SERVICE_CHECK_RESULT;myserver;disk;1;WARNING: 91% used",
+  ]);
+
+Submit a number of commands like L</command()>, but pipelined over the session
+so that many commands share a single round trip (if the server supports
+protocol version 2). If the session breaks down on the way, the commands the
+server didn't acknowledge are submitted again on a new connection. Returns an
+arrayref with one element per command, which is C<undef> if the command was
+accepted and an error message otherwise. Nothing is signaled by dying, except
+for invalid arguments.
+
 =cut
 
+sub send_batch {
+    my ($self, $commands) = @_;
+    ref $commands eq 'ARRAY' or croak("send_batch: arrayref expected");
+    return $self->_send_batch($commands);
+}
+
+=head2 keepalive
+
+  $err = keepalive();
+  my $w = AnyEvent->timer(after => 30, interval => 30, cb => sub { $c->keepalive });
+
+Send a C<NOOP> to the server if the session has been idle for at least the
+C<keepalive> number of seconds specified in the constructor, so that
+submissions after a quiet period don't have to pay for a new handshake. Does
+nothing if there's no session. Call this periodically from your event loop's
+timer or from a C<$SIG{ALRM}> handler; as Perl defers signal handlers until the
+current operation is complete, it never interferes with a submission in
+progress. Returns C<undef> on success, or an error message if the session
+turned out to be broken (the next submission will then reconnect). It never
+dies, so it's safe to use in callbacks.
+
+=cut
+
+# Objects wrap C data which must not be shared, so don't clone them into new
+# ithreads (they'll be undef there).
+sub CLONE_SKIP { 1 }
+
 1;
 __END__
 
-=head1 BUGS
+=head1 THREADS
 
-This module is not thread safe! Due do a workaround for the godawful OpenSSL
-API, static data has to be used, and this I<will> cause problems with threads.
-The original Python library uses pthreads to get around that but due to Perl's
-different threading model this would probably not work. Using the C<MY_CXT>
-macros is a possibility but frankly I'm too lazy to try just for supporting
-Perl threads that don't work well in the first place.
+All client objects with the same C<ciphers> setting share a single OpenSSL
+context, and the PSK credentials are attached to each connection, so no global
+state is involved when connecting. A client object must not be used by more
+than one thread at a time, though, and objects are not cloned into new Perl
+threads (they are C<undef> in the new thread). Create the clients in the thread
+that uses them, or use one L<Net::NSCAng::Client::Pool> per thread.
 
 =head1 SEE ALSO
 
-L<send_nsca(8)>
+L<Net::NSCAng::Client::Pool>, L<send_nsca(8)>
 
 =head1 AUTHOR
 
@@ -0,0 +1,126 @@
+package Net::NSCAng::Client::Pool;
+
+use 5.010001;
+use strict;
+use warnings;
+use Carp;
+use Net::NSCAng::Client;
+
+our $VERSION = $Net::NSCAng::Client::VERSION;
+
+=head1 NAME
+
+Net::NSCAng::Client::Pool - Hand out ready-to-use NSCA-ng sessions
+
+=head1 SYNOPSIS
+
+  use Net::NSCAng::Client ':rcodes';
+  use Net::NSCAng::Client::Pool;
+
+  my $pool = Net::NSCAng::Client::Pool->new('icinga.mydomain.org', 'myid',
+    's3cr3t', node_name => 'server_name', size => 4,
+  );
+  $pool->with_session(sub { $_[0]->host_result(OK, 'Everything is peachy') });
+
+=head1 DESCRIPTION
+
+A pool keeps a number of L<Net::NSCAng::Client> objects around and hands out
+sessions which have already been established, so that submitting a result
+doesn't have to wait for a TLS handshake. As all clients share an OpenSSL
+context, creating the sessions is cheap.
+
+=head1 METHODS
+
+=head2 new
+
+  $pool = new($host, $identity, $psk, %tags);
+
+Takes the same arguments as L<Net::NSCAng::Client/new>, plus the C<size> tag,
+which specifies the maximum number of sessions handed out at the same time.
+The default is 4.
+
+=cut
+
+sub new {
+    my ($class, $host, $identity, $psk) = splice(@_, 0, 4);
+    my %args = @_%2 ? %{$_[0]} : @_;
+    my $size = delete $args{size} // 4;
+    return bless {
+        args => [ $host, $identity, $psk, %args ],
+        size => $size,
+        idle => [],
+        busy => 0,
+    }, $class;
+}
+
+=head2 get
+
+  $client = get();
+
+Return a client with an established session. Dies if the session cannot be
+established, or if C<size> clients are already in use.
+
+=cut
+
+sub get {
+    my $self = shift;
+    my $client;
+
+    $self->{busy} < $self->{size}
+        or croak("get: all $self->{size} sessions are in use");
+
+    # Clients aren't cloned into new threads, so skip undefined entries.
+    $client = pop @{$self->{idle}} while !defined $client && @{$self->{idle}};
+    $client //= Net::NSCAng::Client->new(@{$self->{args}});
+    $client->connect;
+    $self->{busy}++;
+    return $client;
+}
+
+=head2 put
+
+  put($client);
+
+Return a client obtained with L</get> to the pool.
+
+=cut
+
+sub put {
+    my ($self, $client) = @_;
+    $self->{busy}--;
+    push @{$self->{idle}}, $client;
+    return;
+}
+
+=head2 with_session
+
+  with_session(sub { my $client = shift; ... });
+
+Call the given code reference with a client obtained with L</get>, and return
+the client to the pool afterwards, even if the code died.
+
+=cut
+
+sub with_session {
+    my ($self, $code) = @_;
+    my $client = $self->get;
+    my @result = eval { $code->($client) };
+    my $err = $@;
+    $self->put($client);
+    die $err if $err;
+    return wantarray ? @result : $result[0];
+}
+
+1;
+__END__
+
+=head1 SEE ALSO
+
+L<Net::NSCAng::Client>
+
+=head1 COPYRIGHT AND LICENSE
+
+This library is free software; you can redistribute it and/or modify
+it under the same terms as Perl itself.
+
+=cut
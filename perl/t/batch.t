@@ -0,0 +1,35 @@
+use strict;
+use warnings;
+use POSIX qw(setlocale LC_ALL);
+use Test::More tests => 6;
+use Net::NSCAng::Client;
+
+BEGIN { setlocale(LC_ALL, "C") };
+
+my $c = Net::NSCAng::Client->new(qw/ localhost myid s3cr3t /,
+    node_name => 'here', keepalive => 0);
+isa_ok($c, 'Net::NSCAng::Client');
+
+# There's no session to keep alive yet.
+is($c->keepalive, undef, 'keepalive() without session');
+
+# Without a server, send_batch() reports "connection refused" for each
+# command, except for the one with a malformed time stamp.
+my $errors = $c->send_batch([
+    "PROCESS_HOST_CHECK_RESULT;here;0;OK",
+    "[12x] PROCESS_HOST_CHECK_RESULT;here;0;OK",
+    "[1] PROCESS_HOST_CHECK_RESULT;here;0;OK",
+]);
+is(scalar @$errors, 3, 'send_batch() returns one status per command');
+ok(crf($errors->[0]) && crf($errors->[2]), 'send_batch() without server');
+like($errors->[1], qr/invalid time stamp format/, 'send_batch() time stamp');
+
+eval { $c->send_batch("PROCESS_HOST_CHECK_RESULT;here;0;OK") };
+like($@, qr/arrayref expected/, 'send_batch() dies without arrayref');
+
+# Connection-refused-filter (depending on the OpenSSL version, the reason may
+# be missing from the error message)
+sub crf {
+    my $err = shift;
+    return defined $err && $err =~ /^SSL error(?::Connection refused)?$/ ? 1 : 0;
+}
@@ -0,0 +1,34 @@
+use strict;
+use warnings;
+use POSIX qw(setlocale LC_ALL);
+use Test::More tests => 5;
+use Net::NSCAng::Client;
+use Net::NSCAng::Client::Pool;
+
+BEGIN { setlocale(LC_ALL, "C") };
+
+my $p = Net::NSCAng::Client::Pool->new(qw/ localhost myid s3cr3t /,
+    node_name => 'here', size => 1);
+isa_ok($p, 'Net::NSCAng::Client::Pool');
+
+# Without a server, get() dies with "connection refused", and must not use up
+# the pool's single slot.
+ok(crf(sub { $p->put($p->get) }), 'get() and put()');
+ok(crf(sub { $p->put($p->get) }), 'get() after failure');
+
+$p->{busy} = 1;
+eval { $p->get };
+like($@, qr/all 1 sessions are in use/, 'get() dies if pool is exhausted');
+$p->{busy} = 0;
+
+ok(crf(sub { $p->with_session(sub { $_[0]->host_result(0, "OK") }) }),
+    'with_session()');
+
+# Connection-refused-filter (depending on the OpenSSL version, the reason may
+# be missing from the error message)
+sub crf {
+    my $sub = shift;
+    eval { $sub->() };
+    return 1 unless $@;
+    return $@ =~ /SSL error(?::Connection refused)?(?: at |$)/ ? 1 : 0;
+}
@@ -0,0 +1,43 @@
+#!/usr/bin/python
+#
+# Compare submitting check results one at a time with svc_result() against
+# submitting them with a single pipelined send_many() call.
+#
+# Usage: bench_send_many.py <host> <port> <identity> <psk> [<count>]
+
+import sys
+import time
+
+from nscang import NSCAngNotifyer
+
+
+def main():
+    if len(sys.argv) < 5:
+        sys.exit("Usage: %s <host> <port> <identity> <psk> [<count>]"
+                 % sys.argv[0])
+
+    host, port, identity, psk = sys.argv[1:5]
+    count = int(sys.argv[5]) if len(sys.argv) > 5 else 20000
+    results = [("host%d.example.com" % (i % 100), "service%d" % i, i % 4,
+                "Benchmark result %d" % i) for i in range(count)]
+
+    n = NSCAngNotifyer(host=host, port=int(port), identity=identity, psk=psk)
+
+    start = time.time()
+    for r in results:
+        n.svc_result(host_name=r[0], svc_description=r[1],
+                     return_code=r[2], plugin_output=r[3])
+    single = time.time() - start
+    print("svc_result() loop: %d results in %.2f s (%.0f/s)"
+          % (count, single, count / single))
+
+    start = time.time()
+    status = n.send_many(results)
+    pipelined = time.time() - start
+    failed = len([s for s in status if s is not None])
+    print("send_many():       %d results in %.2f s (%.0f/s), %d failed"
+          % (count, pipelined, count / pipelined, failed))
+
+
+if __name__ == "__main__":
+    main()
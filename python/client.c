@@ -27,35 +27,114 @@
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <pthread.h>
 
 #include "client.h"
-#include "uthash.h"
 
-static nscang_client_t *nscang_client_instances;
+/*
+ * All sessions using the same cipher list share a single SSL_CTX, which is
+ * created on first use and kept for the lifetime of the process.  The PSK
+ * callback finds the credentials of a session via SSL_get_ex_data(), so no
+ * global lookup table (or lock) is involved once the session is set up.
+ */
+typedef struct nscang_ctx_s {
+	char *ciphers;
+	SSL_CTX *ssl_ctx;
+	struct nscang_ctx_s *next;
+} nscang_ctx_t;
+
+static nscang_ctx_t *nscang_ctx_cache;
+static pthread_mutex_t nscang_ctx_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t nscang_ex_index_once = PTHREAD_ONCE_INIT;
+static int nscang_ex_index = -1;
+
+static void
+wait_for_socket(nscang_client_t *c, int for_write)
+{
+	fd_set fdset;
+	struct timeval tv;
+	int fd = BIO_get_fd(c->bio, NULL);
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 100000;
+
+	if (fd < 0) {
+		select(0, NULL, NULL, NULL, &tv);
+		return;
+	}
+
+	FD_ZERO(&fdset);
+	FD_SET(fd, &fdset);
+	if (for_write)
+		select(fd + 1, NULL, &fdset, NULL, &tv);
+	else
+		select(fd + 1, &fdset, NULL, NULL, &tv);
+}
+
+/*
+ * Check whether the server closed an established session while it was idle.
+ * As no request is outstanding, any data we receive must be a BAIL message.
+ */
+static int
+session_closed(nscang_client_t *c)
+{
+	int rc;
+
+	if (c->rbuf_len > 0)
+		return 1;
 
-static pthread_rwlock_t nscang_client_instances_lock =
-    PTHREAD_RWLOCK_INITIALIZER;
+	rc = SSL_read(c->ssl, c->rbuf, sizeof(c->rbuf));
+
+	if (rc > 0) {
+		c->rbuf_len = rc;
+		return 1;
+	}
+	return !BIO_should_retry(c->bio);
+}
+
+static int
+format_command(char *buf, int size, unsigned int now, char *host,
+               char *service, int status, char *message)
+{
+	int len;
+
+	if (service == NULL)
+		len = snprintf(buf, size - 1,
+		    "[%u] PROCESS_HOST_CHECK_RESULT;%s;%d;%s",
+		    now, host, status, message);
+	else
+		len = snprintf(buf, size - 1,
+		    "[%u] PROCESS_SERVICE_CHECK_RESULT;%s;%s;%d;%s",
+		    now, host, service, status, message);
+
+	if (len < 0)
+		len = 0;
+	else if (len > size - 2) /* The command was truncated. */
+		len = size - 2;
+
+	buf[len++] = '\n';
+	return len;
+}
 
-unsigned int
+static void
+set_result_error(nscang_client_t *c, nscang_result_t *r)
+{
+	char errstr[1024];
+
+	r->_errno = c->_errno;
+	r->errstr = strdup(nscang_client_errstr(c, errstr, sizeof(errstr)));
+}
+
+static unsigned int
 set_psk(SSL *ssl, const char *hint, char *identity,
         unsigned int max_identity_length, unsigned char *psk,
         unsigned int max_psk_length)
 {
-	int rc;
-	nscang_client_t *c = NULL;
+	nscang_client_t *c = SSL_get_ex_data(ssl, nscang_ex_index);
 
-	while (1) {
-		rc = pthread_rwlock_rdlock(&nscang_client_instances_lock);
-		if ((rc != EBUSY) && (rc != EAGAIN))
-			break;
-	}
-	if (rc == 0) {
-		HASH_FIND_PTR(nscang_client_instances, &ssl, c);
-		pthread_rwlock_unlock(&nscang_client_instances_lock);
-	}
 	if (c != NULL) {
 		strncpy(identity, c->identity, max_identity_length);
 		identity[max_identity_length - 1] = 0x00;
@@ -70,30 +149,106 @@ set_psk(SSL *ssl, const char *hint, char *identity,
 	return 0;
 }
 
-int
-nscang_client_init(nscang_client_t *c, char *host, int port, char *ciphers,
-                   char *identity, char *psk)
+static void
+init_ex_index(void)
 {
-	char port_str[6];
-	int rc;
+	nscang_ex_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+}
 
-	snprintf(port_str, sizeof(port_str), "%d", port);
-	memset(c, 0x00, sizeof(nscang_client_t));
+static int
+get_ssl_ctx(nscang_client_t *c, char *ciphers)
+{
+	nscang_ctx_t *entry;
+	const char *key = ciphers != NULL ? ciphers : "";
 
-	c->ssl_ctx = SSL_CTX_new(SSLv23_client_method());
-	if (c->ssl_ctx == NULL) {
-		c->_errno = NSCANG_ERROR_SSL_CTX_CREATE;
+	pthread_mutex_lock(&nscang_ctx_cache_lock);
+
+	for (entry = nscang_ctx_cache; entry != NULL; entry = entry->next)
+		if (strcmp(entry->ciphers, key) == 0) {
+			c->ssl_ctx = entry->ssl_ctx;
+			pthread_mutex_unlock(&nscang_ctx_cache_lock);
+			return 1;
+		}
+
+	if ((entry = malloc(sizeof(nscang_ctx_t))) == NULL
+	    || (entry->ciphers = strdup(key)) == NULL) {
+		free(entry);
+		pthread_mutex_unlock(&nscang_ctx_cache_lock);
+		c->_errno = NSCANG_ERROR_MALLOC;
 		return 0;
 	}
 
+	ERR_clear_error();
+	entry->ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+	if (entry->ssl_ctx == NULL) {
+		c->_errno = NSCANG_ERROR_SSL_CTX_CREATE;
+		goto fail;
+	}
+
 	if (ciphers != NULL) {
-		if (SSL_CTX_set_cipher_list(c->ssl_ctx, ciphers) != 1) {
+		if (SSL_CTX_set_cipher_list(entry->ssl_ctx, ciphers) != 1) {
+			SSL_CTX_free(entry->ssl_ctx);
 			c->_errno = NSCANG_ERROR_SSL_CIPHERS;
-			return 0;
+			goto fail;
 		}
 	}
 
-	SSL_CTX_set_options(c->ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+	SSL_CTX_set_options(entry->ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+	SSL_CTX_set_psk_client_callback(entry->ssl_ctx, set_psk);
+
+	entry->next = nscang_ctx_cache;
+	nscang_ctx_cache = entry;
+	pthread_mutex_unlock(&nscang_ctx_cache_lock);
+
+	c->ssl_ctx = entry->ssl_ctx;
+	return 1;
+
+fail:
+	pthread_mutex_unlock(&nscang_ctx_cache_lock);
+	free(entry->ciphers);
+	free(entry);
+	return 0;
+}
+
+static int
+attach_credentials(nscang_client_t *c, char *identity, char *psk)
+{
+	pthread_once(&nscang_ex_index_once, init_ex_index);
+
+	c->identity = malloc(strlen(identity) + 1);
+	c->psk = malloc(strlen(psk) + 1);
+
+	if ((c->identity == NULL) || (c->psk == NULL)) {
+		c->_errno = NSCANG_ERROR_MALLOC;
+		return 0;
+	}
+
+	strcpy(c->identity, identity);
+	strcpy(c->psk, psk);
+
+	if (nscang_ex_index < 0
+	    || !SSL_set_ex_data(c->ssl, nscang_ex_index, c)) {
+		c->_errno = NSCANG_ERROR_SSL_CREATE;
+		return 0;
+	}
+
+	SSL_set_connect_state(c->ssl);
+	c->state = NSCANG_STATE_NEW;
+
+	return 1;
+}
+
+int
+nscang_client_init(nscang_client_t *c, char *host, int port, char *ciphers,
+                   char *identity, char *psk)
+{
+	char port_str[6];
+
+	snprintf(port_str, sizeof(port_str), "%d", port);
+	memset(c, 0x00, sizeof(nscang_client_t));
+
+	if (!get_ssl_ctx(c, ciphers))
+		return 0;
 
 	c->bio = BIO_new(BIO_s_connect());
 	if (c->bio == NULL) {
@@ -112,69 +267,155 @@ nscang_client_init(nscang_client_t *c, char *host, int port, char *ciphers,
 	}
 
 	SSL_set_bio(c->ssl, c->bio, c->bio);
-	SSL_set_connect_state(c->ssl);
-	SSL_set_psk_client_callback(c->ssl, set_psk);
 
-	c->identity = malloc(strlen(identity) + 1);
-	c->psk = malloc(strlen(psk) + 1);
+	return attach_credentials(c, identity, psk);
+}
 
-	if ((c->identity == NULL) || (c->psk == NULL)) {
-		c->_errno = NSCANG_ERROR_MALLOC;
+/*
+ * Set up a session which doesn't do any socket I/O itself: the caller feeds
+ * the data received from the server into nscang_client_mem_feed() and sends the
+ * data returned by nscang_client_mem_output() to the server.  This allows for
+ * driving the TLS session from an external event loop.
+ */
+int
+nscang_client_init_mem(nscang_client_t *c, char *ciphers, char *identity,
+                       char *psk)
+{
+	memset(c, 0x00, sizeof(nscang_client_t));
+
+	if (!get_ssl_ctx(c, ciphers))
 		return 0;
-	}
 
-	strcpy(c->identity, identity);
-	strcpy(c->psk, psk);
+	c->bio = BIO_new(BIO_s_mem());
+	c->wbio = BIO_new(BIO_s_mem());
+	if (c->bio == NULL || c->wbio == NULL) {
+		if (c->bio != NULL)
+			BIO_free(c->bio);
+		if (c->wbio != NULL)
+			BIO_free(c->wbio);
+		c->bio = c->wbio = NULL;
+		c->_errno = NSCANG_ERROR_SSL_BIO_CREATE;
+		return 0;
+	}
 
-	/* Busyloop until we get an rw lock. */
-	while (1) {
-		rc = pthread_rwlock_wrlock(&nscang_client_instances_lock);
-		if (rc != EBUSY)
-			break;
+	c->ssl = SSL_new(c->ssl_ctx);
+	if (c->ssl == NULL) {
+		BIO_free(c->bio);
+		BIO_free(c->wbio);
+		c->bio = c->wbio = NULL;
+		nscang_client_free(c);
+		c->_errno = NSCANG_ERROR_SSL_CREATE;
+		return 0;
 	}
-	if (rc != 0) {
-		c->_errno = NSCANG_ERROR_LOCKING;
+
+	SSL_set_mode(c->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	SSL_set_bio(c->ssl, c->bio, c->wbio);
+
+	return attach_credentials(c, identity, psk);
+}
+
+static int
+mem_check(nscang_client_t *c, int rc)
+{
+	switch (SSL_get_error(c->ssl, rc)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
 		return 0;
+	case SSL_ERROR_ZERO_RETURN:
+		c->_errno = NSCANG_ERROR_CLOSED;
+		return -1;
+	default:
+		c->_errno = NSCANG_ERROR_SSL;
+		return -1;
 	}
+}
 
-	HASH_ADD_PTR(nscang_client_instances, ssl, c);
-	pthread_rwlock_unlock(&nscang_client_instances_lock);
+/*
+ * Returns 1 if the handshake is complete, 0 if more input is needed, and -1 on
+ * error.
+ */
+int
+nscang_client_mem_handshake(nscang_client_t *c)
+{
+	int rc;
 
-	c->state = NSCANG_STATE_NEW;
+	if ((rc = SSL_do_handshake(c->ssl)) == 1)
+		return 1;
 
+	return mem_check(c, rc);
+}
+
+int
+nscang_client_mem_feed(nscang_client_t *c, const void *buf, int len)
+{
+	if (BIO_write(c->bio, buf, len) != len) {
+		c->_errno = NSCANG_ERROR_MALLOC;
+		return 0;
+	}
 	return 1;
 }
 
+/*
+ * Returns 1 if the data was written, 0 if the call must be repeated after more
+ * input was fed into the session, and -1 on error.
+ */
+int
+nscang_client_mem_write(nscang_client_t *c, const void *buf, int len)
+{
+	int rc;
+
+	if ((rc = SSL_write(c->ssl, buf, len)) > 0)
+		return 1;
+
+	return mem_check(c, rc);
+}
+
+/*
+ * Returns the number of bytes read, 0 if no data is available, and -1 on error
+ * (or if the server closed the session).
+ */
+int
+nscang_client_mem_read(nscang_client_t *c, void *buf, int size)
+{
+	int rc;
+
+	if ((rc = SSL_read(c->ssl, buf, size)) > 0)
+		return rc;
+
+	return mem_check(c, rc);
+}
+
+int
+nscang_client_mem_output(nscang_client_t *c, void *buf, int size)
+{
+	int rc;
+
+	if ((rc = BIO_read(c->wbio, buf, size)) > 0)
+		return rc;
+
+	return 0;
+}
+
+size_t
+nscang_client_mem_pending(nscang_client_t *c)
+{
+	return BIO_ctrl_pending(c->wbio);
+}
+
 void
 nscang_client_free(nscang_client_t *c)
 {
-	if (c->state != NSCANG_STATE_NONE)
+	/* Sessions set up by nscang_client_init_mem() do no socket I/O. */
+	if (c->state != NSCANG_STATE_NONE && c->wbio == NULL)
 		nscang_client_disconnect(c);
 
-	if (c->ssl != NULL) {
-		int rc;
-
-		/* Busyloop until we get an rw lock. */
-		while (1) {
-			rc = pthread_rwlock_wrlock
-			    (&nscang_client_instances_lock);
-			if (rc != EBUSY)
-				break;
-		}
-		if (rc == 0) {
-			HASH_DEL(nscang_client_instances, c);
-			pthread_rwlock_unlock(&nscang_client_instances_lock);
-		}
-	}
 	if (c->ssl != NULL) {
 		SSL_free(c->ssl);
 		c->ssl = NULL;
 		c->bio = NULL;
+		c->wbio = NULL;
 	}
-	if (c->ssl_ctx != NULL) {
-		SSL_CTX_free(c->ssl_ctx);
-		c->ssl_ctx = NULL;
-	}
+	c->ssl_ctx = NULL; /* Shared, see get_ssl_ctx(). */
 	if (c->identity != NULL) {
 		free(c->identity);
 		c->identity = NULL;
@@ -190,19 +431,15 @@ nscang_client_free(nscang_client_t *c)
 int
 nscang_client_write(nscang_client_t *c, void *buf, int len, int timeout)
 {
-	int rc;
 	time_t endtime;
-	fd_set fdset;
-	struct timeval tv;
-
-	tv.tv_sec = 0;
-	tv.tv_usec = 100000;
 
 	endtime = time(NULL) + timeout;
 
 	while (1) {
-		if ((rc = SSL_write(c->ssl, buf, len)) > 0)
+		if (SSL_write(c->ssl, buf, len) > 0) {
+			c->n_writes++;
 			return 1;
+		}
 
 		if (!BIO_should_retry(c->bio)) {
 			c->_errno = NSCANG_ERROR_SSL;
@@ -214,48 +451,36 @@ nscang_client_write(nscang_client_t *c, void *buf, int len, int timeout)
 			return 0;
 		}
 
-		FD_ZERO(&fdset);
-		FD_SET(BIO_get_fd(c->bio, NULL), &fdset);
-		select(1, NULL, &fdset, NULL, &tv);
+		wait_for_socket(c, 1);
 	}
 }
 
 int
 nscang_client_response(nscang_client_t *c, int timeout)
 {
-	int rc;
+	int rc, len, version;
 	time_t endtime;
-	fd_set fdset;
-	char buf[1024];
-	int was_read = 0;
-	char *ptr = buf;
-	struct timeval tv;
-
-	tv.tv_sec = 0;
-	tv.tv_usec = 100000;
+	char buf[sizeof(c->rbuf)];
+	char *eol;
 
 	endtime = time(NULL) + timeout;
 
-	while (1) {
-		rc = SSL_read(c->ssl, ptr, 1024 - was_read);
-
-		if (rc > 0) {
-			was_read = was_read + rc;
-			ptr = buf + was_read;
-
-			if (buf[was_read - 1] == '\n') {
-				if (buf[was_read - 2] == '\r')
-					buf[was_read - 2] = 0x00;
-				else
-					buf[was_read - 1] = 0x00;
+	/*
+	 * With pipelining, a single SSL_read() may return multiple response
+	 * lines, so we keep any data following the first line in c->rbuf.
+	 */
+	while ((eol = memchr(c->rbuf, '\n', c->rbuf_len)) == NULL) {
+		if (c->rbuf_len == sizeof(c->rbuf)) {
+			c->_errno = NSCANG_ERROR_TOO_LONG_RESPONSE;
+			return 0;
+		}
 
-				break;
-			}
+		rc = SSL_read(c->ssl, c->rbuf + c->rbuf_len,
+		    sizeof(c->rbuf) - c->rbuf_len);
 
-			if (was_read == 1024) {
-				c->_errno = NSCANG_ERROR_TOO_LONG_RESPONSE;
-				return 0;
-			}
+		if (rc > 0) {
+			c->rbuf_len += rc;
+			continue;
 		} else if (!BIO_should_retry(c->bio)) {
 			c->_errno = NSCANG_ERROR_SSL;
 			return 0;
@@ -266,13 +491,23 @@ nscang_client_response(nscang_client_t *c, int timeout)
 			return 0;
 		}
 
-		FD_ZERO(&fdset);
-		FD_SET(BIO_get_fd(c->bio, NULL), &fdset);
-		select(1, &fdset, NULL, NULL, &tv);
+		wait_for_socket(c, 0);
 	}
 
+	len = eol - c->rbuf + 1;
+	memcpy(buf, c->rbuf, len);
+	c->rbuf_len -= len;
+	memmove(c->rbuf, c->rbuf + len, c->rbuf_len);
+
+	if (len >= 2 && buf[len - 2] == '\r')
+		buf[len - 2] = 0x00;
+	else
+		buf[len - 1] = 0x00;
+
 	if (strncmp(buf, "MOIN", 4) == 0) {
-		if (strcmp(buf, "MOIN 1") == 0) {
+		version = atoi(buf + 4);
+		if (version >= 1 && version <= NSCANG_PROTOCOL_VERSION) {
+			c->version = version;
 			return NSCANG_RESP_MOIN;
 		} else {
 			c->_errno = NSCANG_ERROR_BAD_PROTO_VERSION;
@@ -308,25 +543,20 @@ nscang_client_response(nscang_client_t *c, int timeout)
 void
 nscang_client_disconnect(nscang_client_t *c)
 {
-	fd_set fdset;
-	struct timeval tv;
-
-	tv.tv_sec = 0;
-	tv.tv_usec = 100000;
-
 	if (c->state == NSCANG_STATE_MOIN)
 		nscang_client_send_quit(c);
 
 	if ((SSL_shutdown(c->ssl) == -1) && BIO_should_retry(c->bio)) {
-		FD_ZERO(&fdset);
-		FD_SET(BIO_get_fd(c->bio, NULL), &fdset);
-		select(1, NULL, &fdset, NULL, &tv);
+		wait_for_socket(c, 1);
 		SSL_shutdown(c->ssl);
 	}
 
+	/* Don't try to resume the old session on the next connection. */
+	SSL_set_session(c->ssl, NULL);
 	SSL_clear(c->ssl);
 	BIO_reset(c->bio);
 
+	c->rbuf_len = 0;
 	c->state = NSCANG_STATE_NEW;
 }
 
@@ -336,8 +566,11 @@ nscang_client_send_moin(nscang_client_t *c, int timeout)
 	char cmd[64];
 	int len, rc;
 
-	if (c->state == NSCANG_STATE_MOIN)
-		return 1;
+	if (c->state == NSCANG_STATE_MOIN) {
+		if (!session_closed(c))
+			return 1;
+		nscang_client_disconnect(c);
+	}
 
 	if (c->state != NSCANG_STATE_NEW) {
 		c->_errno = NSCANG_ERROR_BAD_STATE;
@@ -345,8 +578,8 @@ nscang_client_send_moin(nscang_client_t *c, int timeout)
 	}
 
 	srandom(time(NULL));
-	len = snprintf(cmd, sizeof(cmd), "MOIN 1 %08ld%08ld\r\n", random(),
-	    random());
+	len = snprintf(cmd, sizeof(cmd), "MOIN %d %08ld%08ld\r\n",
+	    NSCANG_PROTOCOL_VERSION, random(), random());
 
 	if (!nscang_client_write(c, cmd, len, timeout))
 		return 0;
@@ -369,40 +602,39 @@ int
 nscang_client_send_push(nscang_client_t *c, char *host, char *service,
                         int status, char *message, int timeout)
 {
-	char cmd[64], command[1024];
-	int len, rc;
+	char cmd[64 + NSCANG_MAX_COMMAND_SIZE], command[NSCANG_MAX_COMMAND_SIZE];
+	int cmd_len, len, rc;
 
 	if (!nscang_client_send_moin(c, timeout))
 		return 0;
 
-	if (service == NULL)
-		len = snprintf(command, sizeof(command) - 1,
-		    "[%u] PROCESS_HOST_CHECK_RESULT;%s;%d;%s",
-		    (unsigned int)time(NULL), host, status, message);
-	else
-		len = snprintf(command, sizeof(command) - 1,
-		    "[%u] PROCESS_SERVICE_CHECK_RESULT;%s;%s;%d;%s",
-		    (unsigned int)time(NULL), host, service, status, message);
+	len = format_command(command, sizeof(command), (unsigned int)time(NULL),
+	    host, service, status, message);
+	cmd_len = snprintf(cmd, 64, "PUSH %d\n", len);
 
-	command[len++] = '\n';
+	if (c->version > 1) {
+		/* The payload may follow the PUSH line right away. */
+		memcpy(cmd + cmd_len, command, len);
+		if (!nscang_client_write(c, cmd, cmd_len + len, timeout))
+			return 0;
+	} else {
+		if (!nscang_client_write(c, cmd, cmd_len, timeout))
+			return 0;
 
-	snprintf(cmd, sizeof(cmd), "PUSH %d\n", len);
-	if (!nscang_client_write(c, cmd, strlen(cmd), timeout))
-		return 0;
+		rc = nscang_client_response(c, timeout);
 
-	rc = nscang_client_response(c, timeout);
+		if (!rc)
+			return 0;
 
-	if (!rc)
-		return 0;
+		if (rc != NSCANG_RESP_OKAY) {
+			c->_errno = NSCANG_ERROR_PROTOCOL_MISMATCH;
+			return 0;
+		}
 
-	if (rc != NSCANG_RESP_OKAY) {
-		c->_errno = NSCANG_ERROR_PROTOCOL_MISMATCH;
-		return 0;
+		if (!nscang_client_write(c, command, len, timeout))
+			return 0;
 	}
 
-	if (!nscang_client_write(c, command, len, timeout))
-		return 0;
-
 	rc = nscang_client_response(c, timeout);
 
 	if (!rc)
@@ -416,6 +648,125 @@ nscang_client_send_push(nscang_client_t *c, char *host, char *service,
 	return 1;
 }
 
+/*
+ * Submit the given results, and return the number of results the server
+ * responded to.  The per-result status is stored in each result's `_errno' and
+ * `errstr' members (the latter must be released with nscang_result_free()).
+ * With protocol version 2, results are sent in windows of
+ * NSCANG_PIPELINE_WINDOW commands, each formatted into one contiguous buffer,
+ * and the responses to one window are read while the next one is in flight.
+ */
+int
+nscang_client_send_many(nscang_client_t *c, nscang_result_t *results,
+                        int n_results, int timeout)
+{
+	char command[NSCANG_MAX_COMMAND_SIZE];
+	char *buf = NULL;
+	size_t buf_size = 0, buf_len;
+	unsigned int now = (unsigned int)time(NULL);
+	int n_sent = 0, n_acked = 0;
+	int i, len, end, target, rc;
+
+	for (i = 0; i < n_results; i++) {
+		results[i]._errno = 0;
+		results[i].errstr = NULL;
+	}
+
+	if (!nscang_client_send_moin(c, timeout))
+		goto fail;
+
+	if (c->version < 2) {
+		for (; n_acked < n_results; n_acked++) {
+			nscang_result_t *r = &results[n_acked];
+
+			if (nscang_client_send_push(c, r->host, r->service,
+			    r->status, r->message, timeout))
+				continue;
+			if (c->_errno != NSCANG_ERROR_FAIL)
+				goto fail;
+			set_result_error(c, r);
+		}
+		return n_acked;
+	}
+
+	while (n_acked < n_results) {
+		if (n_sent < n_results) {
+			end = n_sent + NSCANG_PIPELINE_WINDOW;
+			if (end > n_results)
+				end = n_results;
+			for (buf_len = 0; n_sent < end; n_sent++) {
+				nscang_result_t *r = &results[n_sent];
+
+				if (buf_size - buf_len < 64 + sizeof(command)) {
+					char *new_buf;
+
+					buf_size = buf_size * 2 + 64
+					    + sizeof(command);
+					if ((new_buf = realloc(buf, buf_size))
+					    == NULL) {
+						c->_errno = NSCANG_ERROR_MALLOC;
+						goto fail;
+					}
+					buf = new_buf;
+				}
+				len = format_command(command, sizeof(command),
+				    now, r->host, r->service, r->status,
+				    r->message);
+				buf_len += snprintf(buf + buf_len, 64,
+				    "PUSH %d\n", len);
+				memcpy(buf + buf_len, command, len);
+				buf_len += len;
+			}
+			if (!nscang_client_write(c, buf, buf_len, timeout))
+				goto fail;
+		}
+
+		/*
+		 * Collect the responses to the previous window while the
+		 * current one is in flight, or all of them once we're done.
+		 */
+		target = n_sent < n_results ?
+		    n_sent - NSCANG_PIPELINE_WINDOW : n_sent;
+
+		for (; n_acked < target; n_acked++) {
+			if ((rc = nscang_client_response(c, timeout))
+			    == NSCANG_RESP_OKAY)
+				continue;
+			if (rc == 0 && c->_errno == NSCANG_ERROR_FAIL) {
+				set_result_error(c, &results[n_acked]);
+				continue;
+			}
+			if (rc != 0)
+				c->_errno = NSCANG_ERROR_PROTOCOL_MISMATCH;
+			goto fail;
+		}
+	}
+
+	free(buf);
+	return n_acked;
+
+fail:
+	for (i = n_acked; i < n_results; i++)
+		set_result_error(c, &results[i]);
+	if (c->state == NSCANG_STATE_MOIN)
+		nscang_client_disconnect(c);
+
+	free(buf);
+	return n_acked;
+}
+
+void
+nscang_result_free(nscang_result_t *results, int n_results)
+{
+	int i;
+
+	for (i = 0; i < n_results; i++)
+		if (results[i].errstr != NULL) {
+			free(results[i].errstr);
+			results[i].errstr = NULL;
+		}
+}
+
 int
 nscang_client_send_quit(nscang_client_t *c)
 {
@@ -482,8 +833,8 @@ nscang_client_errstr(nscang_client_t *c, char *buf, int buf_size)
 		snprintf(buf, buf_size, "Operation not permitted in state %d",
 		    c->state);
 		break;
-	case NSCANG_ERROR_LOCKING:
-		strncpy(buf, "Can't obtain lock for instances list", buf_size);
+	case NSCANG_ERROR_CLOSED:
+		strncpy(buf, "Connection closed by server", buf_size);
 		break;
 	default:
 		buf[0] = 0x00;
@@ -31,27 +31,43 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
-#include "uthash.h"
-
 typedef struct {
 	SSL_CTX *ssl_ctx;
 	BIO *bio;
+	BIO *wbio; /* Only used with nscang_client_init_mem(). */
 	SSL *ssl;
 	int state;
+	int version;
+
+	char rbuf[1024];
+	int rbuf_len;
+	unsigned long n_writes; /* Successful nscang_client_write() calls. */
 
 	char *identity;
 	char *psk;
 
 	int _errno;
 	char errstr[1024];
-
-	UT_hash_handle hh;
 } nscang_client_t;
 
+typedef struct {
+	char *host;
+	char *service; /* NULL for host check results. */
+	int status;
+	char *message;
+
+	int _errno;
+	char *errstr;
+} nscang_result_t;
+
 #define NSCANG_STATE_NONE 0
 #define NSCANG_STATE_NEW  1
 #define NSCANG_STATE_MOIN 2
 
+#define NSCANG_PROTOCOL_VERSION 2
+#define NSCANG_MAX_COMMAND_SIZE 1024
+#define NSCANG_PIPELINE_WINDOW  256
+
 #define NSCANG_RESP_MOIN 1
 #define NSCANG_RESP_OKAY 2
 
@@ -64,7 +80,7 @@ typedef struct {
 #define NSCANG_ERROR_BAIL               7
 #define NSCANG_ERROR_FAIL               8
 #define NSCANG_ERROR_BAD_STATE          9
-#define NSCANG_ERROR_LOCKING            10
+#define NSCANG_ERROR_CLOSED             11
 
 #define NSCANG_ERROR_SSL_CTX_CREATE     101
 #define NSCANG_ERROR_SSL_CIPHERS        102
@@ -74,12 +90,23 @@ typedef struct {
 
 int nscang_client_init(nscang_client_t *c, char *host, int port,
                        char *ciphers, char *identity, char *psk);
+int nscang_client_init_mem(nscang_client_t *c, char *ciphers, char *identity,
+                           char *psk);
+int nscang_client_mem_handshake(nscang_client_t *c);
+int nscang_client_mem_feed(nscang_client_t *c, const void *buf, int len);
+int nscang_client_mem_write(nscang_client_t *c, const void *buf, int len);
+int nscang_client_mem_read(nscang_client_t *c, void *buf, int size);
+int nscang_client_mem_output(nscang_client_t *c, void *buf, int size);
+size_t nscang_client_mem_pending(nscang_client_t *c);
 void nscang_client_free(nscang_client_t *c);
 void nscang_client_disconnect(nscang_client_t *c);
 int nscang_client_send_moin(nscang_client_t *c, int timeout);
 int nscang_client_send_push(nscang_client_t *c, char *host, char *service,
                             int status, char *message, int timeout);
+int nscang_client_send_many(nscang_client_t *c, nscang_result_t *results,
+                            int n_results, int timeout);
 int nscang_client_send_quit(nscang_client_t *c);
 char *nscang_client_errstr(nscang_client_t *c, char *buf, int buf_size);
+void nscang_result_free(nscang_result_t *results, int n_results);
 
 #endif /* __NSCANG_CLIENT_H */
@@ -30,6 +30,7 @@
 #include "structmember.h"
 
 #include <openssl/ssl.h>
+#include <pthread.h>
 
 #include "client.h"
 
@@ -41,9 +42,32 @@ typedef struct {
 	char *psk;
 	char *ciphers;
 	nscang_client_t *client;
+	pthread_mutex_t lock; /* Held while the GIL is released. */
 	/* Type-specific fields go here. */
 } NSCAngNotifyer;
 
+static int
+send_push(NSCAngNotifyer *self, char *host, char *service, int rc,
+          char *output, int timeout)
+{
+	nscang_client_t *client = self->client;
+	int ok;
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&self->lock);
+	ok = nscang_client_send_push(client, host, service, rc, output,
+	    timeout);
+	if (!ok) {
+		nscang_client_disconnect(client);
+		ok = nscang_client_send_push(client, host, service, rc, output,
+		    timeout);
+	}
+	pthread_mutex_unlock(&self->lock);
+	Py_END_ALLOW_THREADS
+
+	return ok;
+}
+
 static PyObject *
 nscang_host_result(PyObject *self, PyObject *args, PyObject *kwds)
 {
@@ -60,14 +84,8 @@ nscang_host_result(PyObject *self, PyObject *args, PyObject *kwds)
 	    kwlist, &host, &rc, &output, &timeout))
 		return NULL;
 
-	if (nscang_client_send_push(client, host, NULL, rc, output, timeout)) {
-		Py_INCREF(Py_None);
-		return Py_None;
-	}
-
-	nscang_client_disconnect(client);
-
-	if (nscang_client_send_push(client, host, NULL, rc, output, timeout)) {
+	if (send_push((NSCAngNotifyer *)self, host, NULL, rc, output,
+	    timeout)) {
 		Py_INCREF(Py_None);
 		return Py_None;
 	}
@@ -94,14 +112,8 @@ nscang_svc_result(PyObject *self, PyObject *args, PyObject *kwds)
 	    kwlist, &host, &service, &rc, &output, &timeout))
 		return NULL;
 
-	if (nscang_client_send_push(client, host, service, rc, output, timeout)) {
-		Py_INCREF(Py_None);
-		return Py_None;
-	}
-
-	nscang_client_disconnect(client);
-
-	if (nscang_client_send_push(client, host, service, rc, output, timeout)) {
+	if (send_push((NSCAngNotifyer *)self, host, service, rc, output,
+	    timeout)) {
 		Py_INCREF(Py_None);
 		return Py_None;
 	}
@@ -111,6 +123,137 @@ nscang_svc_result(PyObject *self, PyObject *args, PyObject *kwds)
 	return NULL;
 }
 
+static PyObject *
+nscang_connect(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	char errstr[1024];
+	static char *kwlist[] = { "timeout", NULL };
+	NSCAngNotifyer *notifyer = (NSCAngNotifyer *)self;
+	nscang_client_t *client = notifyer->client;
+	int timeout = 5;
+	int ok;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|I:connect", kwlist,
+	    &timeout))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&notifyer->lock);
+	ok = nscang_client_send_moin(client, timeout);
+	if (!ok) {
+		nscang_client_disconnect(client);
+		ok = nscang_client_send_moin(client, timeout);
+	}
+	if (!ok)
+		nscang_client_errstr(client, errstr, sizeof(errstr));
+	pthread_mutex_unlock(&notifyer->lock);
+	Py_END_ALLOW_THREADS
+
+	if (!ok) {
+		PyErr_Format(PyExc_RuntimeError, "connect: %s", errstr);
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+nscang_send_many(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = { "results", "timeout", NULL };
+	NSCAngNotifyer *notifyer = (NSCAngNotifyer *)self;
+	nscang_client_t *client = notifyer->client;
+	nscang_result_t *results;
+	PyObject *iterable, *items, *status;
+	Py_ssize_t n, i;
+	unsigned long n_writes;
+	int timeout = 5;
+	int n_acked, reused;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|I:send_many", kwlist,
+	    &iterable, &timeout))
+		return NULL;
+
+	/*
+	 * The tuple keeps the items (and thereby the strings we point to)
+	 * alive while the GIL is released.
+	 */
+	if ((items = PySequence_Tuple(iterable)) == NULL)
+		return NULL;
+	n = PyTuple_GET_SIZE(items);
+
+	if (n == 0) {
+		Py_DECREF(items);
+		return PyList_New(0);
+	}
+	if ((results = calloc(n, sizeof(nscang_result_t))) == NULL) {
+		Py_DECREF(items);
+		return PyErr_NoMemory();
+	}
+	for (i = 0; i < n; i++) {
+		PyObject *item = PyTuple_GET_ITEM(items, i);
+		nscang_result_t *r = &results[i];
+		int ok;
+
+		r->message = "";
+		if (!PyTuple_Check(item)) {
+			PyErr_Format(PyExc_TypeError,
+			    "send_many: results must be tuples");
+			ok = 0;
+		} else if (PyTuple_GET_SIZE(item) == 4)
+			ok = PyArg_ParseTuple(item, "ssi|s:send_many",
+			    &r->host, &r->service, &r->status, &r->message);
+		else
+			ok = PyArg_ParseTuple(item, "si|s:send_many",
+			    &r->host, &r->status, &r->message);
+		if (!ok) {
+			free(results);
+			Py_DECREF(items);
+			return NULL;
+		}
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&notifyer->lock);
+	reused = client->state == NSCANG_STATE_MOIN;
+	n_writes = client->n_writes;
+	n_acked = nscang_client_send_many(client, results, (int)n, timeout);
+	/*
+	 * Retry only if the very first write to a reused session failed, as the
+	 * session was stale then.  Otherwise, the server might have processed
+	 * some of the results even though it didn't respond.
+	 */
+	if (n_acked == 0 && reused && client->n_writes == n_writes) {
+		nscang_result_free(results, (int)n);
+		nscang_client_disconnect(client);
+		n_acked = nscang_client_send_many(client, results, (int)n,
+		    timeout);
+	}
+	pthread_mutex_unlock(&notifyer->lock);
+	Py_END_ALLOW_THREADS
+
+	if ((status = PyList_New(n)) != NULL)
+		for (i = 0; i < n; i++) {
+			PyObject *value;
+
+			if (results[i]._errno == 0) {
+				Py_INCREF(Py_None);
+				value = Py_None;
+			} else if ((value = PyUnicode_FromString(
+			    results[i].errstr != NULL ?
+			    results[i].errstr : "Unknown error")) == NULL) {
+				Py_CLEAR(status);
+				break;
+			}
+			PyList_SET_ITEM(status, i, value);
+		}
+
+	nscang_result_free(results, (int)n);
+	free(results);
+	Py_DECREF(items);
+	return status;
+}
+
 static int
 NSCAngNotifyer_init(NSCAngNotifyer *self, PyObject *args, PyObject *kwds)
 {
@@ -129,6 +272,8 @@ NSCAngNotifyer_init(NSCAngNotifyer *self, PyObject *args, PyObject *kwds)
 	    &self->psk, &self->ciphers))
 		return -1;
 
+	pthread_mutex_init(&self->lock, NULL);
+
 	self->client = malloc(sizeof(nscang_client_t));
 	if (self->client == NULL) {
 		PyErr_Format(PyExc_MemoryError,
@@ -150,6 +295,7 @@ static void
 NSCAngNotifyer_dealloc(NSCAngNotifyer *self)
 {
 	nscang_client_free(self->client);
+	pthread_mutex_destroy(&self->lock);
 	Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
@@ -166,6 +312,13 @@ static PyMethodDef NSCAngNotifyer_methods[] = {
 	{ "svc_result", (PyCFunction) nscang_svc_result,
 	    METH_VARARGS | METH_KEYWORDS,
 	    "Send a service result to the configured monitoring host" },
+	{ "connect", (PyCFunction) nscang_connect,
+	    METH_VARARGS | METH_KEYWORDS,
+	    "Establish the session unless that was done already" },
+	{ "send_many", (PyCFunction) nscang_send_many,
+	    METH_VARARGS | METH_KEYWORDS,
+	    "Send many host and/or service results over a pipelined session; "
+	    "returns a list holding None or an error message per result" },
 	{ NULL }
 };
 
@@ -185,6 +338,205 @@ static PyTypeObject NSCAngNotifyerType = {
 	.tp_free = PyObject_Del,
 };
 
+/*
+ * A TLS session which doesn't do any socket I/O itself, for use with event
+ * loops such as asyncio (see nscang_asyncio.py).
+ */
+typedef struct {
+	PyObject_HEAD
+	nscang_client_t *client;
+} NSCAngTLSSession;
+
+static PyObject *
+session_error(NSCAngTLSSession *self, const char *what)
+{
+	char errstr[1024];
+
+	PyErr_Format(PyExc_RuntimeError, "%s: %s", what,
+	    nscang_client_errstr(self->client, errstr, sizeof(errstr)));
+	return NULL;
+}
+
+static PyObject *
+session_do_handshake(PyObject *self, PyObject *args)
+{
+	NSCAngTLSSession *session = (NSCAngTLSSession *)self;
+
+	switch (nscang_client_mem_handshake(session->client)) {
+	case 1:
+		Py_RETURN_TRUE;
+	case 0:
+		Py_RETURN_FALSE;
+	default:
+		return session_error(session, "do_handshake");
+	}
+}
+
+static PyObject *
+session_feed(PyObject *self, PyObject *args)
+{
+	NSCAngTLSSession *session = (NSCAngTLSSession *)self;
+	Py_buffer data;
+	int ok;
+
+	if (!PyArg_ParseTuple(args, "y*:feed", &data))
+		return NULL;
+
+	ok = nscang_client_mem_feed(session->client, data.buf, (int)data.len);
+	PyBuffer_Release(&data);
+
+	if (!ok)
+		return session_error(session, "feed");
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+session_write(PyObject *self, PyObject *args)
+{
+	NSCAngTLSSession *session = (NSCAngTLSSession *)self;
+	Py_buffer data;
+	int rc;
+
+	if (!PyArg_ParseTuple(args, "y*:write", &data))
+		return NULL;
+
+	rc = nscang_client_mem_write(session->client, data.buf, (int)data.len);
+	PyBuffer_Release(&data);
+
+	switch (rc) {
+	case 1:
+		Py_RETURN_TRUE;
+	case 0:
+		Py_RETURN_FALSE;
+	default:
+		return session_error(session, "write");
+	}
+}
+
+static PyObject *
+session_read(PyObject *self, PyObject *args)
+{
+	NSCAngTLSSession *session = (NSCAngTLSSession *)self;
+	PyObject *result, *chunk;
+	char buf[16384];
+	int n;
+
+	if ((result = PyBytes_FromStringAndSize(NULL, 0)) == NULL)
+		return NULL;
+
+	while ((n = nscang_client_mem_read(session->client, buf, sizeof(buf)))
+	    > 0) {
+		if ((chunk = PyBytes_FromStringAndSize(buf, n)) == NULL) {
+			Py_DECREF(result);
+			return NULL;
+		}
+		PyBytes_ConcatAndDel(&result, chunk);
+		if (result == NULL)
+			return NULL;
+	}
+	if (n < 0 && PyBytes_GET_SIZE(result) == 0) {
+		Py_DECREF(result);
+		return session_error(session, "read");
+	}
+
+	return result;
+}
+
+static PyObject *
+session_outgoing(PyObject *self, PyObject *args)
+{
+	NSCAngTLSSession *session = (NSCAngTLSSession *)self;
+	PyObject *result;
+	size_t pending = nscang_client_mem_pending(session->client);
+	int n;
+
+	if ((result = PyBytes_FromStringAndSize(NULL, pending)) == NULL)
+		return NULL;
+
+	if (pending > 0) {
+		n = nscang_client_mem_output(session->client,
+		    PyBytes_AS_STRING(result), (int)pending);
+		if (_PyBytes_Resize(&result, n) < 0)
+			return NULL;
+	}
+
+	return result;
+}
+
+static int
+NSCAngTLSSession_init(NSCAngTLSSession *self, PyObject *args, PyObject *kwds)
+{
+	char errstr[1024];
+	static char *kwlist[] = { "identity", "psk", "ciphers", NULL };
+	char *identity = NULL;
+	char *psk = NULL;
+	char *ciphers = NULL;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "ss|z:__init__", kwlist,
+	    &identity, &psk, &ciphers))
+		return -1;
+
+	if (self->client != NULL) {
+		nscang_client_free(self->client);
+		free(self->client);
+	}
+
+	self->client = malloc(sizeof(nscang_client_t));
+	if (self->client == NULL) {
+		PyErr_Format(PyExc_MemoryError,
+		    "Can't allocate memory for NSCAng session state");
+		return -1;
+	}
+
+	if (!nscang_client_init_mem(self->client, ciphers, identity, psk)) {
+		PyErr_Format(PyExc_RuntimeError, "nscang_client_init_mem: %s",
+		    nscang_client_errstr(self->client, errstr, sizeof(errstr)));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+NSCAngTLSSession_dealloc(NSCAngTLSSession *self)
+{
+	if (self->client != NULL) {
+		nscang_client_free(self->client);
+		free(self->client);
+	}
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyMethodDef NSCAngTLSSession_methods[] = {
+	{ "do_handshake", session_do_handshake, METH_NOARGS,
+	    "Continue the TLS handshake; returns True once it's complete" },
+	{ "feed", session_feed, METH_VARARGS,
+	    "Feed data received from the server into the session" },
+	{ "write", session_write, METH_VARARGS,
+	    "Encrypt data; returns False if more input must be fed first" },
+	{ "read", session_read, METH_NOARGS,
+	    "Return the decrypted data available so far" },
+	{ "outgoing", session_outgoing, METH_NOARGS,
+	    "Return the data which must be sent to the server" },
+	{ NULL }
+};
+
+static PyTypeObject NSCAngTLSSessionType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "nscang.TLSSession",
+	.tp_basicsize = sizeof(NSCAngTLSSession),
+	.tp_itemsize = 0,
+	.tp_dealloc = (destructor) NSCAngTLSSession_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "TLS-PSK session driven by an external event loop",
+	.tp_methods = NSCAngTLSSession_methods,
+	.tp_init = (initproc) NSCAngTLSSession_init,
+	.tp_alloc = PyType_GenericAlloc,
+	.tp_new = PyType_GenericNew,
+	.tp_free = PyObject_Del,
+};
+
 static PyMethodDef module_methods[] = {
 	{ NULL }
 };
@@ -207,6 +559,8 @@ PyInit_nscang(void)
 
 	if (PyType_Ready(&NSCAngNotifyerType) < 0)
 		return NULL;
+	if (PyType_Ready(&NSCAngTLSSessionType) < 0)
+		return NULL;
 
 	m = PyModule_Create(&nscangmodule);
 	if (m == NULL)
@@ -220,5 +574,13 @@ PyInit_nscang(void)
 		return NULL;
 	}
 
+	Py_INCREF(&NSCAngTLSSessionType);
+	if (PyModule_AddObject(m, "TLSSession",
+	    (PyObject *)&NSCAngTLSSessionType) < 0) {
+		Py_DECREF(&NSCAngTLSSessionType);
+		Py_DECREF(m);
+		return NULL;
+	}
+
 	return m;
 }
@@ -0,0 +1,247 @@
+# Copyright (c) 2014 Holger Weiss <holger@weiss.in-berlin.de>
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice,
+#    this list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+
+"""asyncio client for NSCA-ng servers.
+
+The TLS-PSK session is provided by nscang.TLSSession, which does no socket I/O
+itself; this module moves the data between that session and an asyncio
+transport.  Any number of coroutines may submit check results concurrently:
+their PUSH requests are pipelined over a single connection (if the server
+speaks protocol version 2), and the responses are matched to the submitters in
+order.
+"""
+
+import asyncio
+import collections
+import random
+import time
+
+from nscang import TLSSession
+
+PROTOCOL_VERSION = 2
+
+
+class NSCAngError(RuntimeError):
+    pass
+
+
+class _Protocol(asyncio.Protocol):
+    def __init__(self, client):
+        self._client = client
+
+    def connection_made(self, transport):
+        self._client._connection_made(self, transport)
+
+    def data_received(self, data):
+        self._client._data_received(self, data)
+
+    def connection_lost(self, exc):
+        self._client._connection_lost(self, exc)
+
+    def pause_writing(self):
+        self._client._writable.clear()
+
+    def resume_writing(self):
+        self._client._writable.set()
+
+
+class AsyncNSCAngNotifyer:
+    """Submit check results to an NSCA-ng server from asyncio coroutines.
+
+    The connection is established on the first submission and re-established
+    after it was lost.  At most `max_in_flight' results are awaiting a response
+    at any given time.
+    """
+
+    def __init__(self, host, port=5668, identity=None, psk=None, ciphers=None,
+                 max_in_flight=1024):
+        self.host = host
+        self.port = port
+        self.identity = identity
+        self.psk = psk
+        self.ciphers = ciphers
+        self.version = None
+        self._protocol = None
+        self._transport = None
+        self._session = None
+        self._handshake = None
+        self._input = bytearray()
+        self._unsent = collections.deque()
+        self._waiters = collections.deque()
+        self._writable = asyncio.Event()
+        self._writable.set()
+        self._connect_lock = asyncio.Lock()
+        self._push_lock = asyncio.Lock()  # Serializes protocol version 1.
+        self._slots = asyncio.Semaphore(max_in_flight)
+
+    async def connect(self, timeout=5):
+        async with self._connect_lock:
+            if self._transport is not None:
+                return
+            loop = asyncio.get_running_loop()
+            self._session = TLSSession(self.identity, self.psk, self.ciphers)
+            self._handshake = loop.create_future()
+            try:
+                await asyncio.wait_for(loop.create_connection(
+                    lambda: _Protocol(self), self.host, self.port), timeout)
+                await asyncio.wait_for(asyncio.shield(self._handshake),
+                                       timeout)
+                response = await asyncio.wait_for(self._request(
+                    b"MOIN %d %016x\r\n"
+                    % (PROTOCOL_VERSION, random.getrandbits(64))), timeout)
+                if not response.startswith("MOIN "):
+                    raise NSCAngError("Unexpected response: %s" % response)
+                self.version = int(response[5:])
+            except (Exception, asyncio.CancelledError) as e:
+                self._abort(e if isinstance(e, NSCAngError)
+                            else NSCAngError("Cannot connect: %r" % e))
+                raise
+
+    async def host_result(self, host_name, return_code, plugin_output="",
+                          timeout=5):
+        await self._push("PROCESS_HOST_CHECK_RESULT;%s;%d;%s"
+                         % (host_name, return_code, plugin_output), timeout)
+
+    async def svc_result(self, host_name, svc_description, return_code,
+                         plugin_output="", timeout=5):
+        await self._push("PROCESS_SERVICE_CHECK_RESULT;%s;%s;%d;%s"
+                         % (host_name, svc_description, return_code,
+                            plugin_output), timeout)
+
+    async def close(self, timeout=5):
+        if self._transport is None:
+            return
+        try:
+            await asyncio.wait_for(self._request(b"QUIT\r\n"), timeout)
+        except (NSCAngError, asyncio.TimeoutError):
+            pass
+        self._abort(NSCAngError("Connection closed"))
+
+    async def _push(self, command, timeout):
+        payload = ("[%d] %s\n" % (time.time(), command)).encode("utf-8")
+        header = b"PUSH %d\r\n" % len(payload)
+
+        async with self._slots:
+            await self.connect(timeout)
+            if self.version >= 2:
+                await self._writable.wait()
+                response = await asyncio.wait_for(
+                    self._request(header + payload), timeout)
+            else:
+                async with self._push_lock:
+                    response = await asyncio.wait_for(
+                        self._request(header), timeout)
+                    if response.startswith("OKAY"):
+                        response = await asyncio.wait_for(
+                            self._request(payload), timeout)
+        if not response.startswith("OKAY"):
+            raise NSCAngError(response)
+
+    def _request(self, data):
+        if self._transport is None:
+            raise NSCAngError("Not connected")
+        waiter = asyncio.get_running_loop().create_future()
+        self._waiters.append(waiter)
+        self._send(data)
+        return waiter
+
+    def _send(self, data):
+        if self._unsent or not self._session.write(data):
+            self._unsent.append(data)
+        self._flush()
+
+    def _flush(self):
+        while self._unsent and self._session.write(self._unsent[0]):
+            self._unsent.popleft()
+        output = self._session.outgoing()
+        if output:
+            self._transport.write(output)
+
+    def _connection_made(self, protocol, transport):
+        self._protocol = protocol
+        self._transport = transport
+        self._input.clear()
+        try:
+            if self._session.do_handshake():
+                self._handshake.set_result(None)
+            self._flush()
+        except RuntimeError as e:
+            self._abort(NSCAngError(str(e)))
+
+    def _data_received(self, protocol, data):
+        if protocol is not self._protocol:
+            return
+        try:
+            self._session.feed(data)
+            if not self._handshake.done():
+                if not self._session.do_handshake():
+                    self._flush()
+                    return
+                self._handshake.set_result(None)
+            self._input += self._session.read()
+            self._flush()
+        except RuntimeError as e:
+            self._abort(NSCAngError(str(e)))
+            return
+
+        while True:
+            end = self._input.find(b"\n")
+            if end < 0:
+                break
+            line = self._input[:end].rstrip(b"\r").decode("utf-8", "replace")
+            del self._input[:end + 1]
+            if line.startswith("BAIL"):
+                self._abort(NSCAngError(line))
+                return
+            if not self._waiters:
+                self._abort(NSCAngError("Unexpected response: %s" % line))
+                return
+            waiter = self._waiters.popleft()
+            if not waiter.done():  # The submitter might have timed out.
+                waiter.set_result(line)
+
+    def _connection_lost(self, protocol, exc):
+        if protocol is self._protocol:
+            self._abort(NSCAngError("Connection lost: %s" % exc
+                                    if exc is not None else
+                                    "Connection closed by server"))
+
+    def _abort(self, exc):
+        transport = self._transport
+
+        self._protocol = None
+        self._transport = None
+        self._session = None
+        self.version = None
+        self._unsent.clear()
+        self._writable.set()
+        if self._handshake is not None and not self._handshake.done():
+            self._handshake.set_exception(exc)
+        while self._waiters:
+            waiter = self._waiters.popleft()
+            if not waiter.done():
+                waiter.set_exception(exc)
+        if transport is not None:
+            transport.abort()
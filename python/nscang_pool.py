@@ -0,0 +1,81 @@
+# Copyright (c) 2014 Holger Weiss <holger@weiss.in-berlin.de>
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice,
+#    this list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+
+"""Pool of NSCA-ng sessions for multi-threaded Python programs.
+
+All sessions share the process-wide SSL context of the nscang module, so
+creating them is cheap, and each session is handed to one thread at a time.
+"""
+
+import contextlib
+import queue
+import threading
+
+from nscang import NSCAngNotifyer
+
+
+class NSCAngPool:
+    """Hand out connected NSCAngNotifyer objects.
+
+    At most `size' sessions are created.  If all of them are in use, acquire()
+    blocks until one is released (or until `timeout' seconds have passed).
+    """
+
+    def __init__(self, host, port=5668, identity=None, psk=None, ciphers=None,
+                 size=4, timeout=5):
+        self.host = host
+        self.port = port
+        self.timeout = timeout
+        self._args = dict(host=host, port=port, identity=identity, psk=psk)
+        if ciphers is not None:
+            self._args["ciphers"] = ciphers
+        self._idle = queue.LifoQueue()
+        self._slots = threading.BoundedSemaphore(size)
+
+    def acquire(self, timeout=None):
+        if not self._slots.acquire(timeout=timeout):
+            raise RuntimeError("acquire: No session available")
+        try:
+            try:
+                session = self._idle.get_nowait()
+            except queue.Empty:
+                session = NSCAngNotifyer(**self._args)
+            session.connect(timeout=self.timeout)
+        except BaseException:
+            self._slots.release()
+            raise
+        return session
+
+    def release(self, session):
+        self._idle.put(session)
+        self._slots.release()
+
+    @contextlib.contextmanager
+    def session(self, timeout=None):
+        session = self.acquire(timeout)
+        try:
+            yield session
+        finally:
+            self.release(session)
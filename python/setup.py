@@ -13,6 +13,7 @@ setup(name = "python-nscang",
 """
 Python NSCA-ng client.
 """,
+      py_modules = ["nscang_asyncio", "nscang_pool"],
       ext_modules = [Extension("nscang",
                                ["nscang.c", "client.c"],
                                libraries = ["pthread", "ssl", "crypto"],
@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2014 Holger Weiss <holger@weiss.in-berlin.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <sys/types.h>
+#if HAVE_MMAP
+# include <sys/mman.h>
+#endif
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bulk.h"
+#include "log.h"
+#include "system.h"
+#include "wrappers.h"
+
+#ifndef BULK_BATCH_SIZE
+# define BULK_BATCH_SIZE (1024 * 1024)
+#endif
+
+#define HOST_RESULT_PREFIX "PROCESS_HOST_CHECK_RESULT;"
+#define SERVICE_RESULT_PREFIX "PROCESS_SERVICE_CHECK_RESULT;"
+
+static void read_file(bulk_state * restrict, int, const char * restrict);
+static bool format_record(bulk_state * restrict, bulk_batch * restrict,
+                          const char * restrict, size_t,
+                          const char * restrict, size_t);
+static size_t count_escapes(const char *, size_t);
+
+/*
+ * Exported functions.
+ */
+
+bulk_state *
+bulk_start(const char *path, bool raw_commands, char delimiter, char separator)
+{
+	bulk_state *bulk = xmalloc(sizeof(bulk_state));
+	struct stat sb;
+	int fd, i;
+
+	debug("Starting bulk reader for %s", path);
+
+	for (i = 0; i < BULK_NUM_BATCHES; i++) {
+		bulk->batches[i].data = NULL;
+		bulk->batches[i].size = 0;
+		bulk->batches[i].capacity = 0;
+		bulk->batches[i].n_records = 0;
+		bulk->batches[i].busy = false;
+	}
+	bulk->data = NULL;
+	bulk->input = NULL;
+	bulk->input_size = 0;
+	bulk->input_offset = 0;
+	bulk->delimiter = delimiter;
+	bulk->separator = separator;
+	bulk->raw_commands = raw_commands;
+	bulk->mapped = false;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		die("Cannot open %s: %m", path);
+	if (fstat(fd, &sb) == -1)
+		die("Cannot stat %s: %m", path);
+
+#if HAVE_MMAP
+	if (S_ISREG(sb.st_mode) && sb.st_size > 0) {
+		void *input = mmap(NULL, (size_t)sb.st_size, PROT_READ,
+		    MAP_PRIVATE, fd, 0);
+
+		if (input != MAP_FAILED) {
+			bulk->input = input;
+			bulk->input_size = (size_t)sb.st_size;
+			bulk->mapped = true;
+# if HAVE_MADVISE
+			(void)madvise(input, bulk->input_size, MADV_SEQUENTIAL);
+# endif
+		} else
+			debug("Cannot map %s into memory: %m", path);
+	}
+#endif
+	if (!bulk->mapped)
+		read_file(bulk, fd, path);
+
+	if (close(fd) == -1)
+		die("Cannot close %s: %m", path);
+
+	return bulk;
+}
+
+bulk_batch *
+bulk_read_batch(bulk_state *bulk)
+{
+	bulk_batch *batch = NULL;
+	char timestamp[32];
+	size_t timestamp_len;
+	int i;
+
+	for (i = 0; i < BULK_NUM_BATCHES && batch == NULL; i++)
+		if (!bulk->batches[i].busy)
+			batch = &bulk->batches[i];
+
+	if (batch == NULL || bulk_eof(bulk))
+		return NULL;
+
+	/*
+	 * Calling time(3) once per batch (rather than once per record) is
+	 * good enough.
+	 */
+	timestamp_len = (size_t)snprintf(timestamp, sizeof(timestamp),
+	    "[%lu] ", (unsigned long)time(NULL));
+
+	batch->size = 0;
+	batch->n_records = 0;
+
+	while (bulk->input_offset < bulk->input_size) {
+		const char *record = bulk->input + bulk->input_offset;
+		size_t available = bulk->input_size - bulk->input_offset;
+		const char *end = memchr(record, bulk->separator, available);
+		size_t len = end != NULL ? (size_t)(end - record) : available;
+
+		if (!format_record(bulk, batch, record, len, timestamp,
+		    timestamp_len))
+			break; /* The batch is full. */
+
+		bulk->input_offset += end != NULL ? len + 1 : len;
+	}
+	if (batch->n_records == 0)
+		return NULL;
+
+	debug("Formatted %zu request(s) (%zu bytes)", batch->n_records,
+	    batch->size);
+
+	batch->busy = true;
+	return batch;
+}
+
+bool
+bulk_eof(bulk_state *bulk)
+{
+	return bulk->input_offset >= bulk->input_size;
+}
+
+void
+bulk_release(bulk_batch *batch)
+{
+	batch->busy = false;
+}
+
+void
+bulk_stop(bulk_state *bulk)
+{
+	int i;
+
+	debug("Stopping bulk reader");
+
+	for (i = 0; i < BULK_NUM_BATCHES; i++)
+		if (bulk->batches[i].data != NULL)
+			free(bulk->batches[i].data);
+
+#if HAVE_MMAP
+	if (bulk->mapped)
+		(void)munmap(bulk->input, bulk->input_size);
+	else
+#endif
+	if (bulk->input != NULL)
+		free(bulk->input);
+
+	free(bulk);
+}
+
+/*
+ * Static functions.
+ */
+
+static void
+read_file(bulk_state * restrict bulk, int fd, const char * restrict path)
+{
+	size_t size = BULK_BATCH_SIZE;
+	ssize_t n;
+
+	bulk->input = xmalloc(size);
+
+	do {
+		if (bulk->input_size == size)
+			bulk->input = xrealloc(bulk->input, size *= 2);
+		if ((n = read(fd, bulk->input + bulk->input_size,
+		    size - bulk->input_size)) == -1) {
+			if (errno == EINTR)
+				continue;
+			die("Cannot read %s: %m", path);
+		}
+		bulk->input_size += (size_t)n;
+	} while (n != 0);
+}
+
+static bool
+format_record(bulk_state * restrict bulk, bulk_batch * restrict batch,
+              const char * restrict record, size_t len,
+              const char * restrict timestamp, size_t timestamp_len)
+{
+	const char *delimiters[3], *prefix = "";
+	char header[32], *out;
+	size_t header_len, payload_len, prefix_len = 0, n_escapes = 0, n = 0;
+
+	/* Handle the record the way the standard input reader would. */
+	while (len > 0 && (*record == '\r' || *record == '\n')) {
+		record++;
+		len--;
+	}
+	if (bulk->raw_commands) {
+		while (len > 0 && (*record == ' ' || *record == '\t')) {
+			record++;
+			len--;
+		}
+		if (len == 0)
+			return true;
+		if (*record == '[')
+			timestamp_len = 0;
+	} else {
+		const char *p = record;
+
+		if (len > 0 && record[len - 1] == '\n')
+			len--;
+		if (len == 0)
+			return true;
+
+		for (n = 0; n < 3 && (p = memchr(p, bulk->delimiter,
+		    len - (size_t)(p - record))) != NULL; n++)
+			delimiters[n] = p++;
+
+		switch (n) {
+		case 2:
+			prefix = HOST_RESULT_PREFIX;
+			prefix_len = sizeof(HOST_RESULT_PREFIX) - 1;
+			break;
+		case 3:
+			prefix = SERVICE_RESULT_PREFIX;
+			prefix_len = sizeof(SERVICE_RESULT_PREFIX) - 1;
+			break;
+		default:
+			die("Input format incorrect, see the %s(8) man page",
+			    getprogname());
+		}
+		n_escapes = count_escapes(record, len);
+	}
+
+	payload_len = timestamp_len + prefix_len + len + n_escapes + 1;
+	header_len = (size_t)snprintf(header, sizeof(header), "PUSH %zu\r\n",
+	    payload_len);
+
+	if (batch->capacity - batch->size < header_len + payload_len) {
+		if (batch->n_records > 0)
+			return false;
+		batch->capacity = MAX(header_len + payload_len,
+		    BULK_BATCH_SIZE);
+		batch->data = xrealloc(batch->data, batch->capacity);
+	}
+	out = batch->data + batch->size;
+
+	(void)memcpy(out, header, header_len);
+	out += header_len;
+	(void)memcpy(out, timestamp, timestamp_len);
+	out += timestamp_len;
+	(void)memcpy(out, prefix, prefix_len);
+	out += prefix_len;
+
+	if (n_escapes == 0) {
+		size_t i;
+
+		(void)memcpy(out, record, len);
+		for (i = 0; i < n; i++)
+			out[delimiters[i] - record] = ';';
+		out += len;
+	} else {
+		const char *in;
+		size_t i = 0;
+
+		for (in = record; in < record + len; in++)
+			if (*in == '\\') {
+				*out++ = '\\';
+				*out++ = '\\';
+			} else if (*in == '\n') {
+				*out++ = '\\';
+				*out++ = 'n';
+			} else if (i < n && in == delimiters[i]) {
+				*out++ = ';';
+				i++;
+			} else
+				*out++ = *in;
+	}
+	*out = '\n';
+
+	batch->size += header_len + payload_len;
+	batch->n_records++;
+
+	return true;
+}
+
+static size_t
+count_escapes(const char *input, size_t len)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < len; i++)
+		n += input[i] == '\\' || input[i] == '\n';
+
+	return n;
+}
+
+/* vim:set joinspaces noexpandtab textwidth=80 cinoptions=(4,u0: */
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2014 Holger Weiss <holger@weiss.in-berlin.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The bulk reader maps an input file into memory and formats the records it
+ * contains as pipelined PUSH requests (see the PROTOCOL file).  The requests
+ * are written into a small number of reusable batch buffers, which can be
+ * handed over to tls_write() without further copying.
+ */
+
+#ifndef BULK_H
+# define BULK_H
+
+# if HAVE_CONFIG_H
+#  include <config.h>
+# endif
+
+# include <stdio.h> /* For size_t. */
+
+# include "system.h"
+
+# define BULK_NUM_BATCHES 2
+
+typedef struct {
+	char *data;       /* The formatted PUSH requests. */
+	size_t size;      /* The number of bytes used. */
+	size_t capacity;  /* The number of bytes allocated. */
+	size_t n_records; /* The number of PUSH requests. */
+	bool busy;
+} bulk_batch;
+
+typedef struct bulk_state_s {
+/* public: */
+	void *data; /* Can freely be used by the caller. */
+
+/* private: */
+	bulk_batch batches[BULK_NUM_BATCHES];
+	char *input;
+	size_t input_size;
+	size_t input_offset;
+	char delimiter;
+	char separator;
+	bool raw_commands;
+	bool mapped;
+} bulk_state;
+
+bulk_state *bulk_start(const char *, bool, char, char);
+bulk_batch *bulk_read_batch(bulk_state *);
+bool bulk_eof(bulk_state *);
+void bulk_release(bulk_batch *);
+void bulk_stop(bulk_state *);
+
+#endif
+
+/* vim:set joinspaces noexpandtab textwidth=80 cinoptions=(4,u0: */
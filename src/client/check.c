@@ -0,0 +1,624 @@
+/*
+ * Copyright (c) 2014 Holger Weiss <holger@weiss.in-berlin.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#if HAVE_POSIX_SPAWNP
+# include <spawn.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ev.h>
+
+#include "check.h"
+#include "log.h"
+#include "parse.h"
+#include "system.h"
+#include "util.h"
+#include "wrappers.h"
+
+#ifndef MAX_PLUGIN_OUTPUT_SIZE
+# define MAX_PLUGIN_OUTPUT_SIZE 8192
+#endif
+#ifndef MAX_CHECK_LINE_SIZE
+# define MAX_CHECK_LINE_SIZE 4096
+#endif
+
+#define STATE_UNKNOWN 3
+#define SHELL_CHARACTERS "!\"$&'()*;<>?[\\]^`{|}~"
+
+typedef struct check_s {
+	struct check_s *next;     /* The next configured check. */
+	struct check_s *next_due; /* The next check waiting for a free slot. */
+	check_state *ctx;
+	ev_timer schedule_watcher;
+	ev_timer timeout_watcher;
+	ev_child child_watcher;
+	ev_io output_watcher;
+	ev_tstamp start_time;
+	char *host;
+	char *service;
+	char *command_line;
+	char *args;
+	char **argv;
+	char *output;
+	size_t output_length;
+	pid_t pid;
+	int status;
+	int state;
+	int spawn_error;
+	bool exited;
+	bool eof;
+	bool timed_out;
+} check;
+
+extern char **environ;
+
+static char shell_path[] = "/bin/sh";
+static char shell_option[] = "-c";
+
+static check *parse_check_file(const char * restrict, char);
+static check *new_check(const char *, const char *, const char *);
+static void free_check(check *);
+static void schedule_cb(EV_P_ ev_timer *, int);
+static void timeout_cb(EV_P_ ev_timer *, int);
+static void child_cb(EV_P_ ev_child *, int);
+static void output_cb(EV_P_ ev_io *, int);
+static void run_check(check *);
+static void run_due_checks(check_state *);
+static pid_t spawn_plugin(check *, int);
+static void close_output(check *);
+static void finish_check(check *);
+static char *format_output(check *);
+
+/*
+ * Exported functions.
+ */
+
+check_state *
+check_start(const char * restrict path, char delimiter, ev_tstamp interval,
+            ev_tstamp retry_interval, ev_tstamp timeout,
+            unsigned int max_running)
+{
+	check_state *ctx = xmalloc(sizeof(check_state));
+	check *c;
+	unsigned int i, n_checks = 0;
+
+	debug("Starting check scheduler");
+
+	ctx->data = NULL;
+	ctx->checks = parse_check_file(path, delimiter);
+	ctx->due_head = ctx->due_tail = NULL;
+	ctx->result_handler = NULL;
+	ctx->done_handler = NULL;
+	ctx->interval = interval;
+	ctx->retry_interval = retry_interval;
+	ctx->timeout = timeout;
+	ctx->max_running = max_running > 0 ? max_running : 1;
+	ctx->n_running = 0;
+
+	for (c = ctx->checks; c != NULL; c = c->next)
+		n_checks++;
+	if (n_checks == 0)
+		die("%s doesn't specify any checks", path);
+
+	ctx->n_remaining = n_checks;
+
+	/*
+	 * Spread the initial executions evenly across the check interval, in
+	 * order to avoid bursts of plugin invocations (and server requests).
+	 */
+	for (c = ctx->checks, i = 0; c != NULL; c = c->next, i++) {
+		c->ctx = ctx;
+		ev_timer_set(&c->schedule_watcher,
+		    interval * (ev_tstamp)i / (ev_tstamp)n_checks, 0.0);
+		ev_timer_start(EV_DEFAULT_UC_ &c->schedule_watcher);
+	}
+	return ctx;
+}
+
+void
+check_on_result(check_state *ctx,
+                void handle_result(check_state * restrict, char * restrict))
+{
+	ctx->result_handler = handle_result;
+}
+
+void
+check_on_done(check_state *ctx, void handle_done(check_state *))
+{
+	ctx->done_handler = handle_done;
+}
+
+void
+check_stop(check_state *ctx)
+{
+	check *c, *next;
+
+	debug("Stopping check scheduler");
+
+	for (c = ctx->checks; c != NULL; c = next) {
+		next = c->next;
+		if (c->pid > 0 && !c->exited) {
+			debug("Terminating plugin process %ld",
+			    (long)c->pid);
+			(void)kill(-c->pid, SIGTERM);
+		}
+		free_check(c);
+	}
+	free(ctx);
+}
+
+/*
+ * Static functions.
+ */
+
+static check *
+parse_check_file(const char * restrict path, char delimiter)
+{
+	FILE *f;
+	check *checks = NULL, **last = &checks;
+	char line[MAX_CHECK_LINE_SIZE];
+	char delimiters[2] = { delimiter, '\0' };
+	unsigned long line_number = 0;
+	size_t len;
+
+	if ((f = fopen(path, "r")) == NULL)
+		die("Cannot open %s: %m", path);
+
+	while ((len = xfgets(line, sizeof(line), f)) > 0) {
+		char *fields[3], *start;
+		size_t n;
+
+		line_number++;
+		if (line[len - 1] != '\n' && !feof(f))
+			die("%s:%lu: Line too long", path, line_number);
+		chomp(line);
+
+		start = skip_whitespace(line);
+		if (*start == '\0' || *start == '#')
+			continue;
+
+		/*
+		 * Lines look like "host<delimiter>command" for host checks or
+		 * "host<delimiter>service<delimiter>command" for service
+		 * checks.
+		 */
+		for (n = 0; n < 3 && start != NULL; n++) {
+			fields[n] = start;
+			if (n < 2 && (start = strpbrk(start, delimiters))
+			    != NULL)
+				*start++ = '\0';
+			else
+				start = NULL;
+		}
+		if (n < 2 || *fields[0] == '\0'
+		    || *skip_whitespace(fields[n - 1]) == '\0'
+		    || (n == 3 && *fields[1] == '\0'))
+			die("%s:%lu: Cannot parse line", path, line_number);
+
+		*last = new_check(fields[0], n == 3 ? fields[1] : NULL,
+		    fields[n - 1]);
+		last = &(*last)->next;
+	}
+
+	if (fclose(f) == EOF)
+		die("Cannot close %s: %m", path);
+
+	return checks;
+}
+
+static check *
+new_check(const char *host, const char *service, const char *command_line)
+{
+	check *c = xmalloc(sizeof(check));
+
+	c->next = NULL;
+	c->next_due = NULL;
+	c->ctx = NULL;
+	c->start_time = 0.0;
+	c->host = xstrdup(host);
+	c->service = service != NULL ? xstrdup(service) : NULL;
+	c->command_line = xstrdup(skip_whitespace(command_line));
+	c->output = NULL;
+	c->output_length = 0;
+	c->pid = 0;
+	c->status = 0;
+	c->state = 0;
+	c->spawn_error = 0;
+	c->exited = false;
+	c->eof = false;
+	c->timed_out = false;
+
+	/*
+	 * Like Nagios, we use the shell only if the command line contains
+	 * characters which are special to the shell.
+	 */
+	if (strpbrk(c->command_line, SHELL_CHARACTERS) != NULL) {
+		c->args = NULL;
+		c->argv = xmalloc(4 * sizeof(char *));
+		c->argv[0] = shell_path;
+		c->argv[1] = shell_option;
+		c->argv[2] = c->command_line;
+		c->argv[3] = NULL;
+	} else {
+		char *arg;
+		size_t n = 0;
+
+		c->args = xstrdup(c->command_line);
+		c->argv = xmalloc((strlen(c->args) / 2 + 2) * sizeof(char *));
+		for (arg = strtok(c->args, " \t"); arg != NULL;
+		    arg = strtok(NULL, " \t"))
+			c->argv[n++] = arg;
+		c->argv[n] = NULL;
+	}
+
+	c->schedule_watcher.data = c;
+	c->timeout_watcher.data = c;
+	c->child_watcher.data = c;
+	c->output_watcher.data = c;
+
+	ev_init(&c->schedule_watcher, schedule_cb);
+	ev_init(&c->timeout_watcher, timeout_cb);
+	ev_init(&c->child_watcher, child_cb);
+	ev_init(&c->output_watcher, output_cb);
+
+	debug("Configured check for %s%s%s: %s", c->host,
+	    c->service != NULL ? "/" : "",
+	    c->service != NULL ? c->service : "", c->command_line);
+
+	return c;
+}
+
+static void
+free_check(check *c)
+{
+	if (ev_is_active(&c->schedule_watcher))
+		ev_timer_stop(EV_DEFAULT_UC_ &c->schedule_watcher);
+	if (ev_is_active(&c->timeout_watcher))
+		ev_timer_stop(EV_DEFAULT_UC_ &c->timeout_watcher);
+	if (ev_is_active(&c->child_watcher))
+		ev_child_stop(EV_DEFAULT_UC_ &c->child_watcher);
+	if (!c->eof && c->output != NULL)
+		close_output(c);
+
+	if (c->output != NULL)
+		free(c->output);
+	if (c->service != NULL)
+		free(c->service);
+	if (c->args != NULL)
+		free(c->args);
+	free(c->argv);
+	free(c->command_line);
+	free(c->host);
+	free(c);
+}
+
+static void
+schedule_cb(EV_P_ ev_timer *w, int revents __attribute__((__unused__)))
+{
+	check *c = w->data;
+	check_state *ctx = c->ctx;
+
+	if (ctx->n_running < ctx->max_running)
+		run_check(c);
+	else {
+		debug("Delaying check of %s, %u plugins are running",
+		    c->host, ctx->n_running);
+		c->next_due = NULL;
+		if (ctx->due_tail != NULL)
+			ctx->due_tail->next_due = c;
+		else
+			ctx->due_head = c;
+		ctx->due_tail = c;
+	}
+}
+
+static void
+timeout_cb(EV_P_ ev_timer *w, int revents __attribute__((__unused__)))
+{
+	check *c = w->data;
+
+	warning("Check of %s%s%s timed out, killing plugin", c->host,
+	    c->service != NULL ? "/" : "",
+	    c->service != NULL ? c->service : "");
+
+	c->timed_out = true;
+
+	if (!c->exited)
+		(void)kill(-c->pid, SIGKILL);
+	else { /* Some child process might still hold the pipe open. */
+		close_output(c);
+		finish_check(c);
+	}
+}
+
+static void
+child_cb(EV_P_ ev_child *w, int revents __attribute__((__unused__)))
+{
+	check *c = w->data;
+
+	debug("Plugin process %ld exited with status %d", (long)w->rpid,
+	    w->rstatus);
+
+	ev_child_stop(EV_A_ w);
+	c->status = w->rstatus;
+	c->exited = true;
+
+	if (c->timed_out && !c->eof)
+		close_output(c);
+	if (c->eof)
+		finish_check(c);
+}
+
+static void
+output_cb(EV_P_ ev_io *w, int revents __attribute__((__unused__)))
+{
+	check *c = w->data;
+	char discard[512];
+	ssize_t n;
+
+	do {
+		if (c->output_length < MAX_PLUGIN_OUTPUT_SIZE)
+			n = read(w->fd, c->output + c->output_length,
+			    MAX_PLUGIN_OUTPUT_SIZE - c->output_length);
+		else
+			n = read(w->fd, discard, sizeof(discard));
+
+		if (n > 0 && c->output_length < MAX_PLUGIN_OUTPUT_SIZE)
+			c->output_length += (size_t)n;
+	} while (n > 0);
+
+	if (n == -1) {
+		if (errno == EAGAIN
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+		    || errno == EWOULDBLOCK
+#endif
+		    || errno == EINTR)
+			return;
+		warning("Cannot read plugin output: %m");
+	}
+	close_output(c);
+
+	if (c->exited)
+		finish_check(c);
+}
+
+static void
+run_check(check *c)
+{
+	check_state *ctx = c->ctx;
+	int fd[2];
+
+	info("Checking %s%s%s: %s", c->host, c->service != NULL ? "/" : "",
+	    c->service != NULL ? c->service : "", c->command_line);
+
+	ctx->n_running++;
+	c->start_time = ev_now(EV_DEFAULT_UC);
+	c->output = xmalloc(MAX_PLUGIN_OUTPUT_SIZE + 1);
+	c->output_length = 0;
+	c->status = 0;
+	c->spawn_error = 0;
+	c->exited = false;
+	c->eof = false;
+	c->timed_out = false;
+
+	if (pipe(fd) == -1) {
+		c->spawn_error = errno;
+		c->exited = c->eof = true;
+		finish_check(c);
+		return;
+	}
+	(void)fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+	(void)fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+	(void)fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL, 0) | O_NONBLOCK);
+
+	c->pid = spawn_plugin(c, fd[1]);
+	(void)close(fd[1]);
+
+	if (c->pid == -1) {
+		(void)close(fd[0]);
+		c->exited = c->eof = true;
+		finish_check(c);
+		return;
+	}
+	debug("Started plugin process %ld", (long)c->pid);
+
+	ev_io_set(&c->output_watcher, fd[0], EV_READ);
+	ev_io_start(EV_DEFAULT_UC_ &c->output_watcher);
+	ev_child_set(&c->child_watcher, c->pid, 0);
+	ev_child_start(EV_DEFAULT_UC_ &c->child_watcher);
+
+	if (ctx->timeout > 0.0) {
+		ev_timer_set(&c->timeout_watcher, ctx->timeout, 0.0);
+		ev_timer_start(EV_DEFAULT_UC_ &c->timeout_watcher);
+	}
+}
+
+static void
+run_due_checks(check_state *ctx)
+{
+	while (ctx->due_head != NULL && ctx->n_running < ctx->max_running) {
+		check *c = ctx->due_head;
+
+		if ((ctx->due_head = c->next_due) == NULL)
+			ctx->due_tail = NULL;
+		run_check(c);
+	}
+}
+
+static pid_t
+spawn_plugin(check *c, int fd)
+{
+	pid_t pid;
+#if HAVE_POSIX_SPAWNP
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t signals;
+	int result;
+
+	/*
+	 * The plugin is started in its own process group so that we can kill
+	 * any children it might create.  We ignore SIGPIPE, so we make sure
+	 * the plugin gets the default action.
+	 */
+	(void)posix_spawn_file_actions_init(&actions);
+	(void)posix_spawn_file_actions_addopen(&actions, STDIN_FILENO,
+	    "/dev/null", O_RDONLY, 0);
+	(void)posix_spawn_file_actions_adddup2(&actions, fd, STDOUT_FILENO);
+	(void)posix_spawnattr_init(&attr);
+	(void)posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP
+	    | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+	(void)posix_spawnattr_setpgroup(&attr, 0);
+	(void)sigemptyset(&signals);
+	(void)posix_spawnattr_setsigmask(&attr, &signals);
+	(void)sigaddset(&signals, SIGPIPE);
+	(void)posix_spawnattr_setsigdefault(&attr, &signals);
+
+	if ((result = posix_spawnp(&pid, c->argv[0], &actions, &attr, c->argv,
+	    environ)) != 0) {
+		c->spawn_error = result;
+		pid = -1;
+	}
+	(void)posix_spawnattr_destroy(&attr);
+	(void)posix_spawn_file_actions_destroy(&actions);
+#else
+	int null_fd;
+
+	if ((pid = fork()) == -1)
+		c->spawn_error = errno;
+	else if (pid == 0) {
+		(void)setpgid(0, 0);
+		(void)signal(SIGPIPE, SIG_DFL);
+		if ((null_fd = open("/dev/null", O_RDONLY)) == -1
+		    || dup2(null_fd, STDIN_FILENO) == -1
+		    || dup2(fd, STDOUT_FILENO) == -1)
+			_exit(127);
+		(void)execvp(c->argv[0], c->argv);
+		_exit(127);
+	}
+#endif
+	return pid;
+}
+
+static void
+close_output(check *c)
+{
+	if (ev_is_active(&c->output_watcher))
+		ev_io_stop(EV_DEFAULT_UC_ &c->output_watcher);
+	(void)close(c->output_watcher.fd);
+	c->eof = true;
+}
+
+static void
+finish_check(check *c)
+{
+	check_state *ctx = c->ctx;
+	char *output = format_output(c);
+
+	if (ev_is_active(&c->timeout_watcher))
+		ev_timer_stop(EV_DEFAULT_UC_ &c->timeout_watcher);
+
+	info("Check of %s%s%s returned %d: %s", c->host,
+	    c->service != NULL ? "/" : "", c->service != NULL ? c->service : "",
+	    c->state, output);
+
+	free(c->output);
+	c->output = NULL;
+	c->pid = 0;
+	ctx->n_running--;
+
+	if (ctx->result_handler != NULL)
+		ctx->result_handler(ctx, format_check_result(c->host,
+		    c->service, c->state, output));
+	free(output);
+
+	if (ctx->interval > 0.0) {
+		ev_tstamp interval = c->state != 0 && ctx->retry_interval > 0.0
+		    ? ctx->retry_interval : ctx->interval;
+		ev_tstamp delay = c->start_time + interval
+		    - ev_now(EV_DEFAULT_UC);
+
+		ev_timer_set(&c->schedule_watcher, delay > 0.0 ? delay : 0.0,
+		    0.0);
+		ev_timer_start(EV_DEFAULT_UC_ &c->schedule_watcher);
+	}
+	run_due_checks(ctx);
+
+	if (ctx->interval <= 0.0 && --ctx->n_remaining == 0) {
+		debug("All checks have been executed");
+		if (ctx->done_handler != NULL)
+			ctx->done_handler(ctx);
+	}
+}
+
+static char *
+format_output(check *c)
+{
+	char *output;
+	int code;
+
+	c->output[c->output_length] = '\0';
+	while (c->output_length > 0
+	    && (c->output[c->output_length - 1] == '\n'
+	    || c->output[c->output_length - 1] == '\r'))
+		c->output[--c->output_length] = '\0';
+
+	c->state = STATE_UNKNOWN;
+
+	if (c->spawn_error != 0)
+		xasprintf(&output, "(Cannot execute %s: %s)", c->argv[0],
+		    strerror(c->spawn_error));
+	else if (c->timed_out)
+		xasprintf(&output, "(Check timed out after %.0f seconds)",
+		    (double)c->ctx->timeout);
+	else if (WIFSIGNALED(c->status))
+		xasprintf(&output, "(Plugin was killed by signal %d)",
+		    WTERMSIG(c->status));
+	else if ((code = WEXITSTATUS(c->status)) > STATE_UNKNOWN)
+		xasprintf(&output, "(Return code of %d is out of bounds%s)",
+		    code, code == 126 || code == 127 ?
+		    " - plugin may be missing" : "");
+	else {
+		c->state = code;
+		output = xstrdup(c->output_length > 0 ?
+		    c->output : "(No output returned from plugin)");
+	}
+	return output;
+}
+
+/* vim:set joinspaces noexpandtab textwidth=80 cinoptions=(4,u0: */
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2014 Holger Weiss <holger@weiss.in-berlin.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A simple scheduler which runs Nagios plugins periodically and hands the
+ * results over to the caller.  The plugins are executed in parallel, up to a
+ * configurable limit.  Their output is collected asynchronously using the
+ * default event loop.
+ */
+
+#ifndef CHECK_H
+# define CHECK_H
+
+# if HAVE_CONFIG_H
+#  include <config.h>
+# endif
+
+# include <ev.h>
+
+# include "system.h"
+
+typedef struct check_state_s {
+/* public: */
+	void *data; /* Can freely be used by the caller. */
+
+/* private: */
+	struct check_s *checks;
+	struct check_s *due_head;
+	struct check_s *due_tail;
+	void (*result_handler)(struct check_state_s * restrict,
+	                       char * restrict);
+	void (*done_handler)(struct check_state_s *);
+	ev_tstamp interval;
+	ev_tstamp retry_interval;
+	ev_tstamp timeout;
+	unsigned int max_running;
+	unsigned int n_running;
+	unsigned int n_remaining;
+} check_state;
+
+check_state *check_start(const char * restrict, char, ev_tstamp, ev_tstamp,
+                         ev_tstamp, unsigned int);
+void check_on_result(check_state *,
+                     void (*)(check_state * restrict, char * restrict));
+void check_on_done(check_state *, void (*)(check_state *));
+void check_stop(check_state *);
+
+#endif
+
+/* vim:set joinspaces noexpandtab textwidth=80 cinoptions=(4,u0: */
@@ -39,7 +39,9 @@
 #include <openssl/rand.h>
 
 #include "auth.h"
+#include "bulk.h"
 #include "client.h"
+#include "compress.h"
 #include "input.h"
 #include "log.h"
 #include "parse.h"
@@ -52,29 +54,101 @@
 #ifndef NUM_SESSION_ID_BYTES
 # define NUM_SESSION_ID_BYTES 6
 #endif
+#ifndef MAX_UNACKED_COMMANDS
+# define MAX_UNACKED_COMMANDS 128
+#endif
+#ifndef MAX_QUEUED_COMMANDS
+# define MAX_QUEUED_COMMANDS 10000
+#endif
+#ifndef KEEPALIVE_INTERVAL
+# define KEEPALIVE_INTERVAL 30.0
+#endif
+#ifndef MAX_RECONNECT_DELAY
+# define MAX_RECONNECT_DELAY 60.0
+#endif
+
+#define PROTOCOL_VERSION 2
+
+typedef struct command_s {
+	struct command_s *next;
+	char *data; /* NULL for a NOOP request. */
+	size_t length;
+	bulk_batch *batch; /* Non-NULL for a batch of PUSH requests. */
+	size_t n_requests;
+	size_t n_responses;
+} command;
+
+typedef struct {
+	command *head;
+	command *tail;
+	size_t length;
+} command_queue;
 
 struct client_state_s { /* This is typedef'd to `client_state' in client.h. */
 	tls_client_state *tls_client;
 	tls_state *tls;
 	input_state *input;
-	char *command;
-	size_t command_length;
+	bulk_state *bulk;
+	compressor *compressor; /* Non-NULL if compression was negotiated. */
+	char *server;
+	char *session_id;
+	command_queue pending; /* Commands which weren't sent yet. */
+	command_queue unacked; /* Commands which weren't acknowledged yet. */
+	ev_timer keepalive_watcher;
+	ev_timer reconnect_watcher;
+	ev_tstamp timeout;
+	ev_tstamp reconnect_delay;
+	enum {
+		STATE_CONNECTING,
+		STATE_READY,
+		STATE_QUITTING,
+		STATE_WAITING
+	} state;
+	int protocol_version;
 	int mode;
 	char delimiter;
 	char separator;
+	bool reading;
+	bool reading_input;
+	bool payload_sent;
+	bool finishing;
+	bool compress;
+	bool offering_compression;
 };
 
+static void connect_to_server(client_state *);
 static void handle_input_chunk(input_state * restrict, char * restrict);
 static void handle_input_eof(input_state *);
 static void handle_tls_connect(tls_state *);
+static void send_moin_request(client_state *);
 static void handle_tls_moin_response(tls_state * restrict, char * restrict);
-static void handle_tls_push_response(tls_state * restrict, char * restrict);
-static void handle_tls_command_response(tls_state * restrict, char * restrict);
+static void handle_tls_response(tls_state * restrict, char * restrict);
 static void handle_tls_quit_response(tls_state * restrict, char * restrict);
+static void handle_tls_error(tls_state *);
+static void handle_tls_timeout(tls_state *);
+static void keepalive_cb(EV_P_ ev_timer *, int);
+static void reconnect_cb(EV_P_ ev_timer *, int);
+static void submit(client_state * restrict, char * restrict);
+static void submit_batch(client_state * restrict, bulk_batch * restrict);
+static void send_commands(client_state *);
+#if HAVE_ZLIB_H
+static void send_compressed(client_state * restrict, command * restrict);
+static void send_compressed_batch(client_state * restrict,
+                                  command * restrict);
+#endif
+static void request_input(client_state *);
+static void check_quit(client_state *);
+static void disconnect(client_state *);
 static void send_request(tls_state * restrict, const char * restrict);
 static void bail(tls_state * restrict, const char * restrict, ...)
                  __attribute__((__format__(__printf__, 2, 3)));
 static bool server_is_grumpy(tls_state * restrict, char * restrict);
+static void enqueue(command_queue * restrict, command * restrict);
+static void requeue(command_queue * restrict, command_queue * restrict);
+static command *dequeue(command_queue *);
+static void free_command(command *);
+static void keep_batch(void *);
+static void free_queue(command_queue *);
 static char *generate_session_id(void);
 static char *base64(const unsigned char *, size_t);
 
@@ -84,7 +158,8 @@ static char *base64(const unsigned char *, size_t);
 
 client_state *
 client_start(const char *server, const char *ciphers, ev_tstamp timeout,
-             int mode, char delimiter, char separator)
+             int mode, char delimiter, char separator,
+             const char *input_file, bool compress)
 {
 	client_state *client = xmalloc(sizeof(client_state));
 
@@ -92,16 +167,80 @@ client_start(const char *server, const char *ciphers, ev_tstamp timeout,
 	client->tls_client->data = client;
 	client->tls = NULL;
 	client->input = NULL;
+	client->bulk = NULL;
+	client->compressor = NULL;
+	client->server = xstrdup(server);
+	client->session_id = NULL;
+	client->pending.head = client->pending.tail = NULL;
+	client->pending.length = 0;
+	client->unacked.head = client->unacked.tail = NULL;
+	client->unacked.length = 0;
+	client->timeout = timeout;
+	client->reconnect_delay = 1.0;
+	client->state = STATE_CONNECTING;
+	client->protocol_version = 1;
 	client->mode = mode;
 	client->delimiter = delimiter;
 	client->separator = mode == CLIENT_MODE_COMMAND ? '\n' : separator;
-
-	tls_connect(client->tls_client, server, timeout, TLS_AUTO_DIE,
-	    handle_tls_connect, NULL, set_psk);
+	client->reading = false;
+	client->reading_input = false;
+	client->payload_sent = false;
+	client->finishing = false;
+	client->compress = compress;
+	client->offering_compression = false;
+	client->keepalive_watcher.data = client;
+	client->reconnect_watcher.data = client;
+
+	/*
+	 * Idle daemon sessions must be kept alive, as the server (and we)
+	 * would otherwise close them after the configured timeout.
+	 */
+	ev_init(&client->keepalive_watcher, keepalive_cb);
+	client->keepalive_watcher.repeat = timeout > 0.0 ?
+	    timeout / 2.0 : KEEPALIVE_INTERVAL;
+	ev_init(&client->reconnect_watcher, reconnect_cb);
+
+	if (input_file != NULL)
+		client->bulk = bulk_start(input_file,
+		    mode == CLIENT_MODE_COMMAND, delimiter, client->separator);
+
+	connect_to_server(client);
 
 	return client;
 }
 
+void
+client_submit(client_state * restrict client, char * restrict data)
+{
+	if (client->pending.length >= MAX_QUEUED_COMMANDS) {
+		error("Queue is full, discarding command: %s", data);
+		free(data);
+		exit_code = EXIT_FAILURE;
+	} else {
+		submit(client, data);
+		if (client->state == STATE_READY)
+			send_commands(client);
+	}
+}
+
+void
+client_finish(client_state *client)
+{
+	debug("Finishing session with %s", client->server);
+
+	client->finishing = true;
+
+	if (client->state == STATE_WAITING) {
+		if (client->pending.length > 0) {
+			error("Discarding %zu command(s) queued for %s",
+			    client->pending.length, client->server);
+			exit_code = EXIT_FAILURE;
+		}
+		client_stop(client);
+	} else
+		check_quit(client);
+}
+
 void
 client_stop(client_state *client)
 {
@@ -111,7 +250,21 @@ client_stop(client_state *client)
 		tls_shutdown(client->tls);
 	if (client->tls_client != NULL)
 		tls_client_stop(client->tls_client);
-
+	if (ev_is_active(&client->keepalive_watcher))
+		ev_timer_stop(EV_DEFAULT_UC_ &client->keepalive_watcher);
+	if (ev_is_active(&client->reconnect_watcher))
+		ev_timer_stop(EV_DEFAULT_UC_ &client->reconnect_watcher);
+
+	free_queue(&client->pending);
+	free_queue(&client->unacked);
+	if (client->bulk != NULL)
+		bulk_stop(client->bulk);
+#if HAVE_ZLIB_H
+	compressor_free(client->compressor);
+#endif
+	if (client->session_id != NULL)
+		free(client->session_id);
+	free(client->server);
 	free(client);
 }
 
@@ -119,36 +272,45 @@ client_stop(client_state *client)
  * Static functions.
  */
 
+static void
+connect_to_server(client_state *client)
+{
+	client->state = STATE_CONNECTING;
+
+	if (client->mode == CLIENT_MODE_DAEMON)
+		tls_connect(client->tls_client, client->server,
+		    client->timeout, TLS_NO_AUTO_DIE, handle_tls_connect,
+		    handle_tls_timeout, handle_tls_error, set_psk);
+	else
+		tls_connect(client->tls_client, client->server,
+		    client->timeout, TLS_AUTO_DIE, handle_tls_connect, NULL,
+		    NULL, set_psk);
+}
+
 static void
 handle_input_chunk(input_state * restrict input, char * restrict chunk)
 {
 	client_state *client = input->data;
-	char *request;
 	char *data = skip_newlines(chunk);
 
+	client->reading_input = false;
+
 	if (*data == '\0') { /* Ignore empty input lines. */
 		free(chunk);
-		input_read_chunk(input, handle_input_chunk);
+		request_input(client);
 		return;
 	}
 
 	if (client->mode == CLIENT_MODE_CHECK_RESULT) {
 		chomp(data);
-		client->command = parse_check_result(data, client->delimiter);
+		submit(client, parse_check_result(data, client->delimiter));
 	} else
-		client->command = parse_command(data);
+		submit(client, parse_command(data));
 
 	free(chunk);
 
-	client->command_length = strlen(client->command);
-	client->command[client->command_length++] = '\n';
-
-	xasprintf(&request, "PUSH %u", client->command_length);
-	info("%s C: %s", client->tls->peer, request);
-	tls_write_line(client->tls, request);
-	free(request);
-
-	tls_read_line(client->tls, handle_tls_push_response);
+	send_commands(client);
+	request_input(client);
 }
 
 static void
@@ -157,50 +319,98 @@ handle_input_eof(input_state *input)
 	client_state *client = input->data;
 
 	client->input = NULL;
-	send_request(client->tls, "QUIT");
-	tls_read_line(client->tls, handle_tls_quit_response);
+	client->reading_input = false;
+	client->finishing = true;
+	check_quit(client);
 }
 
 static void
 handle_tls_connect(tls_state *tls)
 {
 	client_state *client = tls->data;
-	char *session_id = generate_session_id();
-	char *request = concat("MOIN 1 ", session_id);
 
+	if (client->session_id != NULL)
+		free(client->session_id);
+	client->session_id = generate_session_id();
 	client->tls = tls;
-	tls_set_connection_id(tls, session_id);
-	free(session_id);
-	send_request(tls, request);
+	client->offering_compression = client->compress;
+	tls_set_connection_id(tls, client->session_id);
+	send_moin_request(client);
+}
+
+static void
+send_moin_request(client_state *client)
+{
+	char *request;
+
+	if (client->offering_compression)
+		xasprintf(&request, "MOIN %d %s %s", PROTOCOL_VERSION,
+		    client->session_id, COMPRESSION_METHOD);
+	else
+		xasprintf(&request, "MOIN %d %s", PROTOCOL_VERSION,
+		    client->session_id);
+	send_request(client->tls, request);
 	free(request);
-	tls_read_line(tls, handle_tls_moin_response);
+	tls_read_line(client->tls, handle_tls_moin_response);
 }
 
 static void
 handle_tls_moin_response(tls_state * restrict tls, char * restrict line)
 {
 	client_state *client = tls->data;
-	int protocol_version;
-	char *args[2];
+	int n_args, protocol_version;
+	char *args[3];
 
 	info("%s S: %s", tls->peer, line);
 
 	if (strncasecmp("MOIN", line, 4) == 0) {
-		if (!parse_line(line, args, 2))
+		if ((n_args = split_line(line, args, 3)) != 2
+		    && (n_args != 3 || !client->offering_compression))
 			bail(tls, "Cannot parse MOIN response");
 		else if ((protocol_version = atoi(args[1])) <= 0)
 			bail(tls, "Expected protocol version");
-		else if (protocol_version != 1)
+		else if (protocol_version > PROTOCOL_VERSION)
 			bail(tls, "Protocol version %d not supported",
 			    protocol_version);
+		else if (n_args == 3 && (protocol_version < 2
+		    || strcasecmp(args[2], COMPRESSION_METHOD) != 0))
+			bail(tls, "Encoding %s not supported", args[2]);
 		else { /* The handshake succeeded. */
-			debug("Protocol handshake successful");
-			client->input = input_start(client->separator);
-			client->input->data = client;
-
-			input_on_eof(client->input, handle_input_eof);
-			input_read_chunk(client->input, handle_input_chunk);
+			debug("Protocol handshake successful (version %d)",
+			    protocol_version);
+			client->protocol_version = protocol_version;
+#if HAVE_ZLIB_H
+			compressor_free(client->compressor);
+			if (n_args == 3) {
+				debug("Compressing PUSH data with %s",
+				    COMPRESSION_METHOD);
+				client->compressor = compressor_new();
+			} else
+				client->compressor = NULL;
+#endif
+			client->state = STATE_READY;
+			client->reconnect_delay = 1.0;
+
+			if (client->mode == CLIENT_MODE_DAEMON)
+				ev_timer_again(EV_DEFAULT_UC_
+				    &client->keepalive_watcher);
+			else if (client->bulk != NULL)
+				request_input(client);
+			else if (client->input == NULL) {
+				client->input = input_start(client->separator);
+				client->input->data = client;
+				input_on_eof(client->input, handle_input_eof);
+				request_input(client);
+			}
+			send_commands(client);
+			check_quit(client);
 		}
+	} else if (client->offering_compression
+	    && strncasecmp("FAIL", line, 4) == 0) {
+		/* Servers which don't support compression end up here. */
+		info("Retrying MOIN request without compression");
+		client->offering_compression = false;
+		send_moin_request(client);
 	} else if (!server_is_grumpy(tls, line))
 		bail(tls, "Received unexpected MOIN response");
 
@@ -208,53 +418,351 @@ handle_tls_moin_response(tls_state * restrict tls, char * restrict line)
 }
 
 static void
-handle_tls_push_response(tls_state * restrict tls, char * restrict line)
+handle_tls_response(tls_state * restrict tls, char * restrict line)
 {
 	client_state *client = tls->data;
+	command *c = client->unacked.head;
 
+	client->reading = false;
 	info("%s S: %s", tls->peer, line);
 
-	if (strcasecmp("OKAY", line) == 0) {
+	/*
+	 * With protocol version 1, the server acknowledges the PUSH request
+	 * before we may transmit the data.
+	 */
+	if (client->protocol_version == 1 && c->data != NULL
+	    && !client->payload_sent && strcasecmp("OKAY", line) == 0) {
 		notice("Transmitting to %s: %.*s", tls->peer,
-		    (int)client->command_length - 1, client->command);
-		tls_write(tls, client->command, client->command_length, free);
-		tls_read_line(tls, handle_tls_command_response);
-	} else if (!server_is_grumpy(tls, line)) {
-		free(client->command);
-		bail(tls, "Received unexpected PUSH response");
+		    (int)c->length - 1, c->data);
+		tls_write(tls, c->data, c->length, NULL);
+		client->payload_sent = true;
+		client->reading = true;
+		tls_read_line(tls, handle_tls_response);
+		free(line);
+		return;
 	}
+	client->payload_sent = false;
 
+	if (strcasecmp("OKAY", line) == 0) {
+		if (++c->n_responses == c->n_requests)
+			free_command(dequeue(&client->unacked));
+	} else if (client->mode == CLIENT_MODE_DAEMON
+	    && strncasecmp("FAIL", line, 4) == 0) {
+		error("Server refused command (%s): %.*s", line,
+		    c->data != NULL ? (int)c->length - 1 : 4,
+		    c->data != NULL ? c->data : "NOOP");
+		free_command(dequeue(&client->unacked));
+		exit_code = EXIT_FAILURE;
+	} else if (client->mode == CLIENT_MODE_DAEMON
+	    && strncasecmp("BAIL", line, 4) == 0) {
+		error("Server said: %s", line);
+		disconnect(client);
+		free(line);
+		return;
+	} else {
+		if (!server_is_grumpy(tls, line))
+			bail(tls, "Received unexpected response after "
+			    "sending command(s)");
+		free(line);
+		return;
+	}
 	free(line);
+
+	send_commands(client);
+	request_input(client);
+	check_quit(client);
 }
 
 static void
-handle_tls_command_response(tls_state * restrict tls, char * restrict line)
+handle_tls_quit_response(tls_state * restrict tls, char * restrict line)
 {
 	client_state *client = tls->data;
 
 	info("%s S: %s", tls->peer, line);
 
 	if (strcasecmp("OKAY", line) == 0)
-		input_read_chunk(client->input, handle_input_chunk);
+		client_stop(client);
 	else if (!server_is_grumpy(tls, line))
-		bail(tls, "Received unexpected response after sending command(s)");
+		bail(tls, "Received unexpected QUIT response");
 
 	free(line);
 }
 
 static void
-handle_tls_quit_response(tls_state * restrict tls, char * restrict line)
+handle_tls_error(tls_state *tls)
 {
 	client_state *client = tls->data;
 
-	info("%s S: %s", tls->peer, line);
+	/* The TLS layer is going to destroy the connection context. */
+	client->tls = NULL;
+	disconnect(client);
+}
 
-	if (strcasecmp("OKAY", line) == 0)
-		client_stop(client);
-	else if (!server_is_grumpy(tls, line))
-		bail(tls, "Received unexpected QUIT response");
+static void
+handle_tls_timeout(tls_state *tls)
+{
+	client_state *client = tls->data;
 
-	free(line);
+	info("%s C: BAIL Connection timed out", tls->peer);
+	tls_write_line(tls, "BAIL Connection timed out");
+	disconnect(client);
+}
+
+static void
+keepalive_cb(EV_P_ ev_timer *w, int revents __attribute__((__unused__)))
+{
+	client_state *client = w->data;
+
+	if (client->state == STATE_READY && client->unacked.length == 0
+	    && client->pending.length == 0) {
+		debug("Sending keepalive request to %s", client->server);
+		submit(client, NULL);
+		send_commands(client);
+	}
+}
+
+static void
+reconnect_cb(EV_P_ ev_timer *w, int revents __attribute__((__unused__)))
+{
+	client_state *client = w->data;
+
+	info("Reconnecting to %s", client->server);
+	connect_to_server(client);
+}
+
+static void
+submit(client_state * restrict client, char * restrict data)
+{
+	command *c = xmalloc(sizeof(command));
+
+	if ((c->data = data) != NULL) {
+		c->length = strlen(data);
+		c->data[c->length++] = '\n'; /* Replace the '\0'. */
+	} else
+		c->length = 0;
+	c->batch = NULL;
+	c->n_requests = 1;
+	c->n_responses = 0;
+
+	enqueue(&client->pending, c);
+}
+
+static void
+submit_batch(client_state * restrict client, bulk_batch * restrict batch)
+{
+	if (client->protocol_version > 1) {
+		command *c = xmalloc(sizeof(command));
+
+		c->data = batch->data;
+		c->length = batch->size;
+		c->batch = batch;
+		c->n_requests = batch->n_records;
+		c->n_responses = 0;
+		enqueue(&client->pending, c);
+	} else {
+		char *p = batch->data, *end = batch->data + batch->size;
+
+		/*
+		 * Without pipelining, we must wait for the server's permission
+		 * before sending each payload, so split the batch up again.
+		 */
+		while (p < end) {
+			char *payload = memchr(p, '\n', (size_t)(end - p)) + 1;
+			size_t length = (size_t)strtoul(p + sizeof("PUSH ") - 1,
+			    NULL, 10);
+			char *data = xmalloc(length);
+
+			(void)memcpy(data, payload, length);
+			data[length - 1] = '\0'; /* Replace the '\n'. */
+			submit(client, data);
+			p = payload + length;
+		}
+		bulk_release(batch);
+	}
+}
+
+static void
+send_commands(client_state *client)
+{
+	tls_state *tls = client->tls;
+	size_t window = client->protocol_version > 1 ?
+	    MAX_UNACKED_COMMANDS : 1;
+	char *request;
+
+	while (client->pending.length > 0 && client->unacked.length < window) {
+		command *c = dequeue(&client->pending);
+
+		if (c->data == NULL)
+			send_request(tls, "NOOP");
+#if HAVE_ZLIB_H
+		else if (client->compressor != NULL && c->batch != NULL)
+			send_compressed_batch(client, c);
+		else if (client->compressor != NULL)
+			send_compressed(client, c);
+#endif
+		else if (c->batch != NULL) {
+			info("%s C: PUSH (%zu requests)", tls->peer,
+			    c->n_requests);
+			notice("Transmitting %zu command(s) to %s",
+			    c->n_requests, tls->peer);
+			tls_write(tls, c->data, c->length, keep_batch);
+		} else {
+			xasprintf(&request, "PUSH %zu", c->length);
+			send_request(tls, request);
+			free(request);
+
+			if (client->protocol_version > 1) {
+				notice("Transmitting to %s: %.*s", tls->peer,
+				    (int)c->length - 1, c->data);
+				tls_write(tls, c->data, c->length, NULL);
+			}
+		}
+		enqueue(&client->unacked, c);
+
+		if (client->mode == CLIENT_MODE_DAEMON)
+			ev_timer_again(EV_DEFAULT_UC_
+			    &client->keepalive_watcher);
+	}
+	if (client->unacked.length > 0 && !client->reading) {
+		client->reading = true;
+		tls_read_line(tls, handle_tls_response);
+	}
+}
+
+#if HAVE_ZLIB_H
+static void
+send_compressed(client_state * restrict client, command * restrict c)
+{
+	tls_state *tls = client->tls;
+	char *request, *data;
+	size_t size;
+
+	data = compressor_run(client->compressor, c->data, c->length, &size);
+	xasprintf(&request, "PUSH %zu %zu", size, c->length);
+	send_request(tls, request);
+	free(request);
+
+	notice("Transmitting to %s: %.*s", tls->peer, (int)c->length - 1,
+	    c->data);
+	tls_write(tls, data, size, free);
+}
+
+/*
+ * The batch holds uncompressed PUSH requests which must be kept for resending
+ * until they're acknowledged, so the compressed requests are written into a
+ * new buffer.
+ */
+static void
+send_compressed_batch(client_state * restrict client, command * restrict c)
+{
+	tls_state *tls = client->tls;
+	char *p = c->data, *end = c->data + c->length, *output;
+	size_t capacity = c->length / 2 + 64, used = 0;
+
+	info("%s C: PUSH (%zu compressed requests)", tls->peer,
+	    c->n_requests);
+	notice("Transmitting %zu command(s) to %s", c->n_requests, tls->peer);
+
+	output = xmalloc(capacity);
+	while (p < end) {
+		char *payload = memchr(p, '\n', (size_t)(end - p)) + 1;
+		size_t length = (size_t)strtoul(p + sizeof("PUSH ") - 1, NULL,
+		    10);
+		char header[64], *data;
+		size_t header_length, size;
+
+		data = compressor_run(client->compressor, payload, length,
+		    &size);
+		header_length = (size_t)snprintf(header, sizeof(header),
+		    "PUSH %zu %zu\r\n", size, length);
+		if (capacity - used < header_length + size) {
+			capacity = MAX(capacity * 2, used + header_length
+			    + size);
+			output = xrealloc(output, capacity);
+		}
+		(void)memcpy(output + used, header, header_length);
+		(void)memcpy(output + used + header_length, data, size);
+		used += header_length + size;
+		free(data);
+		p = payload + length;
+	}
+	tls_write(tls, output, used, free);
+}
+#endif
+
+static void
+request_input(client_state *client)
+{
+	size_t window = client->protocol_version > 1 ?
+	    MAX_UNACKED_COMMANDS : 1;
+
+	if (client->bulk != NULL) {
+		bulk_batch *batch;
+
+		/*
+		 * The bulk reader hands out a new batch only after all
+		 * requests of a previous one were acknowledged.
+		 */
+		while (client->pending.length == 0
+		    && (batch = bulk_read_batch(client->bulk)) != NULL) {
+			submit_batch(client, batch);
+			send_commands(client);
+		}
+		if (bulk_eof(client->bulk))
+			client->finishing = true;
+		return;
+	}
+
+	/*
+	 * Don't read more input than we're allowed to send to the server
+	 * without waiting for responses.
+	 */
+	if (client->input != NULL && !client->reading_input
+	    && client->pending.length + client->unacked.length < window) {
+		client->reading_input = true;
+		input_read_chunk(client->input, handle_input_chunk);
+	}
+}
+
+static void
+check_quit(client_state *client)
+{
+	if (client->finishing && client->state == STATE_READY
+	    && client->pending.length == 0 && client->unacked.length == 0) {
+		client->state = STATE_QUITTING;
+		send_request(client->tls, "QUIT");
+		tls_read_line(client->tls, handle_tls_quit_response);
+	}
+}
+
+static void
+disconnect(client_state *client)
+{
+	if (client->tls != NULL) {
+		tls_shutdown(client->tls);
+		client->tls = NULL;
+	}
+	if (ev_is_active(&client->keepalive_watcher))
+		ev_timer_stop(EV_DEFAULT_UC_ &client->keepalive_watcher);
+
+	/* Resubmit the commands which weren't acknowledged. */
+	requeue(&client->unacked, &client->pending);
+	client->reading = false;
+	client->payload_sent = false;
+
+	if (client->finishing) {
+		client->state = STATE_WAITING;
+		client_finish(client);
+	} else {
+		info("Reconnecting to %s in %.0f second(s)", client->server,
+		    (double)client->reconnect_delay);
+		client->state = STATE_WAITING;
+		ev_timer_set(&client->reconnect_watcher,
+		    client->reconnect_delay, 0.0);
+		ev_timer_start(EV_DEFAULT_UC_ &client->reconnect_watcher);
+		client->reconnect_delay = MIN(client->reconnect_delay * 2.0,
+		    MAX_RECONNECT_DELAY);
+	}
 }
 
 static void
@@ -279,10 +787,16 @@ bail(tls_state * restrict tls, const char * restrict fmt, ...)
 
 	tls_write(tls, "BAIL ", sizeof("BAIL ") - 1, NULL);
 	tls_write_line(tls, message);
-	client_stop(client);
-	critical("%s", message);
+
+	if (client->mode == CLIENT_MODE_DAEMON) {
+		error("%s", message);
+		disconnect(client);
+	} else {
+		client_stop(client);
+		critical("%s", message);
+		exit_code = EXIT_FAILURE;
+	}
 	free(message);
-	exit_code = EXIT_FAILURE;
 }
 
 static bool
@@ -292,14 +806,85 @@ server_is_grumpy(tls_state * restrict tls, char * restrict line)
 
 	if (strncasecmp("FAIL", line, 4) == 0
 	    || strncasecmp("BAIL", line, 4) == 0) {
-		client_stop(client);
-		critical("Server said: %s", line);
+		if (client->mode == CLIENT_MODE_DAEMON) {
+			error("Server said: %s", line);
+			disconnect(client);
+		} else {
+			client_stop(client);
+			critical("Server said: %s", line);
+		}
 		exit_code = EXIT_FAILURE;
 		return true;
 	}
 	return false;
 }
 
+static void
+enqueue(command_queue * restrict queue, command * restrict c)
+{
+	c->next = NULL;
+	if (queue->tail != NULL)
+		queue->tail->next = c;
+	else
+		queue->head = c;
+	queue->tail = c;
+	queue->length++;
+}
+
+static void
+requeue(command_queue * restrict from, command_queue * restrict to)
+{
+	if (from->head == NULL)
+		return;
+
+	from->tail->next = to->head;
+	if (to->tail == NULL)
+		to->tail = from->tail;
+	to->head = from->head;
+	to->length += from->length;
+
+	from->head = from->tail = NULL;
+	from->length = 0;
+}
+
+static command *
+dequeue(command_queue *queue)
+{
+	command *c = queue->head;
+
+	if ((queue->head = c->next) == NULL)
+		queue->tail = NULL;
+	queue->length--;
+
+	return c;
+}
+
+static void
+free_command(command *c)
+{
+	if (c->batch != NULL)
+		bulk_release(c->batch);
+	else if (c->data != NULL)
+		free(c->data);
+	free(c);
+}
+
+static void
+keep_batch(void *data __attribute__((__unused__)))
+{
+	/*
+	 * The batch buffer is released when the server has acknowledged all
+	 * requests it contains, not when it has been written.
+	 */
+}
+
+static void
+free_queue(command_queue *queue)
+{
+	while (queue->head != NULL)
+		free_command(dequeue(queue));
+}
+
 static char *
 generate_session_id(void)
 {
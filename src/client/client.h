@@ -38,13 +38,16 @@
 
 enum {
 	CLIENT_MODE_COMMAND,
-	CLIENT_MODE_CHECK_RESULT
+	CLIENT_MODE_CHECK_RESULT,
+	CLIENT_MODE_DAEMON
 };
 
 typedef struct client_state_s client_state;
 
 client_state *client_start(const char *, const char *, ev_tstamp, int, char,
-                           char);
+                           char, const char *, bool);
+void client_submit(client_state * restrict, char * restrict);
+void client_finish(client_state *);
 void client_stop(client_state *);
 
 #endif
@@ -40,8 +40,13 @@
 #include "util.h"
 #include "wrappers.h"
 
+#define DEFAULT_CHECK_INTERVAL 300
+#define DEFAULT_CHECK_TIMEOUT 60
+#define DEFAULT_COMPRESSION "none"
+#define DEFAULT_MAX_CONCURRENT_CHECKS 8
 #define DEFAULT_PASSWORD "change-me"
 #define DEFAULT_PORT "5668"
+#define DEFAULT_RETRY_INTERVAL 60
 #define DEFAULT_SERVER "localhost"
 #define DEFAULT_TIMEOUT 15
 #define DEFAULT_TLS_CIPHERS \
@@ -74,11 +79,16 @@ conf *
 conf_init(const char *path)
 {
 	static conf cfg[] = {
+		{ "check_interval", TYPE_INTEGER, { 0 } },
+		{ "check_timeout", TYPE_INTEGER, { 0 } },
+		{ "compression", TYPE_STRING, { NULL } },
 		{ "delay", TYPE_INTEGER, { 0 } },
 		{ "encryption_method", TYPE_STRING, { NULL } },
 		{ "identity", TYPE_STRING, { NULL } },
+		{ "max_concurrent_checks", TYPE_INTEGER, { 0 } },
 		{ "password", TYPE_STRING, { NULL } },
 		{ "port", TYPE_STRING, { NULL } },
+		{ "retry_interval", TYPE_INTEGER, { 0 } },
 		{ "server", TYPE_STRING, { NULL } },
 		{ "timeout", TYPE_INTEGER, { 0 } },
 		{ "tls_ciphers", TYPE_STRING, { NULL } },
@@ -87,8 +97,14 @@ conf_init(const char *path)
 
 	debug("Initializing configuration context");
 
+	conf_setint(cfg, "check_interval", DEFAULT_CHECK_INTERVAL);
+	conf_setint(cfg, "check_timeout", DEFAULT_CHECK_TIMEOUT);
+	conf_setstr(cfg, "compression", DEFAULT_COMPRESSION);
+	conf_setint(cfg, "max_concurrent_checks",
+	    DEFAULT_MAX_CONCURRENT_CHECKS);
 	conf_setstr(cfg, "password", DEFAULT_PASSWORD);
 	conf_setstr(cfg, "port", DEFAULT_PORT);
+	conf_setint(cfg, "retry_interval", DEFAULT_RETRY_INTERVAL);
 	conf_setstr(cfg, "server", DEFAULT_SERVER);
 	conf_setint(cfg, "timeout", DEFAULT_TIMEOUT);
 	conf_setstr(cfg, "tls_ciphers", DEFAULT_TLS_CIPHERS);
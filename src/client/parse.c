@@ -124,6 +124,33 @@ parse_check_result(const char *input, char delimiter)
 	return command;
 }
 
+char *
+format_check_result(const char *host, const char *service, int state,
+                    const char *output)
+{
+	char *command, *escaped;
+
+	debug("Formatting check result");
+
+	if (strpbrk(output, "\\\n") != NULL)
+		output = escaped = escape(output);
+	else
+		escaped = NULL;
+
+	if (service == NULL)
+		xasprintf(&command, "[%lu] PROCESS_HOST_CHECK_RESULT;%s;%d;%s",
+		    (unsigned long)time(NULL), host, state, output);
+	else
+		xasprintf(&command,
+		    "[%lu] PROCESS_SERVICE_CHECK_RESULT;%s;%s;%d;%s",
+		    (unsigned long)time(NULL), host, service, state, output);
+
+	if (escaped != NULL)
+		free(escaped);
+
+	return command;
+}
+
 /*
  * Static functions.
  */
@@ -36,6 +36,7 @@
 
 char *parse_command(const char *);
 char *parse_check_result(const char *, char);
+char *format_check_result(const char *, const char *, int, const char *);
 
 #endif
 
@@ -34,9 +34,13 @@
 # include <inttypes.h>
 #endif
 #include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if HAVE_STRINGS_H
+# include <strings.h>
+#endif
 #if HAVE_NANOSLEEP
 # include <time.h>
 #endif
@@ -45,7 +49,9 @@
 #include <ev.h>
 #include <openssl/rand.h>
 
+#include "check.h"
 #include "client.h"
+#include "compress.h"
 #include "conf.h"
 #include "log.h"
 #include "send_nsca.h"
@@ -54,7 +60,9 @@
 #include "wrappers.h"
 
 typedef struct {
+	char *check_file;
 	char *conf_file;
+	char *input_file;
 	char *port;
 	char *server;
 	int delay;
@@ -69,11 +77,18 @@ typedef struct {
 conf *cfg = NULL;
 int exit_code = EXIT_SUCCESS;
 
+static ev_signal sigint_watcher, sigterm_watcher;
+
 static options *get_options(int, char **);
 static void free_options(options *);
 static int parse_backslash_escape(const char *);
 static void delay_execution(unsigned int);
 static unsigned long random_number(unsigned long);
+static bool use_compression(const char *);
+static void start_checks(client_state * restrict, const char * restrict, char);
+static void handle_check_result(check_state * restrict, char * restrict);
+static void stop_checks(check_state *);
+static void signal_cb(EV_P_ ev_signal *, int);
 static void forget_config(void);
 static void usage(int) __attribute__((__noreturn__));
 
@@ -81,6 +96,7 @@ int
 main(int argc, char **argv)
 {
 	options *opt;
+	client_state *client;
 	char *host_port;
 
 	setprogname(argv[0]);
@@ -113,15 +129,25 @@ main(int argc, char **argv)
 	if (conf_getint(cfg, "delay") != 0)
 		delay_execution((unsigned int)conf_getint(cfg, "delay"));
 
-	xasprintf(&host_port, "%s:%s", conf_getstr(cfg, "server"),
-	    conf_getstr(cfg, "port"));
+	/* An absolute path name denotes the server's local socket. */
+	if (conf_getstr(cfg, "server")[0] == '/')
+		host_port = xstrdup(conf_getstr(cfg, "server"));
+	else
+		xasprintf(&host_port, "%s:%s", conf_getstr(cfg, "server"),
+		    conf_getstr(cfg, "port"));
 
-	(void)client_start(host_port,
+	client = client_start(host_port,
 	    conf_getstr(cfg, "tls_ciphers"),
 	    conf_getint(cfg, "timeout"),
+	    opt->check_file != NULL ? CLIENT_MODE_DAEMON :
 	    opt->raw_commands ? CLIENT_MODE_COMMAND : CLIENT_MODE_CHECK_RESULT,
 	    opt->delimiter,
-	    opt->separator);
+	    opt->separator,
+	    opt->input_file,
+	    use_compression(conf_getstr(cfg, "compression")));
+
+	if (opt->check_file != NULL)
+		start_checks(client, opt->check_file, opt->delimiter);
 
 	(void)ev_run(EV_DEFAULT_UC_ 0);
 
@@ -138,7 +164,9 @@ get_options(int argc, char **argv)
 	options *opt = xmalloc(sizeof(options));
 	int option;
 
+	opt->check_file = NULL;
 	opt->conf_file = NULL;
+	opt->input_file = NULL;
 	opt->port = NULL;
 	opt->server = NULL;
 	opt->delay = -1;
@@ -158,7 +186,7 @@ get_options(int argc, char **argv)
 		}
 	}
 
-	while ((option = getopt(argc, argv, "Cc:D:d:e:H:ho:p:SstVv")) != -1) {
+	while ((option = getopt(argc, argv, "Cc:D:d:e:f:H:ho:p:SstVvX:")) != -1) {
 		int character;
 
 		switch (option) {
@@ -190,6 +218,11 @@ get_options(int argc, char **argv)
 				die("-e argument must be a single character");
 			opt->separator = (char)character;
 			break;
+		case 'f':
+			if (opt->input_file != NULL)
+				free(opt->input_file);
+			opt->input_file = xstrdup(optarg);
+			break;
 		case 'H':
 			if (opt->server != NULL)
 				free(opt->server);
@@ -229,12 +262,19 @@ get_options(int argc, char **argv)
 			else if (opt->log_level < LOG_LEVEL_DEBUG)
 				opt->log_level++;
 			break;
+		case 'X':
+			if (opt->check_file != NULL)
+				free(opt->check_file);
+			opt->check_file = xstrdup(optarg);
+			break;
 		default:
 			usage(EXIT_FAILURE);
 		}
 	}
 	if (opt->delimiter == opt->separator)
 		die("Field delimiter must be different from record separator");
+	if (opt->input_file != NULL && opt->check_file != NULL)
+		die("The -f and -X options are mutually exclusive");
 	if (argc - optind > 0)
 		die("Unexpected non-option argument: %s", argv[optind]);
 
@@ -244,8 +284,12 @@ get_options(int argc, char **argv)
 static void
 free_options(options *opt)
 {
+	if (opt->check_file != NULL)
+		free(opt->check_file);
 	if (opt->conf_file != NULL)
 		free(opt->conf_file);
+	if (opt->input_file != NULL)
+		free(opt->input_file);
 	if (opt->port != NULL)
 		free(opt->port);
 	if (opt->server != NULL)
@@ -345,6 +389,70 @@ random_number(unsigned long range)
 	return random_value % range;
 }
 
+static bool
+use_compression(const char *method)
+{
+	if (strcasecmp(method, "none") == 0)
+		return false;
+	if (strcasecmp(method, COMPRESSION_METHOD) != 0)
+		die("Compression method not supported: %s", method);
+#if !HAVE_ZLIB_H
+	die("Compression support was not compiled in");
+#endif
+	return true;
+}
+
+static void
+start_checks(client_state * restrict client, const char * restrict path,
+             char delimiter)
+{
+	check_state *checks;
+
+	checks = check_start(path, delimiter,
+	    (ev_tstamp)conf_getint(cfg, "check_interval"),
+	    (ev_tstamp)conf_getint(cfg, "retry_interval"),
+	    (ev_tstamp)conf_getint(cfg, "check_timeout"),
+	    (unsigned int)conf_getint(cfg, "max_concurrent_checks"));
+	checks->data = client;
+
+	check_on_result(checks, handle_check_result);
+	check_on_done(checks, stop_checks);
+
+	sigint_watcher.data = checks;
+	sigterm_watcher.data = checks;
+	ev_signal_init(&sigint_watcher, signal_cb, SIGINT);
+	ev_signal_init(&sigterm_watcher, signal_cb, SIGTERM);
+	ev_signal_start(EV_DEFAULT_UC_ &sigint_watcher);
+	ev_signal_start(EV_DEFAULT_UC_ &sigterm_watcher);
+}
+
+static void
+handle_check_result(check_state * restrict checks, char * restrict result)
+{
+	client_submit(checks->data, result);
+}
+
+static void
+stop_checks(check_state *checks)
+{
+	client_state *client = checks->data;
+
+	ev_signal_stop(EV_DEFAULT_UC_ &sigint_watcher);
+	ev_signal_stop(EV_DEFAULT_UC_ &sigterm_watcher);
+
+	check_stop(checks);
+	client_finish(client);
+}
+
+static void
+signal_cb(EV_P_ ev_signal *w, int revents __attribute__((__unused__)))
+{
+	notice("Received %s, shutting down",
+	    w->signum == SIGINT ? "SIGINT" : "SIGTERM");
+
+	stop_checks(w->data);
+}
+
 static void
 forget_config(void)
 {
@@ -368,6 +476,7 @@ usage(int status)
 	    " -D <delay>       Sleep up to <delay> seconds on startup.\n"
 	    " -d <delimiter>   Expect <delimiter> to separate input fields.\n"
 	    " -e <separator>   Expect <separator> to separate check results.\n"
+	    " -f <file>        Read the input from the specified <file>.\n"
 	    " -H <server>      Connect and talk to the specified <server>.\n"
 	    " -h               Print this usage information and exit.\n"
 	    " -o <timeout>     Use the specified connection <timeout>.\n"
@@ -376,7 +485,8 @@ usage(int status)
 	    " -s               Write messages to syslog.\n"
 	    " -t               Ignore this option for backward compatibility.\n"
 	    " -V               Print version information and exit.\n"
-	    " -v [-v [-v]]     Increase the verbosity level.\n",
+	    " -v [-v [-v]]     Increase the verbosity level.\n"
+	    " -X <file>        Run the checks listed in the specified <file>.\n",
 	    getprogname());
 
 	exit(status);
@@ -57,7 +57,6 @@ struct buffer_s {
 	size_t size;
 };
 
-static size_t buffer_find_char(buffer *, char);
 static void block_add(buffer *);
 static void block_remove(buffer *);
 static void *block_detach(buffer *, size_t);
@@ -192,12 +191,44 @@ buffer_slurp(buffer * restrict buf, size_t * restrict size)
 	return buffer_read_alloc(buf, size);
 }
 
+size_t
+buffer_find_char(buffer *buf, char character)
+{
+	block *b;
+	size_t pos = 1;
+
+	for (b = buf->first; b != NULL; b = b->next) {
+		size_t i = b == buf->first ? buf->start_offset : 0;
+		size_t end_offset = b == buf->last ?
+		    buf->end_offset : BUFFER_BLOCK_SIZE;
+
+		while (i < end_offset) {
+			if ((char)b->data[i] == character)
+				return pos;
+			i++, pos++;
+		}
+	}
+	return 0;
+}
+
 size_t
 buffer_size(buffer *buf)
 {
 	return buf->size;
 }
 
+size_t
+buffer_memory(buffer *buf)
+{
+	block *blk;
+	size_t size = sizeof(buffer);
+
+	for (blk = buf->first; blk != NULL; blk = blk->next)
+		size += sizeof(block);
+
+	return size;
+}
+
 void
 buffer_free(buffer *buf)
 {
@@ -218,26 +249,6 @@ buffer_free(buffer *buf)
  * Static functions.
  */
 
-static size_t
-buffer_find_char(buffer *buf, char character)
-{
-	block *b;
-	size_t pos = 1;
-
-	for (b = buf->first; b != NULL; b = b->next) {
-		size_t i = b == buf->first ? buf->start_offset : 0;
-		size_t end_offset = b == buf->last ?
-		    buf->end_offset : BUFFER_BLOCK_SIZE;
-
-		while (i < end_offset) {
-			if ((char)b->data[i] == character)
-				return pos;
-			i++, pos++;
-		}
-	}
-	return 0;
-}
-
 static void
 block_add(buffer *buf)
 {
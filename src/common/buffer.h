@@ -45,7 +45,9 @@ void *buffer_read_alloc(buffer * restrict, size_t * restrict);
 char *buffer_read_line(buffer *);
 char *buffer_read_chunk(buffer *, char);
 void *buffer_slurp(buffer * restrict, size_t * restrict);
+size_t buffer_find_char(buffer *, char);
 size_t buffer_size(buffer *);
+size_t buffer_memory(buffer *);
 void buffer_free(buffer *);
 
 #endif
@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2014 Holger Weiss <holger@weiss.in-berlin.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "compress.h"
+#include "log.h"
+#include "system.h"
+#include "wrappers.h"
+
+#define DECOMPRESSOR_BUFFER_SIZE 16384
+
+struct compressor_s {
+	z_stream stream;
+};
+
+struct decompressor_s {
+	z_stream stream;
+	unsigned char buffer[DECOMPRESSOR_BUFFER_SIZE];
+	size_t remaining; /* Number of octets still expected. */
+};
+
+static const unsigned char flush_trailer[] = { 0x00, 0x00, 0xff, 0xff };
+
+static bool inflate_chunk(decompressor * restrict, const void * restrict,
+    size_t, bool (*)(const void *, size_t, void *), void *);
+
+/*
+ * Exported functions.
+ */
+
+compressor *
+compressor_new(void)
+{
+	compressor *c = xmalloc(sizeof(compressor));
+
+	c->stream.zalloc = Z_NULL;
+	c->stream.zfree = Z_NULL;
+	c->stream.opaque = Z_NULL;
+	c->stream.next_in = Z_NULL;
+	c->stream.avail_in = 0;
+
+	if (deflateInit2(&c->stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK)
+		die("Cannot initialize compressor: %s",
+		    c->stream.msg != NULL ? c->stream.msg : "Unknown error");
+
+	return c;
+}
+
+void *
+compressor_run(compressor * restrict c, const void * restrict input,
+               size_t input_size, size_t * restrict output_size)
+{
+	const unsigned char *next = input;
+	unsigned char *output;
+	size_t capacity = input_size / 2 + 64, used = 0;
+	int flush;
+
+	output = xmalloc(capacity);
+
+	do {
+		size_t avail = capacity - used;
+
+		if (c->stream.avail_in == 0) {
+			c->stream.next_in = (unsigned char *)next;
+			c->stream.avail_in = (uInt)MIN(input_size, UINT_MAX);
+			next += c->stream.avail_in;
+			input_size -= c->stream.avail_in;
+		}
+		if (avail < 64) {
+			capacity *= 2;
+			output = xrealloc(output, capacity);
+			avail = capacity - used;
+		}
+		c->stream.next_out = output + used;
+		c->stream.avail_out = (uInt)MIN(avail, UINT_MAX);
+		flush = input_size == 0 ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+
+		/* With a valid stream, deflate(3) cannot fail. */
+		(void)deflate(&c->stream, flush);
+		used = (size_t)(c->stream.next_out - output);
+	} while (input_size > 0 || c->stream.avail_in > 0
+	    || c->stream.avail_out == 0);
+
+	if (used < sizeof(flush_trailer) || memcmp(output + used
+	    - sizeof(flush_trailer), flush_trailer, sizeof(flush_trailer)) != 0)
+		die("Unexpected compressor output");
+
+	*output_size = used - sizeof(flush_trailer);
+	return output;
+}
+
+void
+compressor_free(compressor *c)
+{
+	if (c != NULL) {
+		(void)deflateEnd(&c->stream);
+		free(c);
+	}
+}
+
+decompressor *
+decompressor_new(void)
+{
+	decompressor *d = xmalloc(sizeof(decompressor));
+
+	d->stream.zalloc = Z_NULL;
+	d->stream.zfree = Z_NULL;
+	d->stream.opaque = Z_NULL;
+	d->stream.next_in = Z_NULL;
+	d->stream.avail_in = 0;
+	d->remaining = 0;
+
+	if (inflateInit2(&d->stream, -15) != Z_OK)
+		die("Cannot initialize decompressor: %s",
+		    d->stream.msg != NULL ? d->stream.msg : "Unknown error");
+
+	return d;
+}
+
+void
+decompressor_start(decompressor *d, size_t size)
+{
+	d->remaining = size;
+}
+
+bool
+decompressor_run(decompressor * restrict d, const void * restrict input,
+                 size_t size, bool (*sink)(const void *, size_t, void *),
+                 void *sink_data)
+{
+	const unsigned char *next = input;
+
+	while (size > 0) {
+		size_t chunk_size = MIN(size, UINT_MAX);
+
+		if (!inflate_chunk(d, next, chunk_size, sink, sink_data))
+			return false;
+		next += chunk_size;
+		size -= chunk_size;
+	}
+	return true;
+}
+
+bool
+decompressor_finish(decompressor * restrict d,
+                    bool (*sink)(const void *, size_t, void *), void *sink_data)
+{
+	if (!inflate_chunk(d, flush_trailer, sizeof(flush_trailer), sink,
+	    sink_data))
+		return false;
+	if (d->remaining > 0) {
+		warning("Decompressed data is %zu octets short", d->remaining);
+		return false;
+	}
+	return true;
+}
+
+void
+decompressor_free(decompressor *d)
+{
+	if (d != NULL) {
+		(void)inflateEnd(&d->stream);
+		free(d);
+	}
+}
+
+/*
+ * Static functions.
+ */
+
+static bool
+inflate_chunk(decompressor * restrict d, const void * restrict input,
+              size_t size, bool (*sink)(const void *, size_t, void *),
+              void *sink_data)
+{
+	d->stream.next_in = (unsigned char *)input;
+	d->stream.avail_in = (uInt)size;
+
+	do {
+		size_t n;
+		int status;
+
+		d->stream.next_out = d->buffer;
+		d->stream.avail_out = sizeof(d->buffer);
+
+		status = inflate(&d->stream, Z_SYNC_FLUSH);
+		if (status != Z_OK && status != Z_BUF_ERROR) {
+			warning("Cannot decompress data: %s",
+			    d->stream.msg != NULL ? d->stream.msg : "Bad stream");
+			return false;
+		}
+		if ((n = sizeof(d->buffer) - d->stream.avail_out) > d->remaining) {
+			warning("Decompressed data exceeds announced size");
+			return false;
+		}
+		d->remaining -= n;
+		if (n > 0 && !sink(d->buffer, n, sink_data))
+			return false;
+	} while (d->stream.avail_out == 0);
+
+	return true;
+}
+
+/* vim:set joinspaces noexpandtab textwidth=80 cinoptions=(4,u0: */
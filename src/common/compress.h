@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2014 Holger Weiss <holger@weiss.in-berlin.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * PUSH data may be transmitted as a raw DEFLATE stream (RFC 1951) which spans
+ * all requests of a session, so that the check results submitted earlier serve
+ * as a dictionary for the following ones.  Each request's data is terminated
+ * with a sync flush, and the four octets (0x00 0x00 0xff 0xff) that end the
+ * resulting empty stored block are omitted (like in RFC 7692).
+ */
+
+#ifndef COMPRESS_H
+# define COMPRESS_H
+
+# if HAVE_CONFIG_H
+#  include <config.h>
+# endif
+
+# include <stdio.h> /* For size_t. */
+
+# include "system.h"
+
+# define COMPRESSION_METHOD "deflate"
+
+typedef struct compressor_s compressor;
+typedef struct decompressor_s decompressor;
+
+compressor *compressor_new(void);
+void *compressor_run(compressor * restrict, const void * restrict, size_t,
+    size_t * restrict);
+void compressor_free(compressor *);
+
+decompressor *decompressor_new(void);
+void decompressor_start(decompressor *, size_t);
+bool decompressor_run(decompressor * restrict, const void * restrict, size_t,
+    bool (*)(const void *, size_t, void *), void *);
+bool decompressor_finish(decompressor * restrict,
+    bool (*)(const void *, size_t, void *), void *);
+void decompressor_free(decompressor *);
+
+#endif
+
+/* vim:set joinspaces noexpandtab textwidth=80 cinoptions=(4,u0: */
@@ -0,0 +1,521 @@
+/*
+ * Copyright (c) 2013 Holger Weiss <holger@weiss.in-berlin.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <sys/types.h>
+#if HAVE_SYS_SOCKET_H
+# include <sys/socket.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#if HAVE_PTHREAD
+# include <pthread.h>
+# include <signal.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ev.h>
+
+#include "connector.h"
+#include "log.h"
+#include "system.h"
+#include "wrappers.h"
+
+#ifndef NI_MAXHOST
+# define NI_MAXHOST 1025
+#endif
+#ifndef NI_MAXSERV
+# define NI_MAXSERV 32
+#endif
+
+/* See RFC 8305, section 5. */
+#ifndef CONNECTION_ATTEMPT_DELAY
+# define CONNECTION_ATTEMPT_DELAY 0.25
+#endif
+
+/*
+ * The resolver state is shared with the resolver thread, which might outlive
+ * the connector if the connection attempt is aborted.  In that case, the thread
+ * cleans up after itself.
+ */
+struct resolver_s {
+#if HAVE_PTHREAD
+	pthread_mutex_t mutex;
+#endif
+	ev_async *watcher;
+	struct addrinfo *result;
+	char *host;
+	char *port;
+	int status;
+	int error;
+	bool done;
+	bool abandoned;
+};
+
+static struct resolver_s *resolver_new(const char * restrict,
+                                       const char * restrict, ev_async *);
+static void resolver_free(struct resolver_s *);
+static void resolve(struct resolver_s *, int);
+#if HAVE_PTHREAD
+static bool resolve_in_thread(struct resolver_s *);
+static void *resolver_thread(void *);
+#endif
+static void lock_resolver(struct resolver_s *);
+static void unlock_resolver(struct resolver_s *);
+static void resolve_cb(EV_P_ ev_async *, int);
+static void attempt_cb(EV_P_ ev_io *, int);
+static void delay_cb(EV_P_ ev_timer *, int);
+static void sort_candidates(connector_state *);
+static void start_attempt(connector_state *);
+static void stop_attempts(connector_state *);
+static bool set_nonblocking(int);
+static char *format_address(const struct addrinfo *);
+
+/*
+ * Exported functions.
+ */
+
+connector_state *
+connector_start(const char * restrict host, const char * restrict port,
+                void handle_connect(connector_state *, int),
+                void handle_error(connector_state * restrict,
+                                  const char * restrict))
+{
+	connector_state *conn = xmalloc(sizeof(connector_state));
+
+	debug("Resolving %s", host);
+
+	conn->data = NULL;
+	conn->addresses = NULL;
+	conn->candidates = NULL;
+	conn->attempts = NULL;
+	conn->connect_handler = handle_connect;
+	conn->error_handler = handle_error;
+	conn->n_candidates = 0;
+	conn->n_started = 0;
+	conn->n_running = 0;
+	conn->last_error = 0;
+	conn->resolve_watcher.data = conn;
+	conn->delay_watcher.data = conn;
+	conn->resolver = resolver_new(host, port, &conn->resolve_watcher);
+
+	ev_async_init(&conn->resolve_watcher, resolve_cb);
+	ev_async_start(EV_DEFAULT_UC_ &conn->resolve_watcher);
+	ev_init(&conn->delay_watcher, delay_cb);
+
+	/*
+	 * Numeric addresses are converted right away.  Everything else might
+	 * involve DNS lookups, which shouldn't block the event loop.
+	 */
+	resolve(conn->resolver, AI_NUMERICHOST);
+#if HAVE_PTHREAD
+	if (conn->resolver->status == EAI_NONAME
+	    && resolve_in_thread(conn->resolver))
+		return conn;
+#endif
+	if (conn->resolver->status == EAI_NONAME)
+		resolve(conn->resolver, 0);
+
+	/*
+	 * Hand the result to the resolve_cb() from the event loop, so that the
+	 * caller never sees its handlers called before we return.
+	 */
+	conn->resolver->done = true;
+	ev_feed_event(EV_DEFAULT_UC_ &conn->resolve_watcher, EV_ASYNC);
+
+	return conn;
+}
+
+void
+connector_stop(connector_state *conn)
+{
+	if (conn->resolver != NULL) {
+		bool done;
+
+		lock_resolver(conn->resolver);
+		if (!(done = conn->resolver->done))
+			conn->resolver->abandoned = true;
+		unlock_resolver(conn->resolver);
+		if (done)
+			resolver_free(conn->resolver);
+	}
+	if (ev_is_active(&conn->resolve_watcher))
+		ev_async_stop(EV_DEFAULT_UC_ &conn->resolve_watcher);
+
+	stop_attempts(conn);
+
+	if (conn->addresses != NULL)
+		freeaddrinfo(conn->addresses);
+	if (conn->candidates != NULL)
+		free(conn->candidates);
+	if (conn->attempts != NULL)
+		free(conn->attempts);
+
+	free(conn);
+}
+
+/*
+ * Static functions.
+ */
+
+static struct resolver_s *
+resolver_new(const char * restrict host, const char * restrict port,
+             ev_async *watcher)
+{
+	struct resolver_s *r = xmalloc(sizeof(struct resolver_s));
+
+#if HAVE_PTHREAD
+	if ((errno = pthread_mutex_init(&r->mutex, NULL)) != 0)
+		die("Cannot initialize mutex: %m");
+#endif
+	r->watcher = watcher;
+	r->result = NULL;
+	r->host = xstrdup(host);
+	r->port = port != NULL ? xstrdup(port) : NULL;
+	r->status = 0;
+	r->error = 0;
+	r->done = false;
+	r->abandoned = false;
+
+	return r;
+}
+
+static void
+resolver_free(struct resolver_s *r)
+{
+#if HAVE_PTHREAD
+	(void)pthread_mutex_destroy(&r->mutex);
+#endif
+	if (r->result != NULL)
+		freeaddrinfo(r->result);
+	if (r->port != NULL)
+		free(r->port);
+	free(r->host);
+	free(r);
+}
+
+static void
+resolve(struct resolver_s *r, int flags)
+{
+	struct addrinfo hints;
+
+	(void)memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = flags;
+
+	if ((r->status = getaddrinfo(r->host, r->port, &hints, &r->result))
+	    != 0) {
+		r->error = errno;
+		r->result = NULL;
+	}
+}
+
+#if HAVE_PTHREAD
+static bool
+resolve_in_thread(struct resolver_s *r)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t all_signals, old_signals;
+	int result;
+
+	/* The event loop should handle all signals. */
+	(void)sigfillset(&all_signals);
+	(void)pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+
+	(void)pthread_attr_init(&attr);
+	(void)pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	result = pthread_create(&thread, &attr, resolver_thread, r);
+	(void)pthread_attr_destroy(&attr);
+
+	(void)pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+	if (result != 0) {
+		errno = result;
+		debug("Cannot create resolver thread: %m");
+		return false;
+	}
+	return true;
+}
+
+static void *
+resolver_thread(void *arg)
+{
+	struct resolver_s *r = arg;
+	bool abandoned;
+
+	resolve(r, 0);
+
+	lock_resolver(r);
+	r->done = true;
+	if (!(abandoned = r->abandoned))
+		ev_async_send(EV_DEFAULT_UC_ r->watcher);
+	unlock_resolver(r);
+
+	if (abandoned)
+		resolver_free(r);
+
+	return NULL;
+}
+#endif
+
+static void
+lock_resolver(struct resolver_s *r __attribute__((__unused__)))
+{
+#if HAVE_PTHREAD
+	if ((errno = pthread_mutex_lock(&r->mutex)) != 0)
+		die("Cannot lock mutex: %m");
+#endif
+}
+
+static void
+unlock_resolver(struct resolver_s *r __attribute__((__unused__)))
+{
+#if HAVE_PTHREAD
+	if ((errno = pthread_mutex_unlock(&r->mutex)) != 0)
+		die("Cannot unlock mutex: %m");
+#endif
+}
+
+static void
+resolve_cb(EV_P_ ev_async *w, int revents __attribute__((__unused__)))
+{
+	connector_state *conn = w->data;
+	struct resolver_s *r = conn->resolver;
+	bool done;
+
+	lock_resolver(r);
+	done = r->done;
+	unlock_resolver(r);
+
+	if (!done)
+		return;
+
+	ev_async_stop(EV_A_ w);
+	conn->resolver = NULL;
+
+	if (r->status != 0) {
+		conn->error_handler(conn, r->status == EAI_SYSTEM ?
+		    strerror(r->error) : gai_strerror(r->status));
+		resolver_free(r);
+		return;
+	}
+	conn->addresses = r->result;
+	r->result = NULL;
+	resolver_free(r);
+
+	sort_candidates(conn);
+	start_attempt(conn);
+}
+
+static void
+attempt_cb(EV_P_ ev_io *w, int revents __attribute__((__unused__)))
+{
+	connector_state *conn = w->data;
+	socklen_t len = sizeof(int);
+	int fd = w->fd, error;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+		error = errno;
+
+	ev_io_stop(EV_A_ w);
+	conn->n_running--;
+
+	if (error == 0) {
+		stop_attempts(conn);
+		conn->connect_handler(conn, fd);
+		return;
+	}
+	errno = conn->last_error = error;
+	debug("Connection attempt failed: %m");
+	(void)close(fd);
+
+	/* Don't wait for the delay to expire. */
+	if (conn->n_started < conn->n_candidates)
+		start_attempt(conn);
+	else if (conn->n_running == 0) {
+		errno = conn->last_error;
+		conn->error_handler(conn, strerror(errno));
+	}
+}
+
+static void
+delay_cb(EV_P_ ev_timer *w, int revents __attribute__((__unused__)))
+{
+	connector_state *conn = w->data;
+
+	debug("Connection attempt takes more than %.2f seconds",
+	    (double)CONNECTION_ATTEMPT_DELAY);
+	start_attempt(conn);
+}
+
+static void
+sort_candidates(connector_state *conn)
+{
+	struct addrinfo *ai, *first, *second;
+	size_t n = 0;
+
+	for (ai = conn->addresses; ai != NULL; ai = ai->ai_next)
+		conn->n_candidates++;
+
+	conn->candidates = xmalloc(conn->n_candidates
+	    * sizeof(struct addrinfo *));
+	conn->attempts = xmalloc(conn->n_candidates * sizeof(ev_io));
+
+	/*
+	 * Alternate between the address family of the first address returned
+	 * by getaddrinfo(3) and any other families, keeping the order
+	 * determined by the system (see RFC 8305, section 4).
+	 */
+	first = second = conn->addresses;
+	while (n < conn->n_candidates) {
+		while (first != NULL
+		    && first->ai_family != conn->addresses->ai_family)
+			first = first->ai_next;
+		if (first != NULL) {
+			conn->candidates[n++] = first;
+			first = first->ai_next;
+		}
+		while (second != NULL
+		    && second->ai_family == conn->addresses->ai_family)
+			second = second->ai_next;
+		if (second != NULL) {
+			conn->candidates[n++] = second;
+			second = second->ai_next;
+		}
+	}
+}
+
+static void
+start_attempt(connector_state *conn)
+{
+	if (ev_is_active(&conn->delay_watcher))
+		ev_timer_stop(EV_DEFAULT_UC_ &conn->delay_watcher);
+
+	while (conn->n_started < conn->n_candidates) {
+		struct addrinfo *ai = conn->candidates[conn->n_started];
+		ev_io *w = &conn->attempts[conn->n_started++];
+		char *address = format_address(ai);
+		int fd, result;
+
+		debug("Connecting to %s", address);
+		free(address);
+
+		if ((fd = socket(ai->ai_family, ai->ai_socktype,
+		    ai->ai_protocol)) == -1) {
+			conn->last_error = errno;
+			debug("Cannot create socket: %m");
+			continue;
+		}
+		if (!set_nonblocking(fd)) {
+			conn->last_error = errno;
+			debug("Cannot set non-blocking mode: %m");
+			(void)close(fd);
+			continue;
+		}
+		if ((result = connect(fd, ai->ai_addr, ai->ai_addrlen)) == -1
+		    && errno != EINPROGRESS && errno != EINTR) {
+			conn->last_error = errno;
+			debug("Connection attempt failed: %m");
+			(void)close(fd);
+			continue;
+		}
+
+		ev_io_init(w, attempt_cb, fd, EV_WRITE);
+		w->data = conn;
+		ev_io_start(EV_DEFAULT_UC_ w);
+		if (result == 0)
+			ev_feed_event(EV_DEFAULT_UC_ w, EV_WRITE);
+		conn->n_running++;
+
+		if (conn->n_started < conn->n_candidates) {
+			ev_timer_set(&conn->delay_watcher,
+			    CONNECTION_ATTEMPT_DELAY, 0.0);
+			ev_timer_start(EV_DEFAULT_UC_ &conn->delay_watcher);
+		}
+		return;
+	}
+	if (conn->n_running == 0) {
+		errno = conn->last_error;
+		conn->error_handler(conn, strerror(errno));
+	}
+}
+
+static void
+stop_attempts(connector_state *conn)
+{
+	size_t i;
+
+	for (i = 0; i < conn->n_started; i++)
+		if (ev_is_active(&conn->attempts[i])) {
+			ev_io_stop(EV_DEFAULT_UC_ &conn->attempts[i]);
+			(void)close(conn->attempts[i].fd);
+		}
+	conn->n_running = 0;
+
+	if (ev_is_active(&conn->delay_watcher))
+		ev_timer_stop(EV_DEFAULT_UC_ &conn->delay_watcher);
+}
+
+static bool
+set_nonblocking(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) == -1
+	    || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1
+	    || fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+		return false;
+
+	return true;
+}
+
+static char *
+format_address(const struct addrinfo *ai)
+{
+	char host[NI_MAXHOST], port[NI_MAXSERV], *address;
+
+	if (getnameinfo(ai->ai_addr, ai->ai_addrlen, host, sizeof(host), port,
+	    sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+		return xstrdup("unknown address");
+
+	if (ai->ai_family == AF_INET)
+		xasprintf(&address, "%s:%s", host, port);
+	else
+		xasprintf(&address, "[%s]:%s", host, port);
+
+	return address;
+}
+
+/* vim:set joinspaces noexpandtab textwidth=80 cinoptions=(4,u0: */
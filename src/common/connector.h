@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2013 Holger Weiss <holger@weiss.in-berlin.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A non-blocking TCP connector.  Host names are resolved in a separate thread
+ * (if available), so that a slow DNS server doesn't block the event loop.  The
+ * resulting addresses are then tried as recommended by RFC 8305 ("Happy
+ * Eyeballs"): the address families are interleaved, and a new connection
+ * attempt is started whenever the previous one failed or didn't succeed
+ * within a short delay, without aborting the attempts in progress.  The first
+ * connection established wins.
+ */
+
+#ifndef CONNECTOR_H
+# define CONNECTOR_H
+
+# if HAVE_CONFIG_H
+#  include <config.h>
+# endif
+
+# include <ev.h>
+
+# include "system.h"
+
+typedef struct connector_state_s {
+/* public: */
+	void *data; /* Can freely be used by the caller. */
+
+/* private: */
+	struct resolver_s *resolver;
+	struct addrinfo *addresses;
+	struct addrinfo **candidates;
+	ev_io *attempts;
+	ev_timer delay_watcher;
+	ev_async resolve_watcher;
+	void (*connect_handler)(struct connector_state_s *, int);
+	void (*error_handler)(struct connector_state_s * restrict,
+	                      const char * restrict);
+	size_t n_candidates;
+	size_t n_started;
+	size_t n_running;
+	int last_error;
+} connector_state;
+
+connector_state *connector_start(const char * restrict, const char * restrict,
+                                 void (*)(connector_state *, int),
+                                 void (*)(connector_state * restrict,
+                                          const char * restrict));
+void connector_stop(connector_state *);
+
+#endif
+
+/* vim:set joinspaces noexpandtab textwidth=80 cinoptions=(4,u0: */
@@ -43,7 +43,15 @@
  *   http://thread.gmane.org/gmane.comp.encryption.openssl.devel/12242
  *
  *   However, even if this were true for the current OpenSSL code, we'll rather
- *   not rely on the behaviour until the documentation is updated.
+ *   not rely on the behaviour until the documentation is updated.  When reading
+ *   lines, we use a single static `line_input' buffer for all connections, as
+ *   that buffer's address and size never change, and the data is moved into
+ *   the connection's `tls->input_buffer' as soon as SSL_read() succeeds.
+ *
+ * - We set the SSL_MODE_RELEASE_BUFFERS option (if available) so that OpenSSL
+ *   frees the record buffers of idle connections.  For the same reason, our
+ *   own input and output buffers are only allocated while data is pending, and
+ *   connection contexts are kept in a pool for reuse rather than free(3)d.
  *
  * - We set the SSL_MODE_ENABLE_PARTIAL_WRITE option because SSL_write() splits
  *   up the data into 16 kB chunks, so sending larger pieces of data would
@@ -54,16 +62,39 @@
  *   unless an OpenSSL call explicitly returned SSL_ERROR_WANT_READ or
  *   SSL_ERROR_WANT_WRITE.  Therefore, we kick off new SSL I/O requests via
  *   ev_feed_event() instead of having libev wait for actual socket readiness
- *   before calling the OpenSSL functions.
+ *   before calling the OpenSSL functions.  (New read requests are only kicked
+ *   off that way if input is buffered, as SSL_read() would fail otherwise.)
  *
  * - As an SSL_read() call invalidates the current state of the SSL_write()
  *   stream and vice versa (i.e., there's only a single state of an SSL
  *   connection), such a call has to be followed by a check whether the `ev_io'
- *   watcher for the opposite I/O direction is currently active.  If so, we use
- *   ev_feed_event() to feed the event that watcher is waiting for into the
- *   event loop (we check the `events' member of the `ev_io' struct to find out
- *   whether it's EV_READ or EV_WRITE).  This forces an SSL_read()/SSL_write()
- *   call, which updates the state of that stream.
+ *   watcher for the opposite I/O direction is currently active and waiting for
+ *   something the call might have changed.  If so, we use ev_feed_event() to
+ *   feed the event that watcher is waiting for into the event loop (we check
+ *   the `events' member of the `ev_io' struct to find out whether it's EV_READ
+ *   or EV_WRITE).  This forces an SSL_read()/SSL_write() call, which updates
+ *   the state of that stream.
+ *
+ * - Each epoll_ctl(2) call (or its equivalent) costs a system call, so the
+ *   `ev_io' watchers are bound to the socket only once per connection, their
+ *   events are modified only if they actually change, and the read watcher is
+ *   left running between read requests (it's stopped lazily if input arrives
+ *   while no read request is pending).  libev only touches the kernel's
+ *   interest set if the combined events of all watchers on the socket change.
+ *
+ * - Output is corked: data queued for a connection isn't handed to SSL_write()
+ *   right away.  Instead, the connection is put on a list which is flushed by
+ *   an `ev_prepare' watcher just before the event loop blocks.  That way, all
+ *   responses to the commands a pipelining client sent in one go end up in a
+ *   single TLS record (and send(2) call).  Data queued while the list is being
+ *   flushed (i.e., until the next `ev_check' callback) is written immediately,
+ *   as the loop might otherwise block with output pending.
+ *
+ * - Connections to and from local (Unix domain) sockets skip TLS altogether, as
+ *   the kernel vouches for the peer's user ID, which is then mapped to a client
+ *   identity.  For such connections, the `tls->plain' flag is set, and read(2)
+ *   and write(2) are called instead of SSL_read() and SSL_write().  The rest of
+ *   the machinery (buffering, corking, timeouts) is shared.
  *
  * For additional explanations, see the relevant OpenSSL man pages and the
  * following thread:
@@ -86,6 +117,8 @@
 #if HAVE_SYS_SOCKET_H
 # include <sys/socket.h>
 #endif
+#include <sys/stat.h>
+#include <sys/un.h>
 #ifdef HAVE_NETINET_IN_H
 # include <netinet/in.h>
 #endif
@@ -93,6 +126,8 @@
 # include <arpa/inet.h>
 #endif
 #include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -104,9 +139,11 @@
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 
+#include "connector.h"
 #include "log.h"
 #include "system.h"
 #include "tls.h"
+#include "util.h"
 #include "wrappers.h"
 
 #if !HAVE_STRUCT_SOCKADDR_STORAGE
@@ -117,8 +154,19 @@
 # endif
 #endif
 
-#ifndef INET6_ADDRSTRLEN
-# define INET6_ADDRSTRLEN 46
+#ifndef ACCEPT_BATCH_SIZE
+# define ACCEPT_BATCH_SIZE 64
+#endif
+
+#ifndef TLS_POOL_SIZE
+# define TLS_POOL_SIZE 256
+#endif
+
+#define SOURCE_HASH_SIZE 1024
+
+#ifndef ev_io_modify /* libev < 4.25. */
+# define ev_io_modify(ev, events_) \
+    do { (ev)->events = ((ev)->events & EV__IOFDSET) | (events_); } while (0)
 #endif
 
 #define LINE_MAX_SIZE 2048
@@ -137,27 +185,103 @@ enum {
 
 static void (*warning_f)(const char *, ...);
 static void (*error_f)(const char *, ...);
+static unsigned char line_input[LINE_BUFFER_SIZE];
+static tls_state *pool = NULL;
+static size_t n_pooled = 0;
+static size_t n_active = 0;
+
+/*
+ * Number of connections per client address which haven't completed the TLS
+ * handshake, yet.  This is only maintained if the number is limited.
+ */
+typedef struct source_s {
+	struct source_s *next; /* Link in the hash chain. */
+	size_t n_pending;
+	char addr[INET6_ADDRSTRLEN];
+} source;
+
+static source *sources[SOURCE_HASH_SIZE];
+
+/*
+ * Instead of using one timer per connection, the connections are kept in a
+ * list sorted by the time of their last activity, and a single timer watches
+ * the head of the list.  Activity moves a connection to the tail of the list,
+ * which is an O(1) operation that doesn't touch libev's timer heap.  See the
+ * "Be smart about timeouts" section of the ev(3) documentation.  As the order
+ * is only maintained for connections with equal timeouts, there's one list per
+ * timeout value (in practice, a single list).
+ */
+typedef struct timeout_list_s {
+	struct timeout_list_s *next;
+	tls_state *first;
+	tls_state *last;
+	ev_timer watcher;
+	ev_tstamp timeout;
+} timeout_list;
+
+static timeout_list *timeout_lists = NULL;
+
+/*
+ * Connections with corked output, in the order of their first write request.
+ */
+static tls_state *first_corked = NULL;
+static tls_state *last_corked = NULL;
+static ev_prepare flush_watcher;
+static ev_check cork_watcher;
+static bool flushing = false;
 
 static SSL_CTX *initialize_openssl(const SSL_METHOD *, const char *);
+static int listen_on(const char *, int);
+static int listen_on_local(const char *, int);
+static int accept_connection(int, struct sockaddr *, socklen_t *);
+static bool set_nonblocking(int);
 static tls_state *tls_new(int, int);
 static void tls_free(tls_state *);
+static void tls_drain_pool(void);
+static size_t buffered(buffer *);
+static void release_buffer(buffer **);
+static void attach_socket(tls_state *, int);
+static void watch(EV_P_ ev_io *, int);
+static bool has_pending_input(tls_state *);
+static void handle_tcp_connect(connector_state *, int);
+static void handle_tcp_error(connector_state * restrict, const char * restrict);
 static void connect_cb(EV_P_ ev_io *, int);
+static void connect_local_cb(EV_P_ ev_io *, int);
 static void accept_tcp_cb(EV_P_ ev_io *, int);
+static void accept_local_cb(EV_P_ ev_io *, int);
+static bool get_peer_uid(int, uid_t *);
+static void admit_connection(tls_server_state * restrict, tls_state * restrict);
+static void start_handshake(tls_state *);
+static void finish_handshake(tls_state *);
+static void forget_server_connection(tls_state *);
+static bool count_source(const char *, int, size_t);
 static void accept_ssl_cb(EV_P_ ev_io *, int);
 static void read_cb(EV_P_ ev_io *, int);
 static void write_cb(EV_P_ ev_io *, int);
 static void shutdown_cb(EV_P_ ev_io *, int);
+static int receive(tls_state * restrict, void * restrict, int);
+static int transmit(tls_state * restrict, const void * restrict, int);
+static void start_timeout(tls_state *);
+static void stop_timeout(tls_state *);
+static void touch(tls_state *);
+static void schedule_timeout(timeout_list *);
 static void timeout_cb(EV_P_ ev_timer *, int);
+static void expire(tls_state *);
 static void default_timeout_handler(tls_state *);
 static void default_line_too_long_handler(tls_state *);
 static void start_shutdown(tls_state *);
 static char *read_line(tls_state *);
 static char *read_bytes(tls_state *);
 static void write_buffered(tls_state * restrict, const void * restrict, size_t);
+static void schedule_write(tls_state *);
+static void uncork(tls_state *);
+static void flush_cb(EV_P_ ev_prepare *, int);
+static void cork_cb(EV_P_ ev_check *, int);
 static void reset_watcher_state(EV_P_ ev_io *);
 static void check_tls_error(EV_P_ ev_io *, int);
+static void check_socket_error(EV_P_ ev_io *, int);
 static void log_tls_message(void (*)(const char *, ...), const char *, ...);
-static bool get_peer_address(int, char *, socklen_t);
+static bool format_address(const struct sockaddr *, char *, socklen_t);
 
 /*
  * Exported functions.
@@ -178,6 +302,7 @@ tls_server_state *
 tls_server_start(const char * restrict host_port,
                  const char * restrict ciphers,
                  ev_tstamp timeout,
+                 int backlog,
                  void handle_connect(tls_state *),
                  unsigned int check_psk(SSL *,
                                         const char *,
@@ -196,38 +321,37 @@ tls_server_start(const char * restrict host_port,
 		listen_socket = -1;
 
 	if (listen_socket == -1) {
-		if ((ctx->bio = BIO_new_accept((char *)host_port)) == NULL)
-			die("Cannot create socket: %m");
-		(void)BIO_set_bind_mode(ctx->bio, BIO_BIND_REUSEADDR);
-	} else {
-		if ((ctx->bio = BIO_new(BIO_s_accept())) == NULL)
-			die("Cannot create BIO object");
-		(void)BIO_set_fd(ctx->bio, listen_socket, BIO_NOCLOSE);
-	}
-
-	/*
-	 * We call BIO_set_nbio() in addition to BIO_set_nbio_accept() in order
-	 * to set non-blocking I/O mode also for the *accepted* sockets, not
-	 * only for the listening socket:
-	 *
-	 * http://permalink.gmane.org/gmane.comp.encryption.openssl.user/27438
-	 */
-	(void)BIO_set_nbio_accept(ctx->bio, 1);
-	(void)BIO_set_nbio(ctx->bio, 1); /* For the *accepted* sockets. */
-
-	if (listen_socket == -1) {
-		if (BIO_do_accept(ctx->bio) <= 0)
-			log_tls_message(die, "Cannot bind to %s", host_port);
+		ctx->fd = listen_on(host_port, backlog);
 		debug("Listening on %s", host_port);
-	} else
+	} else {
+		if (!set_nonblocking(listen_socket))
+			die("Cannot set non-blocking mode: %m");
+		ctx->fd = listen_socket;
 		debug("Listening on file descriptor %d", listen_socket);
+	}
 
 	ctx->connect_handler = handle_connect;
+	ctx->accept_handler = NULL;
+	ctx->identify_handler = NULL;
+	ctx->local_path = NULL;
+	ctx->local_fd = -1;
+	ctx->first_queued = NULL;
+	ctx->last_queued = NULL;
 	ctx->timeout = timeout;
+	ctx->max_connections = 0;
+	ctx->max_handshakes = 0;
+	ctx->max_handshakes_per_address = 0;
+	ctx->n_connections = 0;
+	ctx->n_handshakes = 0;
+	ctx->n_queued = 0;
+	ctx->n_deferred = 0;
+	ctx->n_dropped = 0;
 	ctx->accept_watcher.data = ctx;
 
-	ev_io_init(&ctx->accept_watcher, accept_tcp_cb,
-	    (int)BIO_get_fd(ctx->bio, NULL), EV_READ);
+	ev_io_init(&ctx->accept_watcher, accept_tcp_cb, ctx->fd, EV_READ);
+
+	/* Serve established connections before accepting new ones. */
+	ev_set_priority(&ctx->accept_watcher, EV_MINPRI);
 	ev_io_start(EV_DEFAULT_UC_ &ctx->accept_watcher);
 
 	return ctx;
@@ -240,6 +364,7 @@ tls_connect(tls_client_state *ctx,
             int flags,
             void handle_connect(tls_state *),
             void handle_timeout(tls_state *),
+            void handle_error(tls_state *),
             unsigned int set_psk(SSL *,
                                  const char *,
                                  char *,
@@ -248,33 +373,55 @@ tls_connect(tls_client_state *ctx,
                                  unsigned int))
 {
 	tls_state *tls = tls_new(TLS_CLIENT, flags);
-	char *colon;
+	char *host, *port;
+	size_t len;
 
 	tls->data = ctx->data;
 	tls->connect_handler = handle_connect;
 	tls->timeout = timeout;
 	tls->peer = xstrdup(server);
-	if ((colon = strrchr(tls->peer, ':')) != NULL)
-		*colon = '\0'; /* Strip off the port. */
 
 	tls_on_timeout(tls, handle_timeout);
+	tls_on_error(tls, handle_error);
 
-	if ((tls->bio = BIO_new_connect((char *)server)) == NULL)
-		log_tls_message(die, "Cannot create BIO object");
-	(void)BIO_set_nbio(tls->bio, 1);
+	if (server[0] == '/') { /* A local socket. */
+		tls->plain = 1;
+		ev_set_cb(&tls->init_watcher, connect_local_cb);
+		ev_feed_event(EV_DEFAULT_UC_ &tls->init_watcher, EV_CUSTOM);
+		return;
+	}
+	if ((port = strrchr(tls->peer, ':')) != NULL)
+		*port++ = '\0'; /* Strip off the port. */
+
+	/* Accept IPv6 addresses in brackets (e.g., "[2001:db8::1]:5668"). */
+	if (tls->peer[0] == '[' && (len = strlen(tls->peer)) > 1
+	    && tls->peer[len - 1] == ']') {
+		tls->peer[len - 1] = '\0';
+		host = tls->peer + 1;
+	} else
+		host = tls->peer;
 
 	if ((tls->ssl = SSL_new(ctx->ssl)) == NULL)
 		log_tls_message(die, "Cannot create SSL object");
-	SSL_set_bio(tls->ssl, tls->bio, tls->bio);
+	(void)SSL_set_app_data(tls->ssl, tls);
 	SSL_set_psk_client_callback(tls->ssl, set_psk);
 
-	ev_invoke(EV_DEFAULT_UC_ &tls->init_watcher, EV_CUSTOM);
+	tls->connector = connector_start(host, port, handle_tcp_connect,
+	    handle_tcp_error);
+	tls->connector->data = tls;
+
+	if (host != tls->peer) { /* Strip off the brackets. */
+		char *peer = xstrdup(host);
+
+		free(tls->peer);
+		tls->peer = peer;
+	}
 }
 
 void
 tls_read(tls_state *tls, void handle_read(tls_state *, char *), size_t size)
 {
-	if (ev_is_active(&tls->read_watcher))
+	if (tls->read_handler != NULL)
 		die("Internal error: Concurrent read requests issued");
 
 	if (size == READ_LINE) {
@@ -289,9 +436,9 @@ tls_read(tls_state *tls, void handle_read(tls_state *, char *), size_t size)
 	}
 	tls->read_handler = handle_read;
 
-	ev_io_set(&tls->read_watcher, tls->fd, EV_READ);
-	ev_io_start(EV_DEFAULT_UC_ &tls->read_watcher);
-	ev_feed_event(EV_DEFAULT_UC_ &tls->read_watcher, EV_READ);
+	watch(EV_DEFAULT_UC_ &tls->read_watcher, EV_READ);
+	if (has_pending_input(tls))
+		ev_feed_event(EV_DEFAULT_UC_ &tls->read_watcher, EV_READ);
 }
 
 void
@@ -304,18 +451,13 @@ void
 tls_write(tls_state * restrict tls, void * restrict data, size_t size,
           void free_data(void *))
 {
-	if (tls->output == NULL && buffer_size(tls->output_buffer) == 0
+	if (tls->output == NULL && buffered(tls->output_buffer) == 0
 	    && free_data != NULL) {
 		debug("Zero-copying %zu byte(s) for %s", size, tls->peer);
 		tls->output = data;
 		tls->output_size = size;
 		tls->free_output = free_data;
-		if (!ev_is_active(&tls->write_watcher)) {
-			ev_io_set(&tls->write_watcher, tls->fd, EV_WRITE);
-			ev_io_start(EV_DEFAULT_UC_ &tls->write_watcher);
-			ev_feed_event(EV_DEFAULT_UC_ &tls->write_watcher,
-			    EV_WRITE);
-		}
+		schedule_write(tls);
 	} else {
 		write_buffered(tls, data, size);
 		if (free_data != NULL)
@@ -349,6 +491,7 @@ tls_client_stop(tls_client_state *ctx)
 	debug("Stopping TLS client");
 
 	SSL_CTX_free(ctx->ssl);
+	tls_drain_pool();
 	free(ctx);
 }
 
@@ -357,8 +500,21 @@ tls_server_stop(tls_server_state *ctx)
 {
 	debug("Stopping TLS server");
 
+	if (ev_is_active(&ctx->accept_watcher))
+		ev_io_stop(EV_DEFAULT_UC_ &ctx->accept_watcher);
+
+	if (ctx->local_fd != -1) {
+		if (ev_is_active(&ctx->local_watcher))
+			ev_io_stop(EV_DEFAULT_UC_ &ctx->local_watcher);
+		(void)close(ctx->local_fd);
+		if (unlink(ctx->local_path) == -1)
+			warning("Cannot remove %s: %m", ctx->local_path);
+		free(ctx->local_path);
+	}
+
 	SSL_CTX_free(ctx->ssl);
-	BIO_free_all(ctx->bio);
+	(void)close(ctx->fd);
+	tls_drain_pool();
 	free(ctx);
 }
 
@@ -376,7 +532,7 @@ void
 tls_on_drain(tls_state *tls, void handle_drain(tls_state *))
 {
 	tls->drain_handler = handle_drain;
-	if (!ev_is_active(&tls->write_watcher))
+	if (!ev_is_active(&tls->write_watcher) && !tls->corked)
 		tls->drain_handler(tls);
 }
 
@@ -389,17 +545,13 @@ tls_on_error(tls_state *tls, void handle_error(tls_state *))
 void
 tls_on_timeout(tls_state *tls, void handle_timeout(tls_state *))
 {
-	if (ev_is_active(&tls->timeout_watcher))
-		ev_timer_stop(EV_DEFAULT_UC_ &tls->timeout_watcher);
-
 	tls->timeout_handler = handle_timeout != NULL ?
 	    handle_timeout : default_timeout_handler;
 
-	if (tls->timeout > 0.0) {
-		ev_timer_set(&tls->timeout_watcher, tls->timeout, 0.0);
-		ev_timer_start(EV_DEFAULT_UC_ &tls->timeout_watcher);
-		tls->last_activity = ev_now(EV_DEFAULT_UC);
-	}
+	if (tls->timeout_list != NULL)
+		touch(tls);
+	else if (tls->timeout > 0.0)
+		start_timeout(tls);
 }
 
 void
@@ -408,6 +560,89 @@ tls_on_line_too_long(tls_state *tls, void handle_line_too_long(tls_state *))
 	tls->line_too_long_handler = handle_line_too_long;
 }
 
+void
+tls_on_accept(tls_server_state *ctx,
+              bool handle_accept(const struct sockaddr *))
+{
+	ctx->accept_handler = handle_accept;
+}
+
+/*
+ * Additionally accept plaintext connections on a local socket.  The `identify'
+ * function maps the client's user ID to a client identity, or returns NULL if
+ * the user isn't authorized.
+ */
+void
+tls_server_listen_local(tls_server_state * restrict ctx,
+                        const char * restrict path,
+                        int backlog,
+                        const char *identify(uid_t))
+{
+	ctx->local_fd = listen_on_local(path, backlog);
+	ctx->local_path = xstrdup(path);
+	ctx->identify_handler = identify;
+	ctx->local_watcher.data = ctx;
+	debug("Listening on %s", path);
+
+	ev_io_init(&ctx->local_watcher, accept_local_cb, ctx->local_fd,
+	    EV_READ);
+	ev_set_priority(&ctx->local_watcher, EV_MINPRI);
+	ev_io_start(EV_DEFAULT_UC_ &ctx->local_watcher);
+}
+
+void
+tls_set_admission_limits(tls_server_state *ctx, size_t max_connections,
+                         size_t max_handshakes,
+                         size_t max_handshakes_per_address)
+{
+	ctx->max_connections = max_connections;
+	ctx->max_handshakes = max_handshakes;
+	ctx->max_handshakes_per_address = max_handshakes_per_address;
+}
+
+void
+tls_get_admission_stats(tls_server_state * restrict ctx,
+                        size_t * restrict connections,
+                        size_t * restrict handshakes,
+                        size_t * restrict queued,
+                        unsigned long * restrict deferred,
+                        unsigned long * restrict dropped)
+{
+	*connections = ctx->n_connections;
+	*handshakes = ctx->n_handshakes;
+	*queued = ctx->n_queued;
+	*deferred = ctx->n_deferred;
+	*dropped = ctx->n_dropped;
+}
+
+size_t
+tls_memory_usage(tls_state *tls)
+{
+	size_t size = sizeof(tls_state);
+
+	if (tls->input_buffer != NULL)
+		size += buffer_memory(tls->input_buffer);
+	if (tls->output_buffer != NULL)
+		size += buffer_memory(tls->output_buffer);
+	if (tls->input != NULL)
+		size += tls->input_size;
+	if (tls->output != NULL)
+		size += tls->output_size;
+	if (tls->id != NULL)
+		size += strlen(tls->id) + 1;
+	if (tls->peer != NULL)
+		size += strlen(tls->peer) + 1;
+
+	return size;
+}
+
+void
+tls_get_stats(size_t * restrict active, size_t * restrict pooled)
+{
+	*active = n_active;
+	*pooled = n_pooled;
+}
+
 /*
  * Static functions.
  */
@@ -440,20 +675,174 @@ initialize_openssl(const SSL_METHOD *method, const char *ciphers)
 		die("Cannot set SSL cipher(s)");
 	(void)SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
 	(void)SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
+#ifdef SSL_MODE_RELEASE_BUFFERS
+	(void)SSL_CTX_set_mode(ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
+#endif
 
 	(void)signal(SIGPIPE, SIG_IGN);
 
 	return ssl_ctx;
 }
 
+static int
+listen_on(const char *host_port, int backlog)
+{
+	struct addrinfo hints, *addresses, *ai;
+	char *host = xstrdup(host_port), *port;
+	size_t len;
+	int fd = -1, pass, result, saved_errno = 0;
+	bool wildcard;
+
+	if ((port = strrchr(host, ':')) == NULL)
+		die("No port specified in %s", host_port);
+	*port++ = '\0';
+	if (host[0] == '[' && (len = strlen(host)) > 1 && host[len - 1] == ']') {
+		host[len - 1] = '\0';
+		(void)memmove(host, host + 1, len - 1);
+	}
+	wildcard = host[0] == '\0' || strcmp(host, "*") == 0;
+
+	(void)memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	if ((result = getaddrinfo(wildcard ? NULL : host, port, &hints,
+	    &addresses)) != 0)
+		die("Cannot resolve %s: %s", host_port, gai_strerror(result));
+
+	/*
+	 * For the wildcard address, we first try to create an IPv6 socket which
+	 * accepts IPv4 connections as well.
+	 */
+	for (pass = wildcard ? 0 : 1; pass < 2 && fd == -1; pass++)
+		for (ai = addresses; ai != NULL && fd == -1; ai = ai->ai_next) {
+			int on = 1;
+
+#ifdef AF_INET6
+			if (pass == 0 && ai->ai_family != AF_INET6)
+				continue;
+#endif
+			if ((fd = socket(ai->ai_family, ai->ai_socktype,
+			    ai->ai_protocol)) == -1) {
+				saved_errno = errno;
+				continue;
+			}
+			(void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on,
+			    sizeof(on));
+#if defined(AF_INET6) && defined(IPV6_V6ONLY)
+			if (pass == 0) {
+				int off = 0;
+
+				(void)setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+				    &off, sizeof(off));
+			}
+#endif
+			if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1
+			    || listen(fd, backlog) == -1
+			    || !set_nonblocking(fd)) {
+				saved_errno = errno;
+				(void)close(fd);
+				fd = -1;
+			}
+		}
+
+	freeaddrinfo(addresses);
+	free(host);
+
+	if (fd == -1) {
+		errno = saved_errno;
+		die("Cannot bind to %s: %m", host_port);
+	}
+	return fd;
+}
+
+static int
+listen_on_local(const char *path, int backlog)
+{
+	struct sockaddr_un sa;
+	struct stat sb;
+	int fd;
+
+#if !HAVE_GETPEEREID && !defined(SO_PEERCRED)
+	die("Cannot listen on %s: Peer credentials not supported", path);
+#endif
+	if (strlen(path) >= sizeof(sa.sun_path))
+		die("Cannot bind to %s: Path name too long", path);
+
+	(void)memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	(void)strcpy(sa.sun_path, path);
+
+	/* Remove a socket left behind by a previous instance. */
+	if (lstat(path, &sb) == 0 && S_ISSOCK(sb.st_mode) && unlink(path) == -1)
+		die("Cannot remove %s: %m", path);
+
+	/*
+	 * Clients are authorized by their user ID, so everyone may connect to
+	 * the socket.
+	 */
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1
+	    || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1
+	    || chmod(path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH
+	    | S_IWOTH) == -1
+	    || listen(fd, backlog) == -1
+	    || !set_nonblocking(fd))
+		die("Cannot bind to %s: %m", path);
+
+	return fd;
+}
+
+static int
+accept_connection(int listener, struct sockaddr *sa, socklen_t *len)
+{
+	int fd;
+
+#if HAVE_ACCEPT4
+	fd = accept4(listener, sa, len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	if ((fd = accept(listener, sa, len)) != -1 && !set_nonblocking(fd)) {
+		int saved_errno = errno;
+
+		(void)close(fd);
+		errno = saved_errno;
+		fd = -1;
+	}
+#endif
+	return fd;
+}
+
+static bool
+set_nonblocking(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) == -1
+	    || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1
+	    || fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+		return false;
+
+	return true;
+}
+
 static tls_state *
 tls_new(int type, int flags)
 {
-	tls_state *tls = xmalloc(sizeof(tls_state));
+	tls_state *tls;
 
-	debug("Initializing connection context");
+	if (pool != NULL) {
+		debug("Reusing pooled connection context");
+		tls = pool;
+		pool = pool->next;
+		n_pooled--;
+	} else {
+		debug("Initializing connection context");
+		tls = xmalloc(sizeof(tls_state));
+	}
+	n_active++;
 
 	tls->data = NULL;
+	tls->connector = NULL;
 	tls->id = NULL;
 	tls->addr = NULL;
 	tls->peer = NULL;
@@ -461,11 +850,15 @@ tls_new(int type, int flags)
 	tls->read_watcher.data = tls;
 	tls->write_watcher.data = tls;
 	tls->shutdown_watcher.data = tls;
-	tls->timeout_watcher.data = tls;
+	tls->timeout_list = NULL;
+	tls->timeout_prev = NULL;
+	tls->timeout_next = NULL;
+	tls->cork_prev = NULL;
+	tls->cork_next = NULL;
 	tls->timeout = 0.0;
 	tls->last_activity = ev_now(EV_DEFAULT_UC);
-	tls->input_buffer = buffer_new();
-	tls->output_buffer = buffer_new();
+	tls->input_buffer = NULL;
+	tls->output_buffer = NULL;
 	tls->input = NULL;
 	tls->output = NULL;
 	tls->input_size = 0;
@@ -481,8 +874,15 @@ tls_new(int type, int flags)
 	tls->free_output = free;
 	tls->ssl = NULL;
 	tls->bio = NULL;
+	tls->next = NULL;
+	tls->prev = NULL;
+	tls->server = NULL;
 	tls->fd = -1;
 	tls->read_mode = 0;
+	tls->handshaking = 0;
+	tls->queued = 0;
+	tls->corked = 0;
+	tls->plain = 0;
 
 	if (flags & TLS_AUTO_DIE) {
 		warning_f = die;
@@ -497,10 +897,6 @@ tls_new(int type, int flags)
 	ev_init(&tls->read_watcher, read_cb);
 	ev_init(&tls->write_watcher, write_cb);
 	ev_init(&tls->shutdown_watcher, shutdown_cb);
-	ev_init(&tls->timeout_watcher, timeout_cb);
-
-	/* Check for data before checking for timeout. */
-	ev_set_priority(&tls->timeout_watcher, -1);
 
 	return tls;
 }
@@ -518,26 +914,152 @@ tls_free(tls_state *tls)
 		ev_io_stop(EV_DEFAULT_UC_ &tls->write_watcher);
 	if (ev_is_active(&tls->shutdown_watcher))
 		ev_io_stop(EV_DEFAULT_UC_ &tls->shutdown_watcher);
-	if (ev_is_active(&tls->timeout_watcher))
-		ev_timer_stop(EV_DEFAULT_UC_ &tls->timeout_watcher);
+	if (tls->timeout_list != NULL)
+		stop_timeout(tls);
+	if (tls->corked)
+		uncork(tls);
 
-	buffer_free(tls->input_buffer);
-	buffer_free(tls->output_buffer);
+	release_buffer(&tls->input_buffer);
+	release_buffer(&tls->output_buffer);
 
+	if (tls->connector != NULL)
+		connector_stop(tls->connector);
 	if (tls->input != NULL)
 		free(tls->input);
 	if (tls->output != NULL)
-		free(tls->output);
-	if (tls->addr != NULL)
-		free(tls->addr);
+		tls->free_output(tls->output);
 	if (tls->id != NULL)
 		free(tls->id);
 	if (tls->peer != NULL)
 		free(tls->peer);
 	if (tls->ssl != NULL)
 		SSL_free(tls->ssl);
+	else if (tls->plain && tls->fd != -1)
+		(void)close(tls->fd);
+	if (tls->server != NULL)
+		forget_server_connection(tls);
+
+	n_active--;
+	if (n_pooled < TLS_POOL_SIZE) {
+		tls->next = pool;
+		pool = tls;
+		n_pooled++;
+	} else
+		free(tls);
+}
+
+static void
+tls_drain_pool(void)
+{
+	while (pool != NULL) {
+		tls_state *next = pool->next;
+
+		free(pool);
+		pool = next;
+	}
+	n_pooled = 0;
+}
+
+static size_t
+buffered(buffer *buf)
+{
+	return buf != NULL ? buffer_size(buf) : 0;
+}
+
+static void
+release_buffer(buffer **buf)
+{
+	if (*buf != NULL) {
+		buffer_free(*buf);
+		*buf = NULL;
+	}
+}
+
+/*
+ * Bind the watchers to the socket.  Later on, only their events are modified,
+ * so libev doesn't have to re-register the socket with the kernel.
+ */
+static void
+attach_socket(tls_state *tls, int fd)
+{
+	tls->fd = fd;
+	ev_io_set(&tls->init_watcher, fd, EV_READ);
+	ev_io_set(&tls->read_watcher, fd, EV_READ);
+	ev_io_set(&tls->write_watcher, fd, EV_WRITE);
+	ev_io_set(&tls->shutdown_watcher, fd, EV_WRITE);
+}
+
+/*
+ * Start the watcher for the given events, unless it's already doing just that.
+ */
+static void
+watch(EV_P_ ev_io *w, int events)
+{
+	if ((w->events & (EV_READ | EV_WRITE)) == events) {
+		if (!ev_is_active(w))
+			ev_io_start(EV_A_ w);
+		return;
+	}
+	if (ev_is_active(w))
+		ev_io_stop(EV_A_ w);
+	ev_io_modify(w, events);
+	ev_io_start(EV_A_ w);
+}
 
-	free(tls);
+/*
+ * Check whether SSL_read() might succeed without reading from the socket.
+ */
+static bool
+has_pending_input(tls_state *tls)
+{
+	if (buffered(tls->input_buffer) > 0)
+		return true;
+	if (tls->plain)
+		return false;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	return SSL_has_pending(tls->ssl) == 1;
+#else
+	return true; /* We can't tell. */
+#endif
+}
+
+static void
+handle_tcp_connect(connector_state *conn, int fd)
+{
+	tls_state *tls = conn->data;
+
+	debug("TCP connection to %s established", tls->peer);
+
+	connector_stop(conn);
+	tls->connector = NULL;
+	touch(tls);
+	attach_socket(tls, fd);
+
+	if ((tls->bio = BIO_new_socket(fd, BIO_CLOSE)) == NULL) {
+		log_tls_message(error_f, "Cannot create BIO object");
+		(void)close(fd);
+		if (tls->error_handler != NULL)
+			tls->error_handler(tls);
+		tls_free(tls);
+		return;
+	}
+	(void)BIO_set_nbio(tls->bio, 1);
+	SSL_set_bio(tls->ssl, tls->bio, tls->bio);
+
+	ev_invoke(EV_DEFAULT_UC_ &tls->init_watcher, EV_CUSTOM);
+}
+
+static void
+handle_tcp_error(connector_state * restrict conn, const char * restrict reason)
+{
+	tls_state *tls = conn->data;
+
+	error_f("Cannot connect to %s: %s", tls->peer, reason);
+
+	if (tls->error_handler != NULL)
+		tls->error_handler(tls);
+
+	tls_free(tls); /* This also destroys the connector. */
 }
 
 static void
@@ -546,23 +1068,17 @@ connect_cb(EV_P_ ev_io *w, int revents)
 	tls_state *tls = w->data;
 	int result;
 
-	tls->last_activity = ev_now(EV_A);
-	result = SSL_connect(tls->ssl);
-
 	/*
-	 * Initially, connect_cb() is called by ev_invoke() from tls_connect()
-	 * with `revents' set to EV_CUSTOM.  The above SSL_connect() call then
-	 * creates the socket descriptor (`tls->fd') we can watch.
+	 * Initially, connect_cb() is called by ev_invoke() from
+	 * handle_tcp_connect() with `revents' set to EV_CUSTOM.
 	 */
-	if (revents & EV_CUSTOM
-	    && (tls->fd = (int)BIO_get_fd(tls->bio, NULL)) == -1)
-		log_tls_message(die, "Cannot create socket");
+	touch(tls);
+	result = SSL_connect(tls->ssl);
 
 	if (result <= 0) {
 		debug("TLS connection not (yet) established");
 		if (revents & EV_CUSTOM) {
-			ev_io_set(w, tls->fd, EV_WRITE);
-			ev_io_start(EV_A_ &tls->init_watcher);
+			watch(EV_A_ &tls->init_watcher, EV_WRITE);
 			ev_feed_event(EV_A_ &tls->init_watcher, EV_WRITE);
 		}
 		check_tls_error(EV_A_ w, result);
@@ -574,34 +1090,103 @@ connect_cb(EV_P_ ev_io *w, int revents)
 	}
 }
 
+static void
+connect_local_cb(EV_P_ ev_io *w, int revents __attribute__((__unused__)))
+{
+	tls_state *tls = w->data;
+	struct sockaddr_un sa;
+	int fd;
+
+	(void)memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	(void)strncpy(sa.sun_path, tls->peer, sizeof(sa.sun_path) - 1);
+
+	if (strlen(tls->peer) >= sizeof(sa.sun_path))
+		errno = ENAMETOOLONG;
+	else if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) != -1) {
+		if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0
+		    && set_nonblocking(fd)) {
+			debug("Connection to %s established", tls->peer);
+			touch(tls);
+			attach_socket(tls, fd);
+			tls->connect_handler(tls);
+			return;
+		}
+		(void)close(fd);
+	}
+	error_f("Cannot connect to %s: %m", tls->peer);
+
+	if (tls->error_handler != NULL)
+		tls->error_handler(tls);
+
+	tls_free(tls);
+}
+
 static void
 accept_tcp_cb(EV_P_ ev_io *w, int revents __attribute__((__unused__)))
 {
 	tls_server_state *ctx = w->data;
+	int i;
 
-	while (1) { /* Accept all available TCP connections. */
+	/*
+	 * Accept a bounded number of TCP connections per loop iteration, so
+	 * that a reconnect storm doesn't starve the established sessions.  If
+	 * more connections are pending, we'll be called again.
+	 */
+	for (i = 0; i < ACCEPT_BATCH_SIZE; i++) {
+		struct sockaddr_storage sa_storage;
+		struct sockaddr *sa = (struct sockaddr *)&sa_storage;
+		socklen_t len = sizeof(struct sockaddr_storage);
 		tls_state *tls;
+		int fd;
+
+		if (ctx->max_connections > 0
+		    && ctx->n_connections >= ctx->max_connections) {
+			/*
+			 * Leave further connections in the listen queue until
+			 * forget_server_connection() restarts the watcher.
+			 */
+			debug("Limit of %zu connections reached",
+			    ctx->max_connections);
+			ev_io_stop(EV_A_ w);
+			return;
+		}
+		if ((fd = accept_connection(ctx->fd, sa, &len)) == -1)
+			switch (errno) {
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+			case EWOULDBLOCK: /* FALLTHROUGH */
+#endif
+			case EAGAIN:
+				return; /* Let's do something else. */
+			case EINTR: /* FALLTHROUGH */
+			case ECONNABORTED:
+				continue;
+			default:
+				warning("Cannot accept connection: %m");
+				return; /* Let's do something else. */
+			}
 
-		if (BIO_do_accept(ctx->bio) <= 0) {
-			if (BIO_should_retry(ctx->bio))
-				debug("Cannot accept connection right now");
-			else
-				log_tls_message(warning,
-				    "Cannot accept connection");
-			return; /* Let's do something else. */
+		/* Drop unwanted connections before doing any crypto. */
+		if (ctx->accept_handler != NULL && !ctx->accept_handler(sa)) {
+			char addr[INET6_ADDRSTRLEN];
+
+			if (format_address(sa, addr, sizeof(addr)))
+				info("Rejecting connection from %s", addr);
+			(void)close(fd);
+			continue;
 		}
 
 		tls = tls_new(TLS_SERVER, TLS_NO_AUTO_DIE);
-		tls->bio = BIO_pop(ctx->bio);
-		tls->fd = (int)BIO_get_fd(tls->bio, NULL);
-		tls->addr = xmalloc(INET6_ADDRSTRLEN);
+		attach_socket(tls, fd);
+		tls->addr = tls->addr_buffer;
 		tls->connect_handler = ctx->connect_handler;
 		tls->timeout = ctx->timeout;
 		tls->data = ctx->data;
 
-		if (!get_peer_address(tls->fd, tls->addr, INET6_ADDRSTRLEN)) {
+		if (!format_address(sa, tls->addr, sizeof(tls->addr_buffer))) {
+			(void)close(fd);
 			tls_free(tls);
-			return; /* Let's do something else. */
+			continue;
 		}
 
 		tls_on_timeout(tls, default_timeout_handler);
@@ -609,26 +1194,270 @@ accept_tcp_cb(EV_P_ ev_io *w, int revents __attribute__((__unused__)))
 		if ((tls->ssl = SSL_new(ctx->ssl)) == NULL) {
 			log_tls_message(error,
 			    "Cannot create SSL object for %s", tls->addr);
+			(void)close(fd);
 			tls_free(tls);
-			return; /* Let's do something else. */
+			continue;
+		}
+		if ((tls->bio = BIO_new_socket(fd, BIO_CLOSE)) == NULL) {
+			log_tls_message(error,
+			    "Cannot create BIO object for %s", tls->addr);
+			(void)close(fd);
+			tls_free(tls);
+			continue;
 		}
 		SSL_set_bio(tls->ssl, tls->bio, tls->bio);
 
-		ev_io_set(&tls->init_watcher, tls->fd, EV_READ);
-		ev_io_start(EV_A_ &tls->init_watcher);
-		ev_feed_event(EV_A_ &tls->init_watcher, EV_READ);
+		tls->server = ctx;
+		ctx->n_connections++;
 
 		debug("Accepted connection from %s", tls->addr);
+		admit_connection(ctx, tls);
+	}
+}
+
+/*
+ * Local clients are authenticated by the kernel, so they don't perform a TLS
+ * handshake, and the data is exchanged in plaintext.
+ */
+static void
+accept_local_cb(EV_P_ ev_io *w, int revents __attribute__((__unused__)))
+{
+	tls_server_state *ctx = w->data;
+	size_t i;
+
+	for (i = 0; i < ACCEPT_BATCH_SIZE; i++) {
+		tls_state *tls;
+		const char *identity;
+		uid_t uid;
+		int fd;
+
+		if (ctx->max_connections > 0
+		    && ctx->n_connections >= ctx->max_connections) {
+			debug("Limit of %zu connections reached",
+			    ctx->max_connections);
+			ev_io_stop(EV_A_ w);
+			return;
+		}
+		if ((fd = accept_connection(ctx->local_fd, NULL, NULL)) == -1)
+			switch (errno) {
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+			case EWOULDBLOCK: /* FALLTHROUGH */
+#endif
+			case EAGAIN:
+				return; /* Let's do something else. */
+			case EINTR: /* FALLTHROUGH */
+			case ECONNABORTED:
+				continue;
+			default:
+				warning("Cannot accept local connection: %m");
+				return; /* Let's do something else. */
+			}
+
+		if (!get_peer_uid(fd, &uid)) {
+			warning("Cannot get credentials of local client: %m");
+			(void)close(fd);
+			continue;
+		}
+		if ((identity = ctx->identify_handler(uid)) == NULL) {
+			(void)close(fd);
+			continue;
+		}
+
+		tls = tls_new(TLS_SERVER, TLS_NO_AUTO_DIE);
+		attach_socket(tls, fd);
+		tls->plain = 1;
+		tls->addr = tls->addr_buffer;
+		(void)snprintf(tls->addr, sizeof(tls->addr_buffer), "uid=%lu",
+		    (unsigned long)uid);
+		tls->id = xstrdup(identity);
+		xasprintf(&tls->peer, "%s@%s", tls->id, tls->addr);
+		tls->connect_handler = ctx->connect_handler;
+		tls->timeout = ctx->timeout;
+		tls->data = ctx->data;
+		tls->server = ctx;
+		ctx->n_connections++;
+
+		tls_on_timeout(tls, default_timeout_handler);
+
+		debug("Accepted local connection from %s", tls->peer);
+		tls->connect_handler(tls);
 	}
 }
 
+static bool
+get_peer_uid(int fd, uid_t *uid)
+{
+#if HAVE_GETPEEREID
+	gid_t gid;
+
+	return getpeereid(fd, uid, &gid) == 0;
+#elif defined(SO_PEERCRED)
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+		return false;
+	*uid = cred.uid;
+	return true;
+#else
+	(void)fd;
+	(void)uid;
+	errno = ENOSYS;
+	return false;
+#endif
+}
+
+/*
+ * Start the TLS handshake with a new client, or defer it if too many handshakes
+ * are in progress.  Deferred handshakes are started in the order the
+ * connections were accepted.
+ */
+static void
+admit_connection(tls_server_state * restrict ctx, tls_state * restrict tls)
+{
+	if (ctx->max_handshakes_per_address > 0
+	    && !count_source(tls->addr, 1, ctx->max_handshakes_per_address)) {
+		info("Too many pending handshakes with %s, dropping connection",
+		    tls->addr);
+		ctx->n_dropped++;
+		tls_free(tls);
+	} else if (ctx->max_handshakes > 0
+	    && ctx->n_handshakes >= ctx->max_handshakes) {
+		debug("Deferring handshake with %s", tls->addr);
+		tls->queued = 1;
+		tls->prev = ctx->last_queued;
+		tls->next = NULL;
+		if (ctx->last_queued != NULL)
+			ctx->last_queued->next = tls;
+		else
+			ctx->first_queued = tls;
+		ctx->last_queued = tls;
+		ctx->n_queued++;
+		ctx->n_deferred++;
+	} else
+		start_handshake(tls);
+}
+
+static void
+start_handshake(tls_state *tls)
+{
+	tls->handshaking = 1;
+	tls->server->n_handshakes++;
+
+	/* Let established connections take precedence. */
+	ev_set_priority(&tls->init_watcher, -1);
+	watch(EV_DEFAULT_UC_ &tls->init_watcher, EV_READ);
+	ev_feed_event(EV_DEFAULT_UC_ &tls->init_watcher, EV_READ);
+}
+
+/*
+ * Stop accounting the connection as pending, and admit deferred connections if
+ * possible.
+ */
+static void
+finish_handshake(tls_state *tls)
+{
+	tls_server_state *ctx = tls->server;
+
+	if (tls->queued) {
+		if (tls->prev != NULL)
+			tls->prev->next = tls->next;
+		else
+			ctx->first_queued = tls->next;
+		if (tls->next != NULL)
+			tls->next->prev = tls->prev;
+		else
+			ctx->last_queued = tls->prev;
+		tls->next = tls->prev = NULL;
+		tls->queued = 0;
+		ctx->n_queued--;
+	} else if (tls->handshaking) {
+		tls->handshaking = 0;
+		ctx->n_handshakes--;
+	} else
+		return;
+
+	if (ctx->max_handshakes_per_address > 0)
+		(void)count_source(tls->addr, -1, 0);
+
+	while (ctx->first_queued != NULL && (ctx->max_handshakes == 0
+	    || ctx->n_handshakes < ctx->max_handshakes)) {
+		tls_state *next = ctx->first_queued;
+
+		if ((ctx->first_queued = next->next) != NULL)
+			ctx->first_queued->prev = NULL;
+		else
+			ctx->last_queued = NULL;
+		next->next = next->prev = NULL;
+		next->queued = 0;
+		ctx->n_queued--;
+
+		debug("Admitting deferred connection from %s", next->addr);
+		start_handshake(next);
+	}
+}
+
+static void
+forget_server_connection(tls_state *tls)
+{
+	tls_server_state *ctx = tls->server;
+
+	if (tls->queued || tls->handshaking) {
+		if (tls->queued) /* The connection timed out while queued. */
+			ctx->n_dropped++;
+		finish_handshake(tls);
+	}
+	tls->server = NULL;
+	ctx->n_connections--;
+
+	if (!ev_is_active(&ctx->accept_watcher)) {
+		debug("Accepting connections again");
+		ev_io_start(EV_DEFAULT_UC_ &ctx->accept_watcher);
+	}
+	if (ctx->local_fd != -1 && !ev_is_active(&ctx->local_watcher))
+		ev_io_start(EV_DEFAULT_UC_ &ctx->local_watcher);
+}
+
+/*
+ * Adjust the number of pending connections from the given address.  Returns
+ * false (without incrementing the number) if that would exceed the `limit'.
+ */
+static bool
+count_source(const char *addr, int delta, size_t limit)
+{
+	source **p = &sources[hash_string(addr) % SOURCE_HASH_SIZE];
+	source *s;
+
+	while (*p != NULL && strcmp((*p)->addr, addr) != 0)
+		p = &(*p)->next;
+
+	if ((s = *p) == NULL) {
+		if (delta < 0) /* Shouldn't happen. */
+			return true;
+		s = xmalloc(sizeof(source));
+		(void)strcpy(s->addr, addr);
+		s->n_pending = 0;
+		s->next = NULL;
+		*p = s;
+	}
+	if (delta > 0) {
+		if (s->n_pending >= limit)
+			return false;
+		s->n_pending++;
+	} else if (--s->n_pending == 0) {
+		*p = s->next;
+		free(s);
+	}
+	return true;
+}
+
 static void
 accept_ssl_cb(EV_P_ ev_io *w, int revents __attribute__((__unused__)))
 {
 	tls_state *tls = w->data;
 	int result;
 
-	tls->last_activity = ev_now(EV_A);
+	touch(tls);
 
 	if ((result = SSL_accept(tls->ssl)) <= 0) {
 		debug("TLS handshake with %s not (yet) successful", tls->addr);
@@ -641,6 +1470,8 @@ accept_ssl_cb(EV_P_ ev_io *w, int revents __attribute__((__unused__)))
 			xasprintf(&tls->peer, "%s@%s", tls->id, tls->addr);
 			debug("TLS handshake with %s successful", tls->peer);
 			ev_io_stop(EV_A_ w);
+			if (tls->server != NULL)
+				finish_handshake(tls);
 			tls->connect_handler(tls);
 		}
 	}
@@ -650,16 +1481,26 @@ static void
 read_cb(EV_P_ ev_io *w, int revents __attribute__((__unused__)))
 {
 	tls_state *tls = w->data;
+	void (*handle_read)(tls_state * restrict, char * restrict);
 	char *data;
 
+	if (tls->read_handler == NULL) { /* No read request is pending. */
+		ev_io_stop(EV_A_ w);
+		return;
+	}
 	reset_watcher_state(EV_A_ &tls->write_watcher);
-	tls->last_activity = ev_now(EV_A);
+	touch(tls);
 
 	data = tls->read_mode == READ_LINE ? read_line(tls) : read_bytes(tls);
 
+	/*
+	 * The watcher is kept running, as the handler will usually issue the
+	 * next read request right away.
+	 */
 	if (data != NULL) {
-		ev_io_stop(EV_A_ w);
-		tls->read_handler(tls, data);
+		handle_read = tls->read_handler;
+		tls->read_handler = NULL;
+		handle_read(tls, data);
 	}
 }
 
@@ -670,7 +1511,7 @@ write_cb(EV_P_ ev_io *w, int revents __attribute__((__unused__)))
 	int n;
 
 	reset_watcher_state(EV_A_ &tls->read_watcher);
-	tls->last_activity = ev_now(EV_A);
+	touch(tls);
 
 	do {
 		int n_todo;
@@ -679,12 +1520,13 @@ write_cb(EV_P_ ev_io *w, int revents __attribute__((__unused__)))
 			tls->output = buffer_slurp(tls->output_buffer,
 			    &tls->output_size);
 			tls->free_output = free;
+			release_buffer(&tls->output_buffer);
 		}
 		do {
 			n_todo = (int)(tls->output_size
 			    - tls->output_offset);
 
-			if ((n = SSL_write(tls->ssl,
+			if ((n = transmit(tls,
 			    tls->output + tls->output_offset, n_todo)) <= 0) {
 				debug("Sent 0 of %d bytes to %s",
 				    n_todo, tls->peer);
@@ -700,14 +1542,14 @@ write_cb(EV_P_ ev_io *w, int revents __attribute__((__unused__)))
 				tls->output = NULL;
 				tls->output_size = 0;
 				tls->output_offset = 0;
-				if (buffer_size(tls->output_buffer) == 0) {
+				if (buffered(tls->output_buffer) == 0) {
 					ev_io_stop(EV_A_ w);
 					if (tls->drain_handler != NULL)
 						tls->drain_handler(tls);
 				}
 			}
 		} while (n > 0 && n < n_todo);
-	} while (n > 0 && buffer_size(tls->output_buffer) > 0);
+	} while (n > 0 && buffered(tls->output_buffer) > 0);
 }
 
 static void
@@ -716,8 +1558,12 @@ shutdown_cb(EV_P_ ev_io *w, int revents __attribute__((__unused__)))
 	tls_state *tls = w->data;
 	int result;
 
-	tls->last_activity = ev_now(EV_A);
+	touch(tls);
 
+	if (tls->plain) { /* There's no TLS session to close. */
+		tls_free(tls);
+		return;
+	}
 	do {
 		switch (result = SSL_shutdown(tls->ssl)) {
 		case 1: /* We sent and received peer's `close notify'. */
@@ -735,18 +1581,146 @@ shutdown_cb(EV_P_ ev_io *w, int revents __attribute__((__unused__)))
 	} while (result == 0);
 }
 
+static int
+receive(tls_state * restrict tls, void * restrict data, int size)
+{
+	ssize_t n;
+
+	if (!tls->plain)
+		return SSL_read(tls->ssl, data, size);
+	if ((n = read(tls->fd, data, (size_t)size)) == 0)
+		errno = 0; /* EOF. */
+	return (int)n;
+}
+
+static int
+transmit(tls_state * restrict tls, const void * restrict data, int size)
+{
+	if (!tls->plain)
+		return SSL_write(tls->ssl, data, size);
+	return (int)write(tls->fd, data, (size_t)size);
+}
+
+static void
+start_timeout(tls_state *tls)
+{
+	timeout_list *list;
+
+	for (list = timeout_lists; list != NULL; list = list->next)
+		if (list->timeout == tls->timeout)
+			break;
+
+	if (list == NULL) {
+		list = xmalloc(sizeof(timeout_list));
+		list->first = list->last = NULL;
+		list->timeout = tls->timeout;
+		list->watcher.data = list;
+		ev_init(&list->watcher, timeout_cb);
+
+		/* Check for data before checking for timeout. */
+		ev_set_priority(&list->watcher, -1);
+
+		list->next = timeout_lists;
+		timeout_lists = list;
+	}
+	tls->timeout_list = list;
+	tls->timeout_prev = list->last;
+	tls->timeout_next = NULL;
+	tls->last_activity = ev_now(EV_DEFAULT_UC);
+
+	if (list->last != NULL)
+		list->last->timeout_next = tls;
+	else
+		list->first = tls;
+	list->last = tls;
+
+	if (!ev_is_active(&list->watcher))
+		schedule_timeout(list);
+}
+
+static void
+stop_timeout(tls_state *tls)
+{
+	timeout_list *list = tls->timeout_list;
+
+	if (tls->timeout_prev != NULL)
+		tls->timeout_prev->timeout_next = tls->timeout_next;
+	else
+		list->first = tls->timeout_next;
+	if (tls->timeout_next != NULL)
+		tls->timeout_next->timeout_prev = tls->timeout_prev;
+	else
+		list->last = tls->timeout_prev;
+
+	tls->timeout_list = NULL;
+	tls->timeout_prev = tls->timeout_next = NULL;
+
+	/* Don't keep the event loop alive without connections. */
+	if (list->first == NULL && ev_is_active(&list->watcher))
+		ev_timer_stop(EV_DEFAULT_UC_ &list->watcher);
+}
+
+/*
+ * Record activity on the connection.
+ */
+static void
+touch(tls_state *tls)
+{
+	timeout_list *list = tls->timeout_list;
+
+	tls->last_activity = ev_now(EV_DEFAULT_UC);
+
+	if (list != NULL && list->last != tls) {
+		if (tls->timeout_prev != NULL)
+			tls->timeout_prev->timeout_next = tls->timeout_next;
+		else
+			list->first = tls->timeout_next;
+		tls->timeout_next->timeout_prev = tls->timeout_prev;
+
+		tls->timeout_prev = list->last;
+		tls->timeout_next = NULL;
+		list->last->timeout_next = tls;
+		list->last = tls;
+	}
+}
+
+static void
+schedule_timeout(timeout_list *list)
+{
+	ev_tstamp after = list->first->last_activity + list->timeout
+	    - ev_now(EV_DEFAULT_UC);
+
+	ev_timer_set(&list->watcher, after > 0.0 ? after : 0.0, 0.0);
+	ev_timer_start(EV_DEFAULT_UC_ &list->watcher);
+}
+
 static void
 timeout_cb(EV_P_ ev_timer *w, int revents __attribute__((__unused__)))
 {
-	tls_state *tls = w->data;
-	ev_tstamp diff = tls->last_activity + tls->timeout - ev_now(EV_A);
+	timeout_list *list = w->data;
+	ev_tstamp now = ev_now(EV_A);
+
+	/*
+	 * The expire() function moves the connection to the tail of the list or
+	 * removes it, so this loop terminates.
+	 */
+	while (list->first != NULL
+	    && list->first->last_activity + list->timeout <= now)
+		expire(list->first);
 
-	if (diff > 0.0) {
-		debug("Resetting timeout watcher for %s, %.2f seconds left",
-		    tls->peer, (double)diff);
+	if (list->first != NULL && !ev_is_active(w))
+		schedule_timeout(list);
+}
 
-		ev_timer_set(w, diff, 0.0);
-		ev_timer_start(EV_A_ w);
+static void
+expire(tls_state *tls)
+{
+	if (tls->connector != NULL) { /* No TCP connection, yet. */
+		error_f("Cannot connect to %s: Connection timed out",
+		    tls->peer);
+		if (tls->error_handler != NULL)
+			tls->error_handler(tls);
+		tls_free(tls);
 	} else {
 		warning_f("Connection to %s timed out",
 		    tls->peer != NULL ? tls->peer : tls->addr);
@@ -759,10 +1733,11 @@ timeout_cb(EV_P_ ev_timer *w, int revents __attribute__((__unused__)))
 			ev_io_stop(EV_DEFAULT_UC_ &tls->write_watcher);
 		if (ev_is_active(&tls->shutdown_watcher))
 			ev_io_stop(EV_DEFAULT_UC_ &tls->shutdown_watcher);
+		if (tls->corked)
+			uncork(tls);
+		tls->read_handler = NULL;
 
-		ev_timer_set(w, tls->timeout, 0.0);
-		ev_timer_start(EV_A_ w);
-
+		touch(tls); /* Give the timeout handler another period. */
 		tls->timeout_handler(tls);
 	}
 }
@@ -784,8 +1759,11 @@ start_shutdown(tls_state *tls)
 {
 	debug("Initiating shutdown of connection to %s", tls->peer);
 
-	ev_io_set(&tls->shutdown_watcher, tls->fd, EV_WRITE);
-	ev_io_start(EV_DEFAULT_UC_ &tls->shutdown_watcher);
+	/*
+	 * We might have been called by a handler, so the state must not be
+	 * released right away, even for plaintext connections.
+	 */
+	watch(EV_DEFAULT_UC_ &tls->shutdown_watcher, EV_WRITE);
 	ev_feed_event(EV_DEFAULT_UC_ &tls->shutdown_watcher, EV_WRITE);
 }
 
@@ -795,32 +1773,34 @@ read_line(tls_state *tls)
 	char *line = NULL;
 	int n;
 
-	if (tls->input == NULL)
-		tls->input = xmalloc(tls->input_size);
 	do {
-		if ((line = buffer_read_line(tls->input_buffer)) != NULL) {
+		if (tls->input_buffer != NULL
+		    && (line = buffer_read_line(tls->input_buffer)) != NULL) {
 			debug("Received complete line from %s", tls->peer);
-			free(tls->input);
-			tls->input = NULL;
+			if (buffer_size(tls->input_buffer) == 0)
+				release_buffer(&tls->input_buffer);
 			tls->input_size = 0;
 			break;
 		}
-		if (buffer_size(tls->input_buffer) + tls->input_size
+		if (buffered(tls->input_buffer) + tls->input_size
 		    > LINE_MAX_SIZE) {
 			warning_f("Line received from %s is too long",
 			    tls->peer);
 			ev_io_stop(EV_DEFAULT_UC_ &tls->read_watcher);
+			tls->read_handler = NULL;
 			tls->line_too_long_handler(tls);
 			break;
 		}
 
-		if ((n = SSL_read(tls->ssl, tls->input, (int)tls->input_size))
+		if ((n = receive(tls, line_input, (int)tls->input_size))
 		    <= 0) {
 			debug("Didn't receive line from %s (yet)", tls->peer);
 			check_tls_error(EV_DEFAULT_UC_ &tls->read_watcher, n);
 		} else {
 			debug("Buffered %d bytes from %s", n, tls->peer);
-			buffer_append(tls->input_buffer, tls->input,
+			if (tls->input_buffer == NULL)
+				tls->input_buffer = buffer_new();
+			buffer_append(tls->input_buffer, line_input,
 			    (size_t)n);
 		}
 	} while (n > 0);
@@ -831,34 +1811,43 @@ read_line(tls_state *tls)
 static char *
 read_bytes(tls_state *tls)
 {
-	char *bytes = NULL;
+	char *bytes;
 	int n, n_todo;
 
-	if (tls->input == NULL)
+	if (tls->input == NULL) {
 		tls->input = xmalloc(tls->input_size + 1); /* 1 for '\0'. */
-	do {
-		n_todo = (int)(tls->input_size - tls->input_offset);
 
-		if ((n = SSL_read(tls->ssl, tls->input + tls->input_offset,
+		/*
+		 * A pipelining peer might have sent (some of) the data together
+		 * with the preceding line, in which case read_line() already
+		 * moved it into our input buffer.
+		 */
+		if (tls->input_buffer != NULL) {
+			tls->input_offset = buffer_read(tls->input_buffer,
+			    tls->input, tls->input_size);
+			if (buffer_size(tls->input_buffer) == 0)
+				release_buffer(&tls->input_buffer);
+		}
+	}
+	while ((n_todo = (int)(tls->input_size - tls->input_offset)) > 0) {
+		if ((n = receive(tls, tls->input + tls->input_offset,
 		    n_todo)) <= 0) {
 			debug("Received 0 of %d bytes from %s", n_todo,
 			    tls->peer);
 			check_tls_error(EV_DEFAULT_UC_ &tls->read_watcher, n);
-		} else if (n < n_todo) {
-			debug("Received %d of %d bytes from %s", n, n_todo,
-			    tls->peer);
-			tls->input_offset += (size_t)n;
-		} else { /* We're done (n == n_todo). */
-			debug("Received %d bytes from %s, as requested",
-			    n, tls->peer);
-			tls->input[tls->input_size] = '\0';
-			bytes = (char *)tls->input;
-			tls->input = NULL;
-			tls->input_size = 0;
-			tls->input_offset = 0;
-			break; /* Make Clang's Static Analyzer happy. */
+			return NULL;
 		}
-	} while (n > 0 && n < n_todo);
+		debug("Received %d of %d bytes from %s", n, n_todo, tls->peer);
+		tls->input_offset += (size_t)n;
+	}
+	debug("Received %zu bytes from %s, as requested", tls->input_size,
+	    tls->peer);
+
+	tls->input[tls->input_size] = '\0';
+	bytes = (char *)tls->input;
+	tls->input = NULL;
+	tls->input_size = 0;
+	tls->input_offset = 0;
 
 	return bytes;
 }
@@ -868,25 +1857,111 @@ write_buffered(tls_state * restrict tls, const void * restrict data, size_t size
 {
 	debug("Queueing %zu byte(s) for %s", size, tls->peer);
 
+	if (tls->output_buffer == NULL)
+		tls->output_buffer = buffer_new();
 	buffer_append(tls->output_buffer, data, size);
 
-	if (!ev_is_active(&tls->write_watcher)) {
-		ev_io_set(&tls->write_watcher, tls->fd, EV_WRITE);
-		ev_io_start(EV_DEFAULT_UC_ &tls->write_watcher);
+	schedule_write(tls);
+}
+
+static void
+schedule_write(tls_state *tls)
+{
+	if (ev_is_active(&tls->write_watcher) || tls->corked)
+		return; /* The data will be picked up with the pending output. */
+
+	if (flushing) {
+		watch(EV_DEFAULT_UC_ &tls->write_watcher, EV_WRITE);
 		ev_feed_event(EV_DEFAULT_UC_ &tls->write_watcher, EV_WRITE);
+		return;
+	}
+
+	debug("Corking output to %s", tls->peer);
+
+	tls->corked = 1;
+	tls->cork_prev = last_corked;
+	tls->cork_next = NULL;
+	if (last_corked != NULL)
+		last_corked->cork_next = tls;
+	else
+		first_corked = tls;
+	last_corked = tls;
+
+	if (!ev_is_active(&flush_watcher)) {
+		ev_prepare_init(&flush_watcher, flush_cb);
+		ev_check_init(&cork_watcher, cork_cb);
+		ev_set_priority(&cork_watcher, EV_MAXPRI);
+		ev_prepare_start(EV_DEFAULT_UC_ &flush_watcher);
+		ev_check_start(EV_DEFAULT_UC_ &cork_watcher);
+
+		/* These watchers shouldn't keep the event loop alive. */
+		ev_unref(EV_DEFAULT_UC);
+		ev_unref(EV_DEFAULT_UC);
 	}
 }
 
+static void
+uncork(tls_state *tls)
+{
+	if (tls->cork_prev != NULL)
+		tls->cork_prev->cork_next = tls->cork_next;
+	else
+		first_corked = tls->cork_next;
+	if (tls->cork_next != NULL)
+		tls->cork_next->cork_prev = tls->cork_prev;
+	else
+		last_corked = tls->cork_prev;
+
+	tls->cork_prev = NULL;
+	tls->cork_next = NULL;
+	tls->corked = 0;
+}
+
+static void
+flush_cb(EV_P_ ev_prepare *w __attribute__((__unused__)),
+         int revents __attribute__((__unused__)))
+{
+	tls_state *tls;
+
+	flushing = true;
+
+	while ((tls = first_corked) != NULL) {
+		debug("Flushing output to %s", tls->peer);
+		uncork(tls);
+		watch(EV_A_ &tls->write_watcher, EV_WRITE);
+		ev_feed_event(EV_A_ &tls->write_watcher, EV_WRITE);
+	}
+}
+
+static void
+cork_cb(EV_P_ ev_check *w __attribute__((__unused__)),
+        int revents __attribute__((__unused__)))
+{
+	flushing = false;
+}
+
+/*
+ * A watcher which waits for its own I/O direction is woken up by libev anyway,
+ * unless OpenSSL has already pulled the input it's waiting for off the socket.
+ * Only if it waits for the opposite direction (as OpenSSL asked it to), or for
+ * buffered input, the event must be fed manually.
+ */
 static void
 reset_watcher_state(EV_P_ ev_io *w)
 {
 	tls_state *tls = w->data;
 
-	if (ev_is_active(w)) {
-		debug("Resetting %s watcher state for %s",
-		    w == &tls->read_watcher ? "input" : "output", tls->peer);
-		ev_feed_event(EV_A_ w, w->events);
-	}
+	if (!ev_is_active(w))
+		return;
+	if (w == &tls->read_watcher) {
+		if (w->events & EV_READ && !has_pending_input(tls))
+			return;
+	} else if (w->events & EV_WRITE)
+		return;
+
+	debug("Resetting %s watcher state for %s",
+	    w == &tls->read_watcher ? "input" : "output", tls->peer);
+	ev_feed_event(EV_A_ w, w->events);
 }
 
 static void
@@ -895,24 +1970,21 @@ check_tls_error(EV_P_ ev_io *w, int code)
 	tls_state *tls = w->data;
 	const char *peer = tls->peer != NULL ? tls->peer : tls->addr;
 
+	if (tls->plain) {
+		check_socket_error(EV_A_ w, code);
+		return;
+	}
+
 	/* See the SSL_get_error() man page. */
 	switch (SSL_get_error(tls->ssl, code)) {
 	case SSL_ERROR_WANT_ACCEPT:
 	case SSL_ERROR_WANT_READ:
-		if (!(w->events & EV_READ)) {
-			ev_io_stop(EV_A_ w);
-			ev_io_set(w, w->fd, EV_READ);
-			ev_io_start(EV_A_ w);
-		}
+		watch(EV_A_ w, EV_READ);
 		debug("Waiting for input from %s", peer);
 		return;
 	case SSL_ERROR_WANT_CONNECT:
 	case SSL_ERROR_WANT_WRITE:
-		if (!(w->events & EV_WRITE)) {
-			ev_io_stop(EV_A_ w);
-			ev_io_set(w, w->fd, EV_WRITE);
-			ev_io_start(EV_A_ w);
-		}
+		watch(EV_A_ w, EV_WRITE);
 		debug("Waiting for output to %s", peer);
 		return;
 	case SSL_ERROR_SYSCALL:
@@ -963,6 +2035,36 @@ check_tls_error(EV_P_ ev_io *w, int code)
 	tls_free(tls);
 }
 
+static void
+check_socket_error(EV_P_ ev_io *w, int code)
+{
+	tls_state *tls = w->data;
+
+	if (code == -1)
+		switch (errno) {
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+		case EWOULDBLOCK: /* FALLTHROUGH */
+#endif
+		case EAGAIN:
+			watch(EV_A_ w, w == &tls->read_watcher ?
+			    EV_READ : EV_WRITE);
+			debug("Waiting for I/O with %s", tls->peer);
+			return;
+		case EINTR:
+			debug("I/O call has been interrupted");
+			return;
+		default:
+			warning_f("Socket error (%s): %m", tls->peer);
+		}
+	else
+		warning_f("%s closed the connection", tls->peer);
+
+	if (tls->error_handler != NULL)
+		tls->error_handler(tls);
+
+	tls_free(tls);
+}
+
 static void
 log_tls_message(void log(const char *, ...), const char *format, ...)
 {
@@ -984,20 +2086,16 @@ log_tls_message(void log(const char *, ...), const char *format, ...)
 }
 
 static bool
-get_peer_address(int fd, char *destination, socklen_t size)
+format_address(const struct sockaddr *sa, char *destination, socklen_t size)
 {
-	struct sockaddr_storage sa_storage;
-	struct sockaddr *sa = (struct sockaddr *)&sa_storage;
-	socklen_t len = sizeof(struct sockaddr_storage);
+#ifdef AF_INET6
+	const struct in6_addr *in6;
+#endif
 
-	if (getpeername(fd, sa, &len) == -1) {
-		error("Cannot get peer's IP address: %m");
-		return false;
-	}
 	switch (sa->sa_family) {
 	case AF_INET:
 		if (inet_ntop(AF_INET,
-		    &((struct sockaddr_in *)(void *)sa)->sin_addr,
+		    &((const struct sockaddr_in *)(const void *)sa)->sin_addr,
 		    destination, size) == NULL) {
 			error("Cannot convert IPv4 address to text form: %m");
 			return false;
@@ -1005,9 +2103,20 @@ get_peer_address(int fd, char *destination, socklen_t size)
 		break;
 #ifdef AF_INET6
 	case AF_INET6:
-		if (inet_ntop(AF_INET6,
-		    &((struct sockaddr_in6 *)(void *)sa)->sin6_addr,
-		    destination, size) == NULL) {
+		in6 = &((const struct sockaddr_in6 *)(const void *)sa)->sin6_addr;
+# ifdef IN6_IS_ADDR_V4MAPPED
+		/* Print IPv4 peers of dual-stack sockets in IPv4 notation. */
+		if (IN6_IS_ADDR_V4MAPPED(in6)) {
+			if (inet_ntop(AF_INET, in6->s6_addr + 12, destination,
+			    size) == NULL) {
+				error("Cannot convert IPv4 address to text "
+				    "form: %m");
+				return false;
+			}
+			break;
+		}
+# endif
+		if (inet_ntop(AF_INET6, in6, destination, size) == NULL) {
 			error("Cannot convert IPv6 address to text form: %m");
 			return false;
 		}
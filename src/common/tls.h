@@ -48,6 +48,14 @@
 #  include <config.h>
 # endif
 
+# include <sys/types.h>
+# if HAVE_SYS_SOCKET_H
+#  include <sys/socket.h>
+# endif
+# ifdef HAVE_NETINET_IN_H
+#  include <netinet/in.h>
+# endif
+
 # include <ev.h>
 # include <openssl/bio.h>
 # include <openssl/ssl.h>
@@ -55,6 +63,10 @@
 # include "buffer.h"
 # include "system.h"
 
+# ifndef INET6_ADDRSTRLEN
+#  define INET6_ADDRSTRLEN 46
+# endif
+
 # define TLS_NO_AUTO_DIE 0x0
 # define TLS_AUTO_DIE 0x1
 
@@ -66,11 +78,17 @@ typedef struct tls_state_s {
 	char *peer;     /* Client ID and IP address (e.g., "foo@192.0.2.2"). */
 
 /* private: */
+	struct connector_state_s *connector;
+	char addr_buffer[INET6_ADDRSTRLEN];
 	ev_io init_watcher;
 	ev_io read_watcher;
 	ev_io write_watcher;
 	ev_io shutdown_watcher;
-	ev_timer timeout_watcher;
+	struct timeout_list_s *timeout_list;
+	struct tls_state_s *timeout_prev; /* Link in the timeout list. */
+	struct tls_state_s *timeout_next;
+	struct tls_state_s *cork_prev; /* Link in the list of corked output. */
+	struct tls_state_s *cork_next;
 	ev_tstamp timeout;
 	ev_tstamp last_activity;
 	buffer *input_buffer;
@@ -88,10 +106,17 @@ typedef struct tls_state_s {
 	void (*timeout_handler)(struct tls_state_s *);
 	void (*line_too_long_handler)(struct tls_state_s *);
 	void (*free_output)(void *);
+	struct tls_state_s *next; /* Link in the pool or admission queue. */
+	struct tls_state_s *prev; /* Link in the admission queue. */
+	struct tls_server_state_s *server;
 	SSL *ssl;
 	BIO *bio;
 	int fd;
 	unsigned int read_mode : 1;
+	unsigned int handshaking : 1;
+	unsigned int queued : 1;
+	unsigned int corked : 1;
+	unsigned int plain : 1; /* No TLS on local (Unix domain) sockets. */
 } tls_state;
 
 typedef struct {
@@ -104,22 +129,38 @@ typedef struct {
 	ev_tstamp timeout;
 } tls_client_state;
 
-typedef struct {
+typedef struct tls_server_state_s {
 /* public: */
 	void *data;
 
 /* private: */
 	void (*connect_handler)(tls_state *);
+	bool (*accept_handler)(const struct sockaddr *);
+	const char *(*identify_handler)(uid_t);
 	ev_io accept_watcher;
+	ev_io local_watcher;
 	SSL_CTX *ssl;
-	BIO *bio;
+	tls_state *first_queued; /* Admission queue. */
+	tls_state *last_queued;
 	ev_tstamp timeout;
+	size_t max_connections;
+	size_t max_handshakes;
+	size_t max_handshakes_per_address;
+	size_t n_connections;
+	size_t n_handshakes;
+	size_t n_queued;
+	unsigned long n_deferred;
+	unsigned long n_dropped;
+	char *local_path;
+	int fd;
+	int local_fd; /* -1 if no local socket is used. */
 } tls_server_state;
 
 tls_client_state *tls_client_start(const char * restrict);
 tls_server_state *tls_server_start(const char * restrict,
                                    const char * restrict,
                                    ev_tstamp,
+                                   int,
                                    void (*)(tls_state *),
                                    unsigned int (*)(SSL *,
                                                     const char *,
@@ -131,6 +172,7 @@ void tls_connect(tls_client_state *,
                  int flags,
                  void (*)(tls_state *),
                  void (*)(tls_state *),
+                 void (*)(tls_state *),
                  unsigned int (*)(SSL *,
                                   const char *,
                                   char *,
@@ -150,6 +192,16 @@ void tls_on_drain(tls_state *, void (*)(tls_state *));
 void tls_on_timeout(tls_state *, void (*)(tls_state *));
 void tls_on_error(tls_state *, void (*)(tls_state *));
 void tls_on_line_too_long(tls_state *, void (*)(tls_state *));
+void tls_on_accept(tls_server_state *, bool (*)(const struct sockaddr *));
+void tls_server_listen_local(tls_server_state * restrict, const char * restrict,
+                             int, const char *(*)(uid_t));
+void tls_set_admission_limits(tls_server_state *, size_t, size_t, size_t);
+void tls_get_admission_stats(tls_server_state * restrict, size_t * restrict,
+                             size_t * restrict, size_t * restrict,
+                             unsigned long * restrict,
+                             unsigned long * restrict);
+size_t tls_memory_usage(tls_state *);
+void tls_get_stats(size_t * restrict, size_t * restrict);
 
 #endif
 
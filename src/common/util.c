@@ -69,25 +69,35 @@ concat(const char *str1, const char *str2)
 
 bool
 parse_line(char * restrict line, char ** restrict args, int n_args)
+{
+	return split_line(line, args, n_args) == n_args;
+}
+
+/*
+ * Split the line into at most `max_args' words and return the number of words,
+ * or -1 if there are more.
+ */
+int
+split_line(char * restrict line, char ** restrict args, int max_args)
 {
 	char *p;
 	int i;
 
 	for (i = 0, p = strtok(line, " \t"); p != NULL;
 	    i++, p = strtok(NULL, " \t"))
-		if (i < n_args)
+		if (i < max_args)
 			args[i] = p;
 		else {
 			if (i > 0)
 				debug("%s message has more than %d argument(s)",
-				    args[0], n_args - 1);
-			return false;
+				    args[0], max_args - 1);
+			return -1;
 		}
 
 	if (i > 0)
 		debug("%s message has %d argument(s)", args[0], i - 1);
 
-	return (bool)(i == n_args);
+	return i;
 }
 
 char *
@@ -121,6 +131,27 @@ chomp(char *string)
 		string[len - 1] = '\0';
 }
 
+/*
+ * Feed the bytes into Bernstein's hash function, starting with HASH_INITIAL.
+ * This is used for the various hash tables which need more than hsearch(3).
+ */
+unsigned long
+hash_bytes(unsigned long hash, const char *data, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		hash = hash * 33 + (unsigned char)data[i];
+
+	return hash;
+}
+
+unsigned long
+hash_string(const char *string)
+{
+	return hash_bytes(HASH_INITIAL, string, strlen(string));
+}
+
 const char *
 nsca_version(void)
 {
@@ -32,13 +32,20 @@
 #  include <config.h>
 # endif
 
+# include <stdio.h> /* For size_t. */
+
 # include "system.h"
 
+# define HASH_INITIAL 5381UL
+
 char *concat(const char *, const char *);
 bool parse_line(char * restrict , char ** restrict, int);
+int split_line(char * restrict , char ** restrict, int);
 char *skip_newlines(const char *);
 char *skip_whitespace(const char *);
 void chomp(char *);
+unsigned long hash_bytes(unsigned long, const char *, size_t);
+unsigned long hash_string(const char *);
 const char *nsca_version(void);
 
 #endif
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2014 Holger Weiss <holger@weiss.in-berlin.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Source address restrictions.  The permitted subnets are stored in a binary
+ * trie (one for IPv4 and one for IPv6), where each node that terminates a
+ * configured prefix holds the list of owners (i.e., authorization blocks) that
+ * may connect from within that subnet.  A lookup walks down the trie along the
+ * bits of the address, so its cost depends on the prefix lengths only, not on
+ * the number of configured subnets.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <sys/types.h>
+#if HAVE_SYS_SOCKET_H
+# include <sys/socket.h>
+#endif
+#ifdef HAVE_NETINET_IN_H
+# include <netinet/in.h>
+#endif
+#if HAVE_ARPA_INET_H
+# include <arpa/inet.h>
+#endif
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "acl.h"
+#include "log.h"
+#include "system.h"
+#include "wrappers.h"
+
+#define MAX_ADDRESS_SIZE 16 /* Number of bytes in an IPv6 address. */
+
+typedef struct acl_node_s {
+	struct acl_node_s *child[2];
+	const void **owners;
+	size_t n_owners;
+} acl_node;
+
+static acl_node *ipv4_root = NULL;
+static acl_node *ipv6_root = NULL;
+static size_t n_subnets = 0;
+
+static bool parse_subnet(const char * restrict, unsigned char * restrict,
+                         size_t * restrict, unsigned int * restrict);
+static bool is_owner(const acl_node * restrict, const void * restrict);
+static acl_node *new_node(void);
+static void free_node(acl_node *);
+
+/*
+ * Exported functions.
+ */
+
+bool
+acl_add(const char * restrict subnet, const void * restrict owner)
+{
+	unsigned char address[MAX_ADDRESS_SIZE];
+	acl_node **node;
+	size_t size;
+	unsigned int prefix_len, i;
+
+	if (!parse_subnet(subnet, address, &size, &prefix_len))
+		return false;
+
+	node = size == 4 ? &ipv4_root : &ipv6_root;
+	if (*node == NULL)
+		*node = new_node();
+
+	for (i = 0; i < prefix_len; i++) {
+		int bit = (address[i / CHAR_BIT] >> (7 - i % CHAR_BIT)) & 1;
+
+		node = &(*node)->child[bit];
+		if (*node == NULL)
+			*node = new_node();
+	}
+	if (!is_owner(*node, owner)) {
+		(*node)->owners = xrealloc((*node)->owners,
+		    ((*node)->n_owners + 1) * sizeof(*(*node)->owners));
+		(*node)->owners[(*node)->n_owners++] = owner;
+	}
+	n_subnets++;
+
+	debug("Permitting connections from %s", subnet);
+	return true;
+}
+
+bool
+acl_check(const struct sockaddr * restrict sa, const void * restrict owner)
+{
+	const unsigned char *address;
+	const acl_node *node;
+	size_t size;
+	unsigned int i;
+
+	if (n_subnets == 0)
+		return true;
+
+	switch (sa->sa_family) {
+	case AF_INET:
+		address = (const unsigned char *)
+		    &((const struct sockaddr_in *)(const void *)sa)->sin_addr;
+		size = 4;
+		break;
+#ifdef AF_INET6
+	case AF_INET6:
+		address = ((const struct sockaddr_in6 *)(const void *)sa)
+		    ->sin6_addr.s6_addr;
+		size = 16;
+# ifdef IN6_IS_ADDR_V4MAPPED
+		/* Handle IPv4 peers of dual-stack sockets. */
+		if (IN6_IS_ADDR_V4MAPPED(&((const struct sockaddr_in6 *)
+		    (const void *)sa)->sin6_addr)) {
+			address += 12;
+			size = 4;
+		}
+# endif
+		break;
+#endif
+	default:
+		return false;
+	}
+
+	node = size == 4 ? ipv4_root : ipv6_root;
+	for (i = 0; node != NULL; i++) {
+		if (node->n_owners > 0 && (owner == NULL || is_owner(node, owner)))
+			return true;
+		if (i == size * CHAR_BIT)
+			break;
+		node = node->child[(address[i / CHAR_BIT]
+		    >> (7 - i % CHAR_BIT)) & 1];
+	}
+	return false;
+}
+
+bool
+acl_is_empty(void)
+{
+	return (bool)(n_subnets == 0);
+}
+
+void
+acl_free(void)
+{
+	if (ipv4_root != NULL)
+		free_node(ipv4_root);
+	if (ipv6_root != NULL)
+		free_node(ipv6_root);
+	ipv4_root = ipv6_root = NULL;
+	n_subnets = 0;
+}
+
+/*
+ * Static functions.
+ */
+
+/*
+ * Parse an address with an optional prefix length (e.g., "192.0.2.0/24" or
+ * "2001:db8::/32").  Host bits beyond the prefix length are ignored.
+ */
+static bool
+parse_subnet(const char * restrict subnet, unsigned char * restrict address,
+             size_t * restrict size, unsigned int * restrict prefix_len)
+{
+	char *slash, *end, *buf = xstrdup(subnet);
+	long value = -1;
+
+	if ((slash = strchr(buf, '/')) != NULL) {
+		*slash = '\0';
+		errno = 0;
+		value = strtol(slash + 1, &end, 10);
+		if (slash[1] == '\0' || *end != '\0' || errno != 0
+		    || value < 0) {
+			free(buf);
+			return false;
+		}
+	}
+	if (inet_pton(AF_INET, buf, address) == 1)
+		*size = 4;
+#ifdef AF_INET6
+	else if (inet_pton(AF_INET6, buf, address) == 1)
+		*size = 16;
+#endif
+	else {
+		free(buf);
+		return false;
+	}
+	free(buf);
+
+	if (value > (long)(*size * CHAR_BIT))
+		return false;
+	*prefix_len = value == -1 ?
+	    (unsigned int)(*size * CHAR_BIT) : (unsigned int)value;
+	return true;
+}
+
+static bool
+is_owner(const acl_node * restrict node, const void * restrict owner)
+{
+	size_t i;
+
+	for (i = 0; i < node->n_owners; i++)
+		if (node->owners[i] == owner)
+			return true;
+
+	return false;
+}
+
+static acl_node *
+new_node(void)
+{
+	acl_node *node = xmalloc(sizeof(acl_node));
+
+	node->child[0] = node->child[1] = NULL;
+	node->owners = NULL;
+	node->n_owners = 0;
+
+	return node;
+}
+
+static void
+free_node(acl_node *node)
+{
+	if (node->child[0] != NULL)
+		free_node(node->child[0]);
+	if (node->child[1] != NULL)
+		free_node(node->child[1]);
+	free(node->owners);
+	free(node);
+}
+
+/* vim:set joinspaces noexpandtab textwidth=80 cinoptions=(4,u0: */
@@ -30,20 +30,31 @@
 #endif
 
 #include <sys/types.h>
+#if HAVE_SYS_SOCKET_H
+# include <sys/socket.h>
+#endif
+#include <netdb.h>
 #include <regex.h>
 #include <string.h>
 
-#include <confuse.h>
 #include <openssl/ssl.h>
 
+#include "acl.h"
 #include "auth.h"
+#include "command.h"
+#include "conf.h"
+#include "group.h"
 #include "hash.h"
 #include "log.h"
 #include "system.h"
 #include "util.h"
 #include "wrappers.h"
 
-static bool match(regex_t * restrict, const char * restrict);
+static bool is_group_member(const authorization * restrict,
+                            const char * restrict, size_t);
+static bool match(auth_pattern * restrict, const char * restrict, size_t);
+static bool is_permitted_peer(SSL * restrict, const char * restrict,
+                              const authorization * restrict);
 
 /*
  * Exported functions.
@@ -53,8 +64,7 @@ unsigned int
 check_psk(SSL *ssl, const char *identity, unsigned char *password,
           unsigned int max_password_len)
 {
-	cfg_t *auth;
-	const char *configured_pw;
+	authorization *auth;
 	size_t password_len;
 
 	if ((auth = hash_lookup(identity)) == NULL
@@ -62,6 +72,8 @@ check_psk(SSL *ssl, const char *identity, unsigned char *password,
 		warning("Client-supplied ID `%s' is unknown", identity);
 		return 0;
 	}
+	if (!acl_is_empty() && !is_permitted_peer(ssl, identity, auth))
+		return 0;
 	debug("Verifying key provided by %s", identity);
 
 	/*
@@ -73,18 +85,41 @@ check_psk(SSL *ssl, const char *identity, unsigned char *password,
 		return 0;
 	}
 
-	configured_pw = cfg_getstr(auth, "password");
-	password_len = MIN(strlen(configured_pw), max_password_len);
-	(void)memcpy(password, configured_pw, password_len);
+	password_len = MIN(strlen(auth->password), max_password_len);
+	(void)memcpy(password, auth->password, password_len);
 	return (unsigned int)password_len;
 }
 
+/*
+ * Return the identity of a client connected to the local socket, or NULL if the
+ * user isn't authorized.
+ */
+const char *
+check_peer_uid(uid_t uid)
+{
+	const char *identity;
+
+	if ((identity = conf_get_local_identity(uid)) == NULL)
+		warning("Local user with UID %lu is unknown",
+		    (unsigned long)uid);
+	else
+		debug("Local user with UID %lu uses ID %s",
+		    (unsigned long)uid, identity);
+
+	return identity;
+}
+
+/*
+ * The command needn't be NUL-terminated if REG_STARTEND is available, which
+ * allows for matching PUSH data that was streamed into a file (and mapped into
+ * memory) in place.
+ */
 bool
-is_authorized(const char * restrict identity, const char * restrict command)
+is_authorized(const char * restrict identity, const char * restrict command,
+              size_t size)
 {
-	const char *settings[] = { "hosts", "services", "commands" };
-	cfg_t *auth;
-	char *newline;
+	authorization *auth;
+	const char *end = command + size, *newline;
 	size_t i;
 
 	if ((auth = hash_lookup(identity)) == NULL
@@ -93,58 +128,160 @@ is_authorized(const char * restrict identity, const char * restrict command)
 		error("Cannot find authorizations for %s", identity);
 		return false;
 	}
-	if ((newline = strchr(command, '\n')) == NULL) {
+	if ((newline = memchr(command, '\n', size)) == NULL) {
 		warning("Command submitted by %s isn't newline-terminated",
 		    identity);
 		return false;
 	}
-	if (*(newline + 1) != '\0') {
+	if (newline + 1 != end) {
 		warning("Command submitted by %s contains embedded newline(s)",
 		    identity);
 		return false;
 	}
+	if (memchr(command, '\0', size) != NULL) {
+		warning("Command submitted by %s contains NUL character(s)",
+		    identity);
+		return false;
+	}
 	/* Match against the command without the leading bracketed timestamp. */
-	if ((command = strchr(command, ']')) == NULL) {
+	if ((command = memchr(command, ']', (size_t)(newline - command)))
+	    == NULL) {
 		warning("Timestamp missing from command submitted by %s",
 		    identity);
 		return false;
 	}
 	command = skip_whitespace(command + 1);
 
-	for (i = 0; i < sizeof(settings) / sizeof(*settings); i++) {
-		cfg_opt_t *opt = cfg_getopt(auth, settings[i]);
-		unsigned int j;
+	if (is_group_member(auth, command, (size_t)(newline - command)))
+		return true;
+	for (i = 0; i < auth->n_patterns; i++)
+		if (match(auth->patterns[i], command, (size_t)(end - command)))
+			return true;
+
+	return false;
+}
 
-		for (j = 0; j < cfg_opt_size(opt); j++) {
-			regex_t *pattern = cfg_opt_getnptr(opt, j);
+/*
+ * Check whether a command which passed is_authorized() matches one of the
+ * given patterns.
+ */
+bool
+matches_pattern(auth_pattern * const * restrict patterns, size_t n_patterns,
+                const char * restrict command, size_t size)
+{
+	const char *end = command + size;
+	size_t i;
+
+	/* The timestamp was checked by is_authorized(). */
+	command = memchr(command, ']', size);
+	command = skip_whitespace(command + 1);
+
+	for (i = 0; i < n_patterns; i++)
+		if (match(patterns[i], command, (size_t)(end - command)))
+			return true;
 
-			if (match(pattern, command))
-				return true;
-		}
-	}
 	return false;
 }
 
+bool
+is_permitted_source(const struct sockaddr *sa)
+{
+	return acl_check(sa, NULL);
+}
+
 /*
  * Static functions.
  */
 
+/*
+ * Check whether the command is a check result for a host or service which is a
+ * member of one of the groups the client is authorized for.  These lookups take
+ * constant time, so they're done before trying the patterns.
+ */
 static bool
-match(regex_t * restrict pattern, const char * restrict command)
+is_group_member(const authorization * restrict auth,
+                const char * restrict command, size_t size)
 {
+	command_fields fields;
+
+	if (auth->host_group_set == NULL && auth->service_group_set == NULL)
+		return false;
+	if (!command_parse(command, size, &fields))
+		return false;
+
+	switch (fields.type) {
+	case COMMAND_HOST_RESULT:
+		return group_permits_host(auth->host_group_set, fields.host,
+		    fields.host_len);
+	case COMMAND_SERVICE_RESULT:
+		return group_permits_service(auth->service_group_set,
+		    fields.host, fields.host_len, fields.service,
+		    fields.service_len);
+	default:
+		return false;
+	}
+}
+
+static bool
+match(auth_pattern * restrict pattern, const char * restrict command,
+      size_t size)
+{
+#ifdef REG_STARTEND
+	regmatch_t range;
+#endif
 	char errbuf[128];
-	int result = regexec(pattern, command, 0, NULL, 0);
+	int result;
 
+	/* Patterns loaded from the cache are compiled on first use. */
+	if (pattern->regex == NULL && !conf_compile_pattern(pattern))
+		return false;
+
+#ifdef REG_STARTEND
+	range.rm_so = 0;
+	range.rm_eo = (regoff_t)size;
+	result = regexec(pattern->regex, command, 1, &range, REG_STARTEND);
+#else
+	(void)size; /* The command is NUL-terminated. */
+	result = regexec(pattern->regex, command, 0, NULL, 0);
+#endif
 	switch (result) {
 	case 0:
 		return true;
 	case REG_NOMATCH:
 		return false;
 	default:
-		(void)regerror(result, pattern, errbuf, sizeof(errbuf));
+		(void)regerror(result, pattern->regex, errbuf, sizeof(errbuf));
 		error("Error matching command: %s", errbuf);
 		return false;
 	}
 }
 
+/*
+ * Check whether the identity may be used from the client's source address.
+ */
+static bool
+is_permitted_peer(SSL * restrict ssl, const char * restrict identity,
+                  const authorization * restrict auth)
+{
+	struct sockaddr_storage sa_storage;
+	struct sockaddr *sa = (struct sockaddr *)&sa_storage;
+	socklen_t len = sizeof(sa_storage);
+	char addr[NI_MAXHOST];
+	int fd;
+
+	if ((fd = SSL_get_fd(ssl)) == -1 || getpeername(fd, sa, &len) == -1) {
+		error("Cannot get address of client using `%s': %m", identity);
+		return false;
+	}
+	if (acl_check(sa, auth))
+		return true;
+
+	if (getnameinfo(sa, len, addr, sizeof(addr), NULL, 0,
+	    NI_NUMERICHOST) != 0)
+		(void)strcpy(addr, "unknown address");
+	warning("Client-supplied ID `%s' is not permitted from %s", identity,
+	    addr);
+	return false;
+}
+
 /* vim:set joinspaces noexpandtab textwidth=80 cinoptions=(4,u0: */
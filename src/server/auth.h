@@ -32,12 +32,22 @@
 #  include <config.h>
 # endif
 
+# include <sys/types.h>
+# if HAVE_SYS_SOCKET_H
+#  include <sys/socket.h>
+# endif
+
 # include <openssl/ssl.h>
 
+# include "conf.h"
 # include "system.h"
 
 unsigned int check_psk(SSL *, const char *, unsigned char *, unsigned int);
-bool is_authorized(const char * restrict, const char * restrict);
+const char *check_peer_uid(uid_t);
+bool is_authorized(const char * restrict, const char * restrict, size_t);
+bool matches_pattern(auth_pattern * const * restrict, size_t,
+                     const char * restrict, size_t);
+bool is_permitted_source(const struct sockaddr *);
 
 #endif
 
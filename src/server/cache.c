@@ -0,0 +1,935 @@
+/*
+ * Copyright (c) 2014 Holger Weiss <holger@weiss.in-berlin.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The configuration cache holds a snapshot of the processed configuration
+ * (i.e., the global settings, the "forward" blocks, and the "authorize" blocks
+ * after falling back to the global defaults, as well as the location of each
+ * pattern for error messages), so that an unchanged
+ * configuration can be loaded without running libConfuse over every included
+ * file.  The cache file consists of a header and a payload of numbers (in host
+ * byte order) and strings (each preceded by its length and followed by a null
+ * byte).  The file is mapped into memory, and the strings are used in place.
+ * It's only used if the payload checksum is valid and none of the configuration
+ * files and directories have changed since the cache was written.  A file
+ * whose size and modification time are unchanged is checked by hashing its
+ * contents only if it might have been modified within the second it was hashed
+ * in.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <sys/types.h>
+#if HAVE_MMAP
+# include <sys/mman.h>
+#endif
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <confuse.h>
+
+#include "buffer.h"
+#include "cache.h"
+#include "conf.h"
+#include "log.h"
+#include "system.h"
+#include "wrappers.h"
+
+#define CACHE_MAGIC "NSCA-ng"
+#define CACHE_VERSION 5UL
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+typedef struct {
+	char magic[sizeof(CACHE_MAGIC)];
+	unsigned long version;
+	unsigned long long checksum; /* Of the payload. */
+	size_t size;                 /* Of the payload. */
+} cache_header;
+
+typedef struct input_s {
+	struct input_s *next;
+	char *path;
+	unsigned long long hash;
+	time_t hashed;
+	time_t mtime;
+	off_t size;
+	bool is_directory;
+} input;
+
+typedef struct {
+	char *p;
+	char *end;
+	bool ok;
+} cache_reader;
+
+static input *first_input = NULL, *last_input = NULL;
+static char *cache_data = NULL;
+static size_t cache_size = 0;
+static bool cache_mapped = false;
+
+static bool map_cache(const char *);
+static bool read_cache(cache_reader * restrict, const char * restrict,
+                       const char * restrict, cfg_opt_t * restrict,
+                       cfg_t * restrict, authorization ** restrict,
+                       size_t * restrict, pattern_origin ** restrict,
+                       size_t * restrict);
+static bool check_inputs(cache_reader * restrict, const char * restrict);
+static bool check_options(cache_reader * restrict, cfg_opt_t * restrict);
+static cfg_opt_t *find_option(cfg_opt_t * restrict, const char * restrict);
+static void restore_options(cache_reader * restrict, cfg_t * restrict);
+static bool read_authorizations(cache_reader * restrict,
+                                authorization ** restrict, size_t * restrict);
+static void free_authorizations(authorization *, size_t);
+static bool read_origins(cache_reader * restrict, pattern_origin ** restrict,
+                         size_t * restrict);
+static void write_inputs(buffer *);
+static void write_options(buffer * restrict, cfg_opt_t * restrict,
+                          cfg_t * restrict);
+static bool is_cached_option(cfg_opt_t *);
+static char *option_value(cfg_opt_t *, unsigned int);
+static bool write_file(const char * restrict, const cache_header * restrict,
+                       const char * restrict);
+static bool write_all(int, const void *, size_t);
+static void free_inputs(void);
+static void get_data(cache_reader * restrict, void * restrict, size_t);
+static unsigned long get_ulong(cache_reader *);
+static char *get_string(cache_reader *);
+static char **get_strings(cache_reader * restrict, size_t * restrict);
+static void put_ulong(buffer *, unsigned long);
+static void put_string(buffer * restrict, const char * restrict);
+static void put_strings(buffer * restrict, char * const * restrict, size_t);
+static bool hash_file(const char * restrict, unsigned long long * restrict);
+static bool hash_directory(const char * restrict,
+                           unsigned long long * restrict);
+static unsigned long long hash_data(const void *, size_t, unsigned long long);
+
+/*
+ * Exported functions.
+ */
+
+void
+cache_add_input(const char *path)
+{
+	input *in = xmalloc(sizeof(input));
+	struct stat sb;
+
+	in->next = NULL;
+	in->path = xstrdup(path);
+	in->hashed = time(NULL);
+
+	/* Hash before libConfuse reads the input, so we won't miss edits. */
+	if (stat(path, &sb) == -1) {
+		debug("Cannot access %s: %m", path);
+		in->is_directory = false;
+		in->mtime = 0;
+		in->size = -1; /* Never matches, so the cache won't be used. */
+		in->hash = 0;
+	} else {
+		in->is_directory = S_ISDIR(sb.st_mode);
+		in->mtime = sb.st_mtime;
+		in->size = sb.st_size;
+		if (!(in->is_directory ? hash_directory(path, &in->hash)
+		    : hash_file(path, &in->hash)))
+			in->size = -1;
+	}
+
+	if (last_input == NULL)
+		first_input = in;
+	else
+		last_input->next = in;
+	last_input = in;
+}
+
+bool
+cache_load(const char * restrict cache_file, const char * restrict conf_file,
+           cfg_opt_t * restrict opts, cfg_t * restrict cfg,
+           authorization ** restrict auth, size_t * restrict n_auth,
+           pattern_origin ** restrict origins, size_t * restrict n_origins)
+{
+	cache_reader reader;
+
+	if (!map_cache(cache_file))
+		return false;
+
+	reader.p = cache_data + sizeof(cache_header);
+	reader.end = cache_data + cache_size;
+	reader.ok = true;
+
+	if (!read_cache(&reader, cache_file, conf_file, opts, cfg, auth,
+	    n_auth, origins, n_origins)) {
+		cache_free();
+		return false;
+	}
+	debug("Loaded %zu authorization(s) from configuration cache %s",
+	    *n_auth, cache_file);
+	return true;
+}
+
+void
+cache_save(const char * restrict cache_file, const char * restrict conf_file,
+           cfg_opt_t * restrict opts, cfg_t * restrict cfg,
+           const authorization * restrict auth, size_t n_auth,
+           const pattern_origin * restrict origins, size_t n_origins)
+{
+	buffer *payload = buffer_new();
+	cache_header header;
+	char *data;
+	size_t i, j, size;
+
+	put_string(payload, PACKAGE_VERSION);
+	put_string(payload, conf_file);
+	write_inputs(payload);
+	write_options(payload, opts, cfg);
+
+	put_ulong(payload, (unsigned long)n_auth);
+	for (i = 0; i < n_auth; i++) {
+		put_string(payload, auth[i].identity);
+		put_string(payload, auth[i].password);
+		put_strings(payload, auth[i].sources, auth[i].n_sources);
+		put_strings(payload, auth[i].local_users,
+		    auth[i].n_local_users);
+		put_strings(payload, auth[i].host_groups,
+		    auth[i].n_host_groups);
+		put_strings(payload, auth[i].service_groups,
+		    auth[i].n_service_groups);
+		put_ulong(payload, (unsigned long)auth[i].n_patterns);
+		for (j = 0; j < auth[i].n_patterns; j++)
+			put_string(payload, auth[i].patterns[j]->source);
+		buffer_append(payload, &auth[i].max_rate,
+		    sizeof(auth[i].max_rate));
+		put_ulong(payload, auth[i].max_burst);
+		put_ulong(payload, auth[i].queue_share);
+		put_ulong(payload, auth[i].rate_limit_per_address);
+	}
+
+	/* Consecutive origins usually share the file name. */
+	put_ulong(payload, (unsigned long)n_origins);
+	for (i = 0; i < n_origins; i++) {
+		bool new_file = i == 0 || origins[i].file != origins[i - 1].file;
+
+		put_ulong(payload, new_file);
+		if (new_file)
+			put_string(payload, origins[i].file);
+		put_string(payload, origins[i].value);
+		put_ulong(payload, origins[i].line);
+		put_ulong(payload, origins[i].setting);
+	}
+
+	data = buffer_slurp(payload, &size);
+	buffer_free(payload);
+
+	(void)memset(&header, 0, sizeof(header));
+	(void)memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.version = CACHE_VERSION;
+	header.checksum = hash_data(data, size, FNV_OFFSET_BASIS);
+	header.size = size;
+
+	if (write_file(cache_file, &header, data))
+		debug("Wrote %zu authorization(s) to configuration cache %s",
+		    n_auth, cache_file);
+
+	(void)memset(data, 0, size); /* Wipe the passwords. */
+	free(data);
+}
+
+void
+cache_free(void)
+{
+	free_inputs();
+
+	if (cache_data != NULL) {
+#if HAVE_MMAP
+		if (cache_mapped)
+			(void)munmap(cache_data, cache_size);
+		else
+#endif
+		{
+			(void)memset(cache_data, 0, cache_size);
+			free(cache_data);
+		}
+		cache_data = NULL;
+		cache_size = 0;
+		cache_mapped = false;
+	}
+}
+
+/*
+ * Static functions.
+ */
+
+static bool
+map_cache(const char *path)
+{
+	cache_header header;
+	struct stat sb;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		if (errno == ENOENT)
+			debug("Configuration cache %s doesn't exist yet", path);
+		else
+			warning("Cannot open %s: %m", path);
+		return false;
+	}
+	if (fstat(fd, &sb) == -1) {
+		warning("Cannot stat %s: %m", path);
+		(void)close(fd);
+		return false;
+	}
+	if (sb.st_size < (off_t)sizeof(cache_header)) {
+		debug("Ignoring truncated configuration cache %s", path);
+		(void)close(fd);
+		return false;
+	}
+	cache_size = (size_t)sb.st_size;
+
+#if HAVE_MMAP
+	/* Private and writable, so that passwords can be wiped on exit. */
+	cache_data = mmap(NULL, cache_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE, fd, 0);
+	if (cache_data != MAP_FAILED)
+		cache_mapped = true;
+	else {
+		debug("Cannot map %s into memory: %m", path);
+		cache_data = NULL;
+	}
+#endif
+	if (cache_data == NULL) {
+		size_t offset = 0;
+		ssize_t n;
+
+		cache_data = xmalloc(cache_size);
+		while (offset < cache_size) {
+			if ((n = read(fd, cache_data + offset,
+			    cache_size - offset)) == -1 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				warning("Cannot read %s: %m", path);
+				(void)close(fd);
+				cache_free();
+				return false;
+			}
+			offset += (size_t)n;
+		}
+	}
+	if (close(fd) == -1)
+		warning("Cannot close %s: %m", path);
+
+	(void)memcpy(&header, cache_data, sizeof(header));
+	if (memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0
+	    || header.version != CACHE_VERSION
+	    || header.size != cache_size - sizeof(header)
+	    || header.checksum != hash_data(cache_data + sizeof(header),
+	    header.size, FNV_OFFSET_BASIS)) {
+		debug("Ignoring invalid configuration cache %s", path);
+		cache_free();
+		return false;
+	}
+	return true;
+}
+
+static bool
+read_cache(cache_reader * restrict reader, const char * restrict cache_file,
+           const char * restrict conf_file, cfg_opt_t * restrict opts,
+           cfg_t * restrict cfg, authorization ** restrict auth,
+           size_t * restrict n_auth, pattern_origin ** restrict origins,
+           size_t * restrict n_origins)
+{
+	cache_reader options;
+	const char *version, *path;
+
+	if ((version = get_string(reader)) == NULL
+	    || strcmp(version, PACKAGE_VERSION) != 0
+	    || (path = get_string(reader)) == NULL
+	    || strcmp(path, conf_file) != 0) {
+		debug("Ignoring configuration cache %s, as it was written by "
+		    "a different version or for a different file", cache_file);
+		return false;
+	}
+	if (!check_inputs(reader, cache_file))
+		return false;
+
+	options = *reader;
+	if (!check_options(reader, opts)
+	    || !read_authorizations(reader, auth, n_auth)) {
+		warning("Ignoring corrupt configuration cache %s", cache_file);
+		return false;
+	}
+	if (!read_origins(reader, origins, n_origins)) {
+		free_authorizations(*auth, *n_auth);
+		*auth = NULL;
+		*n_auth = 0;
+		warning("Ignoring corrupt configuration cache %s", cache_file);
+		return false;
+	}
+	restore_options(&options, cfg);
+	return true;
+}
+
+static bool
+check_inputs(cache_reader * restrict reader, const char * restrict cache_file)
+{
+	unsigned long i, n_inputs = get_ulong(reader);
+
+	for (i = 0; i < n_inputs && reader->ok; i++) {
+		unsigned long long hash, current_hash;
+		struct stat sb;
+		time_t hashed, mtime;
+		off_t size;
+		bool is_directory, unchanged;
+		char *path;
+
+		path = get_string(reader);
+		is_directory = get_ulong(reader) != 0;
+		get_data(reader, &hash, sizeof(hash));
+		get_data(reader, &hashed, sizeof(hashed));
+		get_data(reader, &mtime, sizeof(mtime));
+		get_data(reader, &size, sizeof(size));
+		if (!reader->ok)
+			break;
+
+		if (stat(path, &sb) == -1)
+			unchanged = false;
+		else if (is_directory)
+			unchanged = S_ISDIR(sb.st_mode)
+			    && hash_directory(path, &current_hash)
+			    && current_hash == hash;
+		else if (!S_ISREG(sb.st_mode) || sb.st_size != size)
+			unchanged = false;
+		else if (sb.st_mtime == mtime && mtime < hashed)
+			unchanged = true;
+		else
+			unchanged = hash_file(path, &current_hash)
+			    && current_hash == hash;
+
+		if (!unchanged) {
+			debug("Configuration cache %s is out of date, as %s "
+			    "has changed", cache_file, path);
+			return false;
+		}
+	}
+	if (!reader->ok) {
+		warning("Ignoring corrupt configuration cache %s", cache_file);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Each value of a section setting is the section's title, followed by the
+ * section's own settings.
+ */
+static bool
+check_options(cache_reader * restrict reader, cfg_opt_t * restrict opts)
+{
+	unsigned long i, j, n_options = get_ulong(reader);
+
+	for (i = 0; i < n_options && reader->ok; i++) {
+		char *name = get_string(reader);
+		unsigned long n_values = get_ulong(reader);
+		cfg_opt_t *opt;
+
+		if (name == NULL || (opt = find_option(opts, name)) == NULL)
+			return false;
+		for (j = 0; j < n_values && reader->ok; j++)
+			if (get_string(reader) != NULL
+			    && opt->type == CFGT_SEC
+			    && !check_options(reader, opt->subopts))
+				return false;
+	}
+	return reader->ok;
+}
+
+static cfg_opt_t *
+find_option(cfg_opt_t * restrict opts, const char * restrict name)
+{
+	cfg_opt_t *opt;
+
+	for (opt = opts; opt->name != NULL; opt++)
+		if (strcmp(opt->name, name) == 0)
+			return opt;
+
+	return NULL;
+}
+
+static void
+restore_options(cache_reader * restrict reader, cfg_t * restrict cfg)
+{
+	unsigned long i, j, n_options = get_ulong(reader);
+
+	for (i = 0; i < n_options; i++) {
+		cfg_opt_t *opt = cfg_getopt(cfg, get_string(reader));
+		unsigned long n_values = get_ulong(reader);
+
+		for (j = 0; j < n_values; j++) {
+			const char *value = get_string(reader);
+			cfg_value_t *result;
+
+			/* For sections, libConfuse takes over the title. */
+			if (opt->type == CFGT_SEC)
+				value = xstrdup(value);
+			if ((result = cfg_setopt(cfg, opt, value)) == NULL)
+				die("Cannot restore `%s' setting from cache",
+				    opt->name);
+			if (opt->type == CFGT_SEC)
+				restore_options(reader, result->section);
+		}
+	}
+}
+
+static bool
+read_authorizations(cache_reader * restrict reader,
+                    authorization ** restrict auth, size_t * restrict n_auth)
+{
+	authorization *a;
+	unsigned long i, j, n = get_ulong(reader);
+
+	/* Each block takes more than one byte, so this catches garbage. */
+	if (!reader->ok || n == 0
+	    || n > (unsigned long)(reader->end - reader->p))
+		return false;
+
+	a = xmalloc(n * sizeof(authorization));
+	for (i = 0; i < n; i++) {
+		a[i].identity = get_string(reader);
+		a[i].password = get_string(reader);
+		a[i].n_patterns = 0;
+		a[i].patterns = NULL;
+		a[i].host_group_set = a[i].service_group_set = NULL;
+		a[i].sources = get_strings(reader, &a[i].n_sources);
+		a[i].local_users = get_strings(reader, &a[i].n_local_users);
+		a[i].host_groups = get_strings(reader, &a[i].n_host_groups);
+		a[i].service_groups = get_strings(reader,
+		    &a[i].n_service_groups);
+		if (!reader->ok) {
+			free_authorizations(a, i + 1);
+			return false;
+		}
+
+		a[i].n_patterns = get_ulong(reader);
+		if (!reader->ok || a[i].n_patterns
+		    > (size_t)(reader->end - reader->p)) {
+			free_authorizations(a, i + 1);
+			return false;
+		}
+		if (a[i].n_patterns > 0)
+			a[i].patterns = xmalloc(a[i].n_patterns
+			    * sizeof(auth_pattern *));
+		for (j = 0; j < a[i].n_patterns; j++) {
+			char *source = get_string(reader);
+
+			if (source == NULL) {
+				free_authorizations(a, i + 1);
+				return false;
+			}
+			/* The pattern is compiled on demand. */
+			a[i].patterns[j] = conf_intern_pattern(source);
+		}
+		get_data(reader, &a[i].max_rate, sizeof(a[i].max_rate));
+		a[i].max_burst = get_ulong(reader);
+		a[i].queue_share = (unsigned int)get_ulong(reader);
+		a[i].rate_limit_per_address = get_ulong(reader) != 0;
+	}
+	if (!reader->ok) {
+		free_authorizations(a, n);
+		return false;
+	}
+	*auth = a;
+	*n_auth = n;
+	return true;
+}
+
+static void
+free_authorizations(authorization *auth, size_t n_auth)
+{
+	size_t i;
+
+	for (i = 0; i < n_auth; i++) {
+		if (auth[i].sources != NULL)
+			free(auth[i].sources);
+		if (auth[i].local_users != NULL)
+			free(auth[i].local_users);
+		if (auth[i].host_groups != NULL)
+			free(auth[i].host_groups);
+		if (auth[i].service_groups != NULL)
+			free(auth[i].service_groups);
+		if (auth[i].patterns != NULL)
+			free(auth[i].patterns);
+	}
+	free(auth);
+}
+
+static bool
+read_origins(cache_reader * restrict reader, pattern_origin ** restrict origins,
+             size_t * restrict n_origins)
+{
+	pattern_origin *o;
+	unsigned long i, n = get_ulong(reader);
+	char *file = NULL;
+
+	/* Each origin takes more than one byte, so this catches garbage. */
+	if (!reader->ok || n > (unsigned long)(reader->end - reader->p))
+		return false;
+
+	o = n > 0 ? xmalloc(n * sizeof(pattern_origin)) : NULL;
+	for (i = 0; i < n && reader->ok; i++) {
+		if (get_ulong(reader) != 0)
+			file = get_string(reader);
+		o[i].file = file;
+		o[i].value = get_string(reader);
+		o[i].line = (unsigned int)get_ulong(reader);
+		o[i].setting = (unsigned int)get_ulong(reader);
+		if (file == NULL || o[i].setting >= N_PATTERN_SETTINGS)
+			reader->ok = false;
+	}
+	if (!reader->ok) {
+		if (o != NULL)
+			free(o);
+		return false;
+	}
+	*origins = o;
+	*n_origins = n;
+	return true;
+}
+
+static void
+write_inputs(buffer *payload)
+{
+	input *in;
+	unsigned long n_inputs = 0;
+
+	for (in = first_input; in != NULL; in = in->next)
+		n_inputs++;
+
+	put_ulong(payload, n_inputs);
+	for (in = first_input; in != NULL; in = in->next) {
+		put_string(payload, in->path);
+		put_ulong(payload, in->is_directory);
+		buffer_append(payload, &in->hash, sizeof(in->hash));
+		buffer_append(payload, &in->hashed, sizeof(in->hashed));
+		buffer_append(payload, &in->mtime, sizeof(in->mtime));
+		buffer_append(payload, &in->size, sizeof(in->size));
+	}
+	free_inputs();
+}
+
+/*
+ * The "authorize" blocks are written separately, in their processed form.
+ */
+static void
+write_options(buffer * restrict payload, cfg_opt_t * restrict opts,
+              cfg_t * restrict cfg)
+{
+	cfg_opt_t *opt;
+	unsigned long n_options = 0;
+
+	for (opt = opts; opt->name != NULL; opt++)
+		if (is_cached_option(opt) && cfg_size(cfg, opt->name) > 0)
+			n_options++;
+
+	put_ulong(payload, n_options);
+	for (opt = opts; opt->name != NULL; opt++) {
+		cfg_opt_t *value_opt = cfg_getopt(cfg, opt->name);
+		unsigned int i, n_values = cfg_opt_size(value_opt);
+
+		if (!is_cached_option(opt) || n_values == 0)
+			continue;
+
+		put_string(payload, opt->name);
+		put_ulong(payload, n_values);
+		for (i = 0; i < n_values; i++) {
+			if (opt->type == CFGT_SEC) {
+				cfg_t *section = cfg_opt_getnsec(value_opt, i);
+
+				put_string(payload, cfg_title(section));
+				write_options(payload, opt->subopts, section);
+			} else {
+				char *value = option_value(value_opt, i);
+
+				put_string(payload, value);
+				free(value);
+			}
+		}
+	}
+}
+
+static bool
+is_cached_option(cfg_opt_t *opt)
+{
+	return opt->type != CFGT_FUNC && (opt->type != CFGT_SEC
+	    || strcmp(opt->name, "authorize") != 0);
+}
+
+static char *
+option_value(cfg_opt_t *opt, unsigned int index)
+{
+	char *value;
+
+	switch (opt->type) {
+	case CFGT_INT:
+		xasprintf(&value, "%ld", cfg_opt_getnint(opt, index));
+		break;
+	case CFGT_FLOAT:
+		xasprintf(&value, "%.17g", cfg_opt_getnfloat(opt, index));
+		break;
+	case CFGT_BOOL:
+		value = xstrdup(cfg_opt_getnbool(opt, index) ?
+		    "true" : "false");
+		break;
+	case CFGT_STR:
+		value = xstrdup(cfg_opt_getnstr(opt, index));
+		break;
+	default: /* We don't use other types for cached settings. */
+		die("Cannot cache `%s' setting", opt->name);
+	}
+	return value;
+}
+
+static bool
+write_file(const char * restrict path, const cache_header * restrict header,
+           const char * restrict data)
+{
+	char *temp_path;
+	int fd;
+	bool success;
+
+	xasprintf(&temp_path, "%s.XXXXXX", path);
+
+	/* The file is created with mode 0600, as it holds the passwords. */
+	if ((fd = mkstemp(temp_path)) == -1) {
+		warning("Cannot create %s: %m", temp_path);
+		free(temp_path);
+		return false;
+	}
+	success = write_all(fd, header, sizeof(*header))
+	    && write_all(fd, data, header->size)
+	    && fsync(fd) == 0;
+	if (close(fd) == -1)
+		success = false;
+	if (success && rename(temp_path, path) == -1)
+		success = false;
+	if (!success) {
+		warning("Cannot write configuration cache %s: %m", path);
+		(void)unlink(temp_path);
+	}
+	free(temp_path);
+	return success;
+}
+
+static bool
+write_all(int fd, const void *data, size_t size)
+{
+	const char *p = data;
+	ssize_t n;
+
+	while (size > 0) {
+		if ((n = write(fd, p, size)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		size -= (size_t)n;
+	}
+	return true;
+}
+
+static void
+free_inputs(void)
+{
+	input *in, *next;
+
+	for (in = first_input; in != NULL; in = next) {
+		next = in->next;
+		free(in->path);
+		free(in);
+	}
+	first_input = last_input = NULL;
+}
+
+static void
+get_data(cache_reader * restrict reader, void * restrict data, size_t size)
+{
+	if (!reader->ok || (size_t)(reader->end - reader->p) < size) {
+		reader->ok = false;
+		(void)memset(data, 0, size);
+	} else {
+		(void)memcpy(data, reader->p, size);
+		reader->p += size;
+	}
+}
+
+static unsigned long
+get_ulong(cache_reader *reader)
+{
+	unsigned long value;
+
+	get_data(reader, &value, sizeof(value));
+	return value;
+}
+
+static char *
+get_string(cache_reader *reader)
+{
+	unsigned long len = get_ulong(reader);
+	char *s = reader->p;
+
+	if (!reader->ok || len >= (unsigned long)(reader->end - reader->p)
+	    || s[len] != '\0') {
+		reader->ok = false;
+		return NULL;
+	}
+	reader->p += len + 1;
+	return s;
+}
+
+/*
+ * Returns NULL for an empty list (and on error, which is flagged as usual).
+ */
+static char **
+get_strings(cache_reader * restrict reader, size_t * restrict n)
+{
+	char **strings;
+	unsigned long i, n_strings = get_ulong(reader);
+
+	*n = 0;
+	if (!reader->ok || n_strings == 0)
+		return NULL;
+	/* Each string takes more than one byte, so this catches garbage. */
+	if (n_strings > (unsigned long)(reader->end - reader->p)) {
+		reader->ok = false;
+		return NULL;
+	}
+
+	strings = xmalloc(n_strings * sizeof(char *));
+	for (i = 0; i < n_strings; i++)
+		if ((strings[i] = get_string(reader)) == NULL) {
+			free(strings);
+			return NULL;
+		}
+	*n = n_strings;
+	return strings;
+}
+
+static void
+put_ulong(buffer *payload, unsigned long value)
+{
+	buffer_append(payload, &value, sizeof(value));
+}
+
+static void
+put_string(buffer * restrict payload, const char * restrict s)
+{
+	size_t len = strlen(s);
+
+	put_ulong(payload, (unsigned long)len);
+	buffer_append(payload, s, len + 1);
+}
+
+static void
+put_strings(buffer * restrict payload, char * const * restrict strings,
+            size_t n)
+{
+	size_t i;
+
+	put_ulong(payload, (unsigned long)n);
+	for (i = 0; i < n; i++)
+		put_string(payload, strings[i]);
+}
+
+static bool
+hash_file(const char * restrict path, unsigned long long * restrict hash)
+{
+	char data[65536];
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		debug("Cannot open %s: %m", path);
+		return false;
+	}
+	*hash = FNV_OFFSET_BASIS;
+	while ((n = read(fd, data, sizeof(data))) != 0) {
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			debug("Cannot read %s: %m", path);
+			(void)close(fd);
+			return false;
+		}
+		*hash = hash_data(data, (size_t)n, *hash);
+	}
+	(void)close(fd);
+	return true;
+}
+
+/*
+ * The directory entries are combined in an order-independent way, as readdir(3)
+ * may return them in any order.
+ */
+static bool
+hash_directory(const char * restrict path, unsigned long long * restrict hash)
+{
+	struct dirent *entry;
+	DIR *dir;
+
+	if ((dir = opendir(path)) == NULL) {
+		debug("Cannot open %s: %m", path);
+		return false;
+	}
+	*hash = 0;
+	while ((entry = readdir(dir)) != NULL)
+		*hash += hash_data(entry->d_name, strlen(entry->d_name),
+		    FNV_OFFSET_BASIS);
+	(void)closedir(dir);
+	return true;
+}
+
+/*
+ * The FNV-1a hash function, see <http://www.isthe.com/chongo/tech/comp/fnv/>.
+ */
+static unsigned long long
+hash_data(const void *data, size_t size, unsigned long long hash)
+{
+	const unsigned char *p = data;
+
+	while (size-- > 0)
+		hash = (hash ^ *p++) * FNV_PRIME;
+
+	return hash;
+}
+
+/* vim:set joinspaces noexpandtab textwidth=80 cinoptions=(4,u0: */
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2014 Holger Weiss <holger@weiss.in-berlin.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stddef.h>
+#include <string.h>
+
+#include "command.h"
+#include "system.h"
+
+#define HOST_RESULT "PROCESS_HOST_CHECK_RESULT"
+#define SERVICE_RESULT "PROCESS_SERVICE_CHECK_RESULT"
+
+static const char *next_field(const char * restrict, const char * restrict,
+                              size_t * restrict);
+static bool is_named(const command_fields * restrict, const char * restrict,
+                     size_t);
+static bool has_result_fields(const char * restrict, const char * restrict);
+
+/*
+ * Exported functions.
+ */
+
+/*
+ * Split an external command into its name and, for check results, the host and
+ * service fields.  A leading bracketed timestamp is skipped.  Nothing is copied
+ * or allocated.  Returns false if the command is malformed, which includes
+ * check results lacking the return code or plugin output.  The fields which
+ * could be parsed are set either way.
+ */
+bool
+command_parse(const char * restrict command, size_t size,
+              command_fields * restrict fields)
+{
+	const char *p = command, *end = command + size;
+
+	fields->name = fields->host = fields->service = NULL;
+	fields->name_len = fields->host_len = fields->service_len = 0;
+	fields->type = COMMAND_OTHER;
+
+	if (size > 0 && end[-1] == '\n')
+		end--;
+	if (p < end && *p == '[') {
+		if ((p = memchr(p, ']', (size_t)(end - p))) == NULL)
+			return false;
+		for (p++; p < end && *p == ' '; p++)
+			continue;
+	}
+
+	fields->name = p;
+	p = next_field(p, end, &fields->name_len);
+
+	if (fields->name_len == 0)
+		return false;
+	if (is_named(fields, HOST_RESULT, sizeof(HOST_RESULT) - 1))
+		fields->type = COMMAND_HOST_RESULT;
+	else if (is_named(fields, SERVICE_RESULT, sizeof(SERVICE_RESULT) - 1))
+		fields->type = COMMAND_SERVICE_RESULT;
+	else
+		return true;
+
+	if (p == NULL)
+		return false;
+	fields->host = p;
+	if ((p = next_field(p, end, &fields->host_len)) == NULL
+	    || fields->host_len == 0)
+		return false;
+
+	if (fields->type == COMMAND_SERVICE_RESULT) {
+		fields->service = p;
+		if ((p = next_field(p, end, &fields->service_len)) == NULL
+		    || fields->service_len == 0)
+			return false;
+		return has_result_fields(p, end);
+	}
+	return p < end; /* The return code must follow. */
+}
+
+/*
+ * Static functions.
+ */
+
+/*
+ * Store the length of the field starting at the given position, and return the
+ * start of the next field, or NULL if there is none.
+ */
+static const char *
+next_field(const char * restrict start, const char * restrict end,
+           size_t * restrict len)
+{
+	const char *semicolon = memchr(start, ';', (size_t)(end - start));
+
+	if (semicolon == NULL) {
+		*len = (size_t)(end - start);
+		return NULL;
+	}
+	*len = (size_t)(semicolon - start);
+	return semicolon + 1;
+}
+
+static bool
+is_named(const command_fields * restrict fields, const char * restrict name,
+         size_t len)
+{
+	return fields->name_len == len && memcmp(fields->name, name, len) == 0;
+}
+
+/*
+ * A service check result must provide a return code and plugin output, each of
+ * which must be non-empty (just like the "services" patterns demand).
+ */
+static bool
+has_result_fields(const char * restrict start, const char * restrict end)
+{
+	const char *semicolon = memchr(start, ';', (size_t)(end - start));
+
+	return semicolon != NULL && semicolon > start && semicolon + 1 < end;
+}
+
+/* vim:set joinspaces noexpandtab textwidth=80 cinoptions=(4,u0: */
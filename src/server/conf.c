@@ -31,22 +31,36 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <ctype.h>
 #include <errno.h>
 #include <ftw.h>
+#if HAVE_PTHREAD
+# include <pthread.h>
+#endif
+#include <pwd.h>
 #include <regex.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "acl.h"
+#include "cache.h"
 #include "conf.h"
 #include "hash.h"
 #include "log.h"
 #include "system.h"
+#include "util.h"
 #include "wrappers.h"
 
 #define MAX_INCLUDE 1000000UL
+#define MAX_COMPILE_THREADS 64
+#define MIN_PATTERNS_PER_THREAD 1000
+#define MIN_PATTERN_BUCKETS 64
 #define DEFAULT_COMMAND_FILE LOCALSTATEDIR "/nagios/rw/nagios.cmd"
+#define DEFAULT_FORWARD_BUFFER_SIZE 1048576
+#define DEFAULT_FORWARD_CONNECTIONS 1
 #define DEFAULT_LISTEN "*"
+#define DEFAULT_LISTEN_BACKLOG 4096
 #define DEFAULT_LOG_LEVEL LOG_LEVEL_NOTICE
 #define DEFAULT_MAX_COMMAND_SIZE 16384
 #define DEFAULT_MAX_QUEUE_SIZE 1024
@@ -55,23 +69,75 @@
 #define DEFAULT_TLS_CIPHERS \
     "PSK-AES256-CBC-SHA:PSK-AES128-CBC-SHA:PSK-3DES-EDE-CBC-SHA:PSK-RC4-SHA"
 
+typedef struct pattern_entry_s {
+	auth_pattern pattern;
+	unsigned long hash;
+	struct pattern_entry_s *next;
+} pattern_entry;
+
+typedef struct {
+	pattern_entry **entries;
+	size_t n_entries;
+} compile_job;
+
+typedef struct {
+	const char *identity;
+	uid_t uid;
+} local_user;
+
+static const char *pattern_settings[N_PATTERN_SETTINGS] = {
+	"hosts",
+	"services",
+	"commands"
+};
+static authorization *authorizations = NULL;
+static forwarding *forwardings = NULL;
+static local_user *local_users = NULL;
+static size_t n_authorizations = 0, n_forwardings = 0, n_local_users = 0;
+static pattern_entry **pattern_buckets = NULL;
+static pattern_entry **patterns = NULL; /* In the order of interning. */
+static size_t n_pattern_buckets = 0, n_patterns = 0, n_pattern_refs = 0;
+static pattern_origin *origins = NULL;
+static size_t n_origins = 0, origins_size = 0;
 static unsigned long n_included = 0;
 static cfg_t *include_cfg;
+static bool caching = false, cached = false, parsing = false;
 
 static int parse_include(cfg_t * restrict, const char * restrict);
 static void check_parse_success(int);
 static void process_auth_sections(cfg_t *);
 static void validate_auth_section(cfg_t *);
+static void convert_auth_section(cfg_t * restrict, authorization * restrict);
+static void process_forward_sections(cfg_t *);
+static void convert_forward_section(cfg_t * restrict, cfg_t * restrict,
+                                    forwarding * restrict);
+static char *pattern_source(size_t, const char *);
+static void compile_patterns(void);
+#if HAVE_PTHREAD
+static void *compile_thread(void *);
+#endif
+static void compile_job_patterns(compile_job *);
+static int compile_pattern(auth_pattern * restrict, char * restrict, size_t);
+static void check_patterns(cfg_t *);
+static void die_invalid_pattern(cfg_t * restrict, const auth_pattern * restrict,
+                                const char * restrict);
+static auth_pattern *find_pattern(const char *, unsigned long);
+static void grow_pattern_table(void);
+static void free_patterns(bool);
+static void free_origins(bool);
+static const pattern_origin *find_origin(const char *);
+static char **get_string_list(cfg_t * restrict, const char * restrict,
+                              size_t * restrict);
+static void load_groups(cfg_t *);
+static void index_authorizations(void);
+static void build_source_acl(void);
+static void build_local_user_map(void);
+static bool get_uid(const char * restrict, uid_t * restrict);
 static void fallback_to_defaults(cfg_t * restrict, cfg_t * restrict);
 static char *host_to_command(const char *);
 static char *service_to_command(const char *);
-static int parse_host_pattern_cb(cfg_t * restrict, cfg_opt_t * restrict,
-                                 const char * restrict, void * restrict);
-static int parse_service_pattern_cb(cfg_t * restrict, cfg_opt_t * restrict,
-                                    const char * restrict, void * restrict);
-static int parse_command_pattern_cb(cfg_t * restrict, cfg_opt_t * restrict,
-                                    const char * restrict, void * restrict);
-static void free_auth_pattern_cb(void *);
+static int parse_pattern_cb(cfg_t * restrict, cfg_opt_t * restrict,
+                            const char * restrict, void * restrict);
 static int validate_unsigned_int_cb(cfg_t *, cfg_opt_t *);
 static int validate_unsigned_float_cb(cfg_t *, cfg_opt_t *);
 static int include_cb(cfg_t * restrict, cfg_opt_t * restrict, int,
@@ -84,7 +150,7 @@ static int include_file_cb(const char *, const struct stat *, int,
  */
 
 cfg_t *
-conf_parse(const char *path)
+conf_parse(const char * restrict path, const char * restrict cache_file)
 {
 	struct stat sb;
 
@@ -93,63 +159,293 @@ conf_parse(const char *path)
 	 * setting, also add the setting as a CFG_STR to the list of global
 	 * options, and add the setting's name to the "settings" array in the
 	 * fallback_to_defaults() function.  This should be done for all
-	 * authorization settings.
+	 * authorization settings, except for "local_users", as a user can only
+	 * be mapped to a single identity.
 	 */
 	cfg_opt_t auth_opts[] = {
 		CFG_STR("password", NULL, CFGF_NODEFAULT),
-		CFG_PTR_LIST_CB("commands", NULL, CFGF_NODEFAULT,
-		    parse_command_pattern_cb, free_auth_pattern_cb),
-		CFG_PTR_LIST_CB("hosts", NULL, CFGF_NODEFAULT,
-		    parse_host_pattern_cb, free_auth_pattern_cb),
-		CFG_PTR_LIST_CB("services", NULL, CFGF_NODEFAULT,
-		    parse_service_pattern_cb, free_auth_pattern_cb),
+		CFG_INT("max_burst", 0, CFGF_NODEFAULT),
+		CFG_FLOAT("max_rate", 0.0, CFGF_NODEFAULT),
+		CFG_INT("queue_share", 0, CFGF_NODEFAULT),
+		CFG_BOOL("rate_limit_per_address", cfg_false, CFGF_NODEFAULT),
+		CFG_STR_LIST("sources", NULL, CFGF_NODEFAULT),
+		CFG_STR_LIST("local_users", NULL, CFGF_NODEFAULT),
+		CFG_STR_LIST_CB("commands", NULL, CFGF_NODEFAULT,
+		    parse_pattern_cb),
+		CFG_STR_LIST("host_groups", NULL, CFGF_NODEFAULT),
+		CFG_STR_LIST_CB("hosts", NULL, CFGF_NODEFAULT,
+		    parse_pattern_cb),
+		CFG_STR_LIST("service_groups", NULL, CFGF_NODEFAULT),
+		CFG_STR_LIST_CB("services", NULL, CFGF_NODEFAULT,
+		    parse_pattern_cb),
+		CFG_END()
+	};
+	cfg_opt_t forward_opts[] = {
+		CFG_STR("server", NULL, CFGF_NODEFAULT),
+		CFG_STR("port", DEFAULT_PORT, CFGF_NONE),
+		CFG_STR("identity", NULL, CFGF_NODEFAULT),
+		CFG_STR("password", NULL, CFGF_NODEFAULT),
+		CFG_STR_LIST_CB("commands", NULL, CFGF_NODEFAULT,
+		    parse_pattern_cb),
+		CFG_STR_LIST_CB("hosts", NULL, CFGF_NODEFAULT,
+		    parse_pattern_cb),
+		CFG_STR_LIST_CB("services", NULL, CFGF_NODEFAULT,
+		    parse_pattern_cb),
+		CFG_INT("connections", DEFAULT_FORWARD_CONNECTIONS, CFGF_NONE),
+		CFG_INT("max_buffer_size", DEFAULT_FORWARD_BUFFER_SIZE,
+		    CFGF_NONE),
+		CFG_INT("max_spool_size", 0, CFGF_NONE),
+		CFG_STR("spool_file", NULL, CFGF_NODEFAULT),
+		CFG_BOOL("submit_locally", cfg_true, CFGF_NONE),
+		CFG_STR("tls_ciphers", NULL, CFGF_NODEFAULT),
 		CFG_END()
 	};
 	cfg_opt_t opts[] = {
 		CFG_FUNC("include", include_cb),
 		CFG_STR("chroot", NULL, CFGF_NODEFAULT),
 		CFG_STR("command_file", DEFAULT_COMMAND_FILE, CFGF_NONE),
-		CFG_STR("commands", NULL, CFGF_NODEFAULT),
-		CFG_STR("hosts", NULL, CFGF_NODEFAULT),
+		CFG_STR_CB("commands", NULL, CFGF_NODEFAULT, parse_pattern_cb),
+		CFG_STR_LIST("host_groups", NULL, CFGF_NODEFAULT),
+		CFG_STR_CB("hosts", NULL, CFGF_NODEFAULT, parse_pattern_cb),
 		CFG_STR("listen", DEFAULT_LISTEN, CFGF_NONE),
+		CFG_INT("listen_backlog", DEFAULT_LISTEN_BACKLOG, CFGF_NONE),
+		CFG_STR("listen_unix", NULL, CFGF_NODEFAULT),
 		CFG_INT("log_level", DEFAULT_LOG_LEVEL, CFGF_NONE),
+		CFG_STR("max_burst", NULL, CFGF_NODEFAULT),
 		CFG_INT("max_command_size", DEFAULT_MAX_COMMAND_SIZE, CFGF_NONE),
+		CFG_INT("max_connections", 0, CFGF_NONE),
+		CFG_INT("max_handshakes", 0, CFGF_NONE),
+		CFG_INT("max_handshakes_per_address", 0, CFGF_NONE),
 		CFG_INT("max_queue_size", DEFAULT_MAX_QUEUE_SIZE, CFGF_NONE),
+		CFG_STR("max_rate", NULL, CFGF_NODEFAULT),
+		CFG_STR("objects_cache", NULL, CFGF_NODEFAULT),
 		CFG_STR("password", NULL, CFGF_NODEFAULT),
 		CFG_STR("pid_file", NULL, CFGF_NODEFAULT),
-		CFG_STR("services", NULL, CFGF_NODEFAULT),
+		CFG_STR("queue_share", NULL, CFGF_NODEFAULT),
+		CFG_STR("rate_limit_per_address", NULL, CFGF_NODEFAULT),
+		CFG_STR_LIST("service_groups", NULL, CFGF_NODEFAULT),
+		CFG_STR_CB("services", NULL, CFGF_NODEFAULT, parse_pattern_cb),
+		CFG_STR_LIST("sources", NULL, CFGF_NODEFAULT),
 		CFG_STR("temp_directory", DEFAULT_TEMP_DIRECTORY, CFGF_NONE),
 		CFG_STR("tls_ciphers", DEFAULT_TLS_CIPHERS, CFGF_NONE),
 		CFG_FLOAT("timeout", DEFAULT_TIMEOUT, CFGF_NONE),
 		CFG_STR("user", NULL, CFGF_NODEFAULT),
 		CFG_SEC("authorize", auth_opts,
 		    CFGF_MULTI | CFGF_TITLE | CFGF_NO_TITLE_DUPES),
+		CFG_SEC("forward", forward_opts,
+		    CFGF_MULTI | CFGF_TITLE | CFGF_NO_TITLE_DUPES),
 		CFG_END()
 	};
 	cfg_t *cfg = cfg_init(opts, CFGF_NONE); /* Aborts on error. */
 
+	cfg_set_validate_func(cfg, "listen_backlog",
+	    validate_unsigned_int_cb);
 	cfg_set_validate_func(cfg, "log_level",
 	    validate_unsigned_int_cb);
 	cfg_set_validate_func(cfg, "max_command_size",
 	    validate_unsigned_int_cb);
+	cfg_set_validate_func(cfg, "max_connections",
+	    validate_unsigned_int_cb);
+	cfg_set_validate_func(cfg, "max_handshakes",
+	    validate_unsigned_int_cb);
+	cfg_set_validate_func(cfg, "max_handshakes_per_address",
+	    validate_unsigned_int_cb);
 	cfg_set_validate_func(cfg, "max_queue_size",
 	    validate_unsigned_int_cb);
 	cfg_set_validate_func(cfg, "timeout",
 	    validate_unsigned_float_cb);
 
-	debug("Parsing configuration file %s", path);
+	if (cache_file != NULL && cache_load(cache_file, path, opts, cfg,
+	    &authorizations, &n_authorizations, &origins, &n_origins))
+		cached = true;
+	else {
+		/* Forget any patterns interned from an unusable cache. */
+		free_patterns(false);
+		debug("Parsing configuration file %s", path);
 
-	if (stat(path, &sb) == -1)
-		die("Cannot access %s: %m", path);
-	if (S_ISDIR(sb.st_mode))
-		check_parse_success(parse_include(cfg, path));
-	else
-		check_parse_success(cfg_parse(cfg, path));
+		caching = cache_file != NULL;
+		if (stat(path, &sb) == -1)
+			die("Cannot access %s: %m", path);
+		parsing = true;
+		if (S_ISDIR(sb.st_mode))
+			check_parse_success(parse_include(cfg, path));
+		else {
+			if (caching)
+				cache_add_input(path);
+			check_parse_success(cfg_parse(cfg, path));
+		}
+		parsing = false;
 
-	process_auth_sections(cfg);
+		process_auth_sections(cfg);
+	}
+	debug("Using %zu unique out of %zu configured pattern(s)", n_patterns,
+	    n_pattern_refs);
+	process_forward_sections(cfg);
+	if (!cached) {
+		/* Only a configuration without invalid patterns is cached. */
+		if (caching)
+			cache_save(cache_file, path, opts, cfg, authorizations,
+			    n_authorizations, origins, n_origins);
+		free_origins(true);
+	}
+	load_groups(cfg);
+	index_authorizations();
+	build_source_acl();
+	build_local_user_map();
 	return cfg;
 }
 
+void
+conf_free(cfg_t *cfg)
+{
+	size_t i;
+
+	for (i = 0; i < n_authorizations; i++) {
+		authorization *auth = &authorizations[i];
+
+		(void)memset(auth->password, 0, strlen(auth->password));
+
+		group_set_free(auth->host_group_set);
+		group_set_free(auth->service_group_set);
+		if (auth->host_groups != NULL)
+			free(auth->host_groups);
+		if (auth->service_groups != NULL)
+			free(auth->service_groups);
+		if (auth->patterns != NULL)
+			free(auth->patterns);
+		if (auth->sources != NULL)
+			free(auth->sources);
+		if (auth->local_users != NULL)
+			free(auth->local_users);
+	}
+	if (authorizations != NULL)
+		free(authorizations);
+	authorizations = NULL;
+	n_authorizations = 0;
+
+	if (local_users != NULL)
+		free(local_users);
+	local_users = NULL;
+	n_local_users = 0;
+
+	for (i = 0; i < n_forwardings; i++) {
+		forwarding *forward = &forwardings[i];
+		size_t j;
+
+		(void)memset(forward->password, 0, strlen(forward->password));
+		for (j = 0; j < forward->n_patterns; j++) {
+			auth_pattern *pattern = forward->patterns[j];
+
+			regfree(pattern->regex);
+			free(pattern->regex);
+			free(pattern->source);
+			free(pattern);
+		}
+		if (forward->patterns != NULL)
+			free(forward->patterns);
+		free(forward->server);
+		free(forward->spool_file);
+	}
+	if (forwardings != NULL)
+		free(forwardings);
+	forwardings = NULL;
+	n_forwardings = 0;
+
+	free_patterns(!cached);
+	free_origins(!cached);
+	group_free();
+	cached = caching = false;
+	cache_free();
+	cfg_free(cfg);
+	acl_free();
+}
+
+bool
+conf_compile_pattern(auth_pattern *pattern)
+{
+	const pattern_origin *origin;
+	char errbuf[128];
+
+	if (compile_pattern(pattern, errbuf, sizeof(errbuf)) != 0) {
+		if ((origin = find_origin(pattern->source)) != NULL)
+			error("%s:%u: Error in `%s' pattern `%s': %s",
+			    origin->file, origin->line,
+			    pattern_settings[origin->setting], origin->value,
+			    errbuf);
+		else
+			error("Cannot compile pattern `%s': %s",
+			    pattern->source, errbuf);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Return the shared pattern for the given source, adding it if it's new.  A
+ * new pattern takes over the source string, so callers which own the string
+ * must free it if they get back a pattern with a different source.
+ */
+auth_pattern *
+conf_intern_pattern(char *source)
+{
+	unsigned long hash = hash_string(source);
+	pattern_entry *entry;
+	auth_pattern *pattern;
+
+	n_pattern_refs++;
+	if ((pattern = find_pattern(source, hash)) != NULL)
+		return pattern;
+
+	if (n_patterns == n_pattern_buckets)
+		grow_pattern_table();
+
+	entry = xmalloc(sizeof(pattern_entry));
+	entry->pattern.source = source;
+	entry->pattern.regex = NULL;
+	entry->hash = hash;
+	entry->next = pattern_buckets[hash % n_pattern_buckets];
+	pattern_buckets[hash % n_pattern_buckets] = entry;
+	patterns[n_patterns++] = entry;
+
+	return &entry->pattern;
+}
+
+/*
+ * Return the identity the given user is mapped to, or NULL if there's none.
+ */
+const char *
+conf_get_local_identity(uid_t uid)
+{
+	size_t i;
+
+	for (i = 0; i < n_local_users; i++)
+		if (local_users[i].uid == uid)
+			return local_users[i].identity;
+
+	return NULL;
+}
+
+const forwarding *
+conf_get_forwardings(size_t *n)
+{
+	*n = n_forwardings;
+	return forwardings;
+}
+
+void
+conf_log_stats(void)
+{
+	size_t i, n_compiled = 0;
+
+	for (i = 0; i < n_patterns; i++)
+		if (patterns[i]->pattern.regex != NULL)
+			n_compiled++;
+
+	notice("%zu authorization(s) referencing %zu pattern(s), %zu unique "
+	    "(%zu compiled)", n_authorizations, n_pattern_refs, n_patterns,
+	    n_compiled);
+}
+
 /*
  * Static functions.
  */
@@ -189,17 +485,19 @@ process_auth_sections(cfg_t *cfg)
 	if ((n_auth_blocks = cfg_size(cfg, "authorize")) == 0)
 		die("No authorizations configured");
 
-	hash_new((size_t)(n_auth_blocks /* Minimize collisions: */ * 1.5));
+	authorizations = xmalloc(n_auth_blocks * sizeof(authorization));
+	n_authorizations = n_auth_blocks;
 
 	for (i = 0; i < n_auth_blocks; i++) {
 		cfg_t *auth = cfg_getnsec(cfg, "authorize", i);
-		const char *identity = cfg_title(auth);
 
-		debug("Processing authorizations for %s", identity);
+		debug("Processing authorizations for %s", cfg_title(auth));
 		fallback_to_defaults(cfg, auth);
 		validate_auth_section(auth);
-		hash_insert(identity, auth);
+		convert_auth_section(auth, &authorizations[i]);
 	}
+	compile_patterns();
+	check_patterns(cfg);
 }
 
 static void
@@ -209,6 +507,578 @@ validate_auth_section(cfg_t *auth)
 
 	if (cfg_size(auth, "password") == 0)
 		die("No password specified for %s", identity);
+	if (cfg_size(auth, "max_rate") > 0
+	    && cfg_getfloat(auth, "max_rate") < 0.0)
+		die("The `max_rate' for %s must be a positive value", identity);
+	if (cfg_size(auth, "max_burst") > 0
+	    && cfg_getint(auth, "max_burst") < 0)
+		die("The `max_burst' for %s must be a positive integer",
+		    identity);
+	if (cfg_size(auth, "queue_share") > 0
+	    && (cfg_getint(auth, "queue_share") < 0
+	    || cfg_getint(auth, "queue_share") > 100))
+		die("The `queue_share' for %s must be between 0 and 100",
+		    identity);
+}
+
+/*
+ * Convert the "authorize" section into the representation used at run time.
+ * The strings are owned by the section, except for the command patterns.
+ */
+static void
+convert_auth_section(cfg_t * restrict section, authorization * restrict auth)
+{
+	unsigned int j;
+	size_t i;
+
+	auth->identity = cfg_title(section);
+	auth->password = cfg_getstr(section, "password");
+	auth->max_rate = cfg_size(section, "max_rate") > 0 ?
+	    cfg_getfloat(section, "max_rate") : 0.0;
+	auth->max_burst = cfg_size(section, "max_burst") > 0 ?
+	    (unsigned long)cfg_getint(section, "max_burst") : 0;
+	auth->queue_share = cfg_size(section, "queue_share") > 0 ?
+	    (unsigned int)cfg_getint(section, "queue_share") : 0;
+	auth->rate_limit_per_address =
+	    cfg_size(section, "rate_limit_per_address") > 0
+	    && cfg_getbool(section, "rate_limit_per_address");
+
+	auth->sources = get_string_list(section, "sources", &auth->n_sources);
+	auth->local_users = get_string_list(section, "local_users",
+	    &auth->n_local_users);
+	auth->host_groups = get_string_list(section, "host_groups",
+	    &auth->n_host_groups);
+	auth->service_groups = get_string_list(section, "service_groups",
+	    &auth->n_service_groups);
+	auth->host_group_set = auth->service_group_set = NULL;
+
+	auth->n_patterns = 0;
+	for (i = 0; i < N_PATTERN_SETTINGS; i++)
+		auth->n_patterns += cfg_size(section, pattern_settings[i]);
+	auth->patterns = auth->n_patterns > 0 ?
+	    xmalloc(auth->n_patterns * sizeof(auth_pattern *)) : NULL;
+	auth->n_patterns = 0;
+
+	for (i = 0; i < N_PATTERN_SETTINGS; i++)
+		for (j = 0; j < cfg_size(section, pattern_settings[i]); j++) {
+			char *source = pattern_source(i,
+			    cfg_getnstr(section, pattern_settings[i], j));
+
+			auth->patterns[auth->n_patterns] =
+			    conf_intern_pattern(source);
+			if (auth->patterns[auth->n_patterns++]->source
+			    != source)
+				free(source);
+		}
+}
+
+/*
+ * The "forward" blocks aren't looked up by identity, and there's usually just a
+ * few of them, so they're simply kept in an array, and their patterns aren't
+ * interned.
+ */
+static void
+process_forward_sections(cfg_t *cfg)
+{
+	unsigned int i;
+
+	if ((n_forwardings = cfg_size(cfg, "forward")) == 0)
+		return;
+
+	forwardings = xmalloc(n_forwardings * sizeof(forwarding));
+	for (i = 0; i < n_forwardings; i++) {
+		cfg_t *section = cfg_getnsec(cfg, "forward", i);
+
+		debug("Processing forwarding settings for %s",
+		    cfg_title(section));
+		convert_forward_section(cfg, section, &forwardings[i]);
+	}
+}
+
+static void
+convert_forward_section(cfg_t * restrict cfg, cfg_t * restrict section,
+                        forwarding * restrict forward)
+{
+	const char *name = cfg_title(section);
+	unsigned int j;
+	size_t i;
+
+	if (cfg_size(section, "server") == 0)
+		die("No server specified for forwarding to %s", name);
+	if (cfg_size(section, "identity") == 0)
+		die("No identity specified for forwarding to %s", name);
+	if (cfg_size(section, "password") == 0)
+		die("No password specified for forwarding to %s", name);
+	if (cfg_getint(section, "connections") < 1)
+		die("The `connections' for %s must be a positive integer",
+		    name);
+	if (cfg_getint(section, "max_buffer_size") < 0)
+		die("The `max_buffer_size' for %s must be a positive integer",
+		    name);
+	if (cfg_getint(section, "max_spool_size") < 0)
+		die("The `max_spool_size' for %s must be a positive integer",
+		    name);
+
+	forward->name = name;
+	xasprintf(&forward->server, "%s:%s", cfg_getstr(section, "server"),
+	    cfg_getstr(section, "port"));
+	forward->identity = cfg_getstr(section, "identity");
+	forward->password = cfg_getstr(section, "password");
+	forward->ciphers = cfg_size(section, "tls_ciphers") > 0 ?
+	    cfg_getstr(section, "tls_ciphers") : cfg_getstr(cfg, "tls_ciphers");
+	if (cfg_size(section, "spool_file") > 0)
+		forward->spool_file = xstrdup(cfg_getstr(section,
+		    "spool_file"));
+	else {
+		char *p;
+
+		/* Keep slashes and the like out of the file name. */
+		xasprintf(&forward->spool_file, "%s/forward-%s.spool",
+		    cfg_getstr(cfg, "temp_directory"), name);
+		for (p = strrchr(forward->spool_file, '/') + 1; *p != '\0';
+		    p++)
+			if (!isalnum((unsigned char)*p) && *p != '.'
+			    && *p != '-')
+				*p = '_';
+	}
+	forward->n_connections = (size_t)cfg_getint(section, "connections");
+	forward->max_buffer_size =
+	    (size_t)cfg_getint(section, "max_buffer_size");
+	forward->max_spool_size =
+	    (size_t)cfg_getint(section, "max_spool_size");
+	forward->submit_locally = cfg_getbool(section, "submit_locally");
+
+	forward->n_patterns = 0;
+	for (i = 0; i < N_PATTERN_SETTINGS; i++)
+		forward->n_patterns += cfg_size(section, pattern_settings[i]);
+	forward->patterns = forward->n_patterns > 0 ?
+	    xmalloc(forward->n_patterns * sizeof(auth_pattern *)) : NULL;
+	forward->n_patterns = 0;
+
+	for (i = 0; i < N_PATTERN_SETTINGS; i++)
+		for (j = 0; j < cfg_size(section, pattern_settings[i]); j++) {
+			const char *value =
+			    cfg_getnstr(section, pattern_settings[i], j);
+			auth_pattern *pattern = xmalloc(sizeof(auth_pattern));
+			char errbuf[128];
+
+			pattern->source = pattern_source(i, value);
+			if (compile_pattern(pattern, errbuf, sizeof(errbuf))
+			    != 0)
+				die_invalid_pattern(cfg, pattern, errbuf);
+			forward->patterns[forward->n_patterns++] = pattern;
+		}
+}
+
+/*
+ * Convert the value of the specified pattern setting into an anchored regular
+ * expression which matches the command.
+ */
+static char *
+pattern_source(size_t setting, const char *value)
+{
+	char *command, *source;
+
+	if (setting == 0)
+		command = host_to_command(value);
+	else if (setting == 1)
+		command = service_to_command(value);
+	else
+		command = xstrdup(value);
+
+	xasprintf(&source, "^%s\n?$", command);
+	free(command);
+
+	return source;
+}
+
+/*
+ * Compiling the patterns of many "authorize" blocks takes a while, so the work
+ * is spread across threads.  (The configuration files are still parsed
+ * sequentially, as libConfuse isn't reentrant.)  Each thread handles a
+ * contiguous range of unique patterns, and errors are reported afterwards in
+ * the order of the configuration files, so the outcome doesn't depend on the
+ * scheduling.
+ */
+static void
+compile_patterns(void)
+{
+	compile_job all = { patterns, n_patterns };
+#if HAVE_PTHREAD && defined(_SC_NPROCESSORS_ONLN)
+	pthread_t threads[MAX_COMPILE_THREADS];
+	compile_job jobs[MAX_COMPILE_THREADS];
+	bool started[MAX_COMPILE_THREADS];
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t i, n_threads;
+
+	n_threads = MIN(n_patterns / MIN_PATTERNS_PER_THREAD,
+	    n_cpus > 1 ? MIN((size_t)n_cpus, MAX_COMPILE_THREADS) : 1);
+
+	if (n_threads > 1) {
+		debug("Compiling %zu patterns using %zu threads", n_patterns,
+		    n_threads);
+
+		for (i = 0; i < n_threads; i++) {
+			size_t first = i * n_patterns / n_threads;
+			size_t last = (i + 1) * n_patterns / n_threads;
+
+			jobs[i].entries = patterns + first;
+			jobs[i].n_entries = last - first;
+			started[i] = pthread_create(&threads[i], NULL,
+			    compile_thread, &jobs[i]) == 0;
+			if (!started[i])
+				compile_job_patterns(&jobs[i]);
+		}
+		for (i = 0; i < n_threads; i++)
+			if (started[i])
+				(void)pthread_join(threads[i], NULL);
+		return;
+	}
+#endif
+	compile_job_patterns(&all);
+}
+
+#if HAVE_PTHREAD
+static void *
+compile_thread(void *arg)
+{
+	compile_job_patterns(arg);
+	return NULL;
+}
+#endif
+
+static void
+compile_job_patterns(compile_job *job)
+{
+	size_t i;
+
+	for (i = 0; i < job->n_entries; i++)
+		(void)compile_pattern(&job->entries[i]->pattern, NULL, 0);
+}
+
+/*
+ * This function may be called by multiple threads concurrently, so it must not
+ * log anything.
+ */
+static int
+compile_pattern(auth_pattern * restrict pattern, char * restrict errbuf,
+                size_t errbuf_size)
+{
+	int status;
+
+	pattern->regex = xmalloc(sizeof(regex_t));
+	if ((status = regcomp(pattern->regex, pattern->source,
+	    REG_EXTENDED | REG_NOSUB)) != 0) {
+		if (errbuf != NULL)
+			(void)regerror(status, pattern->regex, errbuf,
+			    errbuf_size);
+		free(pattern->regex);
+		pattern->regex = NULL;
+	}
+	return status;
+}
+
+/*
+ * Invalid patterns are reported the way libConfuse reported them back when the
+ * patterns were compiled while parsing: the first one in the order of the
+ * configuration files is reported, along with its location.
+ */
+static void
+check_patterns(cfg_t *cfg)
+{
+	char errbuf[128];
+	size_t i;
+
+	for (i = 0; i < n_patterns; i++)
+		if (patterns[i]->pattern.regex == NULL)
+			break;
+	if (i == n_patterns)
+		return;
+
+	for (i = 0; i < n_origins; i++) {
+		pattern_origin *origin = &origins[i];
+		char *source = pattern_source(origin->setting, origin->value);
+		auth_pattern *pattern = find_pattern(source,
+		    hash_string(source));
+
+		free(source);
+		if (pattern == NULL || pattern->regex != NULL)
+			continue;
+
+		(void)compile_pattern(pattern, errbuf, sizeof(errbuf));
+		die_invalid_pattern(cfg, pattern, errbuf);
+	}
+	die("Cannot compile the authorization patterns");
+}
+
+static void
+die_invalid_pattern(cfg_t * restrict cfg, const auth_pattern * restrict pattern,
+                    const char * restrict errbuf)
+{
+	const pattern_origin *origin = find_origin(pattern->source);
+	char *file = cfg->filename;
+	int line = cfg->line;
+
+	if (origin == NULL) /* Won't happen. */
+		die("Cannot compile pattern `%s': %s", pattern->source, errbuf);
+
+	cfg->filename = origin->file;
+	cfg->line = (int)origin->line;
+	cfg_error(cfg, "Error in `%s' pattern `%s': %s",
+	    pattern_settings[origin->setting], origin->value, errbuf);
+	cfg->filename = file;
+	cfg->line = line;
+	exit(EXIT_FAILURE);
+}
+
+static auth_pattern *
+find_pattern(const char *source, unsigned long hash)
+{
+	pattern_entry *entry;
+
+	if (n_pattern_buckets > 0)
+		for (entry = pattern_buckets[hash % n_pattern_buckets];
+		    entry != NULL; entry = entry->next)
+			if (entry->hash == hash
+			    && strcmp(entry->pattern.source, source) == 0)
+				return &entry->pattern;
+
+	return NULL;
+}
+
+static void
+grow_pattern_table(void)
+{
+	size_t i, n_buckets = n_pattern_buckets > 0 ?
+	    n_pattern_buckets * 2 : MIN_PATTERN_BUCKETS;
+
+	if (pattern_buckets != NULL)
+		free(pattern_buckets);
+	pattern_buckets = xmalloc(n_buckets * sizeof(pattern_entry *));
+	for (i = 0; i < n_buckets; i++)
+		pattern_buckets[i] = NULL;
+	patterns = xrealloc(patterns, n_buckets * sizeof(pattern_entry *));
+	n_pattern_buckets = n_buckets;
+
+	for (i = 0; i < n_patterns; i++) {
+		pattern_entry *entry = patterns[i];
+		size_t slot = entry->hash % n_pattern_buckets;
+
+		entry->next = pattern_buckets[slot];
+		pattern_buckets[slot] = entry;
+	}
+}
+
+static void
+free_patterns(bool free_sources)
+{
+	size_t i;
+
+	for (i = 0; i < n_patterns; i++) {
+		auth_pattern *pattern = &patterns[i]->pattern;
+
+		if (pattern->regex != NULL) {
+			regfree(pattern->regex);
+			free(pattern->regex);
+		}
+		if (free_sources)
+			free(pattern->source);
+		free(patterns[i]);
+	}
+	if (pattern_buckets != NULL)
+		free(pattern_buckets);
+	if (patterns != NULL)
+		free(patterns);
+	pattern_buckets = patterns = NULL;
+	n_pattern_buckets = n_patterns = n_pattern_refs = 0;
+}
+
+/*
+ * Look up where the pattern was first specified.  This is only done for error
+ * messages, so a linear search is good enough.
+ */
+static const pattern_origin *
+find_origin(const char *source)
+{
+	size_t i;
+
+	for (i = 0; i < n_origins; i++) {
+		char *origin_source = pattern_source(origins[i].setting,
+		    origins[i].value);
+		bool found = strcmp(origin_source, source) == 0;
+
+		free(origin_source);
+		if (found)
+			return &origins[i];
+	}
+	return NULL;
+}
+
+static void
+free_origins(bool free_strings)
+{
+	size_t i;
+
+	for (i = 0; free_strings && i < n_origins; i++) {
+		if (i == 0 || origins[i].file != origins[i - 1].file)
+			free(origins[i].file);
+		free(origins[i].value);
+	}
+	if (origins != NULL)
+		free(origins);
+	origins = NULL;
+	n_origins = origins_size = 0;
+}
+
+static char **
+get_string_list(cfg_t * restrict section, const char * restrict name,
+                size_t * restrict n)
+{
+	char **list;
+	unsigned int i;
+
+	if ((*n = cfg_size(section, name)) == 0)
+		return NULL;
+
+	list = xmalloc(*n * sizeof(char *));
+	for (i = 0; i < *n; i++)
+		list[i] = cfg_getnstr(section, name, i);
+
+	return list;
+}
+
+/*
+ * The group memberships are read from the "objects_cache" file on every start,
+ * even if the configuration was loaded from the cache, as they change whenever
+ * Nagios reloads its configuration.
+ */
+static void
+load_groups(cfg_t *cfg)
+{
+	const char *objects_cache = cfg_getstr(cfg, "objects_cache");
+	size_t i;
+	bool needed = false;
+
+	for (i = 0; i < n_authorizations; i++)
+		if (authorizations[i].n_host_groups > 0
+		    || authorizations[i].n_service_groups > 0)
+			needed = true;
+	if (!needed)
+		return;
+	if (objects_cache == NULL)
+		die("The `host_groups' and `service_groups' settings require an "
+		    "`objects_cache' file");
+	if (!group_load(objects_cache))
+		exit(EXIT_FAILURE);
+
+	for (i = 0; i < n_authorizations; i++) {
+		authorization *auth = &authorizations[i];
+
+		auth->host_group_set = group_set_new(auth->host_groups,
+		    auth->n_host_groups);
+		auth->service_group_set = group_set_new(auth->service_groups,
+		    auth->n_service_groups);
+	}
+}
+
+static void
+index_authorizations(void)
+{
+	size_t i;
+
+	hash_new((size_t)(n_authorizations /* Minimize collisions: */ * 1.5));
+
+	for (i = 0; i < n_authorizations; i++)
+		hash_insert(authorizations[i].identity, &authorizations[i]);
+}
+
+/*
+ * Source restrictions are enforced only if at least one "authorize" block
+ * specifies them (possibly by falling back to the global setting).  In that
+ * case, blocks without restrictions accept connections from anywhere.
+ */
+static void
+build_source_acl(void)
+{
+	size_t i, j;
+	bool restricted = false;
+
+	for (i = 0; i < n_authorizations; i++)
+		if (authorizations[i].n_sources > 0)
+			restricted = true;
+	if (!restricted)
+		return;
+
+	for (i = 0; i < n_authorizations; i++) {
+		authorization *auth = &authorizations[i];
+
+		if (auth->n_sources == 0) {
+			(void)acl_add("0.0.0.0/0", auth);
+			(void)acl_add("::/0", auth);
+		}
+		for (j = 0; j < auth->n_sources; j++)
+			if (!acl_add(auth->sources[j], auth))
+				die("Invalid source address for %s: %s",
+				    auth->identity, auth->sources[j]);
+	}
+}
+
+/*
+ * There's usually just a few local users, so they're simply kept in an array.
+ * The user names are resolved before the privileges are dropped, as the user
+ * database might not be available in the chroot(2) environment.
+ */
+static void
+build_local_user_map(void)
+{
+	size_t i, j, k;
+
+	for (i = 0; i < n_authorizations; i++) {
+		authorization *auth = &authorizations[i];
+
+		for (j = 0; j < auth->n_local_users; j++) {
+			uid_t uid;
+
+			if (!get_uid(auth->local_users[j], &uid))
+				die("Unknown local user for %s: %s",
+				    auth->identity, auth->local_users[j]);
+			for (k = 0; k < n_local_users; k++)
+				if (local_users[k].uid == uid)
+					die("Local user %s is mapped to %s and "
+					    "%s", auth->local_users[j],
+					    local_users[k].identity,
+					    auth->identity);
+
+			local_users = xrealloc(local_users,
+			    (n_local_users + 1) * sizeof(local_user));
+			local_users[n_local_users].identity = auth->identity;
+			local_users[n_local_users].uid = uid;
+			n_local_users++;
+		}
+	}
+}
+
+/*
+ * Accept a user name or a numeric user ID.
+ */
+static bool
+get_uid(const char * restrict name, uid_t * restrict uid)
+{
+	struct passwd *pw;
+	unsigned long id;
+	char *end;
+
+	if ((pw = getpwnam(name)) != NULL) {
+		*uid = pw->pw_uid;
+		return true;
+	}
+	errno = 0;
+	id = strtoul(name, &end, 10);
+	if (!isdigit((unsigned char)*name) || *end != '\0' || errno != 0)
+		return false;
+
+	*uid = (uid_t)id;
+	return true;
 }
 
 static void
@@ -218,7 +1088,14 @@ fallback_to_defaults(cfg_t * restrict cfg, cfg_t * restrict auth)
 	    "hosts",
 	    "services",
 	    "commands",
-	    "password"
+	    "host_groups",
+	    "service_groups",
+	    "password",
+	    "max_rate",
+	    "max_burst",
+	    "rate_limit_per_address",
+	    "queue_share",
+	    "sources"
 	};
 	size_t i;
 
@@ -269,60 +1146,48 @@ service_to_command(const char *service_pattern)
 	return command_pattern;
 }
 
+/*
+ * See <http://www.nongnu.org/confuse/tutorial-html/ar01s06.html>.
+ */
+/*
+ * The patterns are compiled after parsing, so remember where each of them was
+ * specified, in order to report errors the way libConfuse does.
+ */
 static int
-parse_host_pattern_cb(cfg_t * restrict cfg, cfg_opt_t * restrict opt,
-                      const char * restrict value, void * restrict result)
-{
-	char *command_pattern = host_to_command(value);
-	int success = parse_command_pattern_cb(cfg, opt, command_pattern,
-	    result);
-
-	free(command_pattern);
-	return success;
-}
-
-static int
-parse_service_pattern_cb(cfg_t * restrict cfg, cfg_opt_t * restrict opt,
-                         const char * restrict value, void * restrict result)
+parse_pattern_cb(cfg_t * restrict cfg, cfg_opt_t * restrict opt,
+                 const char * restrict value, void * restrict result)
 {
-	char *command_pattern = service_to_command(value);
-	int success = parse_command_pattern_cb(cfg, opt, command_pattern,
-	    result);
+	pattern_origin *origin, *previous;
 
-	free(command_pattern);
-	return success;
-}
+	*(const char **)result = value;
+	if (!parsing) /* Falling back to a global default. */
+		return 0;
 
-static int
-parse_command_pattern_cb(cfg_t * restrict cfg, cfg_opt_t * restrict opt,
-                         const char * restrict value, void * restrict result)
-{
-	regex_t **re = result;
-	char *pattern;
-	char errbuf[128];
-	int success;
-
-	xasprintf(&pattern, "^%s\n?$", value);
-	*re = xmalloc(sizeof(regex_t));
-	if ((success = regcomp(*re, pattern, REG_EXTENDED | REG_NOSUB)) != 0) {
-		(void)regerror(success, *re, errbuf, sizeof(errbuf));
-		cfg_error(cfg, "Error in `%s' pattern `%s': %s", opt->name,
-		    value, errbuf);
+	if (n_origins == origins_size) {
+		origins_size = origins_size > 0 ? origins_size * 2 : 64;
+		origins = xrealloc(origins,
+		    origins_size * sizeof(pattern_origin));
 	}
-	free(pattern);
-	return success;
-}
+	origin = &origins[n_origins];
+	previous = n_origins > 0 ? &origins[n_origins - 1] : NULL;
+	n_origins++;
 
-static void
-free_auth_pattern_cb(void *value)
-{
-	regfree(value);
-	free(value);
+	if (previous != NULL && cfg->filename != NULL
+	    && strcmp(previous->file, cfg->filename) == 0)
+		origin->file = previous->file;
+	else
+		origin->file = xstrdup(cfg->filename != NULL ?
+		    cfg->filename : "");
+	origin->value = xstrdup(value);
+	origin->line = (unsigned int)cfg->line;
+	for (origin->setting = 0;
+	    strcmp(pattern_settings[origin->setting], opt->name) != 0;
+	    origin->setting++)
+		continue;
+
+	return 0;
 }
 
-/*
- * See <http://www.nongnu.org/confuse/tutorial-html/ar01s06.html>.
- */
 static int
 validate_unsigned_int_cb(cfg_t * restrict cfg, cfg_opt_t * restrict opt)
 {
@@ -372,6 +1237,8 @@ include_cb(cfg_t * restrict cfg, cfg_opt_t * restrict opt, int argc,
 		cfg_error(cfg, "Cannot access %s: %s", path, strerror(errno));
 		status = 1;
 	} else if (S_ISREG(sb.st_mode)) {
+		if (caching)
+			cache_add_input(path);
 		status = cfg_include(cfg, opt, argc, argv);
 	} else if (S_ISDIR(sb.st_mode)) {
 		include_cfg = cfg;
@@ -399,6 +1266,8 @@ include_file_cb(const char *path,
 	char *dot;
 
 	if (type != FTW_F) {
+		if (type == FTW_D && caching)
+			cache_add_input(path);
 		debug("Not including %s, as it's not a regular file", path);
 		return 0;
 	}
@@ -408,6 +1277,8 @@ include_file_cb(const char *path,
 		return 0;
 	}
 	debug("Parsing %s", path);
+	if (caching)
+		cache_add_input(path);
 	check_parse_success(parse_include(include_cfg, path));
 	return 0;
 }
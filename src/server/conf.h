@@ -32,14 +32,73 @@
 #  include <config.h>
 # endif
 
+# include <sys/types.h>
+# include <regex.h>
+
 # include <confuse.h>
 
+# include "group.h"
 # include "system.h"
 
 # define DEFAULT_CONF_FILE SYSCONFDIR "/nsca-ng.cfg"
 # define DEFAULT_PORT "5668"
+# define N_PATTERN_SETTINGS 3 /* "hosts", "services", and "commands". */
+
+typedef struct {
+	char *source;   /* Anchored regular expression. */
+	regex_t *regex; /* NULL until compiled. */
+} auth_pattern;
+
+typedef struct {
+	char *file;           /* Shared with the previous origin if equal. */
+	char *value;          /* As specified by the user. */
+	unsigned int line;
+	unsigned int setting; /* Less than N_PATTERN_SETTINGS. */
+} pattern_origin;
+
+typedef struct {
+	const char *identity;
+	char *password;
+	char **sources;
+	char **local_users;
+	char **host_groups;
+	char **service_groups;
+	auth_pattern **patterns; /* Shared between authorizations. */
+	group_set *host_group_set;    /* NULL if no host groups. */
+	group_set *service_group_set; /* NULL if no service groups. */
+	size_t n_sources;
+	size_t n_local_users;
+	size_t n_host_groups;
+	size_t n_service_groups;
+	size_t n_patterns;
+	double max_rate;            /* 0.0 if unlimited. */
+	unsigned long max_burst;    /* 0 if unspecified. */
+	unsigned int queue_share;   /* 0 if unspecified. */
+	bool rate_limit_per_address;
+} authorization;
+
+typedef struct {
+	const char *name;
+	char *server;             /* Host and port (e.g., "192.0.2.2:5668"). */
+	const char *identity;
+	char *password;
+	const char *ciphers;
+	char *spool_file;
+	auth_pattern **patterns;  /* Owned by the forwarding. */
+	size_t n_patterns;        /* 0 if all commands are forwarded. */
+	size_t n_connections;
+	size_t max_buffer_size;
+	size_t max_spool_size;    /* 0 if unlimited. */
+	bool submit_locally;
+} forwarding;
 
-cfg_t *conf_parse(const char *);
+cfg_t *conf_parse(const char * restrict, const char * restrict);
+void conf_free(cfg_t *);
+bool conf_compile_pattern(auth_pattern *);
+auth_pattern *conf_intern_pattern(char *);
+const char *conf_get_local_identity(uid_t);
+const forwarding *conf_get_forwardings(size_t *);
+void conf_log_stats(void);
 
 #endif
 
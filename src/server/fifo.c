@@ -30,6 +30,9 @@
 #endif
 
 #include <sys/types.h>
+#if HAVE_MMAP
+# include <sys/mman.h>
+#endif
 #include <sys/stat.h>
 #if HAVE_POSIX_AIO
 # include <aio.h>
@@ -46,12 +49,17 @@
 #include <ev.h>
 
 #include "buffer.h"
+#include "command.h"
+#include "conf.h"
 #include "fifo.h"
+#include "hash.h"
 #include "log.h"
 #include "system.h"
+#include "util.h"
 #include "wrappers.h"
 
 #define TIMEOUT 10.0
+#define QUEUE_HASH_SIZE 256
 
 #if HAVE_POSIX_AIO
 # ifdef SIGRTMIN
@@ -69,6 +77,58 @@
 # define PIPE_BUF 512 /* POSIX guarantees PIPE_BUF >= 512. */
 #endif
 
+/*
+ * Commands which cannot be written to the command file right away are queued
+ * in one of two lanes.  Check results (and other PROCESS_* commands) go to the
+ * bulk lane, which has a separate queue per client identity, so that a single
+ * client flooding the server cannot evict the data submitted by others.  The
+ * bulk queues are kept in a ring and drained round-robin, one command at a
+ * time.  A bulk queue is destroyed once it's empty.  All other commands (such
+ * as acknowledgements or downtimes), and the PROCESS_FILE commands generated
+ * by the server itself, go to the priority lane, which consists of a single
+ * queue that is always drained before the bulk lane.  The order of commands is
+ * kept only within each lane: a client's acknowledgement may well be written
+ * before a check result the same client submitted earlier.
+ */
+typedef struct fifo_chunk_s {
+	struct fifo_chunk_s *next;
+	ev_tstamp queued; /* When the commands were queued. */
+	size_t n_commands;
+} fifo_chunk;
+
+typedef struct {
+	const char *name;
+	size_t queued;   /* Number of bytes queued. */
+	size_t n_queued; /* Number of commands queued. */
+	unsigned long n_drained;
+	ev_tstamp total_latency;
+	ev_tstamp max_latency;
+} fifo_lane;
+
+typedef struct fifo_queue_s {
+	struct fifo_queue_s *next;      /* Link in the ring of queues. */
+	struct fifo_queue_s *hash_next; /* Link in the hash chain. */
+	fifo_lane *lane;
+	fifo_chunk *first_chunk;
+	fifo_chunk *last_chunk;
+	buffer *buffer;
+	char *identity;
+	size_t quota;
+} fifo_queue;
+
+/*
+ * A temporary file which is handed to the monitoring core with a PROCESS_FILE
+ * command.  Data which exceeds PIPE_BUF bytes (and therefore cannot be written
+ * to the command file atomically) is dumped into such a file, and so is large
+ * PUSH data, which is streamed into the file as it arrives.
+ */
+struct fifo_dump_s { /* This is typedef'd to `fifo_dump' in fifo.h. */
+	char *path;
+	unsigned char *map;
+	size_t size;
+	int fd;
+};
+
 struct fifo_state_s { /* This is typedef'd to `fifo_state' in fifo.h. */
 #if HAVE_POSIX_AIO
 	struct aiocb async_cb;
@@ -80,15 +140,20 @@ struct fifo_state_s { /* This is typedef'd to `fifo_state' in fifo.h. */
 #endif
 	ev_timer open_watcher;
 	ev_io write_watcher;
-	buffer *output_buffer;
-	char *dump_file;
+	fifo_lane priority_lane;
+	fifo_lane bulk_lane;
+	fifo_queue *priority_queue;
+	fifo_queue *queues[QUEUE_HASH_SIZE];
+	fifo_queue *last_queue; /* The queue drained next is last->next. */
+	size_t queued;
+	fifo_dump dump;
 	const char *dump_dir;
 	const char *path;
 	unsigned char *output;
 	size_t output_size;
 	void (*free_output)(void *);
 	size_t max_queue_size;
-	int dump_fd;
+	unsigned long n_discarded;
 	int fd;
 };
 
@@ -104,13 +169,29 @@ static void timeout_cb(EV_P_ ev_timer *, int);
 static void sync_dump_data(fifo_state *);
 #endif
 static void dispatch_data(fifo_state *);
-static char *make_process_file_command(fifo_state *);
-static bool open_dump_file(fifo_state *);
-static bool close_dump_file(fifo_state *);
+static char *make_process_file_command(const char *);
+static bool open_dump_file(fifo_dump * restrict, const char * restrict);
+static bool close_dump_file(fifo_dump *);
 static bool buffers_are_empty(fifo_state *);
 static bool buffers_exceed_pipe_size(fifo_state *);
 static void join_buffers(fifo_state *);
 static void free_output(fifo_state *);
+static void queue_command(fifo_state * restrict, const char * restrict,
+                          const unsigned char * restrict, size_t);
+static bool is_bulk_command(const unsigned char *, size_t);
+static fifo_queue *new_queue(fifo_lane * restrict, const char * restrict);
+static fifo_queue *get_queue(fifo_state * restrict, const char * restrict);
+static void enforce_quotas(fifo_state * restrict, fifo_queue * restrict,
+                           size_t);
+static void discard_queue(fifo_state * restrict, fifo_queue * restrict);
+static void forget_queued_data(fifo_state * restrict, fifo_queue * restrict);
+static size_t drain_queues(fifo_state * restrict, unsigned char * restrict,
+                           size_t);
+static size_t drain_command(fifo_state * restrict, fifo_queue * restrict,
+                            unsigned char * restrict, size_t);
+static void remove_next_queue(fifo_state *);
+static void free_queue(fifo_queue *);
+static void log_lane_stats(fifo_lane *);
 
 /*
  * Exported functions.
@@ -143,15 +224,25 @@ fifo_start(const char * restrict path, const char * restrict dump_dir,
 #endif
 	fifo->open_watcher.data = fifo;
 	fifo->write_watcher.data = fifo;
-	fifo->output_buffer = buffer_new();
-	fifo->dump_file = NULL;
+	(void)memset(&fifo->priority_lane, 0, sizeof(fifo->priority_lane));
+	(void)memset(&fifo->bulk_lane, 0, sizeof(fifo->bulk_lane));
+	fifo->priority_lane.name = "priority";
+	fifo->bulk_lane.name = "bulk";
+	fifo->priority_queue = new_queue(&fifo->priority_lane, "");
+	(void)memset(fifo->queues, 0, sizeof(fifo->queues));
+	fifo->last_queue = NULL;
+	fifo->queued = 0;
+	fifo->dump.path = NULL;
+	fifo->dump.map = NULL;
+	fifo->dump.size = 0;
+	fifo->dump.fd = -1;
 	fifo->dump_dir = dump_dir;
 	fifo->path = path;
 	fifo->output = NULL;
 	fifo->output_size = 0;
 	fifo->free_output = free;
 	fifo->max_queue_size = max_queue_size * 1024 * 1024;
-	fifo->dump_fd = -1;
+	fifo->n_discarded = 0;
 	fifo->fd = -1;
 
 #if HAVE_POSIX_AIO
@@ -169,32 +260,139 @@ fifo_start(const char * restrict path, const char * restrict dump_dir,
 }
 
 void
-fifo_write(fifo_state * restrict fifo, void * restrict data, size_t size,
-           void free_data(void *))
+fifo_write(fifo_state * restrict fifo, const char * restrict identity,
+           void * restrict data, size_t size, void free_data(void *))
 {
-	if (buffers_are_empty(fifo) && free_data != NULL) {
+	/*
+	 * If the command file isn't open, the data must be queued so that it
+	 * can be prioritized once the command file becomes writable.
+	 */
+	if (buffers_are_empty(fifo) && free_data != NULL && fifo->fd != -1) {
 		debug("Zero-copying %zu byte(s) to command file", size);
 		fifo->output = data;
 		fifo->output_size = size;
 		fifo->free_output = free_data;
 		dispatch_data(fifo);
 	} else {
-		if (fifo->max_queue_size > 0
-		    && buffer_size(fifo->output_buffer) + size
-		    > fifo->max_queue_size) {
-			warning("Queued more than %zu MB, THROWING DATA AWAY",
-			    fifo->max_queue_size / 1024 / 1024);
-			buffer_free(fifo->output_buffer);
-			fifo->output_buffer = buffer_new();
-		}
+		const unsigned char *command = data;
+		size_t left = size;
+
 		debug("Queueing %zu byte(s) for command file", size);
-		buffer_append(fifo->output_buffer, data, size);
+		while (left > 0) {
+			const unsigned char *end = memchr(command, '\n', left);
+			size_t n = end != NULL ? (size_t)(end - command) + 1 : left;
+
+			queue_command(fifo, identity, command, n);
+			command += n;
+			left -= n;
+		}
 		dispatch_data(fifo);
 		if (free_data != NULL)
 			free_data(data);
 	}
 }
 
+/*
+ * Large PUSH data is streamed into a dump file in bounded chunks rather than
+ * being buffered in memory.  Once the data is complete, the caller either
+ * commits the file (which queues the PROCESS_FILE command for it) or discards
+ * it.
+ */
+fifo_dump *
+fifo_dump_open(fifo_state *fifo)
+{
+	fifo_dump *dump = xmalloc(sizeof(fifo_dump));
+
+	if (!open_dump_file(dump, fifo->dump_dir)) {
+		free(dump);
+		return NULL;
+	}
+	debug("Streaming data to %s", dump->path);
+	return dump;
+}
+
+bool
+fifo_dump_write(fifo_dump * restrict dump, const void * restrict data,
+                size_t size)
+{
+	const unsigned char *p = data;
+	size_t offset;
+	ssize_t n;
+
+	for (offset = 0; size > offset; offset += (size_t)n) {
+		do
+			n = write(dump->fd, p + offset, size - offset);
+		while (n == -1 && errno == EINTR);
+		if (n == -1) {
+			error("Cannot write to %s: %m", dump->path);
+			return false;
+		}
+	}
+	dump->size += size;
+	return true;
+}
+
+#if HAVE_MMAP
+const char *
+fifo_dump_map(fifo_dump * restrict dump, size_t * restrict size)
+{
+	void *map;
+
+	if (dump->map == NULL) {
+		if ((map = mmap(NULL, dump->size, PROT_READ, MAP_SHARED,
+		    dump->fd, 0)) == MAP_FAILED) {
+			error("Cannot map %s into memory: %m", dump->path);
+			return NULL;
+		}
+		dump->map = map;
+	}
+	*size = dump->size;
+	return (const char *)dump->map;
+}
+#endif
+
+void
+fifo_dump_commit(fifo_state * restrict fifo, fifo_dump * restrict dump)
+{
+	char *command = make_process_file_command(dump->path);
+
+	debug("Wrote %zu bytes to %s", dump->size, dump->path);
+	if (close_dump_file(dump))
+		fifo_write(fifo, NULL, command, strlen(command), free);
+	else
+		free(command);
+	free(dump);
+}
+
+void
+fifo_dump_discard(fifo_dump *dump)
+{
+	debug("Discarding %s", dump->path);
+	if (unlink(dump->path) == -1)
+		error("Cannot remove %s: %m", dump->path);
+	(void)close_dump_file(dump);
+	free(dump);
+}
+
+void
+fifo_log_stats(fifo_state *fifo)
+{
+	fifo_queue *queue;
+
+	notice("%zu byte(s) queued for command file, %lu byte(s) discarded",
+	    fifo->queued, fifo->n_discarded);
+
+	log_lane_stats(&fifo->priority_lane);
+	log_lane_stats(&fifo->bulk_lane);
+
+	if ((queue = fifo->last_queue) != NULL)
+		do {
+			queue = queue->next;
+			notice("%zu byte(s) queued for %s",
+			    buffer_size(queue->buffer), queue->identity);
+		} while (queue != fifo->last_queue);
+}
+
 void
 fifo_stop(fifo_state *fifo)
 {
@@ -214,7 +412,9 @@ fifo_stop(fifo_state *fifo)
 	if (ev_is_active(&fifo->write_watcher))
 		ev_io_stop(EV_DEFAULT_UC_ &fifo->write_watcher);
 
-	buffer_free(fifo->output_buffer);
+	while (fifo->last_queue != NULL)
+		remove_next_queue(fifo);
+	free_queue(fifo->priority_queue);
 
 	if (fifo->output != NULL)
 		free(fifo->output);
@@ -277,8 +477,9 @@ write_cb(EV_P_ ev_io *w, int revents __attribute__((__unused__)))
 
 	do {
 		if (fifo->output == NULL) {
-			fifo->output = buffer_slurp(fifo->output_buffer,
-			    &fifo->output_size);
+			fifo->output = xmalloc(fifo->queued);
+			fifo->output_size = drain_queues(fifo, fifo->output,
+			    fifo->queued);
 			fifo->free_output = free;
 		}
 		if ((n = write(fifo->fd, fifo->output, fifo->output_size))
@@ -309,10 +510,10 @@ write_cb(EV_P_ ev_io *w, int revents __attribute__((__unused__)))
 			 */
 			debug("Wrote %zd bytes to command file", n);
 			free_output(fifo);
-			if (buffer_size(fifo->output_buffer) == 0)
+			if (fifo->queued == 0)
 				ev_io_stop(EV_A_ w);
 		}
-	} while (n > 0 && buffer_size(fifo->output_buffer) > 0);
+	} while (n > 0 && fifo->queued > 0);
 }
 
 #if HAVE_POSIX_AIO
@@ -343,7 +544,7 @@ async_dump_data(fifo_state *fifo)
 {
 	join_buffers(fifo);
 
-	if (!open_dump_file(fifo)) {
+	if (!open_dump_file(&fifo->dump, fifo->dump_dir)) {
 		free_output(fifo);
 		return;
 	}
@@ -352,7 +553,7 @@ async_dump_data(fifo_state *fifo)
 	fifo->free_aio_buf = fifo->free_output;
 	fifo->async_cb.aio_buf = fifo->output;
 	fifo->async_cb.aio_nbytes = fifo->output_size;
-	fifo->async_cb.aio_fildes = fifo->dump_fd;
+	fifo->async_cb.aio_fildes = fifo->dump.fd;
 	fifo->async_cb.aio_offset = 0;
 	fifo->async_cb.aio_sigevent.sigev_notify = SIGEV_SIGNAL;
 	fifo->async_cb.aio_sigevent.sigev_signo = SIG_AIO;
@@ -361,12 +562,12 @@ async_dump_data(fifo_state *fifo)
 	ev_async_start(EV_DEFAULT_UC_ &fifo->async_watcher);
 
 	debug("Queuing %zu bytes for writing to %s", fifo->output_size,
-	    fifo->dump_file);
+	    fifo->dump.path);
 
 	if (aio_write(&fifo->async_cb) == -1) {
 		error("Cannot queue asynchrous write request: %m");
 		ev_async_stop(EV_DEFAULT_UC_ &fifo->async_watcher);
-		(void)close_dump_file(fifo);
+		(void)close_dump_file(&fifo->dump);
 		free_output(fifo);
 		return;
 	}
@@ -403,18 +604,18 @@ async_cb(EV_P_ ev_async *w, int revents __attribute__((__unused__)))
 	fifo->async_cb.aio_buf = NULL;
 
 	if ((result = aio_error(&fifo->async_cb)) != 0)
-		error("Cannot write to %s: %s", fifo->dump_file,
+		error("Cannot write to %s: %s", fifo->dump.path,
 		    strerror(result));
 	else if ((n = aio_return(&fifo->async_cb))
 	    != (ssize_t)fifo->async_cb.aio_nbytes) /* Presumably an error. */
 		error("Wrote %zd instead of %zu bytes to %s", n,
-		    fifo->async_cb.aio_nbytes, fifo->dump_file);
+		    fifo->async_cb.aio_nbytes, fifo->dump.path);
 	else {
-		char *command = make_process_file_command(fifo);
+		char *command = make_process_file_command(fifo->dump.path);
 
-		debug("Wrote %zd bytes to %s", n, fifo->dump_file);
-		if (close_dump_file(fifo))
-			fifo_write(fifo, command, strlen(command), free);
+		debug("Wrote %zd bytes to %s", n, fifo->dump.path);
+		if (close_dump_file(&fifo->dump))
+			fifo_write(fifo, NULL, command, strlen(command), free);
 	}
 
 	if (buffers_exceed_pipe_size(fifo))
@@ -453,30 +654,30 @@ sync_dump_data(fifo_state *fifo)
 
 	join_buffers(fifo);
 
-	if (!open_dump_file(fifo)) {
+	if (!open_dump_file(&fifo->dump, fifo->dump_dir)) {
 		free_output(fifo);
 		return;
 	}
 
 	for (offset = 0; fifo->output_size > offset; offset += (size_t)n) {
 		do
-			n = write(fifo->dump_fd, fifo->output + offset,
+			n = write(fifo->dump.fd, fifo->output + offset,
 			    fifo->output_size - offset);
 		while (n == -1 && errno == EINTR);
 		if (n == -1) {
-			error("Cannot write to %s: %m", fifo->dump_file);
-			(void)close_dump_file(fifo);
+			error("Cannot write to %s: %m", fifo->dump.path);
+			(void)close_dump_file(&fifo->dump);
 			free_output(fifo);
 			return;
 		}
 		debug("Wrote %zu bytes to %s", fifo->output_size,
-		    fifo->dump_file);
+		    fifo->dump.path);
 	}
 	free_output(fifo);
 
-	command = make_process_file_command(fifo);
-	if (close_dump_file(fifo))
-		fifo_write(fifo, command, strlen(command), free);
+	command = make_process_file_command(fifo->dump.path);
+	if (close_dump_file(&fifo->dump))
+		fifo_write(fifo, NULL, command, strlen(command), free);
 }
 
 #endif
@@ -524,57 +725,63 @@ dispatch_data(fifo_state *fifo)
 }
 
 static char *
-make_process_file_command(fifo_state *fifo)
+make_process_file_command(const char *path)
 {
 	char *command;
 
 	xasprintf(&command, "[%lu] PROCESS_FILE;%s;1\n",
-	    (unsigned long)time(NULL), fifo->dump_file);
+	    (unsigned long)time(NULL), path);
 
 	return command;
 }
 
 static bool
-open_dump_file(fifo_state *fifo)
+open_dump_file(fifo_dump * restrict dump, const char * restrict dir)
 {
-	xasprintf(&fifo->dump_file, "%s/nsca.XXXXXX", fifo->dump_dir);
-	if ((fifo->dump_fd = mkstemp(fifo->dump_file)) == -1) {
-		error("Cannot create %s: %m", fifo->dump_file);
-		free(fifo->dump_file);
-		fifo->dump_file = NULL;
+	xasprintf(&dump->path, "%s/nsca.XXXXXX", dir);
+	if ((dump->fd = mkstemp(dump->path)) == -1) {
+		error("Cannot create %s: %m", dump->path);
+		free(dump->path);
+		dump->path = NULL;
 		return false;
 	}
+	dump->map = NULL;
+	dump->size = 0;
 	return true;
 }
 
 static bool
-close_dump_file(fifo_state *fifo)
+close_dump_file(fifo_dump *dump)
 {
 	int result;
 
+#if HAVE_MMAP
+	if (dump->map != NULL) {
+		(void)munmap(dump->map, dump->size);
+		dump->map = NULL;
+	}
+#endif
 	do
-		result = close(fifo->dump_fd);
+		result = close(dump->fd);
 	while (result == -1 && errno == EINTR);
 	if (result == -1)
-		error("Cannot close %s: %m", fifo->dump_file);
+		error("Cannot close %s: %m", dump->path);
 
-	free(fifo->dump_file);
-	fifo->dump_file = NULL;
+	free(dump->path);
+	dump->path = NULL;
 	return (bool)(result == 0);
 }
 
 static bool
 buffers_are_empty(fifo_state *fifo)
 {
-	return (bool)(fifo->output == NULL
-	    && buffer_size(fifo->output_buffer) == 0);
+	return (bool)(fifo->output == NULL && fifo->queued == 0);
 }
 
 static bool
 buffers_exceed_pipe_size(fifo_state *fifo)
 {
-	return (bool)(fifo->output_size > PIPE_BUF
-	    || buffer_size(fifo->output_buffer) > PIPE_BUF);
+	return (bool)(fifo->output_size > PIPE_BUF || fifo->queued > PIPE_BUF);
 }
 
 static void
@@ -583,10 +790,10 @@ join_buffers(fifo_state *fifo)
 	unsigned char *new_output;
 	size_t new_size;
 
-	if (buffer_size(fifo->output_buffer) == 0)
+	if (fifo->queued == 0)
 		return;
 
-	new_size = fifo->output_size + buffer_size(fifo->output_buffer);
+	new_size = fifo->output_size + fifo->queued;
 	new_output = xmalloc(new_size);
 
 	debug("Joining output buffers (new size: %zu bytes)", new_size);
@@ -594,8 +801,7 @@ join_buffers(fifo_state *fifo)
 	if (fifo->output != NULL)
 		(void)memcpy(new_output, fifo->output, fifo->output_size);
 
-	(void)buffer_read(fifo->output_buffer,
-	    new_output + fifo->output_size,
+	(void)drain_queues(fifo, new_output + fifo->output_size,
 	    new_size - fifo->output_size);
 
 	if (fifo->output != NULL)
@@ -614,4 +820,297 @@ free_output(fifo_state *fifo)
 	fifo->output_size = 0;
 }
 
+/*
+ * Append a single command to the queue it belongs to.
+ */
+static void
+queue_command(fifo_state * restrict fifo, const char * restrict identity,
+              const unsigned char * restrict command, size_t size)
+{
+	fifo_queue *queue;
+	ev_tstamp now = ev_now(EV_DEFAULT_UC);
+
+	if (identity != NULL && is_bulk_command(command, size))
+		queue = get_queue(fifo, identity);
+	else /* Data generated by the server itself is never bulk data. */
+		queue = fifo->priority_queue;
+
+	enforce_quotas(fifo, queue, size);
+	buffer_append(queue->buffer, command, size);
+	fifo->queued += size;
+	queue->lane->queued += size;
+	queue->lane->n_queued++;
+
+	/* Commands queued during the same loop iteration share a chunk. */
+	if (queue->last_chunk != NULL && queue->last_chunk->queued == now)
+		queue->last_chunk->n_commands++;
+	else {
+		fifo_chunk *chunk = xmalloc(sizeof(fifo_chunk));
+
+		chunk->next = NULL;
+		chunk->queued = now;
+		chunk->n_commands = 1;
+
+		if (queue->last_chunk == NULL)
+			queue->first_chunk = chunk;
+		else
+			queue->last_chunk->next = chunk;
+		queue->last_chunk = chunk;
+	}
+}
+
+/*
+ * Check whether the command is a PROCESS_* command, as opposed to an external
+ * command an administrator would expect to take effect right away.
+ */
+static bool
+is_bulk_command(const unsigned char *command, size_t size)
+{
+	static const char prefix[] = "PROCESS_";
+	command_fields fields;
+
+	(void)command_parse((const char *)command, size, &fields);
+	return (bool)(fields.name_len >= sizeof(prefix) - 1
+	    && memcmp(fields.name, prefix, sizeof(prefix) - 1) == 0);
+}
+
+static fifo_queue *
+new_queue(fifo_lane * restrict lane, const char * restrict identity)
+{
+	fifo_queue *queue = xmalloc(sizeof(fifo_queue));
+
+	queue->next = NULL;
+	queue->hash_next = NULL;
+	queue->lane = lane;
+	queue->first_chunk = NULL;
+	queue->last_chunk = NULL;
+	queue->buffer = buffer_new();
+	queue->identity = xstrdup(identity);
+	queue->quota = 0;
+
+	return queue;
+}
+
+static fifo_queue *
+get_queue(fifo_state * restrict fifo, const char * restrict identity)
+{
+	fifo_queue *queue;
+	authorization *auth;
+	size_t slot = hash_string(identity) % QUEUE_HASH_SIZE;
+
+	for (queue = fifo->queues[slot]; queue != NULL;
+	    queue = queue->hash_next)
+		if (strcmp(queue->identity, identity) == 0)
+			return queue;
+
+	queue = new_queue(&fifo->bulk_lane, identity);
+
+	if (fifo->max_queue_size > 0
+	    && ((auth = hash_lookup(identity)) != NULL
+	    || (auth = hash_lookup("*")) != NULL)
+	    && auth->queue_share > 0)
+		queue->quota = fifo->max_queue_size / 100 * auth->queue_share;
+
+	queue->hash_next = fifo->queues[slot];
+	fifo->queues[slot] = queue;
+
+	/* Append the new queue to the end of the current round. */
+	if (fifo->last_queue == NULL)
+		queue->next = queue;
+	else {
+		queue->next = fifo->last_queue->next;
+		fifo->last_queue->next = queue;
+	}
+	fifo->last_queue = queue;
+
+	return queue;
+}
+
+static void
+enforce_quotas(fifo_state * restrict fifo, fifo_queue * restrict queue,
+               size_t size)
+{
+	if (queue->quota > 0
+	    && buffer_size(queue->buffer) + size > queue->quota) {
+		warning("Queued more than %zu KB for %s, THROWING DATA AWAY",
+		    queue->quota / 1024, queue->identity);
+		discard_queue(fifo, queue);
+	}
+
+	/*
+	 * If the total would exceed the limit, sacrifice the bulk data of the
+	 * client(s) who queued the most.  The priority lane is only thrown away
+	 * if there's no bulk data left.
+	 */
+	while (fifo->max_queue_size > 0 && fifo->queued > 0
+	    && fifo->queued + size > fifo->max_queue_size) {
+		fifo_queue *largest = fifo->last_queue, *q = largest;
+
+		if (q != NULL)
+			do
+				if (buffer_size((q = q->next)->buffer)
+				    > buffer_size(largest->buffer))
+					largest = q;
+			while (q != fifo->last_queue);
+
+		if (fifo->bulk_lane.queued == 0) {
+			warning("Queued more than %zu MB, THROWING PRIORITY "
+			    "COMMANDS AWAY", fifo->max_queue_size / 1024 / 1024);
+			discard_queue(fifo, fifo->priority_queue);
+		} else {
+			warning("Queued more than %zu MB, THROWING DATA OF %s "
+			    "AWAY", fifo->max_queue_size / 1024 / 1024,
+			    largest->identity);
+			discard_queue(fifo, largest);
+		}
+	}
+}
+
+static void
+discard_queue(fifo_state * restrict fifo, fifo_queue * restrict queue)
+{
+	fifo->n_discarded += buffer_size(queue->buffer);
+	forget_queued_data(fifo, queue);
+	buffer_free(queue->buffer);
+	queue->buffer = buffer_new();
+}
+
+/*
+ * Remove the data of the queue from the statistics.  The caller is responsible
+ * for getting rid of the queue's buffer.
+ */
+static void
+forget_queued_data(fifo_state * restrict fifo, fifo_queue * restrict queue)
+{
+	size_t size = buffer_size(queue->buffer);
+
+	while (queue->first_chunk != NULL) {
+		fifo_chunk *chunk = queue->first_chunk;
+
+		queue->lane->n_queued -= MIN(chunk->n_commands,
+		    queue->lane->n_queued);
+		queue->first_chunk = chunk->next;
+		free(chunk);
+	}
+	queue->last_chunk = NULL;
+	queue->lane->queued -= size;
+	fifo->queued -= size;
+}
+
+/*
+ * Move up to `size' bytes of queued commands into the `output' buffer.  The
+ * priority lane is drained first, then one command is taken from each bulk
+ * queue in turn.
+ */
+static size_t
+drain_queues(fifo_state * restrict fifo, unsigned char * restrict output,
+             size_t size)
+{
+	size_t n_total = 0;
+
+	while (buffer_size(fifo->priority_queue->buffer) > 0 && n_total < size)
+		n_total += drain_command(fifo, fifo->priority_queue,
+		    output + n_total, size - n_total);
+
+	while (fifo->last_queue != NULL && n_total < size) {
+		fifo_queue *queue = fifo->last_queue->next;
+
+		n_total += drain_command(fifo, queue, output + n_total,
+		    size - n_total);
+
+		if (buffer_size(queue->buffer) == 0)
+			remove_next_queue(fifo);
+		else
+			fifo->last_queue = queue;
+	}
+	return n_total;
+}
+
+/*
+ * Move the first command of the queue into the `output' buffer, and record the
+ * time it spent waiting.
+ */
+static size_t
+drain_command(fifo_state * restrict fifo, fifo_queue * restrict queue,
+              unsigned char * restrict output, size_t size)
+{
+	fifo_lane *lane = queue->lane;
+	fifo_chunk *chunk = queue->first_chunk;
+	size_t n = buffer_find_char(queue->buffer, '\n');
+
+	if (n == 0) /* Shouldn't happen. */
+		n = buffer_size(queue->buffer);
+	n = buffer_read(queue->buffer, output, MIN(n, size));
+	fifo->queued -= n;
+	lane->queued -= n;
+
+	if (chunk != NULL) {
+		ev_tstamp latency = ev_now(EV_DEFAULT_UC) - chunk->queued;
+
+		lane->n_queued--;
+		lane->n_drained++;
+		lane->total_latency += latency;
+		if (latency > lane->max_latency)
+			lane->max_latency = latency;
+
+		if (--chunk->n_commands == 0) {
+			queue->first_chunk = chunk->next;
+			if (queue->first_chunk == NULL)
+				queue->last_chunk = NULL;
+			free(chunk);
+		}
+	}
+	if (buffer_size(queue->buffer) == 0)
+		forget_queued_data(fifo, queue);
+
+	return n;
+}
+
+/*
+ * Remove the bulk queue that would be drained next.
+ */
+static void
+remove_next_queue(fifo_state *fifo)
+{
+	fifo_queue *queue = fifo->last_queue->next;
+	fifo_queue **p =
+	    &fifo->queues[hash_string(queue->identity) % QUEUE_HASH_SIZE];
+
+	while (*p != queue)
+		p = &(*p)->hash_next;
+	*p = queue->hash_next;
+
+	if (queue == fifo->last_queue)
+		fifo->last_queue = NULL;
+	else
+		fifo->last_queue->next = queue->next;
+
+	forget_queued_data(fifo, queue);
+	free_queue(queue);
+}
+
+static void
+free_queue(fifo_queue *queue)
+{
+	while (queue->first_chunk != NULL) {
+		fifo_chunk *chunk = queue->first_chunk;
+
+		queue->first_chunk = chunk->next;
+		free(chunk);
+	}
+	buffer_free(queue->buffer);
+	free(queue->identity);
+	free(queue);
+}
+
+static void
+log_lane_stats(fifo_lane *lane)
+{
+	notice("Command file %s lane: %zu command(s) queued (%zu bytes), %lu "
+	    "dequeued (after %.3f seconds on average, %.3f at most)",
+	    lane->name, lane->n_queued, lane->queued, lane->n_drained,
+	    lane->n_drained > 0 ? lane->total_latency /
+	    (double)lane->n_drained : 0.0, lane->max_latency);
+}
+
 /* vim:set joinspaces noexpandtab textwidth=80 cinoptions=(4,u0: */
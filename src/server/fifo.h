@@ -35,10 +35,19 @@
 # include "system.h"
 
 typedef struct fifo_state_s fifo_state;
+typedef struct fifo_dump_s fifo_dump;
 
 fifo_state *fifo_start(const char * restrict, const char * restrict, size_t);
-void fifo_write(fifo_state * restrict, void * restrict, size_t,
-                void (*)(void *));
+void fifo_write(fifo_state * restrict, const char * restrict,
+                void * restrict, size_t, void (*)(void *));
+fifo_dump *fifo_dump_open(fifo_state *);
+bool fifo_dump_write(fifo_dump * restrict, const void * restrict, size_t);
+# if HAVE_MMAP
+const char *fifo_dump_map(fifo_dump * restrict, size_t * restrict);
+# endif
+void fifo_dump_commit(fifo_state * restrict, fifo_dump * restrict);
+void fifo_dump_discard(fifo_dump *);
+void fifo_log_stats(fifo_state *);
 void fifo_stop(fifo_state *);
 
 #endif
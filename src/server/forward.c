@@ -0,0 +1,992 @@
+/*
+ * Copyright (c) 2014 Holger Weiss <holger@weiss.in-berlin.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Commands matching a "forward" block are relayed to another NSCA-ng server
+ * using a pool of persistent TLS sessions.  If the server speaks protocol
+ * version 2, the PUSH requests are pipelined, so the commands queued while
+ * waiting for responses are written out together.  The commands are retained
+ * until the server acknowledged them, and resubmitted via another (or a new)
+ * session if the session breaks down.  Commands which don't fit into the memory
+ * buffer (e.g., while the server is unreachable) are appended to a spool file,
+ * and the spooled commands are submitted in order as soon as the sessions catch
+ * up.  On shutdown, the buffered commands are spooled as well, so that they're
+ * submitted after a restart.  Each spool file record consists of the time the
+ * command was accepted, a space character, and the newline-terminated command.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#if HAVE_INTTYPES_H
+# include <inttypes.h>
+#endif
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_STRINGS_H
+# include <strings.h>
+#endif
+#include <unistd.h>
+
+#include <ev.h>
+#include <openssl/rand.h>
+
+#include "auth.h"
+#include "conf.h"
+#include "forward.h"
+#include "log.h"
+#include "system.h"
+#include "tls.h"
+#include "util.h"
+#include "wrappers.h"
+
+#ifndef NUM_SESSION_ID_BYTES
+# define NUM_SESSION_ID_BYTES 6
+#endif
+#ifndef MAX_UNACKED_COMMANDS
+# define MAX_UNACKED_COMMANDS 128
+#endif
+#ifndef KEEPALIVE_INTERVAL
+# define KEEPALIVE_INTERVAL 30.0
+#endif
+#ifndef MAX_RECONNECT_DELAY
+# define MAX_RECONNECT_DELAY 60.0
+#endif
+
+#define PROTOCOL_VERSION 2
+#define SPOOL_LINE_SIZE 1024 /* Grown as needed. */
+#define COPY_CHUNK_SIZE 16384
+
+typedef struct record_s {
+	struct record_s *next;
+	char *data; /* NULL for a NOOP request. */
+	size_t size;
+	ev_tstamp accepted;
+} record;
+
+typedef struct {
+	record *head;
+	record *tail;
+	size_t length;
+	size_t size; /* Of the data. */
+} record_queue;
+
+typedef struct {
+	struct target_s *target;
+	tls_state *tls;
+	record_queue unacked;
+	ev_timer keepalive_watcher;
+	ev_timer reconnect_watcher;
+	ev_tstamp reconnect_delay;
+	enum {
+		STATE_CONNECTING,
+		STATE_READY,
+		STATE_WAITING
+	} state;
+	int protocol_version;
+	bool reading;
+	bool payload_sent;
+} session;
+
+typedef struct target_s {
+	const forwarding *conf;
+	tls_client_state *tls_client;
+	session *sessions;
+	record_queue pending;
+	FILE *spool;     /* NULL until needed. */
+	char *spool_line;
+	size_t spool_line_size;
+	off_t spool_size;   /* Bytes written into the spool file. */
+	off_t spool_offset; /* Bytes replayed from the spool file. */
+	unsigned long n_forwarded;
+	unsigned long n_refused;
+	unsigned long n_spooled;
+	unsigned long n_dropped;
+	unsigned long n_lag_samples; /* Since the statistics were logged. */
+	double lag_sum;
+	double lag_max;
+	bool spool_full;
+} target;
+
+static target *targets = NULL;
+static size_t n_targets = 0;
+static ev_tstamp session_timeout;
+
+static void queue_command(target * restrict, const char * restrict, size_t);
+static void dispatch(target *);
+static session *least_busy_session(target *);
+static void send_record(session * restrict, record * restrict);
+static void connect_session(session *);
+static void handle_tls_connect(tls_state *);
+static void handle_tls_moin_response(tls_state * restrict, char * restrict);
+static void handle_tls_response(tls_state * restrict, char * restrict);
+static void handle_tls_error(tls_state *);
+static void handle_tls_timeout(tls_state *);
+static unsigned int set_psk(SSL *, const char *, char *, unsigned int,
+                            unsigned char *, unsigned int);
+static void keepalive_cb(EV_P_ ev_timer *, int);
+static void reconnect_cb(EV_P_ ev_timer *, int);
+static void disconnect(session *);
+static void send_request(tls_state * restrict, const char * restrict);
+static void bail(tls_state * restrict, const char * restrict, ...)
+                 __attribute__((__format__(__printf__, 2, 3)));
+static bool server_is_grumpy(tls_state * restrict, char * restrict);
+static bool open_spool(target *);
+static void spool_command(target * restrict, ev_tstamp,
+                          const char * restrict, size_t);
+static bool replay_spool(target *);
+static char *read_spool_line(target * restrict, size_t * restrict);
+static void discard_spool(target *);
+static void save_spool(target *);
+static bool write_spool_file(target * restrict, char * restrict);
+static record *new_record(char *, size_t, ev_tstamp);
+static void enqueue(record_queue * restrict, record * restrict);
+static void requeue(record_queue * restrict, record_queue * restrict);
+static record *dequeue(record_queue *);
+static void free_record(record *);
+static void free_queue(record_queue *);
+static char *generate_session_id(void);
+
+/*
+ * Exported functions.
+ */
+
+void
+forward_start(const forwarding *forwardings, size_t n_forwardings,
+              ev_tstamp timeout)
+{
+	size_t i, j;
+
+	targets = xmalloc(n_forwardings * sizeof(target));
+	n_targets = n_forwardings;
+	session_timeout = timeout;
+
+	for (i = 0; i < n_targets; i++) {
+		target *t = &targets[i];
+		struct stat sb;
+
+		debug("Starting to forward commands to %s",
+		    forwardings[i].name);
+
+		t->conf = &forwardings[i];
+		t->tls_client = tls_client_start(t->conf->ciphers);
+		t->pending.head = t->pending.tail = NULL;
+		t->pending.length = t->pending.size = 0;
+		t->spool = NULL;
+		t->spool_line = NULL;
+		t->spool_line_size = 0;
+		t->spool_size = t->spool_offset = 0;
+		t->n_forwarded = t->n_refused = 0;
+		t->n_spooled = t->n_dropped = 0;
+		t->n_lag_samples = 0;
+		t->lag_sum = t->lag_max = 0.0;
+		t->spool_full = false;
+
+		/* Commands spooled before a restart are replayed first. */
+		if (stat(t->conf->spool_file, &sb) == 0 && sb.st_size > 0
+		    && open_spool(t)) {
+			notice("Replaying %jd byte(s) of commands spooled for "
+			    "%s", (intmax_t)t->spool_size, t->conf->name);
+		}
+
+		t->sessions = xmalloc(t->conf->n_connections * sizeof(session));
+		for (j = 0; j < t->conf->n_connections; j++) {
+			session *s = &t->sessions[j];
+
+			s->target = t;
+			s->tls = NULL;
+			s->unacked.head = s->unacked.tail = NULL;
+			s->unacked.length = s->unacked.size = 0;
+			s->reconnect_delay = 1.0;
+			s->state = STATE_WAITING;
+			s->protocol_version = 1;
+			s->reading = false;
+			s->payload_sent = false;
+			s->keepalive_watcher.data = s;
+			s->reconnect_watcher.data = s;
+
+			/*
+			 * Idle sessions must be kept alive, as the server (and
+			 * we) would otherwise close them after the timeout.
+			 */
+			ev_init(&s->keepalive_watcher, keepalive_cb);
+			s->keepalive_watcher.repeat = timeout > 0.0 ?
+			    timeout / 2.0 : KEEPALIVE_INTERVAL;
+
+			/* Connect as soon as the event loop is running. */
+			ev_timer_init(&s->reconnect_watcher, reconnect_cb, 0.0,
+			    0.0);
+			ev_timer_start(EV_DEFAULT_UC_ &s->reconnect_watcher);
+		}
+	}
+}
+
+/*
+ * Queue the (authorized) command for each "forward" block it matches.  Return
+ * true if the command should be submitted locally, too.
+ */
+bool
+forward_submit(const char *data, size_t size)
+{
+	bool matched = false, submit_locally = false;
+	size_t i;
+
+	for (i = 0; i < n_targets; i++) {
+		target *t = &targets[i];
+
+		if (t->conf->n_patterns > 0 && !matches_pattern(
+		    t->conf->patterns, t->conf->n_patterns, data, size))
+			continue;
+
+		debug("Forwarding command to %s", t->conf->name);
+		queue_command(t, data, size);
+		matched = true;
+		if (t->conf->submit_locally)
+			submit_locally = true;
+	}
+	return !matched || submit_locally;
+}
+
+void
+forward_log_stats(void)
+{
+	ev_tstamp now = ev_now(EV_DEFAULT_UC);
+	size_t i, j;
+
+	for (i = 0; i < n_targets; i++) {
+		target *t = &targets[i];
+		size_t n_ready = 0, n_unacked = 0;
+		ev_tstamp oldest = t->pending.head != NULL ?
+		    t->pending.head->accepted : now;
+
+		for (j = 0; j < t->conf->n_connections; j++) {
+			session *s = &t->sessions[j];
+
+			if (s->state == STATE_READY)
+				n_ready++;
+			n_unacked += s->unacked.length;
+			if (s->unacked.head != NULL
+			    && s->unacked.head->data != NULL
+			    && s->unacked.head->accepted < oldest)
+				oldest = s->unacked.head->accepted;
+		}
+		notice("Forwarding to %s via %zu of %zu session(s), %zu "
+		    "command(s) buffered, %zu unacknowledged, %jd byte(s) "
+		    "spooled", t->conf->name, n_ready, t->conf->n_connections,
+		    t->pending.length, n_unacked,
+		    (intmax_t)(t->spool_size - t->spool_offset));
+		notice("Forwarded %lu command(s) to %s so far (%lu refused, "
+		    "%lu spooled, %lu dropped)", t->n_forwarded, t->conf->name,
+		    t->n_refused, t->n_spooled, t->n_dropped);
+		notice("Forwarding lag for %s: %.3f s average, %.3f s maximum "
+		    "(since last report), oldest buffered command: %.0f s",
+		    t->conf->name, t->n_lag_samples > 0 ?
+		    t->lag_sum / (double)t->n_lag_samples : 0.0, t->lag_max,
+		    (double)(now - oldest));
+
+		t->n_lag_samples = 0;
+		t->lag_sum = t->lag_max = 0.0;
+	}
+}
+
+void
+forward_stop(void)
+{
+	size_t i, j;
+
+	for (i = 0; i < n_targets; i++) {
+		target *t = &targets[i];
+
+		debug("Stopping to forward commands to %s", t->conf->name);
+
+		for (j = 0; j < t->conf->n_connections; j++) {
+			session *s = &t->sessions[j];
+
+			if (s->tls != NULL)
+				tls_shutdown(s->tls);
+			if (ev_is_active(&s->keepalive_watcher))
+				ev_timer_stop(EV_DEFAULT_UC_
+				    &s->keepalive_watcher);
+			if (ev_is_active(&s->reconnect_watcher))
+				ev_timer_stop(EV_DEFAULT_UC_
+				    &s->reconnect_watcher);
+
+			/* Unacknowledged commands are spooled first. */
+			requeue(&s->unacked, &t->pending);
+		}
+		save_spool(t);
+		free_queue(&t->pending);
+		if (t->spool != NULL)
+			(void)fclose(t->spool);
+		if (t->spool_line != NULL)
+			free(t->spool_line);
+		tls_client_stop(t->tls_client);
+		free(t->sessions);
+	}
+	if (targets != NULL)
+		free(targets);
+	targets = NULL;
+	n_targets = 0;
+}
+
+/*
+ * Static functions.
+ */
+
+static void
+queue_command(target * restrict t, const char * restrict data, size_t size)
+{
+	ev_tstamp now = ev_now(EV_DEFAULT_UC);
+
+	/* Once commands were spooled, later ones must follow them. */
+	if (t->spool_offset < t->spool_size
+	    || t->pending.size + size > t->conf->max_buffer_size)
+		spool_command(t, now, data, size);
+	else {
+		char *copy = xmalloc(size);
+
+		(void)memcpy(copy, data, size);
+		enqueue(&t->pending, new_record(copy, size, now));
+	}
+	dispatch(t);
+}
+
+static void
+dispatch(target *t)
+{
+	session *s;
+	size_t i;
+
+	while ((s = least_busy_session(t)) != NULL
+	    && (t->pending.length > 0 || replay_spool(t)))
+		send_record(s, dequeue(&t->pending));
+
+	for (i = 0; i < t->conf->n_connections; i++) {
+		s = &t->sessions[i];
+
+		if (s->state == STATE_READY && s->unacked.length > 0
+		    && !s->reading) {
+			s->reading = true;
+			tls_read_line(s->tls, handle_tls_response);
+		}
+	}
+}
+
+static session *
+least_busy_session(target *t)
+{
+	session *best = NULL;
+	size_t i;
+
+	for (i = 0; i < t->conf->n_connections; i++) {
+		session *s = &t->sessions[i];
+		size_t window = s->protocol_version > 1 ?
+		    MAX_UNACKED_COMMANDS : 1;
+
+		if (s->state == STATE_READY && s->unacked.length < window
+		    && (best == NULL
+		    || s->unacked.length < best->unacked.length))
+			best = s;
+	}
+	return best;
+}
+
+static void
+send_record(session * restrict s, record * restrict r)
+{
+	tls_state *tls = s->tls;
+	char *request;
+
+	if (r->data == NULL)
+		send_request(tls, "NOOP");
+	else {
+		xasprintf(&request, "PUSH %zu", r->size);
+		send_request(tls, request);
+		free(request);
+
+		if (s->protocol_version > 1) {
+			info("%s C: %.*s", tls->peer, (int)r->size - 1,
+			    r->data);
+			tls_write(tls, r->data, r->size, NULL);
+		}
+	}
+	enqueue(&s->unacked, r);
+	ev_timer_again(EV_DEFAULT_UC_ &s->keepalive_watcher);
+}
+
+static void
+connect_session(session *s)
+{
+	target *t = s->target;
+
+	s->state = STATE_CONNECTING;
+	t->tls_client->data = s;
+	tls_connect(t->tls_client, t->conf->server, session_timeout,
+	    TLS_NO_AUTO_DIE, handle_tls_connect, handle_tls_timeout,
+	    handle_tls_error, set_psk);
+}
+
+static void
+handle_tls_connect(tls_state *tls)
+{
+	session *s = tls->data;
+	char *session_id = generate_session_id(), *request;
+
+	s->tls = tls;
+	tls_set_connection_id(tls, session_id);
+
+	xasprintf(&request, "MOIN %d %s", PROTOCOL_VERSION, session_id);
+	send_request(tls, request);
+	free(request);
+	free(session_id);
+
+	tls_read_line(tls, handle_tls_moin_response);
+}
+
+static void
+handle_tls_moin_response(tls_state * restrict tls, char * restrict line)
+{
+	session *s = tls->data;
+	int protocol_version;
+	char *args[2];
+
+	info("%s S: %s", tls->peer, line);
+
+	if (strncasecmp("MOIN", line, 4) == 0) {
+		if (!parse_line(line, args, 2))
+			bail(tls, "Cannot parse MOIN response");
+		else if ((protocol_version = atoi(args[1])) <= 0)
+			bail(tls, "Expected protocol version");
+		else if (protocol_version > PROTOCOL_VERSION)
+			bail(tls, "Protocol version %d not supported",
+			    protocol_version);
+		else { /* The handshake succeeded. */
+			debug("Protocol handshake successful (version %d)",
+			    protocol_version);
+			info("Forwarding commands to %s via %s",
+			    s->target->conf->name, tls->peer);
+			s->protocol_version = protocol_version;
+			s->state = STATE_READY;
+			s->reconnect_delay = 1.0;
+			ev_timer_again(EV_DEFAULT_UC_ &s->keepalive_watcher);
+			dispatch(s->target);
+		}
+	} else if (!server_is_grumpy(tls, line))
+		bail(tls, "Received unexpected MOIN response");
+
+	free(line);
+}
+
+static void
+handle_tls_response(tls_state * restrict tls, char * restrict line)
+{
+	session *s = tls->data;
+	target *t = s->target;
+	record *r = s->unacked.head;
+	double lag;
+
+	s->reading = false;
+	info("%s S: %s", tls->peer, line);
+
+	/*
+	 * With protocol version 1, the server acknowledges the PUSH request
+	 * before we may transmit the data.
+	 */
+	if (s->protocol_version == 1 && r->data != NULL && !s->payload_sent
+	    && strcasecmp("OKAY", line) == 0) {
+		info("%s C: %.*s", tls->peer, (int)r->size - 1, r->data);
+		tls_write(tls, r->data, r->size, NULL);
+		s->payload_sent = true;
+		s->reading = true;
+		tls_read_line(tls, handle_tls_response);
+		free(line);
+		return;
+	}
+	s->payload_sent = false;
+
+	if (strcasecmp("OKAY", line) == 0) {
+		if (r->data != NULL) {
+			lag = (double)(ev_now(EV_DEFAULT_UC) - r->accepted);
+			t->n_forwarded++;
+			t->n_lag_samples++;
+			t->lag_sum += lag;
+			t->lag_max = MAX(t->lag_max, lag);
+		}
+		free_record(dequeue(&s->unacked));
+	} else if (strncasecmp("FAIL", line, 4) == 0) {
+		/* Resubmitting the command wouldn't help. */
+		error("%s refused forwarded command (%s): %.*s", tls->peer,
+		    line, r->data != NULL ? (int)r->size - 1 : 4,
+		    r->data != NULL ? r->data : "NOOP");
+		if (r->data != NULL)
+			t->n_refused++;
+		free_record(dequeue(&s->unacked));
+	} else if (strncasecmp("BAIL", line, 4) == 0) {
+		error("%s said: %s", tls->peer, line);
+		disconnect(s);
+		free(line);
+		return;
+	} else {
+		bail(tls, "Received unexpected response after forwarding "
+		    "command(s)");
+		free(line);
+		return;
+	}
+	free(line);
+
+	dispatch(t);
+}
+
+static void
+handle_tls_error(tls_state *tls)
+{
+	session *s = tls->data;
+
+	/* The TLS layer is going to destroy the connection context. */
+	s->tls = NULL;
+	disconnect(s);
+}
+
+static void
+handle_tls_timeout(tls_state *tls)
+{
+	session *s = tls->data;
+
+	s->tls = tls; /* The TLS handshake might not have completed. */
+	info("%s C: BAIL Connection timed out", tls->peer);
+	tls_write_line(tls, "BAIL Connection timed out");
+	disconnect(s);
+}
+
+static unsigned int
+set_psk(SSL *ssl,
+        const char *hint __attribute__((__unused__)),
+        char *identity,
+        unsigned int max_identity_len,
+        unsigned char *password,
+        unsigned int max_password_len)
+{
+	tls_state *tls = SSL_get_app_data(ssl);
+	session *s = tls->data;
+	const forwarding *conf = s->target->conf;
+	size_t identity_len = MIN(strlen(conf->identity), max_identity_len - 1);
+	size_t password_len = MIN(strlen(conf->password), max_password_len);
+
+	(void)memcpy(identity, conf->identity, identity_len);
+	(void)memcpy(password, conf->password, password_len);
+
+	identity[identity_len] = '\0';
+
+	return (unsigned int)password_len;
+}
+
+static void
+keepalive_cb(EV_P_ ev_timer *w, int revents __attribute__((__unused__)))
+{
+	session *s = w->data;
+
+	if (s->state == STATE_READY && s->unacked.length == 0) {
+		debug("Sending keepalive request to %s", s->target->conf->name);
+		send_record(s, new_record(NULL, 0, ev_now(EV_A)));
+		dispatch(s->target);
+	}
+}
+
+static void
+reconnect_cb(EV_P_ ev_timer *w, int revents __attribute__((__unused__)))
+{
+	session *s = w->data;
+
+	debug("Connecting to %s", s->target->conf->server);
+	connect_session(s);
+}
+
+static void
+disconnect(session *s)
+{
+	target *t = s->target;
+
+	if (s->tls != NULL) {
+		tls_shutdown(s->tls);
+		s->tls = NULL;
+	}
+	if (ev_is_active(&s->keepalive_watcher))
+		ev_timer_stop(EV_DEFAULT_UC_ &s->keepalive_watcher);
+
+	/* Resubmit the commands which weren't acknowledged. */
+	requeue(&s->unacked, &t->pending);
+	s->reading = false;
+	s->payload_sent = false;
+	s->state = STATE_WAITING;
+
+	info("Reconnecting to %s in %.0f second(s)", t->conf->server,
+	    (double)s->reconnect_delay);
+	ev_timer_set(&s->reconnect_watcher, s->reconnect_delay, 0.0);
+	ev_timer_start(EV_DEFAULT_UC_ &s->reconnect_watcher);
+	s->reconnect_delay = MIN(s->reconnect_delay * 2.0,
+	    MAX_RECONNECT_DELAY);
+
+	/* Other sessions might be able to take over. */
+	dispatch(t);
+}
+
+static void
+send_request(tls_state * restrict tls, const char * restrict request)
+{
+	info("%s C: %s", tls->peer, request);
+	tls_write_line(tls, request);
+}
+
+static void
+bail(tls_state * restrict tls, const char * restrict fmt, ...)
+{
+	va_list ap;
+	char *message;
+
+	va_start(ap, fmt);
+	xvasprintf(&message, fmt, ap);
+	va_end(ap);
+
+	info("%s C: %s %s", tls->peer, "BAIL", message);
+
+	tls_write(tls, "BAIL ", sizeof("BAIL ") - 1, NULL);
+	tls_write_line(tls, message);
+
+	error("%s (%s)", message, tls->peer);
+	disconnect(tls->data);
+	free(message);
+}
+
+static bool
+server_is_grumpy(tls_state * restrict tls, char * restrict line)
+{
+	if (strncasecmp("FAIL", line, 4) == 0
+	    || strncasecmp("BAIL", line, 4) == 0) {
+		error("%s said: %s", tls->peer, line);
+		disconnect(tls->data);
+		return true;
+	}
+	return false;
+}
+
+static bool
+open_spool(target *t)
+{
+	int fd;
+
+	/* The stream is repositioned before each read and write. */
+	if ((fd = open(t->conf->spool_file, O_RDWR | O_CREAT | O_APPEND,
+	    S_IRUSR | S_IWUSR)) == -1) {
+		error("Cannot open %s: %m", t->conf->spool_file);
+		return false;
+	}
+	if ((t->spool = fdopen(fd, "a+")) == NULL
+	    || fseeko(t->spool, 0, SEEK_END) == -1
+	    || (t->spool_size = ftello(t->spool)) == -1) {
+		error("Cannot access %s: %m", t->conf->spool_file);
+		if (t->spool != NULL)
+			(void)fclose(t->spool);
+		else
+			(void)close(fd);
+		t->spool = NULL;
+		t->spool_size = 0;
+		return false;
+	}
+	t->spool_offset = 0;
+	return true;
+}
+
+static void
+spool_command(target * restrict t, ev_tstamp accepted,
+              const char * restrict data, size_t size)
+{
+	int n;
+
+	if (t->conf->max_spool_size > 0 && (size_t)(t->spool_size
+	    - t->spool_offset) + size > t->conf->max_spool_size) {
+		if (!t->spool_full)
+			error("Spool file %s is full, dropping commands for %s",
+			    t->conf->spool_file, t->conf->name);
+		t->spool_full = true;
+		t->n_dropped++;
+		return;
+	}
+	if (t->spool == NULL && !open_spool(t)) {
+		t->n_dropped++;
+		return;
+	}
+	if (fseeko(t->spool, 0, SEEK_END) == -1
+	    || (n = fprintf(t->spool, "%.3f ", (double)accepted)) < 0
+	    || fwrite(data, 1, size, t->spool) != size
+	    || fflush(t->spool) == EOF) {
+		error("Cannot write to %s: %m", t->conf->spool_file);
+		/* Don't leave a partial record behind. */
+		(void)ftruncate(fileno(t->spool), t->spool_size);
+		t->n_dropped++;
+		return;
+	}
+	t->spool_size += (off_t)n + (off_t)size;
+	t->spool_full = false;
+	t->n_spooled++;
+}
+
+/*
+ * Move spooled commands into the memory buffer, filling up to half of it, but
+ * at least one command.  Return true if a command was loaded.
+ */
+static bool
+replay_spool(target *t)
+{
+	bool loaded = false;
+
+	if (t->spool_offset == t->spool_size)
+		return false;
+	if (fseeko(t->spool, t->spool_offset, SEEK_SET) == -1) {
+		error("Cannot seek in %s: %m", t->conf->spool_file);
+		discard_spool(t);
+		return false;
+	}
+	do {
+		char *line, *command, *data;
+		size_t length, size;
+		double accepted;
+
+		if ((line = read_spool_line(t, &length)) == NULL
+		    || (accepted = strtod(line, &command)) <= 0.0
+		    || *command != ' ') {
+			error("Spool file %s is corrupt", t->conf->spool_file);
+			discard_spool(t);
+			return loaded;
+		}
+		size = length - (size_t)(++command - line);
+		data = xmalloc(size);
+		(void)memcpy(data, command, size);
+		enqueue(&t->pending, new_record(data, size, accepted));
+
+		t->spool_offset += (off_t)length;
+		loaded = true;
+	} while (t->spool_offset < t->spool_size
+	    && t->pending.size < t->conf->max_buffer_size / 2);
+
+	if (t->spool_offset == t->spool_size) {
+		debug("Replayed all commands spooled for %s", t->conf->name);
+		discard_spool(t);
+	}
+	return loaded;
+}
+
+static char *
+read_spool_line(target * restrict t, size_t * restrict length)
+{
+	size_t len = 0;
+
+	if (t->spool_line == NULL) {
+		t->spool_line_size = SPOOL_LINE_SIZE;
+		t->spool_line = xmalloc(t->spool_line_size);
+	}
+	do {
+		if (t->spool_line_size - len < 2) {
+			t->spool_line_size *= 2;
+			t->spool_line = xrealloc(t->spool_line,
+			    t->spool_line_size);
+		}
+		if (fgets(t->spool_line + len, (int)(t->spool_line_size - len),
+		    t->spool) == NULL)
+			return NULL;
+		len += strlen(t->spool_line + len);
+	} while (t->spool_line[len - 1] != '\n');
+
+	*length = len;
+	return t->spool_line;
+}
+
+static void
+discard_spool(target *t)
+{
+	if (ftruncate(fileno(t->spool), 0) == -1)
+		error("Cannot truncate %s: %m", t->conf->spool_file);
+	t->spool_size = t->spool_offset = 0;
+}
+
+/*
+ * Write the buffered commands into the spool file, followed by the commands
+ * which are still spooled.
+ */
+static void
+save_spool(target *t)
+{
+	char *temp_path;
+
+	if (t->pending.size == 0 && t->spool_offset == 0) {
+		if (t->spool != NULL && t->spool_size == 0
+		    && unlink(t->conf->spool_file) == -1)
+			error("Cannot remove %s: %m", t->conf->spool_file);
+		return;
+	}
+	xasprintf(&temp_path, "%s.XXXXXX", t->conf->spool_file);
+
+	if (write_spool_file(t, temp_path)
+	    && rename(temp_path, t->conf->spool_file) == 0)
+		notice("Spooled %zu buffered command(s) for %s",
+		    t->pending.length, t->conf->name);
+	else {
+		error("Cannot write %s: %m", t->conf->spool_file);
+		(void)unlink(temp_path);
+	}
+	free(temp_path);
+}
+
+static bool
+write_spool_file(target * restrict t, char * restrict path)
+{
+	FILE *f;
+	record *r;
+	char buf[COPY_CHUNK_SIZE];
+	size_t n;
+	int fd;
+	bool success = true;
+
+	if ((fd = mkstemp(path)) == -1)
+		return false;
+	if ((f = fdopen(fd, "w")) == NULL) {
+		(void)close(fd);
+		return false;
+	}
+	for (r = t->pending.head; r != NULL && success; r = r->next)
+		if (r->data != NULL)
+			success = fprintf(f, "%.3f ", (double)r->accepted) > 0
+			    && fwrite(r->data, 1, r->size, f) == r->size;
+
+	if (success && t->spool_offset < t->spool_size) {
+		if (fseeko(t->spool, t->spool_offset, SEEK_SET) == -1)
+			success = false;
+		while (success && (n = fread(buf, 1, sizeof(buf), t->spool))
+		    > 0)
+			success = fwrite(buf, 1, n, f) == n;
+		if (ferror(t->spool))
+			success = false;
+	}
+	if (fclose(f) == EOF)
+		success = false;
+	return success;
+}
+
+static record *
+new_record(char *data, size_t size, ev_tstamp accepted)
+{
+	record *r = xmalloc(sizeof(record));
+
+	r->data = data;
+	r->size = size;
+	r->accepted = accepted;
+	return r;
+}
+
+static void
+enqueue(record_queue * restrict queue, record * restrict r)
+{
+	r->next = NULL;
+	if (queue->tail != NULL)
+		queue->tail->next = r;
+	else
+		queue->head = r;
+	queue->tail = r;
+	queue->length++;
+	queue->size += r->size;
+}
+
+static void
+requeue(record_queue * restrict from, record_queue * restrict to)
+{
+	if (from->head == NULL)
+		return;
+
+	from->tail->next = to->head;
+	if (to->tail == NULL)
+		to->tail = from->tail;
+	to->head = from->head;
+	to->length += from->length;
+	to->size += from->size;
+
+	from->head = from->tail = NULL;
+	from->length = from->size = 0;
+}
+
+static record *
+dequeue(record_queue *queue)
+{
+	record *r = queue->head;
+
+	if ((queue->head = r->next) == NULL)
+		queue->tail = NULL;
+	queue->length--;
+	queue->size -= r->size;
+
+	return r;
+}
+
+static void
+free_record(record *r)
+{
+	if (r->data != NULL)
+		free(r->data);
+	free(r);
+}
+
+static void
+free_queue(record_queue *queue)
+{
+	while (queue->head != NULL)
+		free_record(dequeue(queue));
+}
+
+static char *
+generate_session_id(void)
+{
+	unsigned char random_bytes[NUM_SESSION_ID_BYTES];
+	char *session_id = xmalloc(2 * sizeof(random_bytes) + 1);
+	size_t i;
+
+#if HAVE_RAND_BYTES
+	(void)RAND_bytes(random_bytes, sizeof(random_bytes));
+#else
+	(void)RAND_pseudo_bytes(random_bytes, sizeof(random_bytes));
+#endif
+	for (i = 0; i < sizeof(random_bytes); i++)
+		(void)sprintf(session_id + 2 * i, "%02x", random_bytes[i]);
+
+	return session_id;
+}
+
+/* vim:set joinspaces noexpandtab textwidth=80 cinoptions=(4,u0: */
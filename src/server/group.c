@@ -0,0 +1,557 @@
+/*
+ * Copyright (c) 2014 Holger Weiss <holger@weiss.in-berlin.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "group.h"
+#include "log.h"
+#include "system.h"
+#include "util.h"
+#include "wrappers.h"
+
+#define MIN_BUCKETS 64
+
+typedef struct table_entry_s {
+	char *key;
+	void *value;
+	struct table_entry_s *next;
+	size_t key_len;
+	unsigned long hash;
+} table_entry;
+
+struct group_table_s {
+	table_entry **buckets;
+	size_t n_buckets;
+	size_t n_entries;
+};
+
+typedef struct {
+	const char *name; /* Points into the objects file. */
+	size_t name_len;
+	unsigned long hash;
+} group_definition;
+
+typedef struct {
+	size_t *groups; /* Indices into the "groups" array. */
+	size_t n_groups;
+} membership;
+
+typedef enum {
+	OBJECT_OTHER,
+	OBJECT_HOSTGROUP,
+	OBJECT_SERVICEGROUP
+} object_type;
+
+static group_definition *groups = NULL;
+static size_t n_groups = 0;
+static struct group_table_s host_members, service_members;
+static char *objects = NULL;
+
+static void parse_objects(const char *);
+static void add_group(object_type, const char * restrict, size_t,
+                      const char * restrict, size_t);
+static void add_member(struct group_table_s * restrict, size_t,
+                       const char * restrict, size_t, const char * restrict,
+                       size_t);
+static const char *next_member(const char * restrict, const char * restrict,
+                               const char ** restrict, size_t * restrict);
+static bool is_member(const struct group_table_s * restrict,
+                      const group_set * restrict, const char * restrict,
+                      size_t, const char * restrict, size_t);
+static char *read_file(const char *);
+static const char *trim(const char * restrict, const char * restrict,
+                        size_t * restrict);
+static table_entry *table_find(const struct group_table_s * restrict,
+                               const char * restrict, size_t,
+                               const char * restrict, size_t, unsigned long);
+static table_entry *table_add(struct group_table_s * restrict,
+                              const char * restrict, size_t,
+                              const char * restrict, size_t);
+static void table_grow(struct group_table_s *);
+static void table_clear(struct group_table_s *);
+static unsigned long hash_key(const char * restrict, size_t,
+                              const char * restrict, size_t);
+
+/*
+ * Exported functions.
+ */
+
+/*
+ * Read the host and service group memberships from a Nagios "objects.cache"
+ * file (or any other file with resolved "hostgroup" and "servicegroup"
+ * definitions).  The group and member names refer to the file contents, which
+ * are kept in memory for that reason.
+ */
+bool
+group_load(const char *path)
+{
+	group_free();
+
+	debug("Reading group memberships from %s", path);
+	if ((objects = read_file(path)) == NULL)
+		return false;
+
+	parse_objects(objects);
+	debug("Got %zu group(s) with %zu host and %zu service member(s)",
+	    n_groups, host_members.n_entries, service_members.n_entries);
+	return true;
+}
+
+void
+group_free(void)
+{
+	table_clear(&host_members);
+	table_clear(&service_members);
+	if (groups != NULL)
+		free(groups);
+	if (objects != NULL)
+		free(objects);
+	groups = NULL;
+	objects = NULL;
+	n_groups = 0;
+}
+
+group_set *
+group_set_new(char * const *names, size_t n_names)
+{
+	group_set *set;
+	size_t i;
+
+	if (n_names == 0)
+		return NULL;
+
+	set = xmalloc(sizeof(group_set));
+	set->buckets = NULL;
+	set->n_buckets = set->n_entries = 0;
+	for (i = 0; i < n_names; i++)
+		(void)table_add(set, names[i], strlen(names[i]), NULL, 0);
+
+	return set;
+}
+
+void
+group_set_free(group_set *set)
+{
+	if (set != NULL) {
+		table_clear(set);
+		free(set);
+	}
+}
+
+bool
+group_permits_host(const group_set * restrict set, const char * restrict host,
+                   size_t host_len)
+{
+	return is_member(&host_members, set, host, host_len, NULL, 0);
+}
+
+bool
+group_permits_service(const group_set * restrict set,
+                      const char * restrict host, size_t host_len,
+                      const char * restrict service, size_t service_len)
+{
+	return is_member(&service_members, set, host, host_len, service,
+	    service_len);
+}
+
+void
+group_log_stats(void)
+{
+	if (objects != NULL)
+		notice("%zu host and service group(s) with %zu host and %zu "
+		    "service member(s)", n_groups, host_members.n_entries,
+		    service_members.n_entries);
+}
+
+/*
+ * Static functions.
+ */
+
+static void
+parse_objects(const char *data)
+{
+	object_type type = OBJECT_OTHER;
+	const char *name = NULL, *members = NULL;
+	size_t name_len = 0, members_len = 0;
+	const char *line, *end;
+
+	for (line = data; *line != '\0'; line = end) {
+		const char *key, *key_end, *value, *line_end;
+		size_t key_len, value_len;
+
+		if ((end = strchr(line, '\n')) == NULL)
+			end = line + strlen(line);
+		line_end = end;
+		if (*end == '\n')
+			end++;
+
+		if ((key = trim(line, line_end, &key_len)) == NULL)
+			continue;
+
+		if (key_len > 7 && strncmp(key, "define", 6) == 0
+		    && (key[6] == ' ' || key[6] == '\t')) {
+			value = trim(key + 6, key + key_len, &value_len);
+			if (value_len >= 10
+			    && strncmp(value, "hostgroup", 9) == 0
+			    && strchr(" \t{", value[9]) != NULL)
+				type = OBJECT_HOSTGROUP;
+			else if (value_len >= 13
+			    && strncmp(value, "servicegroup", 12) == 0
+			    && strchr(" \t{", value[12]) != NULL)
+				type = OBJECT_SERVICEGROUP;
+			else
+				type = OBJECT_OTHER;
+			name = members = NULL;
+			name_len = members_len = 0;
+			continue;
+		}
+		if (key_len == 1 && *key == '}') {
+			if (type != OBJECT_OTHER && name != NULL)
+				add_group(type, name, name_len, members,
+				    members_len);
+			type = OBJECT_OTHER;
+			continue;
+		}
+		if (type == OBJECT_OTHER)
+			continue;
+
+		for (key_end = key; key_end < key + key_len
+		    && *key_end != ' ' && *key_end != '\t'; key_end++)
+			continue;
+		if ((value = trim(key_end, key + key_len, &value_len)) == NULL)
+			continue;
+		key_len = (size_t)(key_end - key);
+		if ((key_len == 14 && type == OBJECT_HOSTGROUP
+		    && strncmp(key, "hostgroup_name", 14) == 0)
+		    || (key_len == 17 && type == OBJECT_SERVICEGROUP
+		    && strncmp(key, "servicegroup_name", 17) == 0)) {
+			name = value;
+			name_len = value_len;
+		} else if (key_len == 7 && strncmp(key, "members", 7) == 0) {
+			members = value;
+			members_len = value_len;
+		}
+	}
+}
+
+/*
+ * Add a group along with its comma-separated list of members.  Service group
+ * members are given as host and service pairs.
+ */
+static void
+add_group(object_type type, const char * restrict name, size_t name_len,
+          const char * restrict members, size_t members_len)
+{
+	const char *p, *end = members != NULL ? members + members_len : NULL;
+	size_t index = n_groups;
+
+	groups = xrealloc(groups, (n_groups + 1) * sizeof(group_definition));
+	groups[index].name = name;
+	groups[index].name_len = name_len;
+	groups[index].hash = hash_key(name, name_len, NULL, 0);
+	n_groups++;
+
+	for (p = members; p != NULL;) {
+		const char *host, *service;
+		size_t host_len, service_len;
+
+		p = next_member(p, end, &host, &host_len);
+		if (type == OBJECT_HOSTGROUP) {
+			add_member(&host_members, index, host, host_len, NULL,
+			    0);
+			continue;
+		}
+		if (p == NULL) {
+			warning("Service group %.*s lists host %.*s without a "
+			    "service", (int)name_len, name, (int)host_len,
+			    host);
+			break;
+		}
+		p = next_member(p, end, &service, &service_len);
+		add_member(&service_members, index, host, host_len, service,
+		    service_len);
+	}
+}
+
+static void
+add_member(struct group_table_s * restrict table, size_t index,
+           const char * restrict host, size_t host_len,
+           const char * restrict service, size_t service_len)
+{
+	table_entry *entry;
+	membership *m;
+
+	if (host_len == 0 || (service != NULL && service_len == 0))
+		return;
+
+	entry = table_add(table, host, host_len, service, service_len);
+	if ((m = entry->value) == NULL) {
+		m = entry->value = xmalloc(sizeof(membership));
+		m->groups = NULL;
+		m->n_groups = 0;
+	} else if (m->groups[m->n_groups - 1] == index)
+		return; /* Listed twice within the same group. */
+
+	m->groups = xrealloc(m->groups, (m->n_groups + 1) * sizeof(size_t));
+	m->groups[m->n_groups++] = index;
+}
+
+/*
+ * Store the (trimmed) member name at the given position, and return the start
+ * of the next member name, or NULL if there is none.
+ */
+static const char *
+next_member(const char * restrict start, const char * restrict end,
+            const char ** restrict name, size_t * restrict len)
+{
+	const char *comma = memchr(start, ',', (size_t)(end - start));
+
+	if ((*name = trim(start, comma != NULL ? comma : end, len)) == NULL)
+		*len = 0;
+	return comma != NULL ? comma + 1 : NULL;
+}
+
+static bool
+is_member(const struct group_table_s * restrict table,
+          const group_set * restrict set, const char * restrict host,
+          size_t host_len, const char * restrict service, size_t service_len)
+{
+	const table_entry *entry;
+	const membership *m;
+	size_t i;
+
+	if (set == NULL || table->n_entries == 0
+	    || (entry = table_find(table, host, host_len, service, service_len,
+	    hash_key(host, host_len, service, service_len))) == NULL)
+		return false;
+
+	m = entry->value;
+	for (i = 0; i < m->n_groups; i++) {
+		const group_definition *group = &groups[m->groups[i]];
+
+		if (table_find(set, group->name, group->name_len, NULL, 0,
+		    group->hash) != NULL)
+			return true;
+	}
+	return false;
+}
+
+static char *
+read_file(const char *path)
+{
+	struct stat sb;
+	char *data;
+	size_t size = 0;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		error("Cannot open %s: %m", path);
+		return NULL;
+	}
+	if (fstat(fd, &sb) == -1) {
+		error("Cannot get status of %s: %m", path);
+		(void)close(fd);
+		return NULL;
+	}
+	data = xmalloc((size_t)sb.st_size + 1);
+	while (size < (size_t)sb.st_size
+	    && (n = read(fd, data + size, (size_t)sb.st_size - size)) != 0) {
+		if (n == -1 && errno != EINTR) {
+			error("Cannot read %s: %m", path);
+			free(data);
+			(void)close(fd);
+			return NULL;
+		}
+		if (n > 0)
+			size += (size_t)n;
+	}
+	(void)close(fd);
+	data[size] = '\0';
+	return data;
+}
+
+/*
+ * Return the first non-blank character between start and end and store the
+ * length of the string without leading and trailing blanks.  Return NULL if
+ * there are only blanks.
+ */
+static const char *
+trim(const char * restrict start, const char * restrict end,
+     size_t * restrict len)
+{
+	while (start < end && (*start == ' ' || *start == '\t'))
+		start++;
+	while (end > start && (end[-1] == ' ' || end[-1] == '\t'
+	    || end[-1] == '\r'))
+		end--;
+
+	*len = (size_t)(end - start);
+	return start < end ? start : NULL;
+}
+
+/*
+ * Table entries are keyed by one or two strings which don't have to be
+ * NUL-terminated.  Two-part keys are stored as "first;second", which is
+ * unambiguous as host names cannot contain semicolons.
+ */
+static table_entry *
+table_find(const struct group_table_s * restrict table,
+           const char * restrict first, size_t first_len,
+           const char * restrict second, size_t second_len,
+           unsigned long hash)
+{
+	table_entry *entry;
+	size_t key_len = second != NULL ? first_len + 1 + second_len
+	    : first_len;
+
+	if (table->n_buckets == 0)
+		return NULL;
+
+	for (entry = table->buckets[hash % table->n_buckets]; entry != NULL;
+	    entry = entry->next)
+		if (entry->hash == hash && entry->key_len == key_len
+		    && memcmp(entry->key, first, first_len) == 0
+		    && (second == NULL
+		    || memcmp(entry->key + first_len + 1, second,
+		    second_len) == 0))
+			return entry;
+
+	return NULL;
+}
+
+static table_entry *
+table_add(struct group_table_s * restrict table, const char * restrict first,
+          size_t first_len, const char * restrict second, size_t second_len)
+{
+	unsigned long hash = hash_key(first, first_len, second, second_len);
+	table_entry *entry;
+	size_t slot;
+
+	if ((entry = table_find(table, first, first_len, second, second_len,
+	    hash)) != NULL)
+		return entry;
+	if (table->n_entries == table->n_buckets)
+		table_grow(table);
+
+	entry = xmalloc(sizeof(table_entry));
+	entry->key_len = second != NULL ? first_len + 1 + second_len
+	    : first_len;
+	entry->key = xmalloc(entry->key_len + 1);
+	(void)memcpy(entry->key, first, first_len);
+	if (second != NULL) {
+		entry->key[first_len] = ';';
+		(void)memcpy(entry->key + first_len + 1, second, second_len);
+	}
+	entry->key[entry->key_len] = '\0';
+	entry->hash = hash;
+	entry->value = NULL;
+
+	slot = hash % table->n_buckets;
+	entry->next = table->buckets[slot];
+	table->buckets[slot] = entry;
+	table->n_entries++;
+
+	return entry;
+}
+
+static void
+table_grow(struct group_table_s *table)
+{
+	size_t i, n_buckets = table->n_buckets > 0 ? table->n_buckets * 2
+	    : MIN_BUCKETS;
+	table_entry **buckets = xmalloc(n_buckets * sizeof(table_entry *));
+
+	for (i = 0; i < n_buckets; i++)
+		buckets[i] = NULL;
+
+	for (i = 0; i < table->n_buckets; i++) {
+		table_entry *entry, *next;
+
+		for (entry = table->buckets[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			entry->next = buckets[entry->hash % n_buckets];
+			buckets[entry->hash % n_buckets] = entry;
+		}
+	}
+	if (table->buckets != NULL)
+		free(table->buckets);
+	table->buckets = buckets;
+	table->n_buckets = n_buckets;
+}
+
+static void
+table_clear(struct group_table_s *table)
+{
+	size_t i;
+
+	for (i = 0; i < table->n_buckets; i++) {
+		table_entry *entry, *next;
+
+		for (entry = table->buckets[i]; entry != NULL; entry = next) {
+			membership *m = entry->value;
+
+			next = entry->next;
+			if (m != NULL) {
+				free(m->groups);
+				free(m);
+			}
+			free(entry->key);
+			free(entry);
+		}
+	}
+	if (table->buckets != NULL)
+		free(table->buckets);
+	table->buckets = NULL;
+	table->n_buckets = table->n_entries = 0;
+}
+
+static unsigned long
+hash_key(const char * restrict first, size_t first_len,
+         const char * restrict second, size_t second_len)
+{
+	unsigned long h = hash_bytes(HASH_INITIAL, first, first_len);
+
+	if (second != NULL) {
+		h = hash_bytes(h, ";", 1);
+		h = hash_bytes(h, second, second_len);
+	}
+	return h;
+}
+
+/* vim:set joinspaces noexpandtab textwidth=80 cinoptions=(4,u0: */
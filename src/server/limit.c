@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 2014 Holger Weiss <holger@weiss.in-berlin.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Token buckets which limit the rate at which clients may submit commands.
+ * There's one bucket per client identity, or per client identity and IP
+ * address.  Requests exceeding the configured rate aren't refused.  Instead,
+ * the caller stops reading from the client until a token is available, so TCP
+ * flow control slows the client down.  Delayed requests of a bucket are resumed
+ * in the order they arrived.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <ev.h>
+
+#include "conf.h"
+#include "hash.h"
+#include "limit.h"
+#include "log.h"
+#include "system.h"
+#include "util.h"
+#include "wrappers.h"
+
+#define HASH_SIZE 1024
+#define SWEEP_THRESHOLD 4096
+
+typedef struct limit_bucket_s {
+	ev_timer refill_watcher;
+	struct limit_bucket_s *next; /* Link in the hash chain. */
+	limit_waiter *first_waiter;
+	limit_waiter *last_waiter;
+	char *key;
+	ev_tstamp last_refill;
+	ev_tstamp total_delay;
+	double tokens;
+	double rate;
+	double burst;
+	unsigned long n_passed;
+	unsigned long n_delayed;
+} limit_bucket;
+
+static limit_bucket *buckets[HASH_SIZE];
+static size_t n_buckets = 0;
+static size_t sweep_threshold = SWEEP_THRESHOLD;
+
+static limit_bucket *get_bucket(const char *, ev_tstamp);
+static void refill(limit_bucket *, ev_tstamp);
+static void schedule_refill(limit_bucket *);
+static void refill_cb(EV_P_ ev_timer *, int);
+static void sweep_buckets(ev_tstamp);
+static void free_bucket(limit_bucket *);
+
+/*
+ * Exported functions.
+ */
+
+void
+limit_init(limit_waiter *waiter)
+{
+	waiter->prev = waiter->next = NULL;
+	waiter->bucket = NULL;
+}
+
+bool
+limit_acquire(limit_waiter * restrict waiter, const char * restrict identity,
+              const char * restrict address, void resume(limit_waiter *))
+{
+	authorization *auth;
+	limit_bucket *bucket;
+	ev_tstamp now = ev_now(EV_DEFAULT_UC);
+	double rate, burst;
+	bool per_address;
+
+	if ((auth = hash_lookup(identity)) == NULL
+	    && (auth = hash_lookup("*")) == NULL)
+		return true; /* The request will be refused anyway. */
+	if ((rate = auth->max_rate) <= 0.0)
+		return true;
+
+	if ((burst = (double)auth->max_burst) < 1.0)
+		burst = MAX(rate, 1.0);
+	per_address = auth->rate_limit_per_address;
+
+	if (per_address) {
+		char *key;
+
+		xasprintf(&key, "%s@%s", identity, address);
+		bucket = get_bucket(key, now);
+		free(key);
+	} else
+		bucket = get_bucket(identity, now);
+	bucket->rate = rate;
+	bucket->burst = burst;
+	refill(bucket, now);
+
+	if (bucket->first_waiter == NULL && bucket->tokens >= 1.0) {
+		bucket->tokens -= 1.0;
+		bucket->n_passed++;
+		return true;
+	}
+
+	debug("Delaying request from %s@%s (limit: %g per second)", identity,
+	    address, rate);
+
+	waiter->bucket = bucket;
+	waiter->resume = resume;
+	waiter->since = now;
+	waiter->next = NULL;
+	waiter->prev = bucket->last_waiter;
+	if (bucket->last_waiter != NULL)
+		bucket->last_waiter->next = waiter;
+	else
+		bucket->first_waiter = waiter;
+	bucket->last_waiter = waiter;
+	bucket->n_delayed++;
+
+	if (!ev_is_active(&bucket->refill_watcher))
+		schedule_refill(bucket);
+
+	return false;
+}
+
+void
+limit_cancel(limit_waiter *waiter)
+{
+	limit_bucket *bucket = waiter->bucket;
+
+	if (bucket == NULL)
+		return;
+
+	if (waiter->prev != NULL)
+		waiter->prev->next = waiter->next;
+	else
+		bucket->first_waiter = waiter->next;
+	if (waiter->next != NULL)
+		waiter->next->prev = waiter->prev;
+	else
+		bucket->last_waiter = waiter->prev;
+
+	if (bucket->first_waiter == NULL
+	    && ev_is_active(&bucket->refill_watcher))
+		ev_timer_stop(EV_DEFAULT_UC_ &bucket->refill_watcher);
+
+	limit_init(waiter);
+}
+
+void
+limit_log_stats(void)
+{
+	limit_bucket *bucket;
+	size_t i;
+
+	for (i = 0; i < HASH_SIZE; i++)
+		for (bucket = buckets[i]; bucket != NULL;
+		    bucket = bucket->next) {
+			size_t n_waiting = 0;
+			limit_waiter *waiter;
+
+			for (waiter = bucket->first_waiter; waiter != NULL;
+			    waiter = waiter->next)
+				n_waiting++;
+
+			notice("Rate limit for %s: %lu request(s) passed, %lu "
+			    "delayed (%.3f seconds on average), %zu waiting",
+			    bucket->key, bucket->n_passed, bucket->n_delayed,
+			    bucket->n_delayed > 0 ? bucket->total_delay /
+			    (double)bucket->n_delayed : 0.0, n_waiting);
+		}
+}
+
+void
+limit_stop(void)
+{
+	size_t i;
+
+	for (i = 0; i < HASH_SIZE; i++)
+		while (buckets[i] != NULL) {
+			limit_bucket *next = buckets[i]->next;
+
+			free_bucket(buckets[i]);
+			buckets[i] = next;
+		}
+	n_buckets = 0;
+}
+
+/*
+ * Static functions.
+ */
+
+static limit_bucket *
+get_bucket(const char *key, ev_tstamp now)
+{
+	limit_bucket *bucket;
+	unsigned int slot = (unsigned int)(hash_string(key) % HASH_SIZE);
+
+	for (bucket = buckets[slot]; bucket != NULL; bucket = bucket->next)
+		if (strcmp(bucket->key, key) == 0)
+			return bucket;
+
+	if (n_buckets >= sweep_threshold)
+		sweep_buckets(now);
+
+	debug("Creating token bucket for %s", key);
+
+	bucket = xmalloc(sizeof(limit_bucket));
+	bucket->key = xstrdup(key);
+	bucket->first_waiter = bucket->last_waiter = NULL;
+	bucket->last_refill = now;
+	bucket->total_delay = 0.0;
+	bucket->tokens = -1.0; /* Filled up by the caller. */
+	bucket->rate = bucket->burst = 0.0;
+	bucket->n_passed = bucket->n_delayed = 0;
+	ev_timer_init(&bucket->refill_watcher, refill_cb, 0.0, 0.0);
+	bucket->refill_watcher.data = bucket;
+
+	bucket->next = buckets[slot];
+	buckets[slot] = bucket;
+	n_buckets++;
+
+	return bucket;
+}
+
+static void
+refill(limit_bucket *bucket, ev_tstamp now)
+{
+	if (bucket->tokens < 0.0) /* New bucket. */
+		bucket->tokens = bucket->burst;
+	else
+		bucket->tokens = MIN(bucket->burst, bucket->tokens
+		    + (now - bucket->last_refill) * bucket->rate);
+	bucket->last_refill = now;
+}
+
+static void
+schedule_refill(limit_bucket *bucket)
+{
+	ev_tstamp delay = (1.0 - bucket->tokens) / bucket->rate;
+
+	ev_timer_set(&bucket->refill_watcher, MAX(delay, 0.0), 0.0);
+	ev_timer_start(EV_DEFAULT_UC_ &bucket->refill_watcher);
+}
+
+static void
+refill_cb(EV_P_ ev_timer *w, int revents __attribute__((__unused__)))
+{
+	limit_bucket *bucket = w->data;
+	ev_tstamp now = ev_now(EV_A);
+
+	refill(bucket, now);
+
+	while (bucket->first_waiter != NULL && bucket->tokens >= 1.0) {
+		limit_waiter *waiter = bucket->first_waiter;
+
+		bucket->first_waiter = waiter->next;
+		if (bucket->first_waiter != NULL)
+			bucket->first_waiter->prev = NULL;
+		else
+			bucket->last_waiter = NULL;
+
+		bucket->tokens -= 1.0;
+		bucket->total_delay += now - waiter->since;
+		limit_init(waiter);
+		waiter->resume(waiter);
+	}
+	if (bucket->first_waiter != NULL)
+		schedule_refill(bucket);
+}
+
+/*
+ * Drop the buckets which are full and have no waiters, as they don't limit
+ * anything.  (Their statistics are lost, though.)
+ */
+static void
+sweep_buckets(ev_tstamp now)
+{
+	size_t i;
+
+	for (i = 0; i < HASH_SIZE; i++) {
+		limit_bucket **p = &buckets[i];
+
+		while (*p != NULL) {
+			limit_bucket *bucket = *p;
+
+			refill(bucket, now);
+			if (bucket->first_waiter == NULL
+			    && bucket->tokens >= bucket->burst) {
+				*p = bucket->next;
+				free_bucket(bucket);
+				n_buckets--;
+			} else
+				p = &bucket->next;
+		}
+	}
+	sweep_threshold = MAX(SWEEP_THRESHOLD, 2 * n_buckets);
+	debug("Keeping %zu token bucket(s) after sweep", n_buckets);
+}
+
+static void
+free_bucket(limit_bucket *bucket)
+{
+	if (ev_is_active(&bucket->refill_watcher))
+		ev_timer_stop(EV_DEFAULT_UC_ &bucket->refill_watcher);
+	free(bucket->key);
+	free(bucket);
+}
+
+/* vim:set joinspaces noexpandtab textwidth=80 cinoptions=(4,u0: */
@@ -57,6 +57,7 @@
 #include <ev.h>
 
 #include "conf.h"
+#include "forward.h"
 #include "log.h"
 #include "server.h"
 #include "system.h"
@@ -65,6 +66,7 @@
 
 typedef struct {
 	char *bind;
+	char *cache_file;
 	char *conf_file;
 	char *command_file;
 	char *pid_file;
@@ -79,6 +81,7 @@ static char *pid_file = NULL;
 static bool restart = false;
 static ev_timer keep_alive_watcher;
 static ev_signal sighup_watcher, sigint_watcher, sigterm_watcher;
+static ev_signal sigusr2_watcher;
 
 static options *get_options(int, char **);
 static void free_options(options *);
@@ -90,13 +93,16 @@ static void stop_keep_alive(void);
 static void notify_systemd(void);
 static void keep_alive_cb(EV_P_ ev_timer *, int);
 static void signal_cb(EV_P_ ev_signal *, int);
+static void stats_cb(EV_P_ ev_signal *, int);
 static void usage(int) __attribute__((__noreturn__));
 
 int
 main(int argc, char **argv)
 {
 	server_state *server;
+	const forwarding *forwardings;
 	options *opt;
+	size_t n_forwardings;
 	pid_t other_pid;
 	int socket_activated;
 
@@ -120,7 +126,7 @@ main(int argc, char **argv)
 
 	opt = get_options(argc, argv);
 	cfg = conf_parse(opt->conf_file != NULL ?
-	    opt->conf_file : DEFAULT_CONF_FILE);
+	    opt->conf_file : DEFAULT_CONF_FILE, opt->cache_file);
 
 	if (cfg_size(cfg, "user") > 0 || cfg_size(cfg, "chroot") > 0)
 		drop_privileges(cfg_size(cfg, "user") > 0 ?
@@ -191,11 +197,17 @@ main(int argc, char **argv)
 
 	server = server_start(
 	    cfg_getstr(cfg, "listen"),
+	    cfg_size(cfg, "listen_unix") > 0 ?
+	    cfg_getstr(cfg, "listen_unix") : NULL,
+	    (int)cfg_getint(cfg, "listen_backlog"),
 	    cfg_getstr(cfg, "tls_ciphers"),
 	    cfg_getstr(cfg, "command_file"),
 	    cfg_getstr(cfg, "temp_directory"),
 	    (size_t)cfg_getint(cfg, "max_command_size"),
 	    (size_t)cfg_getint(cfg, "max_queue_size"),
+	    (size_t)cfg_getint(cfg, "max_connections"),
+	    (size_t)cfg_getint(cfg, "max_handshakes"),
+	    (size_t)cfg_getint(cfg, "max_handshakes_per_address"),
 	    cfg_getfloat(cfg, "timeout"));
 
 	if (!opt->foreground && !socket_activated) {
@@ -211,6 +223,9 @@ main(int argc, char **argv)
 
 	notice("%s starting up", nsca_version());
 
+	forwardings = conf_get_forwardings(&n_forwardings);
+	forward_start(forwardings, n_forwardings, cfg_getfloat(cfg, "timeout"));
+
 	ev_signal_init(&sighup_watcher, signal_cb, SIGHUP);
 	ev_signal_init(&sigint_watcher, signal_cb, SIGINT);
 	ev_signal_init(&sigterm_watcher, signal_cb, SIGTERM);
@@ -218,11 +233,17 @@ main(int argc, char **argv)
 	ev_signal_start(EV_DEFAULT_UC_ &sigint_watcher);
 	ev_signal_start(EV_DEFAULT_UC_ &sigterm_watcher);
 
+	/* SIGUSR1 might be used for AIO completion notifications. */
+	ev_signal_init(&sigusr2_watcher, stats_cb, SIGUSR2);
+	sigusr2_watcher.data = server;
+	ev_signal_start(EV_DEFAULT_UC_ &sigusr2_watcher);
+
 	notify_systemd();
 
 	(void)ev_run(EV_DEFAULT_UC_ 0);
 
 	server_stop(server);
+	forward_stop();
 	free_options(opt);
 	if (restart) {
 		notice("Restarting");
@@ -246,6 +267,7 @@ get_options(int argc, char **argv)
 	int option;
 
 	opt->bind = NULL;
+	opt->cache_file = NULL;
 	opt->conf_file = NULL;
 	opt->command_file = NULL;
 	opt->pid_file = NULL;
@@ -262,7 +284,7 @@ get_options(int argc, char **argv)
 		}
 	}
 
-	while ((option = getopt(argc, argv, "b:C:c:Fhl:P:SsV")) != -1)
+	while ((option = getopt(argc, argv, "b:C:c:Fhk:l:P:SsV")) != -1)
 		switch (option) {
 		case 'b':
 			if (opt->bind != NULL)
@@ -284,6 +306,11 @@ get_options(int argc, char **argv)
 			break;
 		case 'h':
 			usage(EXIT_SUCCESS);
+		case 'k':
+			if (opt->cache_file != NULL)
+				free(opt->cache_file);
+			opt->cache_file = xstrdup(optarg);
+			break;
 		case 'l':
 			opt->log_level = atoi(optarg);
 			break;
@@ -318,6 +345,8 @@ free_options(options *opt)
 {
 	if (opt->bind != NULL)
 		free(opt->bind);
+	if (opt->cache_file != NULL)
+		free(opt->cache_file);
 	if (opt->conf_file != NULL)
 		free(opt->conf_file);
 	if (opt->command_file != NULL)
@@ -381,20 +410,8 @@ remove_pidfile(void)
 static void
 forget_config(void)
 {
-	if (cfg != NULL) {
-		unsigned int i, n_auth_blocks = cfg_size(cfg, "authorize");
-
-		for (i = 0; i < n_auth_blocks; i++) {
-			cfg_t *auth = cfg_getnsec(cfg, "authorize", i);
-
-			if (cfg_size(auth, "password") > 0) {
-				char *password = cfg_getstr(auth, "password");
-
-				(void)memset(password, 0, strlen(password));
-			}
-		}
-		cfg_free(cfg);
-	}
+	if (cfg != NULL)
+		conf_free(cfg);
 }
 
 static void
@@ -446,6 +463,7 @@ signal_cb(EV_P_ ev_signal *w, int revents __attribute__((__unused__)))
 	ev_signal_stop(EV_A_ &sighup_watcher);
 	ev_signal_stop(EV_A_ &sigint_watcher);
 	ev_signal_stop(EV_A_ &sigterm_watcher);
+	ev_signal_stop(EV_A_ &sigusr2_watcher);
 
 	switch (w->signum) {
 	case SIGHUP:
@@ -468,6 +486,13 @@ signal_cb(EV_P_ ev_signal *w, int revents __attribute__((__unused__)))
 		restart = true;
 }
 
+static void
+stats_cb(EV_P_ ev_signal *w, int revents __attribute__((__unused__)))
+{
+	notice("Received SIGUSR2, logging statistics");
+	server_log_stats(w->data);
+}
+
 static void
 usage(int status)
 {
@@ -479,6 +504,7 @@ usage(int status)
 	    " -c <file|dir>    Use the specified configuration <file|dir>.\n"
 	    " -F               Don't detach from the controlling terminal.\n"
 	    " -h               Print this usage information and exit.\n"
+	    " -k <file>        Cache the processed configuration in <file>.\n"
 	    " -l <level>       Set the specified log <level>.\n"
 	    " -P <file>        Write the PID into the specified <file>.\n"
 	    " -S               Write messages to syslog and standard error.\n"
@@ -41,8 +41,14 @@
 
 #include <ev.h>
 
+#include "acl.h"
 #include "auth.h"
+#include "compress.h"
+#include "conf.h"
 #include "fifo.h"
+#include "forward.h"
+#include "group.h"
+#include "limit.h"
 #include "log.h"
 #include "server.h"
 #include "system.h"
@@ -50,21 +56,69 @@
 #include "util.h"
 #include "wrappers.h"
 
+#define PROTOCOL_VERSION 2
+#define DISCARD_CHUNK_SIZE 4096
+#define STREAM_CHUNK_SIZE 16384
+#define LOG_PREFIX_SIZE 128
+
+/*
+ * PUSH data larger than STREAM_CHUNK_SIZE is streamed into a dump file in
+ * chunks of that size, so that the memory used per connection doesn't depend
+ * on the size of the data.  The complete data is then mapped into memory for
+ * the authorization check, which requires regexec(3) to support REG_STARTEND
+ * (as the mapped data isn't NUL-terminated).
+ */
+#if HAVE_MMAP && defined(REG_STARTEND)
+# define STREAM_PUSH_DATA 1
+#endif
+
+#ifndef CONNECTION_POOL_SIZE
+# define CONNECTION_POOL_SIZE 256
+#endif
+
 struct server_state_s { /* This is typedef'd to `server_state' in server.h. */
 	tls_server_state *tls_server;
 	fifo_state *fifo;
 	size_t max_command_size;
 };
 
-typedef struct {
+typedef struct connection_state_s {
 	server_state *ctx;
+	struct connection_state_s *next; /* Link in the pool. */
+	limit_waiter waiter;
+	fifo_dump *dump;     /* PUSH data is streamed into this file. */
+	const char *failure; /* Response to discarded PUSH data. */
+	decompressor *decompressor; /* Non-NULL if PUSH data is compressed. */
+	char *decoded;       /* Decompressed PUSH data (unless streamed). */
+	size_t decoded_length;
+	size_t decoded_size; /* Allocated for the decompressed data. */
+	size_t data_length;  /* Size of the PUSH data after decompression. */
 	size_t input_length;
+	int protocol_version;
 } connection_state;
 
+static connection_state *connection_pool = NULL;
+static size_t n_pooled_connections = 0;
+
 static void handle_connect(tls_state *);
 static void handle_handshake(tls_state * restrict, char * restrict);
 static void handle_connection(tls_state * restrict, char * restrict);
+static void read_push(tls_state *);
+static void resume_push(limit_waiter *);
 static void handle_push(tls_state * restrict, char * restrict);
+#if STREAM_PUSH_DATA
+static void handle_push_chunk(tls_state * restrict, char * restrict);
+static void finish_push_stream(tls_state *);
+#endif
+#if HAVE_ZLIB_H
+static bool select_encoding(tls_state * restrict, char * restrict);
+static void inflate_push(tls_state *);
+static void handle_compressed_chunk(tls_state * restrict, char * restrict);
+static bool store_decoded(const void *, size_t, void *);
+static void finish_inflate(tls_state *);
+#endif
+static void discard_push(tls_state * restrict, const char * restrict);
+static void handle_discard(tls_state * restrict, char * restrict);
 static void handle_error(tls_state *);
 static void handle_timeout(tls_state *);
 static void handle_line_too_long(tls_state *);
@@ -80,11 +134,16 @@ static void connection_stop(tls_state *);
 
 server_state *
 server_start(const char * restrict listen,
+             const char * restrict listen_unix,
+             int backlog,
              const char * restrict ciphers,
              const char * restrict command_file,
              const char * restrict temp_directory,
              size_t max_command_size,
              size_t max_queue_size,
+             size_t max_connections,
+             size_t max_handshakes,
+             size_t max_handshakes_per_address,
              ev_tstamp timeout)
 {
 	server_state *ctx = xmalloc(sizeof(server_state));
@@ -117,9 +176,16 @@ server_start(const char * restrict listen,
 #endif
 	ctx->max_command_size = max_command_size;
 	ctx->fifo = fifo_start(command_file, temp_directory, max_queue_size);
-	ctx->tls_server = tls_server_start(listen, ciphers, timeout,
+	ctx->tls_server = tls_server_start(listen, ciphers, timeout, backlog,
 	    handle_connect, check_psk);
 	ctx->tls_server->data = ctx;
+	tls_set_admission_limits(ctx->tls_server, max_connections,
+	    max_handshakes, max_handshakes_per_address);
+	if (!acl_is_empty())
+		tls_on_accept(ctx->tls_server, is_permitted_source);
+	if (listen_unix != NULL)
+		tls_server_listen_local(ctx->tls_server, listen_unix, backlog,
+		    check_peer_uid);
 
 	return ctx;
 }
@@ -129,7 +195,37 @@ server_stop(server_state *ctx)
 {
 	tls_server_stop(ctx->tls_server);
 	fifo_stop(ctx->fifo);
+	limit_stop();
 	free(ctx);
+
+	while (connection_pool != NULL) {
+		connection_state *next = connection_pool->next;
+
+		free(connection_pool);
+		connection_pool = next;
+	}
+	n_pooled_connections = 0;
+}
+
+void
+server_log_stats(server_state *ctx)
+{
+	size_t n_active, n_pooled, n_connections, n_handshakes, n_queued;
+	unsigned long n_deferred, n_dropped;
+
+	tls_get_stats(&n_active, &n_pooled);
+	notice("%zu connection(s) active, %zu connection context(s) pooled",
+	    n_active, n_pooled);
+	tls_get_admission_stats(ctx->tls_server, &n_connections, &n_handshakes,
+	    &n_queued, &n_deferred, &n_dropped);
+	notice("%zu client connection(s), %zu TLS handshake(s) in progress, "
+	    "%zu waiting (%lu deferred and %lu dropped so far)", n_connections,
+	    n_handshakes, n_queued, n_deferred, n_dropped);
+	conf_log_stats();
+	group_log_stats();
+	limit_log_stats();
+	fifo_log_stats(ctx->fifo);
+	forward_log_stats();
 }
 
 /*
@@ -139,9 +235,26 @@ server_stop(server_state *ctx)
 static void
 handle_connect(tls_state *tls)
 {
-	connection_state *connection = xmalloc(sizeof(connection_state));
+	connection_state *connection;
+
+	if (connection_pool != NULL) {
+		connection = connection_pool;
+		connection_pool = connection->next;
+		n_pooled_connections--;
+	} else
+		connection = xmalloc(sizeof(connection_state));
 
 	connection->ctx = tls->data;
+	connection->dump = NULL;
+	connection->failure = NULL;
+	connection->decompressor = NULL;
+	connection->decoded = NULL;
+	connection->decoded_length = connection->decoded_size = 0;
+	connection->data_length = 0;
+	connection->input_length = 0;
+	connection->protocol_version = 1;
+	limit_init(&connection->waiter);
+	connection->waiter.data = tls;
 	tls->data = connection;
 
 	tls_on_timeout(tls, handle_timeout);
@@ -154,23 +267,39 @@ handle_connect(tls_state *tls)
 static void
 handle_handshake(tls_state * restrict tls, char * restrict line)
 {
-	char *args[3];
+	connection_state *connection = tls->data;
+	char *args[4], *response;
+	int n_args, version;
 
 	info("%s C: %s", tls->peer, line);
 
 	if (strncasecmp("MOIN", line, 4) == 0) {
-		if (!parse_line(line, args, 3)) {
+		if ((n_args = split_line(line, args, 4)) != 3 && n_args != 4) {
 			warning("Cannot parse MOIN request from %s", tls->peer);
 			send_response(tls, "FAIL Cannot parse MOIN request");
 			tls_read_line(tls, handle_handshake);
-		} else if (atoi(args[1]) <= 0) {
+		} else if ((version = atoi(args[1])) <= 0) {
 			warning("Expected protocol version from %s", tls->peer);
 			send_response(tls, "FAIL Expected protocol version");
 			tls_read_line(tls, handle_handshake);
 		} else {
-			debug("MOIN handshake successful");
+			connection->protocol_version =
+			    MIN(version, PROTOCOL_VERSION);
+			debug("MOIN handshake successful (protocol version %d)",
+			    connection->protocol_version);
 			tls_set_connection_id(tls, args[2]);
-			send_response(tls, "MOIN 1");
+#if HAVE_ZLIB_H
+			if (n_args == 4 && connection->protocol_version > 1
+			    && select_encoding(tls, args[3]))
+				xasprintf(&response, "MOIN %d %s",
+				    connection->protocol_version,
+				    COMPRESSION_METHOD);
+			else
+#endif
+				xasprintf(&response, "MOIN %d",
+				    connection->protocol_version);
+			send_response(tls, response);
+			free(response);
 			tls_read_line(tls, handle_connection);
 		}
 	} else if (strncasecmp("PING", line, 4) == 0) {
@@ -189,31 +318,80 @@ static void
 handle_connection(tls_state * restrict tls, char * restrict line)
 {
 	connection_state *connection = tls->data;
-	char *args[2];
-	int data_size;
+	char *args[3];
+	int data_size, decoded_size = 0;
 
 	info("%s C: %s", tls->peer, line);
 
-	if (strncasecmp("NOOP", line, 4) == 0)
+	/*
+	 * With protocol version 2, the client sends the PUSH data right after
+	 * the PUSH request, without waiting for an OKAY response.  Therefore,
+	 * we must either read (or skip) the data, or give up on the session.
+	 */
+	if (strncasecmp("NOOP", line, 4) == 0) {
 		send_response(tls, "OKAY");
-	else if (strncasecmp("PUSH", line, 4) == 0) {
-		if (!parse_line(line, args, 2)) {
+		tls_read_line(tls, handle_connection);
+	} else if (strncasecmp("PUSH", line, 4) == 0) {
+		/*
+		 * If compression was negotiated, the request specifies the
+		 * size of the compressed data and the decompressed size.
+		 */
+		if (!parse_line(line, args,
+		    connection->decompressor != NULL ? 3 : 2)) {
 			warning("Cannot parse PUSH request from %s", tls->peer);
-			send_response(tls, "FAIL Cannot parse PUSH request");
-			tls_read_line(tls, handle_connection);
-		} else if ((data_size = atoi(args[1])) <= 0) {
+			if (connection->protocol_version > 1)
+				bail(tls, "Cannot parse PUSH request");
+			else {
+				send_response(tls,
+				    "FAIL Cannot parse PUSH request");
+				tls_read_line(tls, handle_connection);
+			}
+		} else if ((data_size = atoi(args[1])) <= 0
+		    || (connection->decompressor != NULL
+		    && (decoded_size = atoi(args[2])) <= 0)) {
 			warning("Expected number of bytes from %s", tls->peer);
-			send_response(tls, "FAIL Expected number of bytes");
-			tls_read_line(tls, handle_connection);
+			if (connection->protocol_version > 1)
+				bail(tls, "Expected number of bytes");
+			else {
+				send_response(tls,
+				    "FAIL Expected number of bytes");
+				tls_read_line(tls, handle_connection);
+			}
+#if HAVE_ZLIB_H
+		} else if (connection->decompressor != NULL) {
+			/*
+			 * The compressed data must be decompressed even if
+			 * it's refused, as the following PUSH data might
+			 * refer back to it.
+			 */
+			connection->input_length = (size_t)data_size;
+			connection->data_length = (size_t)decoded_size;
+			if (connection->ctx->max_command_size > 0
+			    && connection->data_length
+			    > connection->ctx->max_command_size) {
+				warning("Command from %s too long", tls->peer);
+				connection->failure = "PUSH data size too large";
+				inflate_push(tls);
+			} else if (limit_acquire(&connection->waiter, tls->id,
+			    tls->addr, resume_push))
+				read_push(tls);
+#endif
 		} else if (connection->ctx->max_command_size > 0
 		    && (size_t)data_size > connection->ctx->max_command_size) {
 			warning("Command from %s too long", tls->peer);
-			send_response(tls, "FAIL PUSH data size too large");
-			tls_read_line(tls, handle_connection);
+			if (connection->protocol_version > 1) {
+				connection->input_length = (size_t)data_size;
+				discard_push(tls, "PUSH data size too large");
+			} else {
+				send_response(tls,
+				    "FAIL PUSH data size too large");
+				tls_read_line(tls, handle_connection);
+			}
 		} else {
-			send_response(tls, "OKAY");
 			connection->input_length = (size_t)data_size;
-			tls_read(tls, handle_push, connection->input_length);
+			if (limit_acquire(&connection->waiter, tls->id,
+			    tls->addr, resume_push))
+				read_push(tls);
 		}
 	} else if (!client_exited(tls, line)) {
 		warning("Expected PUSH or NOOP or QUIT from %s", tls->peer);
@@ -223,6 +401,38 @@ handle_connection(tls_state * restrict tls, char * restrict line)
 	free(line);
 }
 
+static void
+read_push(tls_state *tls)
+{
+	connection_state *connection = tls->data;
+
+	if (connection->protocol_version == 1)
+		send_response(tls, "OKAY");
+#if HAVE_ZLIB_H
+	if (connection->decompressor != NULL) {
+		inflate_push(tls);
+		return;
+	}
+#endif
+#if STREAM_PUSH_DATA
+	if (connection->input_length > STREAM_CHUNK_SIZE) {
+		if ((connection->dump = fifo_dump_open(connection->ctx->fifo))
+		    == NULL)
+			discard_push(tls, "Cannot store PUSH data");
+		else
+			tls_read(tls, handle_push_chunk, STREAM_CHUNK_SIZE);
+		return;
+	}
+#endif
+	tls_read(tls, handle_push, connection->input_length);
+}
+
+static void
+resume_push(limit_waiter *waiter)
+{
+	read_push(waiter->data);
+}
+
 static void
 handle_push(tls_state * restrict tls, char * restrict data)
 {
@@ -233,10 +443,13 @@ handle_push(tls_state * restrict tls, char * restrict data)
 
 	info("%s C: %.*s", tls->peer, width, data);
 
-	if (is_authorized(tls->id, data)) {
+	if (is_authorized(tls->id, data, connection->input_length)) {
 		notice("Queuing data from %s: %.*s", tls->peer, width, data);
-		fifo_write(connection->ctx->fifo, data,
-		    connection->input_length, free);
+		if (forward_submit(data, connection->input_length))
+			fifo_write(connection->ctx->fifo, tls->id, data,
+			    connection->input_length, free);
+		else
+			free(data);
 		send_response(tls, "OKAY");
 	} else {
 		warning("Refusing data from %s: %.*s", tls->peer, width, data);
@@ -247,6 +460,250 @@ handle_push(tls_state * restrict tls, char * restrict data)
 	tls_read_line(tls, handle_connection);
 }
 
+#if STREAM_PUSH_DATA
+static void
+handle_push_chunk(tls_state * restrict tls, char * restrict data)
+{
+	connection_state *connection = tls->data;
+	size_t size = MIN(connection->input_length, STREAM_CHUNK_SIZE);
+	bool written = fifo_dump_write(connection->dump, data, size);
+
+	free(data);
+	connection->input_length -= size;
+
+	if (!written) {
+		fifo_dump_discard(connection->dump);
+		connection->dump = NULL;
+		if (connection->input_length > 0)
+			discard_push(tls, "Cannot store PUSH data");
+		else {
+			send_response(tls, "FAIL Cannot store PUSH data");
+			tls_read_line(tls, handle_connection);
+		}
+	} else if (connection->input_length > 0)
+		tls_read(tls, handle_push_chunk,
+		    MIN(connection->input_length, STREAM_CHUNK_SIZE));
+	else
+		finish_push_stream(tls);
+}
+
+static void
+finish_push_stream(tls_state *tls)
+{
+	connection_state *connection = tls->data;
+	fifo_dump *dump = connection->dump;
+	const char *data;
+	size_t size;
+	int width;
+
+	connection->dump = NULL;
+
+	if ((data = fifo_dump_map(dump, &size)) == NULL) {
+		fifo_dump_discard(dump);
+		send_response(tls, "FAIL Cannot store PUSH data");
+		tls_read_line(tls, handle_connection);
+		return;
+	}
+
+	width = (int)MIN(size, LOG_PREFIX_SIZE);
+	if (is_authorized(tls->id, data, size)) {
+		notice("Queuing %zu bytes of data from %s: %.*s...", size,
+		    tls->peer, width, data);
+		if (forward_submit(data, size))
+			fifo_dump_commit(connection->ctx->fifo, dump);
+		else
+			fifo_dump_discard(dump);
+		send_response(tls, "OKAY");
+	} else {
+		warning("Refusing %zu bytes of data from %s: %.*s...", size,
+		    tls->peer, width, data);
+		fifo_dump_discard(dump);
+		send_response(tls, "FAIL You're not authorized");
+	}
+
+	tls_read_line(tls, handle_connection);
+}
+#endif
+
+#if HAVE_ZLIB_H
+/*
+ * Check whether one of the comma-separated encodings offered by the client is
+ * supported, and set up decompression if so.
+ */
+static bool
+select_encoding(tls_state * restrict tls, char * restrict encodings)
+{
+	connection_state *connection = tls->data;
+	char *encoding;
+
+	for (encoding = strtok(encodings, ","); encoding != NULL;
+	    encoding = strtok(NULL, ","))
+		if (strcasecmp(encoding, COMPRESSION_METHOD) == 0) {
+			debug("Using %s encoding for PUSH data from %s",
+			    COMPRESSION_METHOD, tls->peer);
+			connection->decompressor = decompressor_new();
+			return true;
+		}
+
+	return false;
+}
+
+/*
+ * Decompress the connection->input_length bytes of PUSH data in chunks.  The
+ * result is collected in memory or (if it's large) streamed into a dump file,
+ * unless connection->failure is set, in which case it's thrown away.
+ */
+static void
+inflate_push(tls_state *tls)
+{
+	connection_state *connection = tls->data;
+
+	decompressor_start(connection->decompressor, connection->data_length);
+	connection->decoded_length = 0;
+
+	if (connection->failure != NULL)
+		debug("Decompressing refused PUSH data from %s", tls->peer);
+#if STREAM_PUSH_DATA
+	else if (connection->data_length > STREAM_CHUNK_SIZE) {
+		if ((connection->dump = fifo_dump_open(connection->ctx->fifo))
+		    == NULL)
+			connection->failure = "Cannot store PUSH data";
+	}
+#endif
+	else {
+		/*
+		 * The announced size might be huge if there's no
+		 * `max_command_size', so the buffer grows with the data that
+		 * actually arrives.
+		 */
+		connection->decoded_size = MIN(connection->data_length,
+		    STREAM_CHUNK_SIZE) + 1;
+		connection->decoded = xmalloc(connection->decoded_size);
+	}
+
+	tls_read(tls, handle_compressed_chunk, MIN(connection->input_length,
+	    STREAM_CHUNK_SIZE));
+}
+
+static void
+handle_compressed_chunk(tls_state * restrict tls, char * restrict data)
+{
+	connection_state *connection = tls->data;
+	size_t size = MIN(connection->input_length, STREAM_CHUNK_SIZE);
+	bool okay = decompressor_run(connection->decompressor, data, size,
+	    store_decoded, connection);
+
+	free(data);
+	connection->input_length -= size;
+
+	/*
+	 * If decompression fails, the following PUSH data cannot be decoded
+	 * either, so we give up on the session.
+	 */
+	if (!okay || (connection->input_length == 0
+	    && !decompressor_finish(connection->decompressor, store_decoded,
+	    connection)))
+		bail(tls, "Cannot decompress PUSH data");
+	else if (connection->input_length > 0)
+		tls_read(tls, handle_compressed_chunk,
+		    MIN(connection->input_length, STREAM_CHUNK_SIZE));
+	else
+		finish_inflate(tls);
+}
+
+static bool
+store_decoded(const void *data, size_t size, void *arg)
+{
+	connection_state *connection = arg;
+
+	if (connection->failure != NULL)
+		return true;
+	if (connection->dump != NULL) {
+		if (!fifo_dump_write(connection->dump, data, size)) {
+			fifo_dump_discard(connection->dump);
+			connection->dump = NULL;
+			connection->failure = "Cannot store PUSH data";
+		}
+	} else {
+		/* The decompressor checks the size against data_length. */
+		size_t needed = connection->decoded_length + size + 1;
+
+		if (needed > connection->decoded_size) {
+			connection->decoded_size = MIN(MAX(needed,
+			    connection->decoded_size * 2),
+			    connection->data_length + 1);
+			connection->decoded = xrealloc(connection->decoded,
+			    connection->decoded_size);
+		}
+		(void)memcpy(connection->decoded + connection->decoded_length,
+		    data, size);
+		connection->decoded_length += size;
+	}
+	return true;
+}
+
+static void
+finish_inflate(tls_state *tls)
+{
+	connection_state *connection = tls->data;
+	char *response, *data;
+
+	if (connection->failure != NULL) {
+		xasprintf(&response, "FAIL %s", connection->failure);
+		send_response(tls, response);
+		free(response);
+		connection->failure = NULL;
+		tls_read_line(tls, handle_connection);
+	}
+#if STREAM_PUSH_DATA
+	else if (connection->dump != NULL)
+		finish_push_stream(tls);
+#endif
+	else {
+		data = connection->decoded;
+		data[connection->data_length] = '\0';
+		connection->decoded = NULL;
+		connection->input_length = connection->data_length;
+		handle_push(tls, data);
+	}
+}
+#endif
+
+/*
+ * Skip the remaining connection->input_length bytes of PUSH data, and respond
+ * with the specified failure message.
+ */
+static void
+discard_push(tls_state * restrict tls, const char * restrict failure)
+{
+	connection_state *connection = tls->data;
+
+	connection->failure = failure;
+	tls_read(tls, handle_discard, MIN(connection->input_length,
+	    DISCARD_CHUNK_SIZE));
+}
+
+static void
+handle_discard(tls_state * restrict tls, char * restrict data)
+{
+	connection_state *connection = tls->data;
+	char *response;
+
+	free(data);
+	connection->input_length -= MIN(connection->input_length,
+	    DISCARD_CHUNK_SIZE);
+
+	if (connection->input_length > 0)
+		tls_read(tls, handle_discard, MIN(connection->input_length,
+		    DISCARD_CHUNK_SIZE));
+	else {
+		xasprintf(&response, "FAIL %s", connection->failure);
+		send_response(tls, response);
+		free(response);
+		tls_read_line(tls, handle_connection);
+	}
+}
+
 static void
 handle_error(tls_state *tls)
 {
@@ -313,8 +770,35 @@ static void
 connection_stop(tls_state *tls)
 {
 	connection_state *connection = tls->data;
+	size_t n_active, n_pooled;
+
+	limit_cancel(&connection->waiter);
+	if (connection->dump != NULL) {
+		fifo_dump_discard(connection->dump);
+		connection->dump = NULL;
+	}
+#if HAVE_ZLIB_H
+	if (connection->decompressor != NULL) {
+		decompressor_free(connection->decompressor);
+		connection->decompressor = NULL;
+	}
+#endif
+	if (connection->decoded != NULL) {
+		free(connection->decoded);
+		connection->decoded = NULL;
+	}
 
-	free(connection);
+	tls_get_stats(&n_active, &n_pooled);
+	debug("Connection context of %s uses %zu bytes (%zu active, %zu pooled)",
+	    tls->peer, tls_memory_usage(tls) + sizeof(connection_state),
+	    n_active, n_pooled);
+
+	if (n_pooled_connections < CONNECTION_POOL_SIZE) {
+		connection->next = connection_pool;
+		connection_pool = connection;
+		n_pooled_connections++;
+	} else
+		free(connection);
 }
 
 /* vim:set joinspaces noexpandtab textwidth=80 cinoptions=(4,u0: */
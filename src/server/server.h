@@ -38,9 +38,11 @@
 
 typedef struct server_state_s server_state;
 
-server_state *server_start(const char * restrict, const char * restrict,
+server_state *server_start(const char * restrict, const char * restrict, int,
                            const char * restrict, const char * restrict,
+                           const char * restrict, size_t, size_t, size_t,
                            size_t, size_t, ev_tstamp);
+void server_log_stats(server_state *);
 void server_stop(server_state *);
 
 #endif
@@ -0,0 +1,13 @@
+# Signature of the current package.
+m4_define([AT_PACKAGE_NAME],
+ [NSCA-ng])
+m4_define([AT_PACKAGE_TARNAME],
+ [nsca-ng])
+m4_define([AT_PACKAGE_VERSION],
+ [1.7])
+m4_define([AT_PACKAGE_STRING],
+ [NSCA-ng 1.7])
+m4_define([AT_PACKAGE_BUGREPORT],
+ [developers@nsca-ng.org])
+m4_define([AT_PACKAGE_URL],
+ [http://www.nsca-ng.org/])